@@ -0,0 +1,300 @@
+/*
+ * Microbenchmarks of the card firmware.
+ *
+ * Runs the hot paths of libAPDU.h (../../main) a fixed number
+ * of times once after boot, and prints one line per benchmark
+ * on the UART, so that the results of two releases or of two
+ * boards can be compared line by line:
+ *
+ *    BENCH,Name,MPI,Runs,Bytes,Min,Mean,Max
+ *
+ * MPI is hw or sw (CONFIG_MBEDTLS_HARDWARE_MPI), Bytes is what
+ * a run handles (0 if it doesn't apply), Min, Mean and Max are
+ * the time of a run in us. A benchmark that fails prints
+ * BENCH_FAIL,Name,MPI instead, BENCH_DONE follows the last line.
+ *
+ * The hardware MPI can only be chosen at build time, for the
+ * software one build with
+ *    make SDKCONFIG=sdkconfig.softmpi SDKCONFIG_DEFAULTS=sdkconfig.softmpi.defaults
+ *
+ * The benchmarks start from a fresh card (initialize), so they
+ * erase the state and keys of the card firmware on the board.
+ */
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "esp_vfs.h"
+#include "esp_vfs_fat.h"
+
+#include "libAPDU.h"
+
+#define BENCH_KEYGEN_RUNS 3         // A 2048 bit key takes seconds
+#define BENCH_RSA_RUNS 20
+#define BENCH_FLASH_RUNS 50
+#define BENCH_RESTORE_RUNS 10
+#define BENCH_PATH_RUNS 20          // Runs of BENCH_PATH_LOOPS commands each
+#define BENCH_PATH_LOOPS 1000
+#define BENCH_RNG_RUNS 20
+#define BENCH_RNG_LENGTH 4096
+
+#ifdef CONFIG_MBEDTLS_HARDWARE_MPI
+#define BENCH_MPI "hw"
+#else
+#define BENCH_MPI "sw"
+#endif
+
+typedef struct benchResult_t {
+    const char* name;
+    uint32_t bytes;             // Handled by each run
+    uint32_t runs;
+    int64_t min, max, total;    // In us
+    int64_t mark;               // Start of the current run
+} benchResult_t;
+
+static wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
+
+static void benchStart(benchResult_t* r, const char* name, uint32_t bytes) {
+    bzero(r, sizeof(*r));
+    r->name = name;
+    r->bytes = bytes;
+}
+
+static void benchBegin(benchResult_t* r) {
+    r->mark = esp_timer_get_time();
+}
+
+static void benchEnd(benchResult_t* r) {
+    int64_t t = esp_timer_get_time() - r->mark;
+    if (r->runs == 0 || t < r->min) {
+        r->min = t;
+    }
+    if (t > r->max) {
+        r->max = t;
+    }
+    r->total += t;
+    r->runs++;
+}
+
+static void benchPrint(benchResult_t* r) {
+    printf("BENCH,%s,%s,%u,%u,%" PRId64 ",%" PRId64 ",%" PRId64 "\n", r->name, BENCH_MPI, r->runs, r->bytes,
+            r->min, (r->runs > 0) ? r->total / r->runs : 0, r->max);
+    fflush(stdout);
+}
+
+// A run failed, the ones after it would measure nothing
+static void benchFail(benchResult_t* r) {
+    printf("BENCH_FAIL,%s,%s\n", r->name, BENCH_MPI);
+    fflush(stdout);
+}
+
+static uint8_t benchSetup() {
+    static const char* TAG = "benchSetup";
+    const esp_vfs_fat_mount_config_t mount_config = {
+            .max_files = 4,
+            .format_if_mount_failed = true
+    };
+
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES) {     // Truncated, erase it as the card firmware does
+        const esp_partition_t* nvs_partition = esp_partition_find_first(
+                ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NULL);
+        if (nvs_partition == NULL || esp_partition_erase_range(nvs_partition, 0, nvs_partition->size) != ESP_OK) {
+            return 1;
+        }
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_flash_init failed (0x%x)", err);
+        return 1;
+    }
+    if ((err = esp_vfs_fat_spiflash_mount("/spiflash", "storage", &mount_config, &s_wl_handle)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount FATFS (0x%x)", err);
+        return 1;
+    }
+    if (rngInit() != 0 || initialize() != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+// RSA-2048: GENERATE (keyGen, with the write of the key), the preparation of the key, then
+// signatures and decryptions with it, through the backend of the slot (libKey.h)
+static void benchRSA() {
+    static uint8_t in[KEY_SIZE_BYTES], out[KEY_SIZE_BYTES];
+    benchResult_t r;
+    size_t len;
+
+    benchStart(&r, "keyGen", 0);
+    for (uint32_t i = 0; i < BENCH_KEYGEN_RUNS; i++) {
+        benchBegin(&r);
+        if (keyGen(0xB6) != 0) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+
+    benchStart(&r, "keyPrepare", 0);    // What taskCrypto does between the commands
+    benchBegin(&r);
+    while (keyPending()) {
+        keyPrepareNext();
+    }
+    benchEnd(&r);
+    benchPrint(&r);
+
+    rngRandom(NULL, in, 51);        // The length of a SHA-256 DigestInfo
+    benchStart(&r, "rsaSign", 51);
+    for (uint32_t i = 0; i < BENCH_RSA_RUNS; i++) {
+        benchBegin(&r);
+        if (keySign(0xB6, &sigKey, in, 51, out) != 0) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+
+    benchStart(&r, "rsaDecrypt", KEY_SIZE_BYTES);
+    if (mbedtls_rsa_pkcs1_encrypt(&sigKey, rngRandom, NULL, MBEDTLS_RSA_PUBLIC, 32, in, out) != 0) {
+        benchFail(&r);
+        return;
+    }
+    for (uint32_t i = 0; i < BENCH_RSA_RUNS; i++) {
+        benchBegin(&r);
+        if (keyDecrypt(0xB6, &sigKey, out, in, &len, sizeof(in)) != 0) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+}
+
+// Writes to the flash: a variable in NVS, the state image and journal, a data object
+static void benchStorage() {
+    static uint8_t data[256];
+    benchResult_t r;
+
+    benchStart(&r, "storeVar", 1);
+    for (uint32_t i = 0; i < BENCH_FLASH_RUNS; i++) {
+        benchBegin(&r);
+        if (storeVar("benchVar", (uint8_t) i, 0, 8) != SW_NO_ERROR) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+
+    benchStart(&r, "saveState", 0);
+    for (uint32_t i = 0; i < BENCH_FLASH_RUNS; i++) {
+        benchBegin(&r);
+        if (saveState() != SW_NO_ERROR) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+
+    benchStart(&r, "doWrite", sizeof(data));
+    for (uint32_t i = 0; i < BENCH_FLASH_RUNS; i++) {
+        data[0] = (uint8_t) i;
+        benchBegin(&r);
+        if (doWrite(DO_URL, data, sizeof(data)) != ESP_OK) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+    doWrite(DO_URL, NULL, 0);
+
+    benchStart(&r, "restoreState", 0);
+    for (uint32_t i = 0; i < BENCH_RESTORE_RUNS; i++) {
+        benchBegin(&r);
+        if (restoreState() != 0) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+}
+
+// The APDU path without the crypto: parsing an extended command, cutting a long response
+static void benchPath() {
+    static char cmd[7 + 255 + 2];
+    static outData output;
+    benchResult_t r;
+    apdu_t apdu;
+
+    bzero(cmd, sizeof(cmd));
+    cmd[1] = (char) 0xDA;           // PUT DATA, 255 bytes of data
+    cmd[5] = 0x00;
+    cmd[6] = (char) 0xFF;
+    benchStart(&r, "parseAPDU", BENCH_PATH_LOOPS * sizeof(cmd));
+    for (uint32_t i = 0; i < BENCH_PATH_RUNS; i++) {
+        benchBegin(&r);
+        for (uint32_t j = 0; j < BENCH_PATH_LOOPS; j++) {
+            parseAPDU(&apdu, cmd, sizeof(cmd));
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+
+    apdu.extended = 0;              // Short Le: 256 bytes per response, the rest with GET RESPONSE
+    out_offset = 0;
+    benchStart(&r, "sendNext", BENCH_PATH_LOOPS * KEY_SIZE_BYTES);
+    for (uint32_t i = 0; i < BENCH_PATH_RUNS; i++) {
+        benchBegin(&r);
+        for (uint32_t j = 0; j < BENCH_PATH_LOOPS; j++) {
+            sendBuffer(&apdu, KEY_SIZE_BYTES, &output);
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+}
+
+static void benchRNG() {
+    static uint8_t data[BENCH_RNG_LENGTH];
+    benchResult_t r;
+
+    benchStart(&r, "rngRandom", sizeof(data));
+    for (uint32_t i = 0; i < BENCH_RNG_RUNS; i++) {
+        benchBegin(&r);
+        if (rngRandom(NULL, data, sizeof(data)) != 0) {
+            benchFail(&r);
+            return;
+        }
+        benchEnd(&r);
+    }
+    benchPrint(&r);
+}
+
+static void taskBench(void *pvParameters) {
+    if (benchSetup() == 0) {
+        benchRNG();
+        benchPath();
+        benchRSA();
+        benchStorage();
+    }
+    printf("BENCH_DONE\n");
+    fflush(stdout);
+    vTaskDelete(NULL);
+}
+
+void app_main() {
+    // On APP_CPU, where the task watchdog doesn't watch the idle task (sdkconfig.defaults)
+    xTaskCreatePinnedToCore(&taskBench, "taskBench", 16384, NULL, 5, NULL, APP_CPU_NUM);
+}
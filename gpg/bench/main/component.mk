@@ -0,0 +1,5 @@
+#
+# "main" pseudo-component makefile.
+#
+# The benchmarks run the code of the card firmware, its headers are in ../../main
+COMPONENT_PRIV_INCLUDEDIRS := ../../main
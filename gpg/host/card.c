@@ -0,0 +1,138 @@
+/*
+ * The OpenPGP card of the firmware, as a library of the host, see card.h.
+ *
+ * Handles:
+ *    Starting the card as app_main and taskConnect do
+ *    Running a command APDU as runCommand and taskCrypto do
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "port.h"
+#include "card.h"
+
+// The files of the firmware are under the mount point, see port.h
+#define fopen portFopen
+#define unlink portUnlink
+#define rename portRename
+
+#include "libAPDU.h"
+#include "esp_vfs_fat.h"
+
+#undef fopen
+#undef unlink
+#undef rename
+
+static wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
+static pthread_mutex_t cardMutex = PTHREAD_MUTEX_INITIALIZER;  // One command at a time, as on the ESP32
+static uint8_t cardReady = 0;
+
+uint8_t cardOpen(const char* dir) {
+    static const char* TAG = "cardOpen";
+    const esp_vfs_fat_mount_config_t mount_config = {
+            .max_files = 4,
+            .format_if_mount_failed = true
+    };
+    uint8_t initialized = 0;
+    nvs_handle nvsHandle;
+    esp_err_t err;
+
+    if (cardReady) {
+        return 1;
+    }
+    if (portInit(dir) != 0) {
+        ESP_LOGE(TAG, "Can't use the directory %s", dir);
+        return 1;
+    }
+    diagInit(0);        // Before anything allocates through mbedtls
+    if ((err = nvs_flash_init()) != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_flash_init failed (0x%x)", err);
+        return 1;
+    }
+    if ((err = esp_vfs_fat_spiflash_mount("/spiflash", "storage", &mount_config, &s_wl_handle)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount FATFS (0x%x)", err);
+        return 1;
+    }
+    traceInit(TRACE_OFF);   // Can still be turned on with INS 57
+    if (rngInit() != 0) {
+        return 1;
+    }
+    if ((err = nvs_open("storage", NVS_READWRITE, &nvsHandle)) != ESP_OK) {
+        return 1;
+    }
+    err = nvs_get_u8(nvsHandle, "initialized", &initialized);
+    nvs_close(nvsHandle);
+    switch (err) {
+        case ESP_OK:        // Already initialized, restore the data
+            if (restoreState() != 0) {
+                return 1;
+            }
+            break;
+        case ESP_ERR_NVS_NOT_FOUND:     // A new card
+            if (initialize() != 0) {
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+    }
+    if (keyPoolInit() != 0) {
+        return 1;
+    }
+    while (keyPending()) {
+        keyPrepareNext();
+    }
+    cardReady = 1;
+    return 0;
+}
+
+uint16_t cardProcess(const uint8_t* command, uint16_t length, uint8_t* response, uint16_t size) {
+    static char cmd[7 + COMMAND_MAX_LENGTH + 2];    // parseAPDU works in place
+    static outData output;
+    int64_t phases[STATS_PHASES] = { 0 };
+    apdu_t comAPDU;
+    int64_t mark;
+    uint16_t sw;
+
+    if (!cardReady || size < 2) {
+        return 0;
+    }
+    if (length > sizeof(cmd)) {     // Longer than any command the card takes
+        response[0] = 0x67;     // SW_WRONG_LENGTH
+        response[1] = 0x00;
+        return 2;
+    }
+    pthread_mutex_lock(&cardMutex);
+    memcpy(cmd, command, length);
+    while (keyPending()) {      // Between two commands, as taskCrypto does when it's idle
+        keyPrepareNext();
+    }
+
+    mark = esp_timer_get_time();
+    sw = parseAPDU(&comAPDU, cmd, length);
+    phases[STATS_PARSE] = esp_timer_get_time() - mark;
+    traceRecord(TRACE_COMMAND, (uint8_t*) cmd, length);
+
+    if (sw != SW_NO_ERROR) {    // Malformed, answered without running it, as runCommand does
+        output.data[0] = (uint8_t) (sw >> 8);
+        output.data[1] = (uint8_t) (sw & 0xFF);
+        output.length = 2;
+    } else {
+        mark = esp_timer_get_time();
+        statsFlashClear();
+        process(&comAPDU, &output);
+        phases[STATS_FLASH] = statsFlashTime;
+        phases[STATS_CRYPTO] = esp_timer_get_time() - mark - statsFlashTime;
+    }
+
+    traceRecord(TRACE_RESPONSE, output.data, output.length);
+    sw = (output.length >= 2) ? (output.data[output.length-2] << 8) | output.data[output.length-1] : 0;
+    statsRecord(comAPDU.INS, comAPDU.P1P2, sw, phases);
+
+    length = (output.length <= size) ? output.length : 0;
+    memcpy(response, output.data, length);
+    pthread_mutex_unlock(&cardMutex);
+    return length;
+}
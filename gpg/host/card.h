@@ -0,0 +1,36 @@
+/*
+ * The OpenPGP card of the firmware, as a library of the host.
+ *
+ * The APDU commands go straight to process() of libAPDU.h, the
+ * way taskConnect hands them to the crypto worker on the ESP32,
+ * without the network and the proceed button. The state, the
+ * keys and the NVS of the card are kept in a directory, so a
+ * card survives a restart like the ESP32 does.
+ *
+ * Handles:
+ *    Starting the card, from its directory
+ *    Running a command APDU
+ */
+#ifndef __CARD_H__
+#define __CARD_H__
+
+#include <stdint.h>
+
+/**
+ * Start the card kept in dir, or a new one if there is none, as the
+ * ESP32 does when it boots. Has to be called once, before cardProcess.
+ *
+ * @return 0 on success, 1 on failure
+ */
+uint8_t cardOpen(const char* dir);
+
+/**
+ * Run one command APDU (not a batch frame). The keys that have changed
+ * are prepared before it, as taskCrypto does between two commands.
+ *
+ * @param response Receives the response APDU, up to size bytes
+ * @return Length of the response, 0 if it doesn't fit in size
+ */
+uint16_t cardProcess(const uint8_t* command, uint16_t length, uint8_t* response, uint16_t size);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Host port: the heaps of the ESP32. The host has a single heap that
+ * doesn't run out, so all of the figures read as 0 (see libDiag.h).
+ */
+#ifndef __ESP_HEAP_CAPS_H__
+#define __ESP_HEAP_CAPS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_DMA (1<<3)
+#define MALLOC_CAP_SPIRAM (1<<10)
+#define MALLOC_CAP_INTERNAL (1<<11)
+
+#define heap_caps_get_free_size(caps) ((size_t) 0)
+#define heap_caps_get_minimum_free_size(caps) ((size_t) 0)
+#define heap_caps_get_largest_free_block(caps) ((size_t) 0)
+
+#endif
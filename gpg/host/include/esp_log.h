@@ -0,0 +1,38 @@
+/*
+ * Host port: the log of ESP-IDF, to stderr in the format of the UART
+ * log. The level is the same for all tags, esp_log_level_set("*", ...),
+ * and starts at ESP_LOG_WARN so that the log doesn't slow down a run.
+ */
+#ifndef __ESP_LOG_H__
+#define __ESP_LOG_H__
+
+#include <stdio.h>
+#include "esp_timer.h"
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+extern esp_log_level_t portLogLevel;
+
+void esp_log_level_set(const char* tag, esp_log_level_t level);
+
+#define PORT_LOG(level, letter, tag, format, ...) do { \
+    if (portLogLevel >= (level)) { \
+        fprintf(stderr, letter " (%lld) %s: " format "\n", \
+                (long long) (esp_timer_get_time() / 1000), tag, ##__VA_ARGS__); \
+    } \
+} while(0)
+
+#define ESP_LOGE(tag, format, ...) PORT_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) PORT_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) PORT_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) PORT_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) PORT_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * Host port: a mapping of a partition is its copy in memory, so there is
+ * nothing to unmap.
+ */
+#ifndef __ESP_SPI_FLASH_H__
+#define __ESP_SPI_FLASH_H__
+
+#include <stdint.h>
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+typedef enum {
+    SPI_FLASH_MMAP_DATA,
+    SPI_FLASH_MMAP_INST
+} spi_flash_mmap_memory_t;
+
+#define spi_flash_munmap(handle) ((void) (handle))
+
+#endif
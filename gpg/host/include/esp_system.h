@@ -0,0 +1,11 @@
+/*
+ * Host port: the system services of ESP-IDF. The card only restarts on
+ * hardware, so there is nothing here but the error codes.
+ */
+#ifndef __ESP_SYSTEM_H__
+#define __ESP_SYSTEM_H__
+
+#include <stdlib.h>
+#include "esp_err.h"
+
+#endif
@@ -0,0 +1,11 @@
+/*
+ * Host port: the time since boot, on the monotonic clock of the host.
+ */
+#ifndef __ESP_TIMER_H__
+#define __ESP_TIMER_H__
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);   // Microseconds since the card was started
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Host port: the FAT filesystem in flash. Mounting it maps the paths
+ * under the mount point to a directory of the card, named after the
+ * partition. The files of the firmware are opened through portFopen()
+ * and the others of port.h, as the VFS of ESP-IDF does it on the ESP32.
+ */
+#ifndef __ESP_VFS_FAT_H__
+#define __ESP_VFS_FAT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef int32_t wl_handle_t;
+
+#define WL_INVALID_HANDLE -1
+
+typedef struct {
+    bool format_if_mount_failed;
+    int max_files;
+} esp_vfs_fat_mount_config_t;
+
+esp_err_t esp_vfs_fat_spiflash_mount(const char* base_path, const char* partition_label,
+        const esp_vfs_fat_mount_config_t* mount_config, wl_handle_t* wl_handle);
+esp_err_t esp_vfs_fat_spiflash_unmount(const char* base_path, wl_handle_t wl_handle);
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Host port: the mutexes of FreeRTOS (see FreeRTOS.h).
+ */
+#ifndef __FREERTOS_SEMPHR_H__
+#define __FREERTOS_SEMPHR_H__
+
+#include "FreeRTOS.h"
+
+typedef pthread_mutex_t* SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * Host port: the tasks of FreeRTOS, and their notifications (see
+ * FreeRTOS.h). A thread that wasn't created as a task gets a handle the
+ * first time it asks for one.
+ */
+#ifndef __FREERTOS_TASK_H__
+#define __FREERTOS_TASK_H__
+
+#include "FreeRTOS.h"
+
+typedef struct portTask_t* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stack,
+        void* parameters, UBaseType_t priority, TaskHandle_t* created, BaseType_t core);
+#define xTaskCreate(code, name, stack, parameters, priority, created) \
+    xTaskCreatePinnedToCore(code, name, stack, parameters, priority, created, tskNO_AFFINITY)
+void vTaskDelay(TickType_t ticks);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+const char* pcTaskGetTaskName(TaskHandle_t task);
+#define uxTaskGetStackHighWaterMark(task) ((UBaseType_t) 0)    // The stacks of the host are large
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+#endif
@@ -0,0 +1,11 @@
+/*
+ * Host port: loads nvs.bin from the directory of the card (see nvs.h).
+ */
+#ifndef __NVS_FLASH_H__
+#define __NVS_FLASH_H__
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init(void);
+
+#endif
@@ -0,0 +1,11 @@
+/*
+ * Host port: the CRC32 of the ROM of the ESP32, the one of zlib.
+ */
+#ifndef __ROM_CRC_H__
+#define __ROM_CRC_H__
+
+#include <stdint.h>
+
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
+
+#endif
@@ -0,0 +1,623 @@
+/*
+ * Host port of the card firmware, see port.h.
+ *
+ * Handles:
+ *    The directory of the card and the paths of the FAT filesystem
+ *    The time, the log level and the CRC32 of the ROM
+ *    The tasks, their notifications and the mutexes of FreeRTOS
+ *    The NVS, in nvs.bin
+ *    The raw data partitions, in a file each
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_vfs_fat.h"
+#include "nvs_flash.h"
+#include "rom/crc.h"
+
+#include "port.h"
+
+#define PORT_NAME_LENGTH 16         // Of a task, a key or a namespace of the NVS, with the NUL
+#define PORT_NVS_ENTRIES 64
+#define PORT_NVS_DATA 64            // Longest blob
+#define PORT_NVS_SPACES 8
+#define PORT_NVS_READONLY 0x100     // Bit of a handle opened with NVS_READONLY
+
+#define PORT_NVS_U8 1
+#define PORT_NVS_U16 2
+#define PORT_NVS_BLOB 3
+
+static char portDirectory[PATH_MAX - PORT_NAME_LENGTH - 8];   // Room for "/" and the name of a file in it
+static char portFsBase[PATH_MAX];           // Mount point of the FAT filesystem, empty if it isn't mounted
+static char portFsDirectory[PATH_MAX];      // Where its files are
+static int64_t portBoot = 0;                // Monotonic time of portInit, in us
+
+esp_log_level_t portLogLevel = ESP_LOG_WARN;
+
+static int64_t portNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The absolute time ms milliseconds from now on clock, for the timed waits
+static void portDeadline(clockid_t clock, TickType_t ms, struct timespec* ts) {
+    clock_gettime(clock, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long) (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+uint8_t portInit(const char* dir) {
+    if (strlen(dir) >= sizeof(portDirectory)) {
+        return 1;
+    }
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {    // Only the owner, the keys are in it
+        return 1;
+    }
+    strcpy(portDirectory, dir);
+    portBoot = portNow();
+    return 0;
+}
+
+// A file of the directory of the card
+static void portFile(const char* name, char* path) {
+    snprintf(path, PATH_MAX, "%s/%s", portDirectory, name);
+}
+
+// The path of the host for a path of the firmware
+static const char* portPath(const char* path, char* out) {
+    size_t length = strlen(portFsBase);
+
+    if (length == 0 || strncmp(path, portFsBase, length) != 0 || path[length] != '/') {
+        return path;
+    }
+    snprintf(out, PATH_MAX, "%s%s", portFsDirectory, path + length);
+    return out;
+}
+
+FILE* portFopen(const char* path, const char* mode) {
+    char out[PATH_MAX];
+    return fopen(portPath(path, out), mode);
+}
+
+int portUnlink(const char* path) {
+    char out[PATH_MAX];
+    return unlink(portPath(path, out));
+}
+
+int portRename(const char* from, const char* to) {
+    char fromOut[PATH_MAX], toOut[PATH_MAX];
+    return rename(portPath(from, fromOut), portPath(to, toOut));
+}
+
+esp_err_t esp_vfs_fat_spiflash_mount(const char* base_path, const char* partition_label,
+        const esp_vfs_fat_mount_config_t* mount_config, wl_handle_t* wl_handle) {
+    if (portDirectory[0] == '\0' || strlen(base_path) >= sizeof(portFsBase)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    portFile(partition_label, portFsDirectory);
+    if (mkdir(portFsDirectory, 0700) != 0 && errno != EEXIST) {
+        return ESP_FAIL;
+    }
+    strcpy(portFsBase, base_path);
+    *wl_handle = 0;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_spiflash_unmount(const char* base_path, wl_handle_t wl_handle) {
+    portFsBase[0] = '\0';
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void) {
+    return portNow() - portBoot;
+}
+
+// There is a single level, for all of the tags
+void esp_log_level_set(const char* tag, esp_log_level_t level) {
+    portLogLevel = level;
+}
+
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+    static const uint32_t table[16] = {     // Reflected 0x04C11DB7, 4 bits at a time
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *(buf++);
+        crc = table[crc & 0x0F] ^ (crc >> 4);
+        crc = table[crc & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+/*
+ * Tasks
+ */
+
+struct portTask_t {
+    pthread_t thread;
+    TaskFunction_t code;
+    void* parameters;
+    char name[PORT_NAME_LENGTH];
+    pthread_mutex_t mutex;      // Guards notified
+    pthread_cond_t cond;
+    uint32_t notified;          // Notifications not taken yet
+};
+
+static __thread TaskHandle_t portCurrent = NULL;
+
+static TaskHandle_t portTaskNew(const char* name) {
+    TaskHandle_t task = calloc(1, sizeof(struct portTask_t));
+    pthread_condattr_t attr;
+
+    if (task == NULL) {
+        return NULL;
+    }
+    strncpy(task->name, name, PORT_NAME_LENGTH - 1);
+    pthread_mutex_init(&task->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);     // The timed waits are on the monotonic clock
+    pthread_cond_init(&task->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return task;
+}
+
+static void* portTaskRun(void* arg) {
+    portCurrent = arg;
+    portCurrent->code(portCurrent->parameters);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char* name, uint32_t stack,
+        void* parameters, UBaseType_t priority, TaskHandle_t* created, BaseType_t core) {
+    TaskHandle_t task = portTaskNew(name);
+    pthread_attr_t attr;
+    int ret;
+
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->code = code;
+    task->parameters = parameters;
+    if (created != NULL) {      // Before the task runs, it may be notified right away
+        *created = task;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&task->thread, &attr, portTaskRun, task);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        if (created != NULL) {
+            *created = NULL;
+        }
+        free(task);
+        return pdFAIL;
+    }
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = { ticks / 1000, (long) (ticks % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (portCurrent == NULL) {      // A thread of the host, such as the one of cardProcess
+        portCurrent = portTaskNew("host");
+    }
+    return portCurrent;
+}
+
+const char* pcTaskGetTaskName(TaskHandle_t task) {
+    if (task == NULL) {
+        task = xTaskGetCurrentTaskHandle();
+    }
+    return (task != NULL) ? task->name : "";
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    pthread_mutex_lock(&task->mutex);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline;
+    uint32_t value;
+    int ret = 0;
+
+    if (task == NULL) {
+        return 0;
+    }
+    portDeadline(CLOCK_MONOTONIC, ticks, &deadline);
+    pthread_mutex_lock(&task->mutex);
+    while (task->notified == 0 && ret == 0) {
+        if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(&task->cond, &task->mutex);
+        } else {
+            ret = pthread_cond_timedwait(&task->cond, &task->mutex, &deadline);
+        }
+    }
+    value = task->notified;
+    if (value != 0) {
+        task->notified = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->mutex);
+    return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    SemaphoreHandle_t semaphore = malloc(sizeof(pthread_mutex_t));
+
+    if (semaphore != NULL) {
+        pthread_mutex_init(semaphore, NULL);
+    }
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) {
+    struct timespec deadline;
+
+    if (ticks == portMAX_DELAY) {
+        return (pthread_mutex_lock(semaphore) == 0) ? pdTRUE : pdFALSE;
+    }
+    portDeadline(CLOCK_REALTIME, ticks, &deadline);
+    return (pthread_mutex_timedlock(semaphore, &deadline) == 0) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    return (pthread_mutex_unlock(semaphore) == 0) ? pdTRUE : pdFALSE;
+}
+
+/*
+ * NVS
+ */
+
+typedef struct portNvsEntry_t {     // Written as is to nvs.bin
+    char space[PORT_NAME_LENGTH];   // Empty if the entry is free
+    char key[PORT_NAME_LENGTH];
+    uint8_t type;                   // PORT_NVS_*
+    uint16_t length;
+    uint8_t data[PORT_NVS_DATA];
+} portNvsEntry_t;
+
+static portNvsEntry_t portNvs[PORT_NVS_ENTRIES];
+static char portNvsSpaces[PORT_NVS_SPACES][PORT_NAME_LENGTH];  // Index + 1 of a namespace is its handle
+static uint8_t portNvsReady = 0;
+static pthread_mutex_t portNvsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Write the table to nvs.bin, through a temporary file so that a crash keeps the old one
+static esp_err_t portNvsSave() {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    FILE* f;
+
+    portFile("nvs.bin", path);
+    portFile("nvs.tmp", tmp);
+    if ((f = fopen(tmp, "wb")) == NULL) {
+        return ESP_FAIL;
+    }
+    if (fwrite(portNvs, sizeof(portNvs), 1, f) != 1) {
+        fclose(f);
+        return ESP_FAIL;
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void) {
+    char path[PATH_MAX];
+    FILE* f;
+
+    if (portDirectory[0] == '\0') {
+        return ESP_ERR_INVALID_STATE;
+    }
+    pthread_mutex_lock(&portNvsMutex);
+    bzero(portNvs, sizeof(portNvs));
+    portFile("nvs.bin", path);
+    if ((f = fopen(path, "rb")) != NULL) {     // A new card has none yet
+        if (fread(portNvs, sizeof(portNvs), 1, f) != 1) {
+            bzero(portNvs, sizeof(portNvs));    // Cut short, start over as a truncated NVS would
+        }
+        fclose(f);
+    }
+    portNvsReady = 1;
+    pthread_mutex_unlock(&portNvsMutex);
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode open_mode, nvs_handle* out_handle) {
+    esp_err_t err = ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+
+    if (!portNvsReady) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (strlen(name) >= PORT_NAME_LENGTH) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+    pthread_mutex_lock(&portNvsMutex);
+    for (uint8_t i = 0; i < PORT_NVS_SPACES; i++) {
+        if (portNvsSpaces[i][0] == '\0') {
+            strcpy(portNvsSpaces[i], name);
+        }
+        if (strcmp(portNvsSpaces[i], name) == 0) {
+            *out_handle = (i + 1) | ((open_mode == NVS_READONLY) ? PORT_NVS_READONLY : 0);
+            err = ESP_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&portNvsMutex);
+    return err;
+}
+
+// The handles stay valid, there is one per namespace
+void nvs_close(nvs_handle handle) {
+}
+
+// Every change has already been written
+esp_err_t nvs_commit(nvs_handle handle) {
+    return ESP_OK;
+}
+
+// The namespace of a handle, NULL if it is not one
+static const char* portNvsSpace(nvs_handle handle) {
+    uint32_t index = (handle & ~PORT_NVS_READONLY) - 1;
+    return (index < PORT_NVS_SPACES && portNvsSpaces[index][0] != '\0') ? portNvsSpaces[index] : NULL;
+}
+
+// The entry of a key, or a free one if create is set. Called with portNvsMutex held.
+static portNvsEntry_t* portNvsFind(const char* space, const char* key, uint8_t create) {
+    portNvsEntry_t* free = NULL;
+
+    for (uint8_t i = 0; i < PORT_NVS_ENTRIES; i++) {
+        if (portNvs[i].space[0] == '\0') {
+            if (free == NULL) {
+                free = &portNvs[i];
+            }
+        } else if (strcmp(portNvs[i].space, space) == 0 && strcmp(portNvs[i].key, key) == 0) {
+            return &portNvs[i];
+        }
+    }
+    return create ? free : NULL;
+}
+
+static esp_err_t portNvsSet(nvs_handle handle, const char* key, uint8_t type, const void* value, size_t length) {
+    const char* space = portNvsSpace(handle);
+    portNvsEntry_t* entry;
+    esp_err_t err;
+
+    if (space == NULL) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (handle & PORT_NVS_READONLY) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    if (strlen(key) >= PORT_NAME_LENGTH) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+    if (length > PORT_NVS_DATA) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    pthread_mutex_lock(&portNvsMutex);
+    if ((entry = portNvsFind(space, key, 1)) == NULL) {
+        pthread_mutex_unlock(&portNvsMutex);
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    strcpy(entry->space, space);
+    strcpy(entry->key, key);
+    entry->type = type;
+    entry->length = (uint16_t) length;
+    memcpy(entry->data, value, length);
+    err = portNvsSave();
+    pthread_mutex_unlock(&portNvsMutex);
+    return err;
+}
+
+// Copy the value of a key to out, *length is its room and then the length of the value
+static esp_err_t portNvsGet(nvs_handle handle, const char* key, uint8_t type, void* out, size_t* length) {
+    const char* space = portNvsSpace(handle);
+    portNvsEntry_t* entry;
+    esp_err_t err = ESP_OK;
+
+    if (space == NULL) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    pthread_mutex_lock(&portNvsMutex);
+    if ((entry = portNvsFind(space, key, 0)) == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (entry->type != type) {
+        err = ESP_ERR_NVS_TYPE_MISMATCH;
+    } else if (out != NULL && *length < entry->length) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        if (out != NULL) {
+            memcpy(out, entry->data, entry->length);
+        }
+        *length = entry->length;
+    }
+    pthread_mutex_unlock(&portNvsMutex);
+    return err;
+}
+
+esp_err_t nvs_set_u8(nvs_handle handle, const char* key, uint8_t value) {
+    return portNvsSet(handle, key, PORT_NVS_U8, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u8(nvs_handle handle, const char* key, uint8_t* out_value) {
+    size_t length = sizeof(*out_value);
+    return portNvsGet(handle, key, PORT_NVS_U8, out_value, &length);
+}
+
+esp_err_t nvs_set_u16(nvs_handle handle, const char* key, uint16_t value) {
+    return portNvsSet(handle, key, PORT_NVS_U16, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u16(nvs_handle handle, const char* key, uint16_t* out_value) {
+    size_t length = sizeof(*out_value);
+    return portNvsGet(handle, key, PORT_NVS_U16, out_value, &length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char* key, const void* value, size_t length) {
+    return portNvsSet(handle, key, PORT_NVS_BLOB, value, length);
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char* key, void* out_value, size_t* length) {
+    return portNvsGet(handle, key, PORT_NVS_BLOB, out_value, length);
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char* key) {
+    const char* space = portNvsSpace(handle);
+    portNvsEntry_t* entry;
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    if (space == NULL) {
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    if (handle & PORT_NVS_READONLY) {
+        return ESP_ERR_NVS_READ_ONLY;
+    }
+    pthread_mutex_lock(&portNvsMutex);
+    if ((entry = portNvsFind(space, key, 0)) != NULL) {
+        bzero(entry, sizeof(*entry));
+        err = portNvsSave();
+    }
+    pthread_mutex_unlock(&portNvsMutex);
+    return err;
+}
+
+/*
+ * Partitions
+ */
+
+typedef struct portPartition_t {
+    esp_partition_t partition;  // First, the firmware only sees this part
+    uint8_t* data;              // The copy in memory, NULL until the partition is first found
+    int fd;
+} portPartition_t;
+
+static portPartition_t portPartitions[] = {     // The raw data partitions of partitions.csv
+    { { ESP_PARTITION_TYPE_DATA, 0x40, 0, 64*1024, "dos", false }, NULL, -1 },
+};
+
+#define PORT_PARTITIONS (sizeof(portPartitions) / sizeof(portPartitions[0]))
+
+static pthread_mutex_t portPartitionMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Read the file of a partition, a new one is erased flash
+static uint8_t portPartitionLoad(portPartition_t* p) {
+    char path[PATH_MAX], name[PORT_NAME_LENGTH + 8];
+    uint32_t size = p->partition.size;
+    ssize_t r;
+
+    snprintf(name, sizeof(name), "%s.bin", p->partition.label);
+    portFile(name, path);
+    if ((p->data = malloc(size)) == NULL) {
+        return 1;
+    }
+    memset(p->data, 0xFF, size);
+    if ((p->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        free(p->data);
+        p->data = NULL;
+        return 1;
+    }
+    r = pread(p->fd, p->data, size, 0);
+    if (r < (ssize_t) size) {       // New, or cut short: the rest is erased
+        memset(p->data + ((r > 0) ? r : 0), 0xFF, size - ((r > 0) ? r : 0));
+        if (pwrite(p->fd, p->data, size, 0) != (ssize_t) size) {
+            close(p->fd);
+            free(p->data);
+            p->data = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type,
+        esp_partition_subtype_t subtype, const char* label) {
+    const esp_partition_t* found = NULL;
+
+    pthread_mutex_lock(&portPartitionMutex);
+    for (uint8_t i = 0; i < PORT_PARTITIONS; i++) {
+        portPartition_t* p = &portPartitions[i];
+        if (p->partition.type != type
+                || (subtype != ESP_PARTITION_SUBTYPE_ANY && p->partition.subtype != subtype)
+                || (label != NULL && strcmp(p->partition.label, label) != 0)) {
+            continue;
+        }
+        if (p->data != NULL || portPartitionLoad(p) == 0) {
+            found = &p->partition;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&portPartitionMutex);
+    return found;
+}
+
+// Write a range of the copy in memory to the file
+static esp_err_t portPartitionFlush(portPartition_t* p, size_t offset, size_t size) {
+    return (pwrite(p->fd, p->data + offset, size, offset) == (ssize_t) size) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+    portPartition_t* p = (portPartition_t*) partition;
+
+    if (offset > partition->size || size > partition->size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (offset % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(p->data + offset, 0xFF, size);
+    return portPartitionFlush(p, offset, size);
+}
+
+// A write can only clear bits, as on the flash, an unerased sector shows up as on the ESP32
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* src, size_t size) {
+    portPartition_t* p = (portPartition_t*) partition;
+    const uint8_t* in = src;
+
+    if (offset > partition->size || size > partition->size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (size_t i = 0; i < size; i++) {
+        p->data[offset + i] &= in[i];
+    }
+    return portPartitionFlush(p, offset, size);
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, uint32_t offset, uint32_t size,
+        spi_flash_mmap_memory_t memory, const void** out_ptr, spi_flash_mmap_handle_t* out_handle) {
+    if (offset > partition->size || size > partition->size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *out_ptr = ((portPartition_t*) partition)->data + offset;
+    *out_handle = 0;
+    return ESP_OK;
+}
@@ -0,0 +1,38 @@
+/*
+ * Host port of the card firmware.
+ *
+ * The code of ../main is built for the host against the headers
+ * in include/, which stand in for those of ESP-IDF and FreeRTOS:
+ * the tasks and mutexes run on POSIX threads, the NVS, the raw
+ * data partitions and the FAT filesystem are files in the
+ * directory of the card, and mbedtls is the one of the host.
+ * The rest of ESP-IDF (WiFi, GPIO, the DS peripheral) is left
+ * out along with gpg.c, the card is driven through card.h.
+ *
+ * The firmware opens its files with the paths of the mount point
+ * of the FAT filesystem, card.c sends those calls here.
+ *
+ * Handles:
+ *    The directory of the card
+ *    The paths of the FAT filesystem
+ */
+#ifndef __PORT_H__
+#define __PORT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Keep the state of the card in dir, which is created if it doesn't
+ * exist yet. Has to be called once, before anything else.
+ *
+ * @return 0 on success, 1 on failure
+ */
+uint8_t portInit(const char* dir);
+
+// fopen, unlink and rename, with the paths under the mount point in the directory of the card
+FILE* portFopen(const char* path, const char* mode);
+int portUnlink(const char* path);
+int portRename(const char* from, const char* to);
+
+#endif
@@ -8,12 +8,16 @@
  *    Connection with another machine
  *    Receiving APDU commands and writing APDU responses
  */
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "esp_event_loop.h"
@@ -23,6 +27,9 @@
 #include "nvs.h"
 #include "rom/uart.h"
 #include "driver/gpio.h"
+#ifdef CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -34,16 +41,70 @@
 
 #include "netlist.h"
 #include "libAPDU.h"
+#include "libChannel.h"
 
 #define PORT 5511       // The default port of this protocol
-// Display the time it takes to complete an operation
-//#define TIMING        // Do not enable unless testing, or a 1 second delay will be added for each operation
-#define PRINTAPDU       // If defined, APDU info is printed, mainly used for debug reasons
+#define BEACON_PORT 5512        // The UDP port the host relay announces itself on
+#define BEACON_RETRY 5          // Seconds to wait for a beacon before trying the last known host again
+#define SESSION_IDLE_TIMEOUT 30 // Seconds without any frame from the host before the session is dropped
+#define JOB_POLL 1000           // Milliseconds between two looks at the socket while a command runs
+// The session is encrypted (see libChannel.h), the host relay must run with -k FILE. Define PLAINTEXT
+// for the clients that talk to the ESP32 directly (vicc --esp32, the BixVReader Esp32Reader,
+// testing/*.py), they don't speak the channel
+//#define PLAINTEXT
+#ifndef PLAINTEXT
+#define CHANNEL
+#endif
+// Display the time each phase of an operation takes (always counted in libStats.h)
+//#define TIMING        // Do not enable unless testing, the timing output slows down each operation
+#define PRINTAPDU       // If defined, APDUs are traced in full from boot on (see libTrace.h)
 #define PROCEEDBTN      // Do not perform a security operation until the button is pressed
+#define BUTTON_TIMEOUT 15       // Seconds to wait for the button before giving up
+// Touch cache: a press authorizes up to TOUCH_CACHE_OPS operations of the same key (0 = no limit)
+// within TOUCH_CACHE_TIME seconds (0 = no limit). With both at 0, every operation needs a press
+#define TOUCH_CACHE_OPS 0
+#define TOUCH_CACHE_TIME 0
+#define WIFI_CACHE_LEASE        // Reuse the last DHCP lease as a static IP, instead of waiting for DHCP
+#define WIFI_SCAN_MAX 20        // APs kept from a scan
+// Power save: full power from the connection or the first command of a burst, until POWER_IDLE seconds
+// after the last one (0 = never save power). Then the radio sleeps between beacons and, if power
+// management is enabled (CONFIG_PM_ENABLE, CONFIG_PM_DFS_INIT_AUTO), the CPU clock may go down
+#define POWER_IDLE 10
+#define POWER_IDLE_PS WIFI_PS_MIN_MODEM      // WIFI_PS_MAX_MODEM saves more, but wakes up later
+#define DIAG_PERIOD 0            // Seconds between two log lines of the heap and stack figures (0 = none, see libDiag.h)
+#define BATCH_FRAME 0xFF        // First byte of a batch frame, CLA FF is invalid (ISO 7816-4)
+#define BATCH_MAX_COMMANDS 4    // Commands run from a single batch frame
+#define BATCH_MAX_LENGTH (1 + BATCH_MAX_COMMANDS*(2 + RESPONSE_MAX_LENGTH + 2))
+#define FRAME_TAIL CHANNEL_TAG_LENGTH   // Room after the data of a frame, for the tag of the channel
+#define FRAME_TOO_LONG (-2)     // recvFrame: a frame longer than the buffer has been dropped
+_Static_assert(OUT_TAIL >= FRAME_TAIL, "a response must have room for the tag");
 
 // FreeRTOS event group to signal connected & ready to make a request
 static EventGroupHandle_t wifiEventGroup;
 
+// Queue of the APDU commands for the crypto worker
+static QueueHandle_t cryptoQueue;
+
+typedef struct cryptoJob_t {    // An APDU command handed to the crypto worker
+    apdu_t* apdu;               // The command, NULL to invalidate the PINs
+    outData* output;            // Where the response goes
+    TaskHandle_t caller;        // Notified when the response is ready
+} cryptoJob_t;
+
+/**
+ * Invalidate the PINs on the crypto worker, after the command it may be
+ * running, instead of under it. Never blocks, so it is safe from the WiFi
+ * event task: taskConnect has at most one command in the queue, so a full
+ * queue already holds a reset.
+ */
+static void postInvalidate() {
+    cryptoJob_t job = { NULL, NULL, NULL };
+    xQueueSend(cryptoQueue, &job, 0);
+}
+
+// Start of each beacon of the host relay
+static const uint8_t BEACON_MAGIC[4] = { 'W', 'S', 'C', 'B' };
+
 // Flag that is set when connected to an AP with an IP
 const int CONNECTED_BIT = BIT0;
 
@@ -54,19 +115,287 @@ static wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
 const char *base_path = "/spiflash";
 
 uint8_t connected = 0;  // Status bit for the WiFi
-uint8_t proceed = 0;    // When the proceed button is pressed, proceed is set
 uint8_t hardRst = 0;    // When the hard reset button is pressed, hardRst is set
-uint16_t timeCount = 0; // How many operations were performed
-uint64_t totalTime = 0; // Total time taken for all operations in milliseconds
+
+static SemaphoreHandle_t powerMutex;        // Guards powerFull, against the timer task
+static TimerHandle_t powerTimer;            // Fires POWER_IDLE seconds after the last command
+static uint8_t powerFull = 0;               // Radio awake, CPU at its maximum frequency
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t powerLock;      // Held at full power
+#endif
+
+static SemaphoreHandle_t proceedSemaphore;  // Given by each press of the proceed button
+static TaskHandle_t blinkTask;              // Notified to start and to stop blinking
 
 void proceedHandle(void* arg) {     // Interrupt handler for the proceed button
-    proceed = 1;
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(proceedSemaphore, &woken);    // Wake up the task waiting for it, if any
+    if (woken == pdTRUE) {
+        portYIELD_FROM_ISR();
+    }
 }
 
 void hardReset(void* arg) {         // Interrupt handler for the hard reset button
     hardRst = 1;
 }
 
+/**
+ * Receive exactly len bytes from the socket.
+ *
+ * @return 0 on success, -1 if the connection was closed, failed or timed out
+ */
+int recvAll(int sockfd, uint8_t* buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        int r = recv(sockfd, buf + received, len - received, 0);
+        if (r <= 0) {
+            return -1;
+        }
+        received += r;
+    }
+    return 0;
+}
+
+/**
+ * Take a frame too long for buf off the socket, max bytes at most at a
+ * time, so that the session can go on. Once the channel is up, the frame
+ * is decrypted as it comes and its tag is still checked. buf[0] is left
+ * with the first byte of the frame, for the answer to it.
+ *
+ * @return 0 on success, -1 if the session has ended
+ */
+static int drainFrame(int sockfd, uint8_t* buf, uint16_t max, uint16_t len) {
+    uint16_t piece = max & ~0x0F;   // But for the last one, the pieces GCM takes are whole blocks
+    uint8_t first = 0;
+    uint16_t n;
+
+    if (channelActive) {
+        if (len < CHANNEL_TAG_LENGTH || channelOpenStart() != 0) {
+            return -1;
+        }
+        len -= CHANNEL_TAG_LENGTH;
+    }
+    for (uint16_t done = 0; done < len; done += n) {
+        n = (len - done < piece) ? len - done : piece;
+        if (recvAll(sockfd, buf, n) != 0 || (channelActive && channelOpenUpdate(buf, n) != 0)) {
+            return -1;
+        }
+        if (done == 0) {
+            first = buf[0];
+        }
+    }
+    if (channelActive && (recvAll(sockfd, buf, CHANNEL_TAG_LENGTH) != 0 || channelOpenFinish(buf) != 0)) {
+        return -1;
+    }
+    buf[0] = first;
+    return 0;
+}
+
+/**
+ * Receive one frame of the session protocol. Every frame is prefixed with
+ * its length on 2 bytes (network byte order), the same way vpcd frames the
+ * messages to the virtual ICC. A zero length frame is a keep-alive. Once
+ * the channel is up, the other frames are decrypted in place. A frame
+ * longer than max is taken off the socket, but not kept (see drainFrame).
+ *
+ * @return The length of the frame, FRAME_TOO_LONG for a frame longer than
+ *         max, or -1 if the session has ended
+ */
+int recvFrame(int sockfd, uint8_t* buf, uint16_t max) {
+    uint8_t size[2];
+    if (recvAll(sockfd, size, sizeof(size)) != 0) {
+        return -1;
+    }
+    uint16_t len = (uint16_t) (size[0] << 8 | size[1]);
+    if (len > max) {        // Longer than any command the card takes
+        return (drainFrame(sockfd, buf, max, len) == 0) ? FRAME_TOO_LONG : -1;
+    }
+    if (recvAll(sockfd, buf, len) != 0) {
+        return -1;
+    }
+    if (len > 0 && channelActive) {
+        return channelOpen(buf, len);
+    }
+    return len;
+}
+
+/**
+ * Send one frame of the session protocol. The length prefix and the data
+ * are written at once, so that a response goes out in a single segment.
+ * frame has room for the prefix, the data follows it, so nothing is copied.
+ * Once the channel is up, the data is encrypted in place, frame has room
+ * for FRAME_TAIL more bytes after it.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int sendFrame(int sockfd, uint8_t* frame, uint16_t len) {
+    if (len > 0 && channelActive) {
+        int sealed = channelSeal(frame + 2, len);
+        if (sealed < 0) {
+            return -1;
+        }
+        len = (uint16_t) sealed;
+    }
+    frame[0] = (uint8_t) (len >> 8);
+    frame[1] = (uint8_t) (len & 0xFF);
+    if (write(sockfd, frame, len + 2) != len + 2) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Set up a socket for a long lived session with the host: no Nagle delay
+ * on the small APDU frames, TCP keep-alive to notice a dead peer and a
+ * receive timeout to notice a host that has gone silent.
+ */
+void setupSession(int sockfd) {
+    int yes = 1;
+    int idle = 10, interval = 5, count = 3;
+    struct timeval timeout = { .tv_sec = SESSION_IDLE_TIMEOUT, .tv_usec = 0 };
+
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * Open the socket that receives the beacons of the host. The relay
+ * broadcasts a beacon (BEACON_MAGIC | Port, 2 bytes in network byte
+ * order) every second while it listens, so a beacon tells both that
+ * the relay is ready and where it is. With a PSK, a nonce and a tag
+ * follow (see channelBeacon), without it only the host of netlist.h
+ * is followed to another port.
+ *
+ * @return The socket, or -1 on failure
+ */
+int openBeacon() {
+    struct sockaddr_in addr;
+    int beaconfd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (beaconfd < 0) {
+        return -1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BEACON_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(beaconfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(beaconfd);
+        return -1;
+    }
+    return beaconfd;
+}
+
+/**
+ * Wait up to timeout ms for a beacon of the host, and set host to the
+ * address it came from and the port it announces. The beacons that
+ * arrived before the call are dropped, the relay may have gone since,
+ * and so are those that can't be trusted.
+ *
+ * @return 0 if a beacon arrived, -1 on timeout
+ */
+int waitBeacon(int beaconfd, struct sockaddr_in* host, uint32_t timeout) {
+    uint8_t beacon[sizeof(BEACON_MAGIC) + CHANNEL_BEACON_LENGTH];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int64_t until = esp_timer_get_time() + (int64_t) timeout*1000;
+    int64_t left;
+    fd_set fds;
+    int len;
+
+    while (recv(beaconfd, beacon, sizeof(beacon), MSG_DONTWAIT) >= 0);    // Drop the old ones
+    while ((left = until - esp_timer_get_time()) > 0) {
+        struct timeval tv = { .tv_sec = left / 1000000, .tv_usec = left % 1000000 };
+        FD_ZERO(&fds);
+        FD_SET(beaconfd, &fds);
+        if (select(beaconfd + 1, &fds, NULL, NULL, &tv) <= 0) {
+            return -1;
+        }
+        fromLen = sizeof(from);
+        len = recvfrom(beaconfd, beacon, sizeof(beacon), 0, (struct sockaddr *)&from, &fromLen);
+        if (len < (int) sizeof(BEACON_MAGIC) + 2 || memcmp(beacon, BEACON_MAGIC, sizeof(BEACON_MAGIC)) != 0) {
+            continue;   // Not a beacon of the relay
+        }
+#ifdef CHANNEL
+        if (!channelBeacon(from.sin_addr.s_addr, beacon + sizeof(BEACON_MAGIC), len - sizeof(BEACON_MAGIC))) {
+            continue;   // Not from the relay that has the PSK
+        }
+#else
+        if (from.sin_addr.s_addr != inet_addr(IP[currNet])) {
+            continue;   // Nothing to check it with, only the host of netlist.h may move
+        }
+#endif
+        host->sin_family = AF_INET;
+        host->sin_addr.s_addr = from.sin_addr.s_addr;
+        host->sin_port = htons((uint16_t) (beacon[sizeof(BEACON_MAGIC)] << 8 | beacon[sizeof(BEACON_MAGIC) + 1]));
+        return 0;
+    }
+    return -1;
+}
+
+#ifdef PROCEEDBTN
+static uint8_t touchValid[3];   // A press covers the key (signature, decryption, authentication)
+static uint16_t touchLeft[3];   // Operations it still covers
+static int64_t touchUntil[3];   // Time until it covers them, from esp_timer_get_time()
+
+void touchClear() {     // Forget the touch cache, at the start of a session and with the PINs
+    bzero(touchValid, sizeof(touchValid));
+}
+
+/**
+ * Wait for the proceed button, unless a recent press of it still covers
+ * an operation of the key (the touch cache). The LEDs blink meanwhile.
+ * The operation is only counted by touchUsed, once it has run.
+ *
+ * @param key 0 for signature, 1 for decryption, 2 for authentication
+ * @return 1 if the operation can go on, 0 if the time ran out
+ */
+uint8_t waitButton(uint8_t key) {
+    int64_t now = esp_timer_get_time();
+
+    if (touchValid[key]) {
+        if ((TOUCH_CACHE_TIME == 0 || now < touchUntil[key]) &&
+            (TOUCH_CACHE_OPS == 0 || touchLeft[key] > 0)) {
+            return 1;
+        }
+        touchValid[key] = 0;
+    }
+
+    xSemaphoreTake(proceedSemaphore, 0);    // A press from before the request doesn't count
+    xTaskNotifyGive(blinkTask);             // Start blinking
+    BaseType_t pressed = xSemaphoreTake(proceedSemaphore, (BUTTON_TIMEOUT*1000)/portTICK_PERIOD_MS);
+    xTaskNotifyGive(blinkTask);             // Stop blinking
+    if (pressed != pdTRUE) {
+        return 0;
+    }
+
+    if (TOUCH_CACHE_OPS != 0 || TOUCH_CACHE_TIME != 0) {
+        touchValid[key] = 1;
+        touchLeft[key] = TOUCH_CACHE_OPS;       // This operation counts once it has run
+        touchUntil[key] = esp_timer_get_time() + (int64_t) TOUCH_CACHE_TIME * 1000000;
+    }
+    return 1;
+}
+
+/**
+ * Count an operation of the key against the touch cache, once the crypto
+ * worker has run it. An operation it turned down (PIN not verified, no
+ * key) doesn't use up the press.
+ *
+ * @param sw Status word of the response
+ */
+void touchUsed(uint8_t key, uint16_t sw) {
+    if (touchValid[key] && TOUCH_CACHE_OPS != 0 && touchLeft[key] > 0 &&
+            (sw == SW_NO_ERROR || (sw & 0xFF00) == SW_BYTES_REMAINING_00)) {
+        touchLeft[key]--;
+    }
+}
+#endif
+
 uint8_t mountFS() {     // Mount the filesystem at the beginning
     static const char *TAG = "mountFS";
     ESP_LOGI(TAG, "Mounting FAT filesystem");
@@ -90,6 +419,8 @@ void unmountFS() {      // Unmount the filesystem before restarting
 }
 
 void initGPIO() {
+    proceedSemaphore = xSemaphoreCreateBinary();            // Before the ISR can give it
+
     gpio_set_direction(GPIO_NUM_25, GPIO_MODE_OUTPUT);      // WiFi status LED
     gpio_set_direction(GPIO_NUM_26, GPIO_MODE_OUTPUT);      // Processing status LED
 
@@ -119,34 +450,205 @@ void initNVS() {        // Initialize the non-volatile storage
     ESP_ERROR_CHECK(err);
 }
 
+/*
+ * Network selection. The network that last gave an IP is cached in NVS
+ * (which network, its BSSID and channel, and the lease) so that a boot
+ * or a reconnect can skip the scan and the DHCP exchange. When the
+ * cached network fails, a single scan ranks the known networks by RSSI
+ * and they are tried in that order, the scan is only repeated once all
+ * of them have failed.
+ */
+typedef struct wifiCache_t {    // Stored as a blob in NVS
+    uint8_t net;                // Index in wifiConfig
+    uint8_t bssid[6];
+    uint8_t channel;
+    tcpip_adapter_ip_info_t lease;  // The last lease, reused as a static IP
+} wifiCache_t;
+
+typedef struct wifiCandidate_t {    // A known network found by the scan
+    uint8_t net;
+    uint8_t bssid[6];           // Of its strongest AP
+    uint8_t channel;
+    int8_t rssi;
+} wifiCandidate_t;
+
+static wifiCache_t wifiCache;
+static wifiCandidate_t wifiCandidates[NUMOFNETS];   // Ranked by RSSI, strongest first
+static uint8_t wifiCandidateCount = 0;
+static uint8_t wifiCandidateNext = 0;   // The candidate to try next
+static uint8_t wifiFast = 0;            // Set while trying the cached network
+static uint8_t wifiRejoin = 0;          // Set when the link is lost, to retry the same AP once
+static uint8_t wifiStaticLease = 0;     // Set while the cached lease is used instead of DHCP
+
+// Read the cached network from NVS, return 0 if there is a valid one
+static uint8_t wifiLoadCache() {
+    nvs_handle nvsHandle;
+    size_t len = sizeof(wifiCache);
+    esp_err_t err;
+
+    if (nvs_open("storage", NVS_READONLY, &nvsHandle) != ESP_OK) {
+        return 1;
+    }
+    err = nvs_get_blob(nvsHandle, "wifiCache", &wifiCache, &len);
+    nvs_close(nvsHandle);
+    return (err != ESP_OK || len != sizeof(wifiCache) || wifiCache.net >= NUMOFNETS);
+}
+
+// Write the cached network to NVS, only if it has changed (spares the flash)
+static void wifiStoreCache(wifiCache_t* cache) {
+    nvs_handle nvsHandle;
+
+    if (memcmp(cache, &wifiCache, sizeof(wifiCache)) == 0) {
+        return;
+    }
+    memcpy(&wifiCache, cache, sizeof(wifiCache));
+    if (nvs_open("storage", NVS_READWRITE, &nvsHandle) == ESP_OK) {
+        if (nvs_set_blob(nvsHandle, "wifiCache", &wifiCache, sizeof(wifiCache)) == ESP_OK) {
+            nvs_commit(nvsHandle);
+        }
+        nvs_close(nvsHandle);
+    }
+}
+
+// Forget the cached lease and go back to DHCP
+void wifiDropLease() {
+    if (wifiStaticLease) {
+        wifiStaticLease = 0;
+        tcpip_adapter_dhcpc_start(TCPIP_ADAPTER_IF_STA);
+    }
+}
+
+// Connect to the network net through the AP bssid on channel
+static void wifiJoin(uint8_t net, uint8_t* bssid, uint8_t channel) {
+    static const char *TAG = "wifiJoin";
+    wifi_config_t config;
+
+    memcpy(&config, wifiConfig[net], sizeof(config));
+    config.sta.bssid_set = 1;           // No scan for the AP, it is already known
+    memcpy(config.sta.bssid, bssid, sizeof(config.sta.bssid));
+    config.sta.channel = channel;
+    currNet = net;
+    ESP_LOGI(TAG, "Setting WiFi configuration SSID %s, channel %d...", config.sta.ssid, channel);
+    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &config));
+    ESP_ERROR_CHECK(esp_wifi_connect());
+}
+
+static void wifiScan() {
+    static const char *TAG = "wifiScan";
+    esp_err_t err;
+
+    wifiDropLease();            // The lease only holds for the cached network
+    wifiCandidateCount = 0;
+    wifiCandidateNext = 0;
+    if ((err = esp_wifi_scan_start(NULL, false)) != ESP_OK) {   // Ends with SYSTEM_EVENT_SCAN_DONE
+        ESP_LOGE(TAG, "esp_wifi_scan_start returned %d", err);
+    }
+}
+
+// Rank the known networks found by the scan, by the RSSI of their strongest AP
+static void wifiRank() {
+    static const char *TAG = "wifiRank";
+    static wifi_ap_record_t records[WIFI_SCAN_MAX];     // Static, the event task has a small stack
+    uint16_t count = WIFI_SCAN_MAX;
+    uint8_t i, j, found;
+
+    if (esp_wifi_scan_get_ap_records(&count, records) != ESP_OK) {
+        count = 0;
+    }
+    for (uint8_t net = 0; net < NUMOFNETS; net++) {
+        found = 0;
+        for (i = 0; i < count; i++) {
+            if (strncmp((char*) records[i].ssid, (char*) (*wifiConfig[net]).sta.ssid, 32) != 0) {
+                continue;
+            }
+            if (!found || records[i].rssi > wifiCandidates[wifiCandidateCount].rssi) {
+                wifiCandidates[wifiCandidateCount].net = net;
+                memcpy(wifiCandidates[wifiCandidateCount].bssid, records[i].bssid, 6);
+                wifiCandidates[wifiCandidateCount].channel = records[i].primary;
+                wifiCandidates[wifiCandidateCount].rssi = records[i].rssi;
+                found = 1;
+            }
+        }
+        if (!found) {
+            continue;
+        }
+        wifiCandidate_t c = wifiCandidates[wifiCandidateCount];    // Insert it in RSSI order
+        for (j = wifiCandidateCount; j > 0 && wifiCandidates[j-1].rssi < c.rssi; j--) {
+            wifiCandidates[j] = wifiCandidates[j-1];
+        }
+        wifiCandidates[j] = c;
+        wifiCandidateCount++;
+    }
+    ESP_LOGI(TAG, "%d APs found, %d known networks", count, wifiCandidateCount);
+}
+
+// Try the next ranked network, or scan again once they have all failed
+static void wifiNext() {
+    if (wifiCandidateNext < wifiCandidateCount) {
+        wifiCandidate_t* c = &wifiCandidates[wifiCandidateNext++];
+        wifiJoin(c->net, c->bssid, c->channel);
+    } else {
+        wifiScan();
+    }
+}
+
 static esp_err_t event_handler(void *ctx, system_event_t *event) {
     static const char *TAG = "wifiEventHandler";
+    wifi_ap_record_t ap;
+    wifiCache_t cache;
 
     switch(event->event_id) {
     case SYSTEM_EVENT_STA_START:
-        currNet = nextNet;      // Select the next network in the list and try to connect
-        ESP_LOGI(TAG, "Setting WiFi configuration SSID %s...", (*wifiConfig[currNet]).sta.ssid);
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifiConfig[currNet]));
-        nextNet = (nextNet + 1) % NUMOFNETS;    // Prepare the next network to select
-        ESP_ERROR_CHECK(esp_wifi_connect());
+        if (wifiLoadCache() == 0) {     // Fast path, straight to the network that worked last
+            wifiFast = 1;
+#ifdef WIFI_CACHE_LEASE
+            if (wifiCache.lease.ip.addr != 0) {
+                tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
+                tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &wifiCache.lease);
+                wifiStaticLease = 1;
+            }
+#endif
+            wifiJoin(wifiCache.net, wifiCache.bssid, wifiCache.channel);
+        } else {
+            wifiScan();
+        }
+        break;
+    case SYSTEM_EVENT_SCAN_DONE:
+        wifiRank();
+        wifiNext();
         break;
     case SYSTEM_EVENT_STA_GOT_IP:
         connected = 1;
-        invalidate();                   // Invalidate / PIN Reset at a new WiFi connection
+        wifiFast = 0;
+        wifiRejoin = 1;                 // If the link is lost, the same AP is tried first
+        if (event->event_info.got_ip.ip_changed) {
+            postInvalidate();           // Invalidate / PIN Reset, no session survives a new IP
+        }
         gpio_set_level(GPIO_NUM_26, 1); // Connected to a network, light up the LED
         ESP_LOGI(TAG, "Connected to AP");
+        if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+            bzero(&cache, sizeof(cache));
+            cache.net = currNet;
+            memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+            cache.channel = ap.primary;
+            cache.lease = event->event_info.got_ip.ip_info;
+            wifiStoreCache(&cache);
+        }
         xEventGroupSetBits(wifiEventGroup, CONNECTED_BIT);
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
-        connected = 0;
-        invalidate();                   // Invalidate / PIN Reset at a WiFi disconnect
+        connected = 0;                  // The PINs are kept, they are reset when the session ends
         gpio_set_level(GPIO_NUM_26, 0); // Disconnected, turn of the LED
         xEventGroupClearBits(wifiEventGroup, CONNECTED_BIT);
-        currNet = nextNet;      // Select the next network in the list and try to connect
-        ESP_LOGI(TAG, "Setting WiFi configuration SSID %s...", (*wifiConfig[nextNet]).sta.ssid);
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifiConfig[nextNet]));
-        nextNet = (nextNet + 1) % NUMOFNETS;    // Prepare the next network to select
-        ESP_ERROR_CHECK(esp_wifi_connect());
+        if (wifiRejoin) {               // Lost the AP, it may only be a short drop
+            wifiRejoin = 0;
+            ESP_ERROR_CHECK(esp_wifi_connect());
+        } else if (wifiFast) {          // The cached network is gone, look for another one
+            wifiFast = 0;
+            wifiScan();
+        } else {
+            wifiNext();
+        }
         break;
     default:
         break;
@@ -154,9 +656,52 @@ static esp_err_t event_handler(void *ctx, system_event_t *event) {
     return ESP_OK;
 }
 
-static void initWiFi(void) {    // Configure and initialize WiFi
-    nextNet = 0;        // Attempt to connect to this network next
+/**
+ * Go to full power, or stay there for POWER_IDLE more seconds. Called
+ * on a connection to the host and on each command, not on keep-alives:
+ * the host sends them to an idle session too.
+ */
+static void powerActive() {
+    xSemaphoreTake(powerMutex, portMAX_DELAY);
+    if (powerFull == 0) {
+        esp_wifi_set_ps(WIFI_PS_NONE);  // No beacon interval added to each APDU
+#ifdef CONFIG_PM_ENABLE
+        esp_pm_lock_acquire(powerLock);
+#endif
+        powerFull = 1;
+    }
+    if (POWER_IDLE != 0) {
+        xTimerReset(powerTimer, 0);     // Within the mutex, so powerIdle can't get in between
+    }
+    xSemaphoreGive(powerMutex);
+}
+
+static void powerIdle(TimerHandle_t timer) {    // The burst is over, save power
+    if (xSemaphoreTake(powerMutex, 0) != pdTRUE) {
+        return;     // powerActive is running, and restarts the timer
+    }
+    if (powerFull == 1) {
+        esp_wifi_set_ps(POWER_IDLE_PS);
+#ifdef CONFIG_PM_ENABLE
+        esp_pm_lock_release(powerLock);
+#endif
+        powerFull = 0;
+        ESP_LOGI("powerIdle", "Idle, saving power");
+    }
+    xSemaphoreGive(powerMutex);
+}
 
+static void initPower(void) {   // Start at full power, until the first idle window is over
+    powerMutex = xSemaphoreCreateMutex();
+    powerTimer = xTimerCreate("powerTimer", (POWER_IDLE*1000)/portTICK_PERIOD_MS + 1,
+            pdFALSE, NULL, powerIdle);
+#ifdef CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "powerLock", &powerLock));
+#endif
+    powerActive();
+}
+
+static void initWiFi(void) {    // Configure and initialize WiFi
     tcpip_adapter_init();   // Initialize the TCP/IP adapter
     wifiEventGroup = xEventGroupCreate();
     ESP_ERROR_CHECK(esp_event_loop_init(event_handler, NULL));
@@ -166,21 +711,248 @@ static void initWiFi(void) {    // Configure and initialize WiFi
     ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_start());
-    esp_wifi_set_ps(WIFI_PS_NONE);
+    initPower();
+}
+
+/**
+ * Answer the keep-alives the host sends while a command runs. Only an
+ * empty frame is taken off the socket, any other frame stays there for
+ * the session loop, once the response has been sent.
+ *
+ * @return 0 if the session can go on, -1 if the host is gone
+ */
+static int answerKeepAlives(int sockfd) {
+    uint8_t size[2];
+    int r;
+
+    while ((r = recv(sockfd, size, sizeof(size), MSG_PEEK | MSG_DONTWAIT)) == sizeof(size)
+            && size[0] == 0 && size[1] == 0) {
+        if (recv(sockfd, size, sizeof(size), 0) != sizeof(size) || sendFrame(sockfd, size, 0) != 0) {
+            return -1;
+        }
+    }
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return -1;      // Hung up, or the link is broken
+    }
+    return 0;
+}
+
+// Status word of a response, 0 if it is too short to have one
+static uint16_t responseSW(outData* output) {
+    return (output->length >= 2) ?
+            (output->data[output->length-2] << 8) | output->data[output->length-1] : 0;
+}
+
+/**
+ * Run one command APDU: wait for the button if it needs it, then hand it
+ * to the crypto worker. The response is left in output. While the worker
+ * runs it, the keep-alives of the host are answered every JOB_POLL ms.
+ *
+ * @param phases Time taken by each phase, but for the write of the response
+ * @return 0 on success, -1 if the host went away while the command ran
+ */
+static int runCommand(int sockfd, apdu_t* comAPDU, outData* output, char* cmd, int len, int64_t phases[STATS_PHASES]) {
+    int gone = 0;
+    int64_t mark = esp_timer_get_time();
+    uint16_t parsed = parseAPDU(comAPDU, cmd, len);     // Parse the APDU command, in place
+    phases[STATS_PARSE] = esp_timer_get_time() - mark;
+
+    traceRecord(TRACE_COMMAND, (uint8_t*) cmd, len);    // Printed later by taskTrace
+
+    if (parsed != SW_NO_ERROR) {        // Malformed, answered without running it
+        output->data[0] = (uint8_t) (parsed >> 8);
+        output->data[1] = (uint8_t) (parsed & 0xFF);
+        output->length = 2;
+        return 0;
+    }
+
+#ifdef PROCEEDBTN   // The button has to be pressed before performing a security operation
+    int key = -1;       // The key of the operation, if it needs the button
+    if ((comAPDU->CLA != 0x10) & (comAPDU->INS == 0x88 || comAPDU->INS == 0x2A
+            || comAPDU->INS == 0x58)) {  // Ignore for command chaining, one press for a whole BATCH SIGN
+        key = (comAPDU->INS == 0x88) ? 2 : ((comAPDU->P1P2 == 0x9E9A || comAPDU->INS == 0x58) ? 0 : 1);
+        mark = esp_timer_get_time();
+        uint8_t pressed = waitButton(key);
+        phases[STATS_BUTTON] = esp_timer_get_time() - mark;
+        if (pressed == 0) {             // The time ran out
+            output->data[0] = 0x69;     // Set the output to SW_AUTHENTICATION_BLOCKED
+            output->data[1]= 0x83;      // SW_AUTHENTICATION_BLOCKED = 0x6983
+            output->length = 2;         // Set the length of the output to 2 bytes
+            return 0;                   // And bypass the processing of this APDU command
+        }
+    }
+#endif
+
+    gpio_set_level(GPIO_NUM_25, 1);     // Start processing a command
+
+    mark = esp_timer_get_time();
+    // Perform the appropriate operation on the crypto worker, PRO_CPU stays free for the network
+    cryptoJob_t job = { comAPDU, output, xTaskGetCurrentTaskHandle() };
+    xQueueSend(cryptoQueue, &job, portMAX_DELAY);
+    while (ulTaskNotifyTake(pdTRUE, JOB_POLL/portTICK_PERIOD_MS) == 0) {
+        if (gone == 0 && answerKeepAlives(sockfd) != 0) {
+            gone = 1;   // Still wait for the worker, the command and response buffers are in use
+        }
+    }
+
+    phases[STATS_FLASH] = statsFlashTime;
+    phases[STATS_CRYPTO] = esp_timer_get_time() - mark - statsFlashTime;
+#ifdef PROCEEDBTN
+    if (key >= 0) {
+        touchUsed(key, responseSW(output));
+    } else if (comAPDU->INS == 0x55) {  // The PINs were reset, see taskCrypto for the other way
+        touchClear();
+    }
+#endif
+    gpio_set_level(GPIO_NUM_25, 0);     // End of command processing
+    return gone ? -1 : 0;
+}
+
+// Add a command that has been answered to the statistics
+static void countCommand(apdu_t* comAPDU, uint16_t sw, int64_t phases[STATS_PHASES]) {
+    statsRecord(comAPDU->INS, comAPDU->P1P2, sw, phases);
+#ifdef TIMING       // Print where the time of this command went, in us
+    printf("\t\tParse: %" PRId64 "\tButton: %" PRId64 "\tCrypto: %" PRId64 "\tFlash: %" PRId64 "\tWrite: %" PRId64 "\n",
+           phases[STATS_PARSE], phases[STATS_BUTTON], phases[STATS_CRYPTO],
+           phases[STATS_FLASH], phases[STATS_WRITE]);
+    fflush(stdout);
+#endif
+}
+
+/**
+ * Run a batch frame: BATCH_FRAME | Length | APDU | Length | APDU ...,
+ * each length on 2 bytes (network byte order). The commands are run in
+ * order and stop after the first one that doesn't end with 90 00 or 61 XX,
+ * or after BATCH_MAX_COMMANDS of them, the host sends the rest again. The
+ * responses go back in a single frame of the same form.
+ *
+ * @return 0 on success, -1 if the responses couldn't be sent
+ */
+static int runBatch(int sockfd, apdu_t* comAPDU, outData* output, char* batch, int len) {
+    static uint8_t frame[2 + BATCH_MAX_LENGTH + FRAME_TAIL];   // Length | BATCH_FRAME | Responses
+    int64_t phases[STATS_PHASES];
+    uint16_t out = 2;
+    int offset = 1;
+
+    frame[out++] = BATCH_FRAME;
+    for (uint8_t count = 0; count < BATCH_MAX_COMMANDS && offset + 2 <= len; count++) {
+        uint16_t size = (uint16_t) ((uint8_t) batch[offset] << 8 | (uint8_t) batch[offset+1]);
+        if (size < 4 || offset + 2 + size > len) {  // Not an APDU, nothing after it can be trusted
+            break;
+        }
+        bzero(phases, sizeof(phases));
+        if (runCommand(sockfd, comAPDU, output, batch + offset + 2, size, phases) != 0) {
+            return -1;
+        }
+        offset += 2 + size;
+
+        frame[out++] = (uint8_t) (output->length >> 8);
+        frame[out++] = (uint8_t) (output->length & 0xFF);
+        memcpy(frame + out, output->data, output->length);
+        out += output->length;
+        traceRecord(TRACE_RESPONSE, output->data, output->length);
+        uint16_t sw = responseSW(output);
+        countCommand(comAPDU, sw, phases);      // The write is counted for none of them
+
+        if (sw != SW_NO_ERROR && (sw & 0xFF00) != SW_BYTES_REMAINING_00) {
+            break;      // Stop on error, the commands after it expect it to have worked
+        }
+    }
+
+    if (sendFrame(sockfd, frame, out - 2) != 0) {
+        return -1;
+    }
+    ESP_LOGI("runBatch", "... %d bytes of responses sent", out - 2);
+    return 0;
+}
+
+/**
+ * Answer a frame that recvFrame dropped as too long with 67 00
+ * (SW_WRONG_LENGTH), in a batch frame of its own for a batch, so that
+ * the host knows none of its commands has run.
+ *
+ * @return 0 on success, -1 if the answer couldn't be sent
+ */
+static int answerTooLong(int sockfd, uint8_t first) {
+    uint8_t frame[2 + 5 + FRAME_TAIL];      // Length | [BATCH_FRAME | 00 02 |] 67 00
+    uint16_t out = 2;
+
+    if (first == BATCH_FRAME) {
+        frame[out++] = BATCH_FRAME;
+        frame[out++] = 0x00;
+        frame[out++] = 0x02;
+    }
+    frame[out++] = (uint8_t) (SW_WRONG_LENGTH >> 8);
+    frame[out++] = (uint8_t) (SW_WRONG_LENGTH & 0xFF);
+    ESP_LOGE("answerTooLong", "... %s too long for the card", (first == BATCH_FRAME) ? "batch" : "command");
+    return sendFrame(sockfd, frame, out - 2);
+}
+
+#ifdef CHANNEL
+/**
+ * Wait for the proceed button before a pairing, with or without
+ * PROCEEDBTN: nobody pairs with the ESP32 without a hand on it.
+ *
+ * @return 1 once it is pressed, 0 if the time ran out
+ */
+static uint8_t waitPairButton() {
+#ifdef PROCEEDBTN
+    touchClear();   // Only a press for the pairing counts
+    uint8_t pressed = waitButton(0);
+    touchClear();   // And it is for the pairing only
+    return pressed;
+#else
+    xSemaphoreTake(proceedSemaphore, 0);    // A press from before the request doesn't count
+    return xSemaphoreTake(proceedSemaphore, (BUTTON_TIMEOUT*1000)/portTICK_PERIOD_MS) == pdTRUE;
+#endif
 }
 
+/**
+ * Set up the encrypted channel of a new session (see libChannel.h). An
+ * ESP32 that isn't paired yet takes the PSK the relay offers, once the
+ * proceed button is pressed.
+ *
+ * @return 0 once the frames are encrypted, -1 if the session can't go on
+ */
+static int startChannel(int sockfd) {
+    static const char *TAG = "startChannel";
+    uint8_t frame[2 + CHANNEL_REPLY_MAX];
+    int r;
+
+    if (sendFrame(sockfd, frame, channelHello(frame + 2)) != 0
+            || (r = recvFrame(sockfd, frame, sizeof(frame))) < 0) {
+        return -1;
+    }
+    if ((r = channelAccept(frame, r)) == CHANNEL_PAIR) {
+        ESP_LOGI(TAG, "The host asks to pair, press the button");
+        r = (waitPairButton() != 0) ? channelPair() : -1;
+    }
+    return r;
+}
+#endif
+
 static void taskConnect(void *pvParameters) {
     static const char *TAG = "taskConnect";
 
     int sockfd, r;
-    apdu_t comAPDU;
-    outData output;
-    char recvBuf[1024];
+    int beaconfd;               // Receives the beacons of the host relay
+    int hostNet = -1;           // The network serv_addr belongs to
+    apdu_t comAPDU;             // A view of the command in recvBuf
+    static outData output;      // Static, so that the extended length buffers stay off the stack
+    static char recvBuf[7 + COMMAND_MAX_LENGTH + 2 + FRAME_TAIL];  // Header | 00 Lc Lc | Data | Le Le
     struct sockaddr_in serv_addr;
 
     nvs_handle nvsHandle;       // Open NVS to check if the device has been initialized
     uint8_t initialized = 0;    // Flag to check
     gpio_set_level(GPIO_NUM_25, 1);     // Initialize/restore start
+    if (rngInit() != 0) {       // The DRBG is seeded once, before any operation needs it
+        goto exit;
+    }
+#ifdef CHANNEL
+    if (channelInit() != 0) {
+        goto exit;
+    }
+#endif
     esp_err_t err = nvs_open("storage", NVS_READWRITE, &nvsHandle); // Open the NVS
     if (err != ESP_OK) {
         goto exit;
@@ -202,17 +974,31 @@ static void taskConnect(void *pvParameters) {
             default :
                 goto exit;
         }
+        if (keyPoolInit() != 0) {   // Start pre-generating a key pair for the next GENERATE
+            goto exit;
+        }
+        while (keyPending()) {      // No session yet, the keys are ready before the first command
+            keyPrepareNext();
+        }
         gpio_set_level(GPIO_NUM_25, 0);     // Initialize/restore end
     }
 
+    beaconfd = openBeacon();    // Without it the host is only polled at its address in netlist.h
+    if (beaconfd < 0) {
+        ESP_LOGE(TAG, "... Failed to open the beacon socket: %d", errno);
+    }
+
     while(1) {
 begin:
         // Wait for the callback to set the CONNECTED_BIT in the event group.
         xEventGroupWaitBits(wifiEventGroup, CONNECTED_BIT, false, true, portMAX_DELAY);
 
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(PORT);           // Set the port of this protocol
-        serv_addr.sin_addr.s_addr = inet_addr(IP[currNet]); // The IP address of the other machine
+        if (hostNet != currNet) {   // New network, start from the host listed for it
+            serv_addr.sin_family = AF_INET;
+            serv_addr.sin_port = htons(PORT);           // Set the port of this protocol
+            serv_addr.sin_addr.s_addr = inet_addr(IP[currNet]); // The IP address of the other machine
+            hostNet = currNet;
+        }
         sockfd = socket(AF_INET, SOCK_STREAM, 0);   // Setup the socket
         if (sockfd < 0) {
             ESP_LOGE(TAG, "... Failed to allocate socket: %d", errno);
@@ -224,111 +1010,94 @@ begin:
         if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0) {
             ESP_LOGE(TAG, "... socket connect failed errno: %d", errno);
             ESP_LOGI(TAG, "Check that the server is running at the other end");
-            invalidate();   // Invalidate / PIN Reset at a possible end of a connection
+            postInvalidate();   // Invalidate / PIN Reset at a possible end of a connection
+            wifiDropLease();    // The cached lease may be stale, get a new one
             close(sockfd);  // The connection may have failed because there is no server running
-            vTaskDelay(5000/portTICK_PERIOD_MS);    // So wait a few seconds
+            if (beaconfd < 0) {
+                vTaskDelay((BEACON_RETRY*1000)/portTICK_PERIOD_MS);    // So wait a few seconds
+            } else if (waitBeacon(beaconfd, &serv_addr, BEACON_RETRY*1000) == 0) {  // Or until it announces itself
+                ESP_LOGI(TAG, "Host announced at %s:%d", inet_ntoa(serv_addr.sin_addr), ntohs(serv_addr.sin_port));
+            }
             ESP_LOGI(TAG, "Trying again ...\n");    // And try to connect again
             goto begin;
         }
         ESP_LOGI(TAG, "... connected\n");
-
-        bzero(recvBuf, sizeof(recvBuf));                // Zero the receive buffer
-        r = read(sockfd, recvBuf, sizeof(recvBuf)-1);   // Receive the APDU command
-        comAPDU = parseAPDU(recvBuf, r);                // Parse the APDU command
-
-        if (comAPDU.INS == 0x00) {      // Nothing more to receive
-            invalidate();   // Invalidate / PIN Reset at a possible end of a connection
-            close(sockfd); 
+        powerActive();      // A session usually starts with a burst of commands
+        setupSession(sockfd);
+#ifdef PROCEEDBTN
+        touchClear();   // A press never carries over to another session
+#endif
+#ifdef CHANNEL
+        if (startChannel(sockfd) != 0) {
+            ESP_LOGE(TAG, "... no channel with the host");
+            close(sockfd);
+            vTaskDelay((BEACON_RETRY*1000)/portTICK_PERIOD_MS);    // Not a relay that knows the PSK
             goto begin;
         }
-
-#ifdef PRINTAPDU    // Print the parsed command APDU
-        printf("CLA: %02X\tINS: %02X\tP1: %02X\t", comAPDU.CLA, comAPDU.INS, comAPDU.P1);
-        printf("P2: %02X\tP1P2: %02X\tLc: %02X\tData: ", comAPDU.P2, comAPDU.P1P2, comAPDU.Lc);
-        const uint8_t* tmp = comAPDU.data;
-        while(*tmp)
-            printf("%02X ", (unsigned int) *tmp++);
-        printf("\nLe: %02X\tTotal: %d\n", comAPDU.Le, r);
-        fflush(stdout);
 #endif
 
-#ifdef PROCEEDBTN   // The button has to be pressed before performing a security operation
-        if ((comAPDU.CLA != 0x10) & (comAPDU.INS == 0x88 || comAPDU.INS == 0x2A)) { // Ignore for command chaining
-            proceed = 0;    // Set the flag to 0
-            int time = 0;   // Simple time counter
-
-            while (proceed == 0 && time < 30) { // Wait until the button is pressed or time runs out
-                gpio_set_level(GPIO_NUM_25, 1);     // Flash the LEDs to notify the user
-                gpio_set_level(GPIO_NUM_26, 1);     // Flash the LEDs to notify the user
-                vTaskDelay(250/portTICK_PERIOD_MS); // Wait for 250ms
-                gpio_set_level(GPIO_NUM_25, 0);     // Flash the LEDs to notify the user
-                gpio_set_level(GPIO_NUM_26, 0);     // Flash the LEDs to notify the user
-                vTaskDelay(250/portTICK_PERIOD_MS); // Wait for another 250ms
-                time++;     // 2 * 250ms * 30 = 15 seconds
+        while(1) {      // Serve command APDUs until the session ends
+            r = recvFrame(sockfd, (uint8_t*) recvBuf, sizeof(recvBuf));
+            if (r == FRAME_TOO_LONG) {
+                if (answerTooLong(sockfd, (uint8_t) recvBuf[0]) != 0) {
+                    ESP_LOGE(TAG, "... socket send failed");
+                    postInvalidate();   // Invalidate / PIN Reset at the end of a session
+                    close(sockfd);
+                    goto begin;
+                }
+                continue;
             }
-            gpio_set_level(GPIO_NUM_26, 1);         // Turn the WiFi status LED back on
-            if (time == 30) {           // If time == 30 it means that the time ran out
-                output.data[0] = 0x69;  // Set the output to SW_AUTHENTICATION_BLOCKED
-                output.data[1]= 0x83;   // SW_AUTHENTICATION_BLOCKED = 0x6983
-                output.length = 2;      // Set the length of the output to 2 bytes
-                goto writeOutput;       // And bypass the processing of this APDU command
+            if (r < 0) {    // The host hung up, or has been silent for too long
+                ESP_LOGI(TAG, "... session ended\n");
+                postInvalidate();   // Invalidate / PIN Reset at the end of a session
+                close(sockfd);
+                goto begin;
             }
-        }
-#endif
 
-        gpio_set_level(GPIO_NUM_25, 1);     // Start processing a command
+            if (r == 0) {   // Keep-alive, echo it back so the host knows we're still here
+                uint8_t empty[2];
+                if (sendFrame(sockfd, empty, 0) != 0) {
+                    postInvalidate();
+                    close(sockfd);
+                    goto begin;
+                }
+                continue;
+            }
 
-#ifdef TIMING                               // If TIMING is defined, print the duration of each operation
-        uint32_t startTime, endTime;
-        startTime = system_get_time();      // Yes, it is deprecated, but it's fine for this job
-#endif
+            powerActive();
 
-        process(comAPDU, &output);          // Perform the appropriate operation
-
-#ifdef TIMING
-        endTime = system_get_time();
-        uint32_t duration = endTime - startTime;
-        uint32_t min = duration/60000000;
-        uint32_t timeTmp = duration%60000000;
-        uint32_t sec = timeTmp/1000000;
-        timeTmp = timeTmp%1000000;
-        uint32_t ms = timeTmp/1000;
-        uint32_t us = timeTmp%1000;
-        printf("\t\t(mm:ss:mls:us)    /   Duration: %d us\n", duration);
-        printf("\t\t %02d:%02d:%03d:%03d\n", min, sec, ms, us);
-        if (comAPDU.INS == 0x84 && comAPDU.CLA == 0x00) {   // Get Challenge: 0x84
-            timeCount++;            // Keep track of the number of times a specific operation has been performed
-            totalTime += duration;  // Keep the total time taken in order to calculate an average
-            printf("Number of operations: %d\t\tTotal time: %lld us\t\t", timeCount, totalTime);
-            printf("Average time: %lld\n", totalTime/timeCount);
-        }
-        fflush(stdout);
-
-        vTaskDelay(1000/portTICK_PERIOD_MS);    // To avoid watchdog starvation on repeated operations
-#endif
-        gpio_set_level(GPIO_NUM_25, 0);     // End of command processing
-
-#ifdef PRINTAPDU    // Print the response APDU and it's length
-        printf("Output Data: ");
-        const uint8_t* tmp2 = output.data;
-        while(*tmp2)
-            printf("%02X ", (unsigned int) *tmp2++);
-        printf("\nLength: %d\n", output.length);
-        fflush(stdout);
-#endif
+            if (r > 1 && (uint8_t) recvBuf[0] == BATCH_FRAME) {    // Several commands in one frame
+                if (runBatch(sockfd, &comAPDU, &output, recvBuf, r) != 0) {
+                    ESP_LOGE(TAG, "... socket send failed");
+                    postInvalidate();   // Invalidate / PIN Reset at the end of a session
+                    close(sockfd);
+                    goto begin;
+                }
+                continue;
+            }
 
-#ifdef PROCEEDBTN
-writeOutput:    // Label to jump if pressing the button is required and it didn't happen
-#endif
+            int64_t phases[STATS_PHASES] = { 0 };   // Where the time of this command goes
+            if (runCommand(sockfd, &comAPDU, &output, recvBuf, r, phases) != 0) {
+                ESP_LOGI(TAG, "... session ended during a command\n");
+                postInvalidate();   // Invalidate / PIN Reset at the end of a session
+                close(sockfd);
+                goto begin;
+            }
 
-        if (write(sockfd, output.data, output.length) < 0) {    // Write the response
-            ESP_LOGE(TAG, "... socket send failed");
-            vTaskDelay(1000/portTICK_PERIOD_MS);
-            close(sockfd);
-            goto exit;
+            uint16_t sw = responseSW(&output);      // Before the channel encrypts the response
+            traceRecord(TRACE_RESPONSE, output.data, output.length);
+
+            int64_t mark = esp_timer_get_time();
+            if (sendFrame(sockfd, output.head, output.length) != 0) {   // Write the response
+                ESP_LOGE(TAG, "... socket send failed");
+                postInvalidate();   // Invalidate / PIN Reset at the end of a session
+                close(sockfd);
+                goto begin;
+            }
+            phases[STATS_WRITE] = esp_timer_get_time() - mark;
+            ESP_LOGI(TAG, "... socket send success\n");
+            countCommand(&comAPDU, sw, phases);
         }
-        ESP_LOGI(TAG, "... socket send success\n");
-        close(sockfd);
     }
 
 exit:   // Restart the system, in a controlled manner
@@ -341,11 +1110,42 @@ exit:   // Restart the system, in a controlled manner
     esp_restart();
 }
 
+/**
+ * The crypto worker, pinned to APP_CPU. All of the APDU commands are
+ * processed here, one at a time, so long operations (RSA signatures, key
+ * generation) don't hold up WiFi, lwIP and the other tasks on PRO_CPU.
+ * A key that has changed is prepared here too, once no command waits;
+ * the tick of waiting between two of them lets the idle task of the core
+ * run, as the task watchdog checks it (see rngRandomYield).
+ */
+static void taskCrypto(void *pvParameters) {
+    cryptoJob_t job;
+    while(1) {
+        if (xQueueReceive(cryptoQueue, &job, keyPending() ? 1 : portMAX_DELAY) == pdTRUE) {
+            if (job.apdu == NULL) {     // Sent by the network side, see postInvalidate
+                invalidate();
+#ifdef PROCEEDBTN
+                touchClear();           // A press doesn't outlive the PINs it was given with
+#endif
+                continue;
+            }
+            statsFlashClear();
+            process(job.apdu, job.output);
+            xTaskNotifyGive(job.caller);
+        } else {
+            keyPrepareNext();
+        }
+    }
+}
+
 static void checkReset(void *pvParameters) {
     while(1) {      // Check periodically (by polling) if reset button has been pressed
         if (hardRst == 1) {     // If it was pressed, erase "initialized" from NVS
             nvs_handle nvsHandle;
             if (nvs_open("storage", NVS_READWRITE, &nvsHandle) == ESP_OK) {
+#ifdef CHANNEL
+                channelForget(nvsHandle);   // Paired again with the next host
+#endif
                 if (nvs_erase_key(nvsHandle, "initialized") == ESP_OK) {
                     unmountFS();    // This will result in a re-initialization
                     esp_restart();  // When the ESP32 restarts
@@ -356,6 +1156,23 @@ static void checkReset(void *pvParameters) {
     }
 }
 
+#ifdef PROCEEDBTN
+static void taskBlink(void *pvParameters) {
+    uint8_t toggle;
+    while(1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);    // Wait for a request that needs the button
+        toggle = 1;
+        do {        // Flash the LEDs to notify the user, until the wait is over
+            gpio_set_level(GPIO_NUM_25, toggle);
+            gpio_set_level(GPIO_NUM_26, toggle);
+            toggle ^= 1;
+        } while (ulTaskNotifyTake(pdTRUE, 250/portTICK_PERIOD_MS) == 0);
+        gpio_set_level(GPIO_NUM_25, 0);
+        gpio_set_level(GPIO_NUM_26, connected);     // Back to the WiFi status
+    }
+}
+#endif
+
 static void wifiStatus(void *pvParameters) {
     uint8_t toggle = 0;     // Toggle for WiFi status LED
     while(1) {  // Flash while it is still looking for a known network
@@ -368,13 +1185,31 @@ static void wifiStatus(void *pvParameters) {
 }
 
 void app_main() {
+    TaskHandle_t handle;
+    diagInit(DIAG_PERIOD);  // Before anything allocates through mbedtls
     initGPIO();     // Initialize the Input/Output pins
     initNVS();      // Initialize the Non-Volatile Storage
     if (!mountFS()) {   // Mount the FileSystem
         exit(0);
     }
+    // Room for the command of taskConnect and a reset, see postInvalidate
+    cryptoQueue = xQueueCreate(2, sizeof(cryptoJob_t));
     initWiFi();     // Initialize the WiFi
-    xTaskCreate(&taskConnect, "taskConnect", 8192, NULL, 5, NULL);
-    xTaskCreate(&checkReset, "checkReset", 2048, NULL, 5, NULL);
-    xTaskCreate(&wifiStatus, "wifiStatus", 512, NULL, 5, NULL);
+#ifdef PRINTAPDU
+    traceInit(TRACE_FULL);
+#else
+    traceInit(TRACE_OFF);   // Can still be turned on with INS 57
+#endif
+    xTaskCreatePinnedToCore(&taskCrypto, "taskCrypto", 8192, NULL, 5, &handle, APP_CPU_NUM);
+    diagTask(handle, 8192);
+#ifdef PROCEEDBTN   // Above taskConnect, so the LEDs are restored before it goes on
+    xTaskCreatePinnedToCore(&taskBlink, "taskBlink", 1024, NULL, 6, &blinkTask, PRO_CPU_NUM);
+    diagTask(blinkTask, 1024);
+#endif
+    xTaskCreatePinnedToCore(&taskConnect, "taskConnect", 8192, NULL, 5, &handle, PRO_CPU_NUM);
+    diagTask(handle, 8192);
+    xTaskCreate(&checkReset, "checkReset", 2048, NULL, 5, &handle);
+    diagTask(handle, 2048);
+    xTaskCreate(&wifiStatus, "wifiStatus", 512, NULL, 5, &handle);
+    diagTask(handle, 512);
 }
\ No newline at end of file
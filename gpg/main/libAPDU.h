@@ -32,11 +32,23 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "esp_partition.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "errno.h"
+#include "stddef.h"
+#include "unistd.h"
+#include "rom/crc.h"
+
+#include "libDiag.h"
+#include "libRNG.h"
+#include "libECC.h"
+#include "libKey.h"
+#include "libStats.h"
+#include "libTrace.h"
+#include "libDO.h"
 
 #define ERRORCHK(x, y) do { \
   int ret = (x); \
@@ -50,8 +62,9 @@
 
 #define FORCE_SM_GET_CHALLENGE 1
 
+// Card capabilities (73): command chaining and extended Lc/Le fields
 static const uint8_t HISTORICAL[15] = { 0x00, 0x73, 0x00, 0x00, \
-                    (uint8_t) 0x80, 0x00, 0x00, 0x00, \
+                    (uint8_t) 0xC0, 0x00, 0x00, 0x00, \
                     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
 static const uint8_t AID[16] = { (uint8_t) 0xD2, 0x76, 0x00, 0x01, \
@@ -79,25 +92,28 @@ static const uint8_t VERSION[3] = { 0x01, 0x00, 0x12 };
 #define SW_UNKNOWN 0x6F00
 
 /**
- *  0xF8, // Support for GET CHALLENGE
+ *  0xFC, // Support for GET CHALLENGE
  *               // Support for Key Import
  *               // PW1 Status byte changeable
  *               // Support for private use data objects
+ *               // Algorithm attributes changeable
  *  0x00,       // Secure messaging using 3DES
  *  0x00, 0xFF, // Maximum length of challenges
  *  0x04, 0xC0, // Maximum length Cardholder Certificate
- *  0x00, 0xFF, // Maximum length command data
- *  0x00, 0xFF  // Maximum length response data
+ *  0x04, 0xC5, // Maximum length command data
+ *  0x04, 0xC5  // Maximum length response data
  */
-static const uint8_t EXTENDED_CAP[10] = { (uint8_t) 0xF8, 0x00, \
+static const uint8_t EXTENDED_CAP[10] = { (uint8_t) 0xFC, 0x00, \
                     0x00, (uint8_t) 0xFF, 0x04, (uint8_t) 0xC0, \
-                    0x00, (uint8_t) 0xFF, 0x00, (uint8_t) 0xFF };
-
-#define RESPONSE_MAX_LENGTH 255     // Max length of the response APDU
-#define CHALLENGES_MAX_LENGTH 255
+                    0x04, (uint8_t) 0xC5, 0x04, (uint8_t) 0xC5 };
 
 #define BUFFER_MAX_LENGTH 1221
 
+#define COMMAND_MAX_LENGTH BUFFER_MAX_LENGTH    // Max length of the command data (extended Lc)
+#define RESPONSE_MAX_LENGTH BUFFER_MAX_LENGTH   // Max length of the response APDU (extended Le)
+#define SHORT_MAX_LENGTH 255                    // Max length of a short response APDU
+#define CHALLENGES_MAX_LENGTH 255
+
 #define LOGINDATA_MAX_LENGTH 254
 #define URL_MAX_LENGTH 254
 #define NAME_MAX_LENGTH 39
@@ -132,11 +148,7 @@ static uint8_t PW3_DEFAULT[8] = { 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38
 
 uint8_t zero = 0;
 
-uint8_t loginData[LOGINDATA_MAX_LENGTH];
-uint16_t loginData_length;
-
-uint8_t url[URL_MAX_LENGTH];    // Public key URL
-uint16_t url_length;
+// The login data, the URL, the certificate and the private use DOs are in libDO.h
 
 uint8_t name[NAME_MAX_LENGTH];  // Cardholder's name
 uint16_t name_length;
@@ -144,24 +156,9 @@ uint16_t name_length;
 uint8_t lang[LANG_MAX_LENGTH];  // Language preferences
 uint16_t lang_length;
 
-uint8_t cert[CERT_MAX_LENGTH];  // Certificate
-uint16_t cert_length;
-
 uint8_t sex;
 
-uint8_t private_use_do_1[PRIVATE_DO_MAX_LENGTH];
-uint16_t private_use_do_1_length;
-
-uint8_t private_use_do_2[PRIVATE_DO_MAX_LENGTH];
-uint16_t private_use_do_2_length;
-
-uint8_t private_use_do_3[PRIVATE_DO_MAX_LENGTH];
-uint16_t private_use_do_3_length;
-
-uint8_t private_use_do_4[PRIVATE_DO_MAX_LENGTH];
-uint16_t private_use_do_4_length;
-
-typedef struct apdu_t { // Sturct that holds a command APDU
+typedef struct apdu_t { // Sturct that holds a command APDU, a view of the receive buffer
     uint8_t CLA;        // Class
     uint8_t INS;        // Instruction
     uint8_t P1;         // Parameter 1
@@ -169,13 +166,18 @@ typedef struct apdu_t { // Sturct that holds a command APDU
     uint16_t P1P2;      // Parameter 1 | Parameter 2
     uint16_t Lc;        // Length of the data
     uint16_t Le;        // Maximum number of response bytes expected
-    uint8_t data[256];  // The actual command data
+    uint8_t extended;   // Flag for extended Lc/Le fields
+    const uint8_t* data;    // The command data, where it was received
 } apdu_t;
 
+#define OUT_TAIL 16     // Room after a response for the transport, the tag of an encrypted frame
+
 typedef struct outData {    // Data struct for the response APDU
     uint16_t length;                        // Length of the response
-    uint8_t data[RESPONSE_MAX_LENGTH+2];    // The actual response
+    uint8_t head[2];                        // Room for the frame length, see sendFrame
+    uint8_t data[RESPONSE_MAX_LENGTH+2+OUT_TAIL];   // The actual response
 } outData;
+_Static_assert(offsetof(outData, data) == offsetof(outData, head) + 2, "head must precede data");
 
 typedef struct ownerPIN {   // Equivalent struct to the java OwnerPIN
     uint8_t remaining;      // PIN remaining tries
@@ -209,6 +211,10 @@ uint8_t authAttributes[6] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x03 };  // Authenti
 uint8_t authFP[FP_SIZE];                            // Authentication key fingerprint
 uint8_t authTime[4] = { 0x00, 0x00, 0x00, 0x00 };   // Authentication key generation/import time
 
+// A key is RSA (with the attributes above) unless its curve is set
+mbedtls_ecp_keypair sigEcKey, decEcKey, authEcKey;  // The ECC keys
+uint8_t sigCurve = ECC_NONE, decCurve = ECC_NONE, authCurve = ECC_NONE;
+
 uint8_t ca1_fp[FP_LENGTH];  // CA 1 fingerprint
 uint8_t ca2_fp[FP_LENGTH];  // CA 2 fingerprint
 uint8_t ca3_fp[FP_LENGTH];  // CA 3 fingerprint
@@ -216,6 +222,7 @@ uint8_t ca3_fp[FP_LENGTH];  // CA 3 fingerprint
 uint8_t buffer[BUFFER_MAX_LENGTH];
 uint16_t out_left = 0;      // Counter for sending data in multiple response APDUs
 uint16_t out_sent = 0;      // How many data have already been sent
+uint16_t out_offset = 0;    // Where the data of the response starts in buffer
 uint16_t in_received = 0;   // Length of the data of command APDUs
 
 uint8_t chain = 0;          // Flag used for command chaining
@@ -226,17 +233,32 @@ uint8_t terminated = 0;     // Terminated flag, if = 1 the card is locked
 
 
 /**
- * Parse the receive buffer to an APDU struct.
+ * Parse the receive buffer to an APDU struct. Both the short and the
+ * extended (ISO 7816-4) encodings of Lc and Le are accepted. An extended
+ * field starts with a 00 byte followed by the length on 2 bytes, and an
+ * extended Le that follows Lc is just 2 bytes.
+ *
+ * The data is not copied, so the receive buffer has to stay untouched
+ * until the command has been processed.
  *
+ * @param apdu The struct to fill in, with no data if the command is malformed
  * @param recvBuf The receive buffer
  * @param n The length of the buffer
+ * @return SW_NO_ERROR, or SW_WRONG_LENGTH if the command is shorter than
+ *         its header, its data doesn't match Lc, or Lc is larger than
+ *         COMMAND_MAX_LENGTH
  */
-apdu_t parseAPDU(char* recvBuf, int n){
+uint16_t parseAPDU(apdu_t* apdu, char* recvBuf, int n){
     apdu_t newAPDU;
+    int offset = 5;     // Offset of the command data
+    uint16_t status = SW_NO_ERROR;
 
-    newAPDU.Lc = 0;
-    newAPDU.Le = 0;
-    bzero(newAPDU.data, sizeof(newAPDU.data));
+    bzero(&newAPDU, sizeof(newAPDU));
+    if (n < 4) {        // Not even a header
+        newAPDU.data = (const uint8_t*) recvBuf;
+        (*apdu) = newAPDU;
+        return SW_WRONG_LENGTH;
+    }
 
     newAPDU.CLA = recvBuf[0];
     newAPDU.INS = recvBuf[1];
@@ -245,16 +267,39 @@ apdu_t parseAPDU(char* recvBuf, int n){
     newAPDU.P1P2 = newAPDU.P1 << 8 | newAPDU.P2;
     if (n == 5) {     // Then we have: CLA | INS | P1 | P2 | Le
         newAPDU.Le = (uint16_t) (0xFF & recvBuf[4]);
+    } else if (n == 7 && recvBuf[4] == 0) {     // CLA | INS | P1 | P2 | 00 | Le | Le
+        newAPDU.extended = 1;
+        newAPDU.Le = (uint16_t) ((0xFF & recvBuf[5]) << 8 | (0xFF & recvBuf[6]));
+    } else if (n > 7 && recvBuf[4] == 0) {      // CLA | INS | P1 | P2 | 00 | Lc | Lc | Data (| Le | Le)
+        newAPDU.extended = 1;
+        newAPDU.Lc = (uint16_t) ((0xFF & recvBuf[5]) << 8 | (0xFF & recvBuf[6]));
+        offset = 7;
+        if (n == offset + newAPDU.Lc + 2) {
+            newAPDU.Le = (uint16_t) ((0xFF & recvBuf[offset+newAPDU.Lc]) << 8 | \
+                    (0xFF & recvBuf[offset+newAPDU.Lc+1]));
+        } else if (n != offset + newAPDU.Lc) {
+            status = SW_WRONG_LENGTH;
+        }
     } else if (n > 5) {
         newAPDU.Lc = (uint16_t) (0xFF & recvBuf[4]);
-        if (n > 5 + newAPDU.Lc) {   // CLA | INS | P1 | P2 | Lc | Data | Le
-            newAPDU.Le = (uint16_t) (0xFF & recvBuf[5+newAPDU.Lc]);
-            memcpy(newAPDU.data, (recvBuf+5), n-6);
-        } else {                    // CLA | INS | P1 | P2 | Lc | Data
-            memcpy(newAPDU.data, (recvBuf+5), n-5);
+        if (n == offset + newAPDU.Lc + 1) {     // CLA | INS | P1 | P2 | Lc | Data | Le
+            newAPDU.Le = (uint16_t) (0xFF & recvBuf[offset+newAPDU.Lc]);
+        } else if (n != offset + newAPDU.Lc) {  // Otherwise CLA | INS | P1 | P2 | Lc | Data
+            status = SW_WRONG_LENGTH;
         }
     }
-    return newAPDU;
+
+    // Never run a command on a part of its data
+    if (newAPDU.Lc > COMMAND_MAX_LENGTH) {
+        status = SW_WRONG_LENGTH;
+    }
+    if (status != SW_NO_ERROR) {
+        newAPDU.Lc = 0;
+        newAPDU.Le = 0;
+    }
+    newAPDU.data = (const uint8_t*) (recvBuf + offset);
+    (*apdu) = newAPDU;
+    return status;
 }
 
 // Function to store the value of a variable to the Non-Volatile Storage
@@ -263,148 +308,954 @@ uint16_t storeVar(char* key, uint8_t val8, uint16_t val16, uint8_t mode) {
     if (nvs_open("storage", NVS_READWRITE, &nvsHandle) != ESP_OK) {
         return SW_UNKNOWN;
     } else {
-        esp_err_t err;
+        esp_err_t err = ESP_FAIL;
         if (mode == 8) {
             err = nvs_set_u8(nvsHandle, key, val8);
-            if (err != ESP_OK) {
-                return err;
-            }
         } else if (mode == 16) {
             err = nvs_set_u16(nvsHandle, key, val16);
-            if (err != ESP_OK) {
-                return err;
-            }
-        } else {
-            return SW_UNKNOWN;
         }
 
-        err = nvs_commit(nvsHandle);
-        if (err != ESP_OK) {
-            return err;
+        if (err == ESP_OK) {
+            err = nvs_commit(nvsHandle);
         }
         nvs_close(nvsHandle);
-        return SW_NO_ERROR;
+        return (err == ESP_OK) ? SW_NO_ERROR : SW_UNKNOWN;
+    }
+}
+
+// Function to restore the value of a variable from the Non-Volatile Storage
+uint16_t restoreVar(char* key, uint8_t* val8, uint16_t* val16, uint8_t mode) {
+    nvs_handle nvsHandle;
+    if (nvs_open("storage", NVS_READWRITE, &nvsHandle) != ESP_OK) {
+        return SW_UNKNOWN;
+    } else {
+        esp_err_t err = ESP_FAIL;
+        if (mode == 8) {
+            err = nvs_get_u8(nvsHandle, key, val8);
+        } else if (mode == 16) {
+            err = nvs_get_u16(nvsHandle, key, val16);
+        }
+        nvs_close(nvsHandle);
+        return (err == ESP_OK) ? SW_NO_ERROR : SW_UNKNOWN;
     }
 }
 
-// Function to store a byte array to the flash memory filesystem
-uint16_t storeBuf(char* key, uint8_t* ptr, uint16_t len) {
+// Function to restore a byte array from the flash memory filesystem
+uint16_t restoreBuf(char* key, uint8_t* ptr, uint16_t len){
     FILE* fp = NULL;
-    if ((fp = fopen(key, "wb")) == NULL) {
-        ESP_LOGE("storeBuf", "I failed hard, code: %d", errno);
+    if ((fp = fopen(key, "rb")) == NULL) {
         return SW_UNKNOWN;
     }
-    fwrite(ptr, sizeof(uint8_t), len, fp);
+    fread(ptr, sizeof(uint8_t), len, fp);
     fclose(fp);
     return SW_NO_ERROR;
 }
 
-// Function to restore the value of a variable from the Non-Volatile Storage
-uint16_t restoreVar(char* key, uint8_t* val8, uint16_t* val16, uint8_t mode) {
-    nvs_handle nvsHandle;
-    if (nvs_open("storage", NVS_READWRITE, &nvsHandle) != ESP_OK) {
-        return SW_UNKNOWN;
+/**
+ * The variables of the key of the given type (B6, B8 or A4). Pointers
+ * that are not needed may be NULL.
+ *
+ * @return 0, or 1 if the type is unknown
+ */
+uint8_t keySlot(uint8_t type, uint8_t** isEmpty, uint8_t** curve, mbedtls_ecp_keypair** ecKey) {
+    uint8_t* e;
+    uint8_t* c;
+    mbedtls_ecp_keypair* k;
+
+    if (type == (uint8_t) 0xB6) {           // B6 = signature
+        e = &isSigEmpty; c = &sigCurve; k = &sigEcKey;
+    } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
+        e = &isDecEmpty; c = &decCurve; k = &decEcKey;
+    } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
+        e = &isAuthEmpty; c = &authCurve; k = &authEcKey;
     } else {
-        if (mode == 8) {
-            if (nvs_get_u8(nvsHandle, key, val8) != ESP_OK) {
-                return SW_UNKNOWN;
+        return 1;
+    }
+    if (isEmpty != NULL) {
+        (*isEmpty) = e;
+    }
+    if (curve != NULL) {
+        (*curve) = c;
+    }
+    if (ecKey != NULL) {
+        (*ecKey) = k;
+    }
+    return 0;
+}
+
+/**
+ * Every key is stored in its own record: a header (magic, layout version,
+ * type, length, CRC32) followed by N, E, D, P, Q, DP, DQ and QP as
+ * big-endian binary, each one taking the fixed size of keySizes. The
+ * consistency of a key is checked when it is generated or imported, the
+ * CRC is enough to trust it on every restore after that.
+ *
+ * ECC keys use the same header, in a file of their own, followed by the
+ * curve and D (see libECC.h). Q is derived again on restore.
+ */
+#define KEY_MAGIC 0x4B504750        // "PGPK"
+#define KEY_VERSION 1
+#define KEY_COMPONENTS 8
+#define KEY_E_BYTES 4               // Room for any public exponent up to 32 bits
+#define SPARE_KEY 0x00              // Type of the pre-generated key, not bound to any slot yet
+
+typedef struct keyHeader_t {
+    uint32_t magic;     // KEY_MAGIC
+    uint8_t version;    // KEY_VERSION, the layout of the components
+    uint8_t type;       // B6, B8 or A4
+    uint16_t length;    // Length of the components that follow
+    uint32_t crc;       // CRC32 of the components
+} keyHeader_t;
+
+// Size of N, E, D, P, Q, DP, DQ and QP in a key record
+static const uint16_t keySizes[KEY_COMPONENTS] = { KEY_SIZE_BYTES, KEY_E_BYTES, \
+                    KEY_SIZE_BYTES, KEY_SIZE_BYTES/2, KEY_SIZE_BYTES/2, \
+                    KEY_SIZE_BYTES/2, KEY_SIZE_BYTES/2, KEY_SIZE_BYTES/2 };
+
+#define KEY_RECORD_LENGTH (2*KEY_SIZE_BYTES + KEY_E_BYTES + 5*(KEY_SIZE_BYTES/2))
+
+// Path of the key record, or of the old hex text file if legacy is set
+const char* keyPath(uint8_t type, uint8_t legacy) {
+    if (type == (uint8_t) 0xB6) {           // B6 = signature
+        return legacy ? "/spiflash/sigKey.dat" : "/spiflash/sigKey.bin";
+    } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
+        return legacy ? "/spiflash/decKey.dat" : "/spiflash/decKey.bin";
+    } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
+        return legacy ? "/spiflash/authKey.dat" : "/spiflash/authKey.bin";
+    } else if (type == (uint8_t) SPARE_KEY && !legacy) {
+        return "/spiflash/spareKey.bin";
+    }
+    return NULL;
+}
+
+// Path of the temporary file of writeKeyRecord, one for each type: the
+// spare key is written by the key pool while the crypto worker writes the others
+const char* keyTmpPath(uint8_t type) {
+    if (type == (uint8_t) 0xB6) {           // B6 = signature
+        return "/spiflash/sigKey.tmp";
+    } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
+        return "/spiflash/decKey.tmp";
+    } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
+        return "/spiflash/authKey.tmp";
+    } else if (type == (uint8_t) SPARE_KEY) {
+        return "/spiflash/spareKey.tmp";
+    }
+    return NULL;
+}
+
+// Path of the ECC key record
+const char* ecKeyPath(uint8_t type) {
+    if (type == (uint8_t) 0xB6) {           // B6 = signature
+        return "/spiflash/sigKey.ecc";
+    } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
+        return "/spiflash/decKey.ecc";
+    } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
+        return "/spiflash/authKey.ecc";
+    }
+    return NULL;
+}
+
+#ifdef KEY_DS
+// Path of the DS blob record of a key, made at provisioning (see libKey.h)
+const char* dsKeyPath(uint8_t type) {
+    if (type == (uint8_t) 0xB6) {           // B6 = signature
+        return "/spiflash/sigKey.ds";
+    } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
+        return "/spiflash/decKey.ds";
+    } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
+        return "/spiflash/authKey.ds";
+    }
+    return NULL;
+}
+#endif
+
+void keyComponents(mbedtls_rsa_context* key, mbedtls_mpi* comp[KEY_COMPONENTS]) {
+    comp[0] = &key->N;
+    comp[1] = &key->E;
+    comp[2] = &key->D;
+    comp[3] = &key->P;
+    comp[4] = &key->Q;
+    comp[5] = &key->DP;
+    comp[6] = &key->DQ;
+    comp[7] = &key->QP;
+}
+
+/**
+ * Write a header and the record to path.
+ *
+ * The record is first written to keyTmpPath(type) and then renamed, as
+ * writeImage does, so that a power loss during a write leaves either the old
+ * or the new record (see recoverKeyRecord). The key pool and the crypto worker
+ * write at the same time, but never the same type, so each type has its own
+ * temporary file; the FAT names are 8.3, which rules out <path>.tmp.
+ */
+uint16_t writeKeyRecord(const char* path, uint8_t type, uint8_t* record, uint16_t length) {
+    static const char *TAG = "writeKeyRecord";
+    int64_t start = esp_timer_get_time();
+    keyHeader_t header;
+    const char* tmp = keyTmpPath(type);
+    uint16_t ret = SW_UNKNOWN;
+    FILE* f = NULL;
+
+    header.magic = KEY_MAGIC;
+    header.version = KEY_VERSION;
+    header.type = type;
+    header.length = length;
+    header.crc = crc32_le(0, record, length);
+
+    if (tmp == NULL) {
+        goto exitWR;
+    }
+    if ((f = fopen(tmp, "wb")) == NULL) {
+        goto exitWK;
+    }
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+        fwrite(record, length, 1, f) != 1 ||
+        fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fclose(f);
+        goto exitWK;
+    }
+    if (fclose(f) != 0) {
+        goto exitWK;
+    }
+    unlink(path);       // FAT can't rename over an existing file
+    if (rename(tmp, path) != 0) {
+        ESP_LOGE(TAG, "rename failed for key %02X", type);
+        goto exitWR;    // Left for recoverKeyRecord, the old record is gone
+    }
+    ret = SW_NO_ERROR;
+    goto exitWR;
+
+exitWK:
+    unlink(tmp);    // The old record is still there
+exitWR:
+    statsFlash(start);
+    return ret;
+}
+
+/**
+ * Read a record of the given type and length from path.
+ *
+ * @return SW_NO_ERROR, SW_RECORD_NOT_FOUND if there is no record, or
+ *         SW_UNKNOWN if the record cannot be used
+ */
+uint16_t readKeyRecord(const char* path, uint8_t type, uint8_t* record, uint16_t length) {
+    static const char *TAG = "readKeyRecord";
+    keyHeader_t header;
+    uint16_t ret = SW_UNKNOWN;
+    FILE* f = NULL;
+
+    if (path == NULL || (f = fopen(path, "rb")) == NULL) {
+        return SW_RECORD_NOT_FOUND;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != KEY_MAGIC || header.version != KEY_VERSION ||
+        header.type != type || header.length != length ||
+        fread(record, length, 1, f) != 1) {
+        ESP_LOGE(TAG, "Invalid record for key %02X", type);
+        goto exitRR;
+    }
+    if (crc32_le(0, record, length) != header.crc) {
+        ESP_LOGE(TAG, "CRC mismatch for key %02X", type);
+        goto exitRR;
+    }
+    ret = SW_NO_ERROR;
+
+exitRR:
+    fclose(f);
+    return ret;
+}
+
+/**
+ * Finish a writeKeyRecord of the type cut short between removing the old
+ * record and the rename, or drop the temporary file of one that didn't get
+ * there.
+ */
+void recoverKeyRecord(uint8_t type) {
+    static const char *TAG = "recoverKeyRecord";
+    const char* tmp = keyTmpPath(type);
+    keyHeader_t header;
+    const char* path = NULL;
+    uint8_t chunk[64];
+    uint32_t crc = 0;
+    size_t left, n;
+    FILE* f = NULL;
+
+    if (tmp == NULL || (f = fopen(tmp, "rb")) == NULL) {
+        return;
+    }
+    if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == KEY_MAGIC &&
+        header.version == KEY_VERSION && header.type == type) {
+        if (header.length == KEY_RECORD_LENGTH) {
+            path = keyPath(type, 0);
+        } else if (header.length == ECC_RECORD_LENGTH) {
+            path = ecKeyPath(type);
+        }
+        for (left = header.length; path != NULL && left > 0; left -= n) {
+            n = (left < sizeof(chunk)) ? left : sizeof(chunk);
+            if (fread(chunk, n, 1, f) != 1) {
+                path = NULL;    // Cut short before the old record was removed
+            } else {
+                crc = crc32_le(crc, chunk, n);
             }
-        } else if (mode == 16) {
-            if (nvs_get_u16(nvsHandle, key, val16) != ESP_OK) {
-                return SW_UNKNOWN;
+        }
+    }
+    fclose(f);
+
+    if (path != NULL && crc == header.crc && (f = fopen(path, "rb")) == NULL) {
+        ESP_LOGI(TAG, "Using %s", tmp);
+        if (rename(tmp, path) == 0) {
+            return;
+        }
+    } else if (f != NULL) {
+        fclose(f);
+    }
+    unlink(tmp);
+}
+
+/**
+ * Write the record of a key to the flash memory.
+ *
+ * @param key The key, already checked
+ * @param type Type of the key (B6, B8 or A4)
+ */
+uint16_t storeKey(mbedtls_rsa_context* key, uint8_t type) {
+    static const char *TAG = "storeKey";
+    mbedtls_mpi* comp[KEY_COMPONENTS];
+    uint16_t ret = SW_UNKNOWN;
+    uint8_t* record = NULL;
+
+    if (keyPath(type, 0) == NULL || (record = malloc(KEY_RECORD_LENGTH)) == NULL) {
+        return SW_UNKNOWN;
+    }
+
+    keyComponents(key, comp);
+    uint8_t* recordOffset = record;
+    for (int i = 0; i < KEY_COMPONENTS; i++) {
+        if (mbedtls_mpi_write_binary(comp[i], recordOffset, keySizes[i]) != 0) {
+            ESP_LOGE(TAG, "Component %d does not fit in the record", i);
+            goto exitSK;
+        }
+        recordOffset += keySizes[i];
+    }
+    ret = writeKeyRecord(keyPath(type, 0), type, record, KEY_RECORD_LENGTH);
+
+exitSK:
+    bzero(record, KEY_RECORD_LENGTH);   // Don't leave private key material on the heap
+    free(record);
+    return ret;
+}
+
+/**
+ * Read the record of a key from the flash memory.
+ *
+ * @return SW_NO_ERROR, SW_RECORD_NOT_FOUND if there is no record, or
+ *         SW_UNKNOWN if the record cannot be used
+ */
+uint16_t loadKey(mbedtls_rsa_context* key, uint8_t type) {
+    mbedtls_mpi* comp[KEY_COMPONENTS];
+    uint16_t ret;
+    uint8_t* record = NULL;
+
+    if ((record = malloc(KEY_RECORD_LENGTH)) == NULL) {
+        return SW_UNKNOWN;
+    }
+    if ((ret = readKeyRecord(keyPath(type, 0), type, record, KEY_RECORD_LENGTH)) != SW_NO_ERROR) {
+        goto exitLK;
+    }
+
+    ret = SW_UNKNOWN;
+    keyComponents(key, comp);
+    uint8_t* recordOffset = record;
+    for (int i = 0; i < KEY_COMPONENTS; i++) {
+        if (mbedtls_mpi_read_binary(comp[i], recordOffset, keySizes[i]) != 0) {
+            goto exitLK;
+        }
+        recordOffset += keySizes[i];
+    }
+    key->len = (mbedtls_mpi_bitlen(&key->N) + 7) >> 3;
+    ret = SW_NO_ERROR;
+
+exitLK:
+    bzero(record, KEY_RECORD_LENGTH);
+    free(record);
+    return ret;
+}
+
+#ifdef KEY_DS
+// A DS record is the blob followed by N and E, with the usual header
+#define DS_RECORD_LENGTH (sizeof(esp_ds_data_t) + KEY_SIZE_BYTES + KEY_E_BYTES)
+
+/**
+ * Read the DS blob record of a key, and hand the key to the DS. Only the
+ * public part of the key is read to key.
+ *
+ * @return SW_NO_ERROR, SW_RECORD_NOT_FOUND if there is no record, or
+ *         SW_UNKNOWN if the record cannot be used
+ */
+uint16_t loadDsKey(mbedtls_rsa_context* key, uint8_t type) {
+    static const char *TAG = "loadDsKey";
+    static uint32_t record[(DS_RECORD_LENGTH + 3) / 4];    // Aligned for the blob
+    uint8_t* pub = (uint8_t*) record + sizeof(esp_ds_data_t);
+    uint16_t ret;
+
+    if ((ret = readKeyRecord(dsKeyPath(type), type, (uint8_t*) record, DS_RECORD_LENGTH)) != SW_NO_ERROR) {
+        return ret;
+    }
+    if (mbedtls_mpi_read_binary(&key->N, pub, KEY_SIZE_BYTES) != 0 ||
+        mbedtls_mpi_read_binary(&key->E, pub + KEY_SIZE_BYTES, KEY_E_BYTES) != 0) {
+        return SW_UNKNOWN;
+    }
+    key->len = (mbedtls_mpi_bitlen(&key->N) + 7) >> 3;
+    if (mbedtls_rsa_check_pubkey(key) != 0 || keyUseDs(type, (esp_ds_data_t*) record, key) != 0) {
+        ESP_LOGE(TAG, "Unusable blob for key %02X", type);
+        return SW_UNKNOWN;
+    }
+    ESP_LOGI(TAG, "Key %02X uses the DS", type);
+    return SW_NO_ERROR;
+}
+#endif
+
+// The key of the given type has just been generated or imported, to RAM
+void keyReplaced(uint8_t type) {
+    keyUseSoft(type);
+    if (type == (uint8_t) 0xB6) {
+        keyChanged(type, &sigKey);
+    } else if (type == (uint8_t) 0xB8) {
+        keyChanged(type, &decKey);
+    } else if (type == (uint8_t) 0xA4) {
+        keyChanged(type, &authKey);
+    }
+#ifdef KEY_DS
+    unlink(dsKeyPath(type));    // The blob is of the key it replaces
+#endif
+}
+
+/**
+ * Store a new RSA key, already checked, to the flash memory, and only
+ * then copy it into the slot of the given type. A key that can't be
+ * stored leaves the slot with the key it had.
+ *
+ * @param key The new key, in a context of its own
+ */
+uint16_t installKey(mbedtls_rsa_context* key, uint8_t type) {
+    mbedtls_rsa_context* slot;
+
+    if (type == (uint8_t) 0xB6) {
+        slot = &sigKey;
+    } else if (type == (uint8_t) 0xB8) {
+        slot = &decKey;
+    } else if (type == (uint8_t) 0xA4) {
+        slot = &authKey;
+    } else {
+        return SW_UNKNOWN;
+    }
+    if (storeKey(key, type) != SW_NO_ERROR || mbedtls_rsa_copy(slot, key) != 0) {
+        return SW_UNKNOWN;
+    }
+    keyReplaced(type);
+    return SW_NO_ERROR;
+}
+
+// Write the record of an ECC key, already checked, to the flash memory
+uint16_t storeEcKey(mbedtls_ecp_keypair* key, uint8_t curve, uint8_t type) {
+    uint8_t record[ECC_RECORD_LENGTH];
+    uint16_t ret = SW_UNKNOWN;
+
+    if (ecKeyPath(type) != NULL && eccWriteRecord(key, curve, record) == 0) {
+        ret = writeKeyRecord(ecKeyPath(type), type, record, ECC_RECORD_LENGTH);
+    }
+    bzero(record, sizeof(record));
+    return ret;
+}
+
+/**
+ * Restore an ECC key from the flash memory. The curve of the record has
+ * to be the one the key is set to.
+ */
+uint16_t readEcKey(uint8_t type) {
+    static const char *TAG = "readEcKey";
+    uint8_t record[ECC_RECORD_LENGTH];
+    mbedtls_ecp_keypair* key;
+    uint8_t* curve;
+    uint16_t ret;
+
+    if (keySlot(type, NULL, &curve, &key) != 0) {
+        return SW_UNKNOWN;
+    }
+    if ((ret = readKeyRecord(ecKeyPath(type), type, record, ECC_RECORD_LENGTH)) == SW_NO_ERROR) {
+        if (record[0] != (*curve) || eccReadRecord(key, record) != 0) {
+            ESP_LOGE(TAG, "Unusable record for key %02X", type);
+            ret = SW_UNKNOWN;
+        }
+    }
+    bzero(record, sizeof(record));
+    return ret;
+}
+
+/**
+ * Restore a key from the flash storage. A key that is still in the old
+ * hex text file is checked once, and then moved to a key record.
+ *
+ * @param type Type of the key (B6, B8 or A4)
+ */
+uint16_t readKey(uint8_t type) {
+    static const char *TAG = "readKey";
+    mbedtls_rsa_context* key;
+    uint16_t ret;
+    FILE *f;
+
+    if (type == (uint8_t) 0xB6) {           // B6 = signature
+        key = &sigKey;
+    } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
+        key = &decKey;
+    } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
+        key = &authKey;
+    } else {
+        ESP_LOGE(TAG, "Some error must have happened");
+        ret = SW_UNKNOWN;
+        goto exitRK;
+    }
+
+#ifdef KEY_DS
+    if ((ret = loadDsKey(key, type)) != SW_RECORD_NOT_FOUND) {  // Only the public key is read then
+        goto exitRK;
+    }
+#endif
+    if ((ret = loadKey(key, type)) != SW_RECORD_NOT_FOUND) {
+        goto exitRK;
+    }
+
+    if ((f = fopen(keyPath(type, 1), "rb")) == NULL) {
+        ret = SW_UNKNOWN;
+        goto exitRK;
+    }
+
+    if ((mbedtls_mpi_read_file(&key->N , 16, f) != 0) ||
+        (mbedtls_mpi_read_file(&key->E , 16, f) != 0) ||
+        (mbedtls_mpi_read_file(&key->D , 16, f) != 0) ||
+        (mbedtls_mpi_read_file(&key->P , 16, f) != 0) ||
+        (mbedtls_mpi_read_file(&key->Q , 16, f) != 0) ||
+        (mbedtls_mpi_read_file(&key->DP, 16, f) != 0) ||
+        (mbedtls_mpi_read_file(&key->DQ, 16, f) != 0) ||
+        (mbedtls_mpi_read_file(&key->QP, 16, f) != 0)) {
+        ESP_LOGE(TAG, "\nError:\tmbedtls_mpi_read_file failed");
+        ret = SW_UNKNOWN;
+        fclose(f);
+        goto exitRK;
+    }
+    fclose(f);
+
+    key->len = (mbedtls_mpi_bitlen(&key->N) + 7) >> 3;
+
+    if (mbedtls_rsa_check_privkey(key) != 0) {  // Check that the key is right
+        ESP_LOGE(TAG, "Failed hard");
+        ret = SW_UNKNOWN;
+        goto exitRK;
+    }
+
+    if ((ret = storeKey(key, type)) == SW_NO_ERROR) {
+        unlink(keyPath(type, 1));
+        ESP_LOGI(TAG, "Key %02X migrated", type);
+    }
+
+exitRK:
+    if (ret == SW_NO_ERROR) {
+        keyChanged(type, key);
+    }
+    return ret;
+}
+
+/**
+ * The state of the card is kept in a single image in the flash memory
+ * filesystem, so that it can be restored with one sequential read. The
+ * image is a header followed by the fields of stateFields, in order, each
+ * one taking its full size. Any change to the list must increase
+ * STATE_VERSION. New fields are only appended, marked with the version
+ * that added them, so that an older image still loads and leaves them at
+ * their defaults. Fields that moved out of the image are kept in the list,
+ * marked with the last version that had them, so that an older image is
+ * still read and their value is moved to where they live now.
+ *
+ * An image is first written to STATE_TMP_PATH and then renamed, so that
+ * a power loss during a write leaves either the old or the new image.
+ *
+ * The counters that change on the hot path (the PIN retry counters, the
+ * signature counter and the PW1 modes) are marked as journaled. When only
+ * those have changed, saveState appends a small record with their values
+ * to JOURNAL_PATH instead of writing the whole image. Every record names
+ * the image it applies to by its CRC, and is replayed after the image is
+ * loaded. When nothing has changed at all, nothing is written.
+ */
+#define STATE_PATH "/spiflash/state.img"
+#define STATE_TMP_PATH "/spiflash/state.tmp"
+#define STATE_MAGIC 0x53504750      // "PGPS"
+#define STATE_VERSION 3            // 2: ECC curves of the keys, 3: DOs moved to libDO.h
+
+#define JOURNAL_PATH "/spiflash/state.jnl"
+#define JOURNAL_DATA_MAX 16         // Room for the journaled fields of a record
+#define JOURNAL_MAX_RECORDS 64      // Then the journal is folded into a new image
+
+#define STATE_RESTORED 0            // Valid image found
+#define STATE_NOT_FOUND 1           // No image, the device has never written one
+#define STATE_INVALID 2             // Image found, but it cannot be used
+
+typedef struct stateHeader_t {
+    uint32_t magic;     // STATE_MAGIC
+    uint16_t version;   // STATE_VERSION, the layout of the fields
+    uint16_t length;    // Length of the fields that follow
+    uint32_t crc;       // CRC32 of the fields
+} stateHeader_t;
+
+typedef struct journalRecord_t {
+    uint32_t image;     // CRC32 of the image this record applies to
+    uint8_t data[JOURNAL_DATA_MAX]; // The journaled fields, in order
+    uint32_t crc;       // CRC32 of image and data
+} journalRecord_t;
+
+typedef struct stateField_t {
+    void* ptr;          // The variable
+    uint16_t size;      // Its size in the image
+    uint8_t journal;    // Changes are appended to the journal
+    uint16_t since;     // The STATE_VERSION that added the field
+    uint16_t until;     // The last STATE_VERSION that had the field, 0 if current
+    uint8_t object;     // For a field moved to libDO.h, its DO_*
+} stateField_t;
+
+#define FIELD(x) { &(x), sizeof(x), 0, 1, 0, 0 }
+#define COUNTER(x) { &(x), sizeof(x), 1, 1, 0, 0 }
+#define ADDED(x, v) { &(x), sizeof(x), 0, v, 0, 0 }
+// A length and the byte array that followed it, moved to the object id after version v
+#define MOVED(size, id, v) { NULL, sizeof(uint16_t) + (size), 0, 1, v, id }
+
+static const stateField_t stateFields[] = {
+    COUNTER(pw1_modes), FIELD(pw1_status),
+    FIELD(pw1.limit), COUNTER(pw1.remaining), FIELD(pw1_length), FIELD(pw1.value),
+    FIELD(rc.limit), COUNTER(rc.remaining), FIELD(rc_length), FIELD(rc.value),
+    FIELD(pw3.limit), COUNTER(pw3.remaining), FIELD(pw3_length), FIELD(pw3.value),
+    COUNTER(ds_counter),
+    FIELD(isSigEmpty), FIELD(sigAttributes), FIELD(sigFP), FIELD(sigTime),
+    FIELD(isDecEmpty), FIELD(decAttributes), FIELD(decFP), FIELD(decTime),
+    FIELD(isAuthEmpty), FIELD(authAttributes), FIELD(authFP), FIELD(authTime),
+    FIELD(ca1_fp), FIELD(ca2_fp), FIELD(ca3_fp),
+    MOVED(LOGINDATA_MAX_LENGTH, DO_LOGIN, 2),
+    MOVED(URL_MAX_LENGTH, DO_URL, 2),
+    FIELD(name_length), FIELD(name),
+    FIELD(lang_length), FIELD(lang),
+    MOVED(CERT_MAX_LENGTH, DO_CERT, 2),
+    FIELD(sex),
+    MOVED(PRIVATE_DO_MAX_LENGTH, DO_PRIVATE_1, 2),
+    MOVED(PRIVATE_DO_MAX_LENGTH, DO_PRIVATE_2, 2),
+    MOVED(PRIVATE_DO_MAX_LENGTH, DO_PRIVATE_3, 2),
+    MOVED(PRIVATE_DO_MAX_LENGTH, DO_PRIVATE_4, 2),
+    FIELD(terminated),
+    ADDED(sigCurve, 2), ADDED(decCurve, 2), ADDED(authCurve, 2),
+};
+
+#define STATE_FIELDS (sizeof(stateFields)/sizeof(stateFields[0]))
+
+static uint8_t stateSaved = 0;      // Set when the variables below describe the flash
+static uint32_t stateImageCRC;      // CRC32 of the image on flash
+static uint32_t stateFixedCRC;      // CRC32 of the fields of the image that are not journaled
+static uint8_t journalData[JOURNAL_DATA_MAX];   // The journaled fields, as on flash
+static uint16_t journalRecords = 0; // Records in the journal
+
+// Length of the image of the given version
+uint16_t stateLength(uint16_t version) {
+    uint16_t len = 0;
+    for (int i = 0; i < STATE_FIELDS; i++) {
+        if (stateFields[i].since <= version
+                && (stateFields[i].until == 0 || version <= stateFields[i].until)) {
+            len += stateFields[i].size;
+        }
+    }
+    return len;
+}
+
+// Compute the CRC32 of all of the fields, and of the ones that are not journaled
+void stateCRC(uint32_t* all, uint32_t* fixed) {
+    (*all) = 0;
+    (*fixed) = 0;
+    for (int i = 0; i < STATE_FIELDS; i++) {
+        if (stateFields[i].until != 0) {
+            continue;
+        }
+        (*all) = crc32_le(*all, stateFields[i].ptr, stateFields[i].size);
+        if (!stateFields[i].journal) {
+            (*fixed) = crc32_le(*fixed, stateFields[i].ptr, stateFields[i].size);
+        }
+    }
+}
+
+// Copy the journaled fields to data (or back from it, if restore is set)
+void journalFields(uint8_t* data, uint8_t restore) {
+    if (!restore) {
+        bzero(data, JOURNAL_DATA_MAX);
+    }
+    for (int i = 0; i < STATE_FIELDS; i++) {
+        if (stateFields[i].journal) {
+            if (restore) {
+                memcpy(stateFields[i].ptr, data, stateFields[i].size);
+            } else {
+                memcpy(data, stateFields[i].ptr, stateFields[i].size);
             }
-        } else {
-            return SW_UNKNOWN;
+            data += stateFields[i].size;
         }
-        nvs_close(nvsHandle);
-        return SW_NO_ERROR;
     }
 }
 
-// Function to restore a byte array from the flash memory filesystem
-uint16_t restoreBuf(char* key, uint8_t* ptr, uint16_t len){
-    FILE* fp = NULL;
-    if ((fp = fopen(key, "rb")) == NULL) {
+// Write the whole image, which makes the journal obsolete
+uint16_t writeImage() {
+    static const char* TAG = "writeImage";
+    stateHeader_t header;
+    uint32_t fixed;
+    uint16_t ret = SW_UNKNOWN;
+    FILE* fp = NULL;
+
+    header.magic = STATE_MAGIC;
+    header.version = STATE_VERSION;
+    header.length = stateLength(STATE_VERSION);
+    stateCRC(&header.crc, &fixed);
+
+    if ((fp = fopen(STATE_TMP_PATH, "wb")) == NULL) {
+        ESP_LOGE(TAG, "fopen failed, code: %d", errno);
+        goto exitWI;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        goto exitWI;
+    }
+    for (int i = 0; i < STATE_FIELDS; i++) {
+        if (stateFields[i].until != 0) {
+            continue;
+        }
+        if (fwrite(stateFields[i].ptr, stateFields[i].size, 1, fp) != 1) {
+            goto exitWI;
+        }
+    }
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        goto exitWI;
+    }
+    fp = NULL;
+
+    unlink(STATE_PATH);     // FAT can't rename over an existing file
+    if (rename(STATE_TMP_PATH, STATE_PATH) != 0) {
+        ESP_LOGE(TAG, "rename failed, code: %d", errno);
+        goto exitWI;
+    }
+    unlink(JOURNAL_PATH);   // Any record left would name the old image anyway
+
+    stateImageCRC = header.crc;
+    stateFixedCRC = fixed;
+    journalFields(journalData, 0);
+    journalRecords = 0;
+    stateSaved = 1;
+    ret = SW_NO_ERROR;
+
+exitWI:
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    if (ret != SW_NO_ERROR) {
+        stateSaved = 0;     // Don't know what is on flash anymore, write it all next time
+    }
+    return ret;
+}
+
+// Append the journaled fields (given in data) to the journal
+uint16_t writeJournal(uint8_t* data) {
+    journalRecord_t record;
+    FILE* fp = NULL;
+
+    record.image = stateImageCRC;
+    memcpy(record.data, data, JOURNAL_DATA_MAX);
+    record.crc = crc32_le(0, (uint8_t*) &record, offsetof(journalRecord_t, crc));
+
+    if ((fp = fopen(JOURNAL_PATH, "ab")) == NULL) {
+        return SW_UNKNOWN;
+    }
+    if (fwrite(&record, sizeof(record), 1, fp) != 1) {
+        fclose(fp);
+        return SW_UNKNOWN;
+    }
+    if (fclose(fp) != 0) {
+        return SW_UNKNOWN;
+    }
+
+    memcpy(journalData, data, JOURNAL_DATA_MAX);
+    journalRecords++;
+    return SW_NO_ERROR;
+}
+
+/**
+ * Write the state of the card to the flash memory. Has to be called after
+ * any change to the variables of stateFields. Only what has changed since
+ * the last call is written (see above).
+ */
+uint16_t saveState() {
+    int64_t start = esp_timer_get_time();
+    uint8_t data[JOURNAL_DATA_MAX];
+    uint32_t all, fixed;
+    uint16_t ret = SW_NO_ERROR;
+
+    stateCRC(&all, &fixed);
+    if (stateSaved && fixed == stateFixedCRC && journalRecords < JOURNAL_MAX_RECORDS) {
+        journalFields(data, 0);
+        if (memcmp(data, journalData, JOURNAL_DATA_MAX) == 0) {
+            goto exitSS;            // Nothing has changed
+        }
+        if (writeJournal(data) == SW_NO_ERROR) {
+            goto exitSS;
+        }
+    }
+    ret = writeImage();
+
+exitSS:
+    statsFlash(start);
+    return ret;
+}
+
+// Apply the records of the journal that belong to the image that was loaded
+void replayJournal() {
+    static const char* TAG = "replayJournal";
+    journalRecord_t record;
+    FILE* fp = NULL;
+
+    if ((fp = fopen(JOURNAL_PATH, "rb")) == NULL) {
+        return;
+    }
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        if (record.crc != crc32_le(0, (uint8_t*) &record, offsetof(journalRecord_t, crc))) {
+            ESP_LOGE(TAG, "Torn record, ignoring the rest");
+            break;
+        }
+        if (record.image != stateImageCRC) {
+            // Left behind by an image write that didn't finish, the image is newer
+            journalRecords = JOURNAL_MAX_RECORDS;   // So write a new image next time
+            break;
+        }
+        journalFields(record.data, 1);
+        memcpy(journalData, record.data, JOURNAL_DATA_MAX);
+        journalRecords++;
+    }
+    fclose(fp);
+}
+
+// Move a field of an older image (a length and its byte array) to its object
+uint16_t moveField(const stateField_t* field, uint8_t* value) {
+    uint16_t len;
+
+    memcpy(&len, value, sizeof(len));
+    if (len > field->size - sizeof(len)) {
         return SW_UNKNOWN;
     }
-    fread(ptr, sizeof(uint8_t), len, fp);
-    fclose(fp);
-    return SW_NO_ERROR;
+    return (doWrite(field->object, value + sizeof(len), len) == ESP_OK) ? SW_NO_ERROR : SW_UNKNOWN;
 }
 
-// Function to read and print the keys from the flash storage
-uint16_t readKey(uint8_t type) {
-    static const char *TAG = "readKey";
-    mbedtls_rsa_context* key;
-    uint16_t ret;
-    FILE *f;
+/**
+ * Read the state image (and its journal) from the flash memory. Nothing is
+ * changed unless the whole image is valid. The fields that moved out of an
+ * older image are written to their objects, restoreState then saves the
+ * image with the current layout.
+ *
+ * @return STATE_RESTORED, STATE_NOT_FOUND or STATE_INVALID
+ */
+uint8_t loadState() {
+    static const char* TAG = "loadState";
+    stateHeader_t header;
+    uint8_t ret = STATE_INVALID;
+    uint8_t* image = NULL;
+    FILE* fp = NULL;
 
-    if (type == (uint8_t) 0xB6) {           // B6 = signature
-        key = &sigKey;
-        if ((f = fopen("/spiflash/sigKey.dat", "rb")) == NULL) {
-            ret = SW_UNKNOWN;
-            goto exitRK;
+    if ((fp = fopen(STATE_PATH, "rb")) == NULL) {
+        // A write may have been interrupted right before the rename
+        if ((fp = fopen(STATE_TMP_PATH, "rb")) == NULL) {
+            return STATE_NOT_FOUND;
         }
-    } else if (type == (uint8_t) 0xB8) {    // B8 = decryption
-        key = &decKey;
-        if ((f = fopen("/spiflash/decKey.dat", "rb")) == NULL) {
-            ret = SW_UNKNOWN;
-            goto exitRK;
+        ESP_LOGI(TAG, "Using %s", STATE_TMP_PATH);
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1) {
+        goto exitLS;
+    }
+    if (header.magic != STATE_MAGIC || header.version == 0 || header.version > STATE_VERSION
+            || header.length != stateLength(header.version)) {
+        ESP_LOGE(TAG, "Unknown image, version %d", header.version);
+        goto exitLS;
+    }
+
+    if ((image = malloc(header.length)) == NULL) {
+        goto exitLS;
+    }
+    if (fread(image, header.length, 1, fp) != 1) {
+        goto exitLS;
+    }
+    if (crc32_le(0, image, header.length) != header.crc) {
+        ESP_LOGE(TAG, "CRC mismatch");
+        goto exitLS;
+    }
+
+    uint8_t* imageOffset = image;
+    for (int i = 0; i < STATE_FIELDS; i++) {
+        if (stateFields[i].since > header.version) {
+            continue;
         }
-    } else if (type == (uint8_t) 0xA4) {    // A4 = authentication
-        key = &authKey;
-        if ((f = fopen("/spiflash/authKey.dat", "rb")) == NULL) {
-            ret = SW_UNKNOWN;
-            goto exitRK;
+        if (stateFields[i].until == 0) {
+            memcpy(stateFields[i].ptr, imageOffset, stateFields[i].size);
+        } else if (header.version <= stateFields[i].until) {
+            if (moveField(&stateFields[i], imageOffset) != SW_NO_ERROR) {
+                goto exitLS;
+            }
+        } else {
+            continue;
         }
-    } else {
-        ESP_LOGE(TAG, "Some error must have happened");
-        ret = SW_UNKNOWN;
-        goto exitRK;
+        imageOffset += stateFields[i].size;
     }
 
-    if ((mbedtls_mpi_read_file(&key->N , 16, f) != 0) ||
-        (mbedtls_mpi_read_file(&key->E , 16, f) != 0) ||
-        (mbedtls_mpi_read_file(&key->D , 16, f) != 0) ||
-        (mbedtls_mpi_read_file(&key->P , 16, f) != 0) ||
-        (mbedtls_mpi_read_file(&key->Q , 16, f) != 0) ||
-        (mbedtls_mpi_read_file(&key->DP, 16, f) != 0) ||
-        (mbedtls_mpi_read_file(&key->DQ, 16, f) != 0) ||
-        (mbedtls_mpi_read_file(&key->QP, 16, f) != 0)) {
-        ESP_LOGE(TAG, "\nError:\tmbedtls_mpi_read_file failed");
-        ret = SW_UNKNOWN;
-        fclose(f);
-        goto exitRK;
+    uint32_t all;
+    stateCRC(&all, &stateFixedCRC);
+    stateImageCRC = header.crc;
+    journalFields(journalData, 0);
+    journalRecords = 0;
+    stateSaved = 1;
+    replayJournal();
+    if (header.version != STATE_VERSION) {
+        stateSaved = 0;     // Write the new layout on the next save
     }
+    ret = STATE_RESTORED;
 
-    key->len = (mbedtls_mpi_bitlen(&key->N) + 7) >> 3;
+exitLS:
+    free(image);
+    fclose(fp);
+    return ret;
+}
 
-    if (mbedtls_rsa_check_privkey(key) != 0) {  // Check that the key is right
-        ESP_LOGE(TAG, "Failed hard");
-        ret = SW_UNKNOWN;
-        goto exitRK;
+// Restore a byte array of the old layout, and its length, to the object id
+uint16_t restoreLegacyDO(char* lenKey, char* path, uint8_t id, uint16_t max) {
+    uint16_t ret = SW_UNKNOWN;
+    uint16_t len = 0;
+    uint8_t* data = NULL;
+
+    ERRORCHK(restoreVar(lenKey, 0, &len, 16), return SW_UNKNOWN);
+    if (len > max || (data = malloc(len + 1)) == NULL) {
+        return SW_UNKNOWN;
+    }
+    ERRORCHK(restoreBuf(path, data, len), goto exitRL);
+    if (doWrite(id, data, len) == ESP_OK) {
+        ret = SW_NO_ERROR;
     }
-    ret = SW_NO_ERROR;
 
-exitRK:
+exitRL:
+    free(data);
     return ret;
 }
 
 /**
- * This function is responsible for restoring the state of the
- * ESP32 after a restart. It runs each time the ESP32 restarts,
- * after the first initialization.
- *
- * Restores:
- *    Variables (such as lengths, PIN remaining tries, etc)
- *    Byte arrays (PINs, cardholder related data, etc)
- *    Keys (Signature, Decryption, Authentication)
+ * Restore the state from the layout used before the state image: one NVS
+ * entry per variable and one file per byte array. Only used once, to
+ * migrate a device to the state image.
  */
-uint8_t restoreState() {
-    static const char* TAG = "restoreState";
-    fflush(stdout);
-
-    bzero(buffer, sizeof(buffer));
+uint8_t restoreLegacyState() {
     ERRORCHK(restoreVar("PW1_MODE_NO81", &pw1_modes[PW1_MODE_NO81], 0, 8), return 1);
     ERRORCHK(restoreVar("PW1_MODE_NO82", &pw1_modes[PW1_MODE_NO82], 0, 8), return 1);
 
@@ -417,6 +1268,7 @@ uint8_t restoreState() {
     ERRORCHK(restoreVar("rc_limit", &rc.limit, 0, 8), return 1);
     ERRORCHK(restoreVar("rc_length", &rc_length, 0, 8), return 1);
     ERRORCHK(restoreVar("rc_remaining", &rc.remaining, 0, 8), return 1);
+    ERRORCHK(restoreBuf("/spiflash/rc.dat", rc.value, rc_length+1), return 1);
 
     ERRORCHK(restoreVar("pw3_limit", &pw3.limit, 0, 8), return 1);
     ERRORCHK(restoreVar("pw3_length", &pw3_length, 0, 8), return 1);
@@ -424,34 +1276,23 @@ uint8_t restoreState() {
     ERRORCHK(restoreVar("pw3_remaining", &pw3.remaining, 0, 8), return 1);
 
     ERRORCHK(restoreVar("isSigEmpty", &isSigEmpty, 0, 8), return 1);
-    if (isSigEmpty == 0) {
-        ERRORCHK(readKey(0xB6), return 1);
-    }
     ERRORCHK(restoreBuf("/spiflash/sigAttr.dat", sigAttributes, sizeof(sigAttributes)), return 1);
     ERRORCHK(restoreBuf("/spiflash/sigFP.dat", sigFP, sizeof(sigFP)), return 1);
     ERRORCHK(restoreBuf("/spiflash/sigTime.dat", sigTime, sizeof(sigTime)), return 1);
 
     ERRORCHK(restoreVar("isDecEmpty", &isDecEmpty, 0, 8), return 1);
-    if (isDecEmpty == 0) {
-        ERRORCHK(readKey(0xB8), return 1);
-    }
     ERRORCHK(restoreBuf("/spiflash/decAttr.dat", decAttributes, sizeof(decAttributes)), return 1);
     ERRORCHK(restoreBuf("/spiflash/decFP.dat", decFP, sizeof(decFP)), return 1);
     ERRORCHK(restoreBuf("/spiflash/decTime.dat", decTime, sizeof(decTime)), return 1);
 
     ERRORCHK(restoreVar("isAuthEmpty", &isAuthEmpty, 0, 8), return 1);
-    if (isAuthEmpty == 0) {
-        ERRORCHK(readKey(0xA4), return 1);
-    }
     ERRORCHK(restoreBuf("/spiflash/autAttr.dat", authAttributes, sizeof(authAttributes)), return 1);
     ERRORCHK(restoreBuf("/spiflash/authFP.dat", authFP, sizeof(authFP)), return 1);
     ERRORCHK(restoreBuf("/spiflash/authTime.dat", authTime, sizeof(authTime)), return 1);
 
-    ERRORCHK(restoreVar("loginData_len", 0, &loginData_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/logData.dat", loginData, loginData_length), return 1);
+    ERRORCHK(restoreLegacyDO("loginData_len", "/spiflash/logData.dat", DO_LOGIN, LOGINDATA_MAX_LENGTH), return 1);
 
-    ERRORCHK(restoreVar("url_length", 0, &url_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/url.dat", url, url_length), return 1);
+    ERRORCHK(restoreLegacyDO("url_length", "/spiflash/url.dat", DO_URL, URL_MAX_LENGTH), return 1);
 
     ERRORCHK(restoreVar("name_length", 0, &name_length, 16), return 1);
     ERRORCHK(restoreBuf("/spiflash/name.dat", name, name_length), return 1);
@@ -459,42 +1300,95 @@ uint8_t restoreState() {
     ERRORCHK(restoreVar("lang_length", 0, &lang_length, 16), return 1);
     ERRORCHK(restoreBuf("/spiflash/lang.dat", lang, lang_length), return 1);
 
-    ERRORCHK(restoreVar("cert_length", 0, &cert_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/cert.dat", cert, cert_length), return 1);
+    ERRORCHK(restoreLegacyDO("cert_length", "/spiflash/cert.dat", DO_CERT, CERT_MAX_LENGTH), return 1);
 
     ERRORCHK(restoreVar("sex", &sex, 0, 8), return 1);
 
-    ERRORCHK(restoreVar("privdo1_len", 0, &private_use_do_1_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo1.dat", private_use_do_1, private_use_do_1_length), return 1);
+    ERRORCHK(restoreLegacyDO("privdo1_len", "/spiflash/privdo1.dat", DO_PRIVATE_1, PRIVATE_DO_MAX_LENGTH), return 1);
 
-    ERRORCHK(restoreVar("privdo2_len", 0, &private_use_do_2_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo2.dat", private_use_do_2, private_use_do_2_length), return 1);
+    ERRORCHK(restoreLegacyDO("privdo2_len", "/spiflash/privdo2.dat", DO_PRIVATE_2, PRIVATE_DO_MAX_LENGTH), return 1);
 
-    ERRORCHK(restoreVar("privdo3_len", 0, &private_use_do_3_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo3.dat", private_use_do_3, private_use_do_3_length), return 1);
+    ERRORCHK(restoreLegacyDO("privdo3_len", "/spiflash/privdo3.dat", DO_PRIVATE_3, PRIVATE_DO_MAX_LENGTH), return 1);
 
-    ERRORCHK(restoreVar("privdo4_len", 0, &private_use_do_4_length, 16), return 1);
-    ERRORCHK(restoreBuf("/spiflash/privdo4.dat", private_use_do_4, private_use_do_4_length), return 1);
+    ERRORCHK(restoreLegacyDO("privdo4_len", "/spiflash/privdo4.dat", DO_PRIVATE_4, PRIVATE_DO_MAX_LENGTH), return 1);
 
     ERRORCHK(restoreVar("terminated", &terminated, 0, 8), return 1);
 
+    // These files only exist once the data has been set
+    restoreBuf("/spiflash/ds_count.dat", ds_counter, sizeof(ds_counter));
+    restoreBuf("/spiflash/ca1_fp.dat", ca1_fp, sizeof(ca1_fp));
+    restoreBuf("/spiflash/ca2_fp.dat", ca2_fp, sizeof(ca2_fp));
+    restoreBuf("/spiflash/ca3_fp.dat", ca3_fp, sizeof(ca3_fp));
+
+    return 0;
+}
+
+uint8_t dataCheck();     // With the data objects, below
+
+/**
+ * This function is responsible for restoring the state of the
+ * ESP32 after a restart. It runs each time the ESP32 restarts,
+ * after the first initialization.
+ *
+ * Restores:
+ *    The state image (PINs, lengths, cardholder related data, etc)
+ *    Keys (Signature, Decryption, Authentication)
+ *
+ * A device without a state image is migrated from the old layout.
+ */
+uint8_t restoreState() {
+    static const char* TAG = "restoreState";
+    fflush(stdout);
+
+    bzero(buffer, sizeof(buffer));
+    // As initialize() does, the contexts are set up before the keys are read into them
+    mbedtls_rsa_init(&sigKey, MBEDTLS_RSA_PKCS_V15, 0);
+    mbedtls_rsa_init(&decKey, MBEDTLS_RSA_PKCS_V15, 0);
+    mbedtls_rsa_init(&authKey, MBEDTLS_RSA_PKCS_V15, 0);
+    mbedtls_ecp_keypair_init(&sigEcKey);
+    mbedtls_ecp_keypair_init(&decEcKey);
+    mbedtls_ecp_keypair_init(&authEcKey);
+    recoverKeyRecord(0xB6);
+    recoverKeyRecord(0xB8);
+    recoverKeyRecord(0xA4);
+    recoverKeyRecord(SPARE_KEY);
+    switch (loadState()) {
+        case STATE_RESTORED:
+            if (!stateSaved) {
+                ERRORCHK(saveState(), return 1);    // Older layout
+            }
+            break;
+        case STATE_NOT_FOUND:
+            ESP_LOGI(TAG, "No state image, migrating");
+            if (restoreLegacyState() != 0) {
+                return 1;
+            }
+            ERRORCHK(saveState(), return 1);
+            break;
+        default :
+            return 1;
+    }
+    if (dataCheck() != 0) {
+        return 1;
+    }
+
+    if (isSigEmpty == 0) {
+        ERRORCHK((sigCurve == ECC_NONE) ? readKey(0xB6) : readEcKey(0xB6), return 1);
+    }
+    if (isDecEmpty == 0) {
+        ERRORCHK((decCurve == ECC_NONE) ? readKey(0xB8) : readEcKey(0xB8), return 1);
+    }
+    if (isAuthEmpty == 0) {
+        ERRORCHK((authCurve == ECC_NONE) ? readKey(0xA4) : readEcKey(0xA4), return 1);
+    }
+
     ESP_LOGI(TAG, "SUCCESS");
     return 0;
 }
 
 // Update all of the PIN attributes in the memory
 uint8_t updatePINattr() {
-    ERRORCHK(storeVar("pw1_remaining", pw1.remaining, 0, 8), return 1);
-    ERRORCHK(storeVar("pw1_length", pw1_length, 0, 8), return 1);
-    ERRORCHK(storeBuf("/spiflash/pw1.dat", pw1.value, pw1_length+1), return 1);
-
-    ERRORCHK(storeVar("rc_remaining", rc.remaining, 0, 8), return 1);
-    ERRORCHK(storeVar("rc_length", rc_length, 0, 8), return 1);
-    ERRORCHK(storeBuf("/spiflash/rc.dat", rc.value, rc_length+1), return 1);
-
-    ERRORCHK(storeVar("pw3_remaining", pw3.remaining, 0, 8), return 1);
-    ERRORCHK(storeVar("pw3_length", pw3_length, 0, 8), return 1);
-    ERRORCHK(storeBuf("/spiflash/pw3.dat", pw3.value, pw3_length+1), return 1);
+    ERRORCHK(saveState(), return 1);
     return 0;
 }
 
@@ -570,16 +1464,16 @@ void resetChaining() {
  *
  * @param apdu
  */
-uint16_t commandChaining(apdu_t apdu){
-    uint16_t len = apdu.Lc;
+uint16_t commandChaining(apdu_t* apdu){
+    uint16_t len = apdu->Lc;
 
     if (chain == 0) {
         resetChaining();
     }
 
-    if ((uint8_t) (apdu.CLA & (uint8_t) 0x10) == (uint8_t) 0x10) {
+    if ((uint8_t) (apdu->CLA & (uint8_t) 0x10) == (uint8_t) 0x10) {
         // If chaining was already initiated, INS and P1P2 should match
-        if ((chain == 1) && (apdu.INS != chain_ins && apdu.P1P2 != chain_p1p2)) {
+        if ((chain == 1) && (apdu->INS != chain_ins && apdu->P1P2 != chain_p1p2)) {
             resetChaining();
             return SW_CONDITIONS_NOT_SATISFIED;
         }
@@ -592,16 +1486,16 @@ uint16_t commandChaining(apdu_t apdu){
 
         // Store received data in buffer
         uint8_t* bufOffset = buffer + in_received;
-        memcpy(bufOffset, apdu.data, len);
+        memcpy(bufOffset, apdu->data, len);
         in_received += len;
 
         chain = 1;
-        chain_ins = apdu.INS;
-        chain_p1p2 = apdu.P1P2;
+        chain_ins = apdu->INS;
+        chain_p1p2 = apdu->P1P2;
         return SW_NO_ERROR;
     }
 
-    if ((chain == 1) && (apdu.INS == chain_ins) && (apdu.P1P2 == chain_p1p2)) {
+    if ((chain == 1) && (apdu->INS == chain_ins) && (apdu->P1P2 == chain_p1p2)) {
         chain = 0;
 
         // Check whether data to be received is larger than size of the buffer
@@ -612,7 +1506,7 @@ uint16_t commandChaining(apdu_t apdu){
 
         // Add received data to the buffer
         uint8_t* bufOffset = buffer + in_received;
-        memcpy(bufOffset, apdu.data, len);
+        memcpy(bufOffset, apdu->data, len);
         in_received += len;
         return 0;
     } else if (chain == 1) {
@@ -620,8 +1514,8 @@ uint16_t commandChaining(apdu_t apdu){
         resetChaining();
         return SW_UNKNOWN;
     } else {
-        // No chaining was used, so copy data to buffer
-        memcpy(buffer, apdu.data, len);
+        // No chaining was used, so copy data to buffer, where the command works on it
+        memcpy(buffer, apdu->data, len);
         in_received = len;
         return 0;
     }
@@ -699,9 +1593,8 @@ uint16_t changeReferenceData(uint8_t mode) {
             return SW_UNKNOWN;
         }
         pw1_modes[PW1_MODE_NO81] = 0;
-        ERRORCHK(storeVar("PW1_MODE_NO81", pw1_modes[PW1_MODE_NO81], 0, 8), return SW_UNKNOWN);
         pw1_modes[PW1_MODE_NO82] = 0;
-        return storeVar("PW1_MODE_NO82", pw1_modes[PW1_MODE_NO82], 0, 8);
+        return saveState();
     } else if (mode == (uint8_t) 0x83) {
         // Check length of the new password
         uint16_t new_length = (uint16_t) (in_received - pw3_length);
@@ -769,26 +1662,132 @@ uint16_t resetRetryCounter(uint8_t mode) {
 }
 
 /**
- * Increase the digital signature counter by one. In case of overflow
+ * Increase the digital signature counter by count. In case of overflow
  * SW_WARNING_STATE_UNCHANGED will be thrown and nothing will
  * change.
  */
-uint16_t increaseDSCounter() {
-    for (short i = (short) ((sizeof(ds_counter)/sizeof(ds_counter[0])) - 1); i >= 0; i--) {
-        if ((uint16_t) (ds_counter[i] & 0xFF) >= 0xFF) {
-            if (i == 0) {
-                // Overflow
-                return SW_WARNING_STATE_UNCHANGED;
-            } else {
-                ds_counter[i] = 0;
-            }
-        } else {
-            ds_counter[i]++;
-            break;
-        }
+uint16_t increaseDSCounter(uint16_t count) {
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < sizeof(ds_counter); i++) {
+        value = (value << 8) | ds_counter[i];
+    }
+    if (value + count > 0xFFFFFF) {     // Overflow, checked before anything changes
+        return SW_WARNING_STATE_UNCHANGED;
+    }
+    value += count;
+    for (short i = (short) (sizeof(ds_counter) - 1); i >= 0; i--, value >>= 8) {
+        ds_counter[i] = (uint8_t) (value & 0xFF);
+    }
+    ERRORCHK(saveState(), return 1);
+
+    return SW_NO_ERROR;
+}
+
+/**
+ * Get number of bytes needed to represent length for TLV element.
+ *
+ * @param length
+ *            Length of value
+ * @return Number of bytes needed to represent length
+ */
+uint16_t getLengthBytes(uint16_t length) {
+    if (length <= 127) {
+        return 1;
+    } else if (length <= 255) {
+        return 2;
+    } else {
+        return 3;
+    }
+}
+
+/**
+ * Get length of TLV element.
+ *
+ * @param data
+ *            Byte array
+ * @param offset
+ *            Offset within byte array containing first byte
+ * @return Length of value
+ */
+uint16_t getLength(uint8_t* data, uint16_t offset, uint16_t* status) {
+    uint16_t len = 0;
+
+    if ((data[offset] & (uint8_t) 0x80) == (uint8_t) 0x00) {
+        len = data[offset];
+        (*status) = SW_NO_ERROR;
+    } else if ((data[offset] & (uint8_t) 0x7F) == (uint8_t) 0x01) {
+        len = data[(uint16_t) (offset + 1)];
+        len &= 0x00FF;
+        (*status) = SW_NO_ERROR;
+    } else if ((data[offset] & (uint8_t) 0x7F) == (uint8_t) 0x02) {
+        len = (uint16_t) (data[(uint16_t) (offset + 1)] << 8) | data[(uint16_t) (offset + 2)];
+        (*status) = SW_NO_ERROR;
+    } else {
+        (*status) = SW_UNKNOWN;
+    }
+
+    return len;
+}
+
+// ECDSA signature of the data in buffer, written as r | s right after it
+uint16_t signEc(mbedtls_ecp_keypair* key, uint16_t* length) {
+    if (in_received > BUFFER_MAX_LENGTH - 2*ECC_KEY_BYTES) {
+        return SW_WRONG_LENGTH;
+    }
+    if (eccSign(key, buffer, in_received, buffer + in_received, length) != 0) {
+        return SW_UNKNOWN;
+    }
+    out_offset = in_received;
+    return SW_NO_ERROR;
+}
+
+/**
+ * ECDH with the key for confidentiality. The data is the public key of
+ * the other party, as A6 { 7F49 { 86 <public key> } }, and the shared
+ * secret is written to buffer.
+ */
+uint16_t decipherEc(uint16_t* length) {
+    uint8_t secret[ECC_KEY_BYTES];
+    uint16_t status, len;
+    uint16_t offset = 0;
+
+    if (buffer[offset++] != (uint8_t) 0xA6) {
+        return SW_WRONG_DATA;
+    }
+    len = getLength(buffer, offset, &status);
+    if (status != SW_NO_ERROR) {
+        return SW_WRONG_DATA;
+    }
+    offset += getLengthBytes(len);
+
+    if (buffer[offset++] != 0x7F || buffer[offset++] != 0x49) {
+        return SW_WRONG_DATA;
+    }
+    len = getLength(buffer, offset, &status);
+    if (status != SW_NO_ERROR) {
+        return SW_WRONG_DATA;
+    }
+    offset += getLengthBytes(len);
+
+    if (buffer[offset++] != (uint8_t) 0x86) {
+        return SW_WRONG_DATA;
+    }
+    len = getLength(buffer, offset, &status);
+    if (status != SW_NO_ERROR) {
+        return SW_WRONG_DATA;
+    }
+    offset += getLengthBytes(len);
+    if (offset + len > in_received) {
+        return SW_WRONG_DATA;
     }
-    ERRORCHK(storeBuf("/spiflash/ds_count.dat", ds_counter, sizeof(ds_counter)), return 1);
 
+    if (eccAgree(&decEcKey, decCurve, buffer + offset, len, secret, length) != 0) {
+        bzero(secret, sizeof(secret));
+        return SW_WRONG_DATA;   // Most likely not a point of the curve
+    }
+    memcpy(buffer, secret, (*length));
+    bzero(secret, sizeof(secret));
     return SW_NO_ERROR;
 }
 
@@ -816,34 +1815,112 @@ uint16_t computeDigitalSignature(uint16_t* length) {
     if (isSigEmpty) {
         return SW_REFERENCED_DATA_NOT_FOUND;
     }
-
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-    mbedtls_entropy_context entropy;
-    mbedtls_entropy_init(&entropy);
-    const char *pers = "computeDigitalSignature";
-
-    if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-                        (const unsigned char *) pers, strlen(pers)) != 0) {
-        return SW_UNKNOWN;  // It is not unknown though, there is a return value
+
+    if (increaseDSCounter(1) != SW_NO_ERROR) {
+        return SW_WARNING_STATE_UNCHANGED;
+    }
+
+    if (sigCurve != ECC_NONE) {     // ECDSA, the data is the hash itself
+        return signEc(&sigEcKey, length);
+    }
+
+    uint8_t* outOffset = buffer + in_received;
+    if (keySign(0xB6, &sigKey, buffer, in_received, outOffset) != 0) {
+        return SW_UNKNOWN;  // Again, not really unknown...
+    }
+
+    len = (mbedtls_mpi_bitlen(&sigKey.N) + 7) >> 3;
+    out_offset = in_received;   // Sent from where it is, buffer before it is non-empty
+    (*length) = len;
+    return SW_NO_ERROR;
+}
+
+/**
+ * Provide the BATCH SIGN command (custom INS 58, P1P2 0000)
+ *
+ * Sign several digests with the key for digital signatures, for a single
+ * verification of PW1 with mode No. 81 and a single press of the button.
+ * The data is a list of 80 | L | DigestInfo (the hash itself for an ECDSA
+ * key), the response is the signatures in the same order, one after the
+ * other. The signature counter is increased once for the whole batch.
+ *
+ * The signatures take the place of the digests in buffer, so a batch is
+ * limited to what fits in it, e.g. 4 signatures of a 2048 bit RSA key.
+ *
+ * @param length Length of data written in buffer
+ */
+uint16_t batchSign(uint16_t* length) {
+    static uint8_t sig[KEY_SIZE_BYTES];     // Larger than an ECDSA signature
+    uint16_t count = 0, offset = 0, sigLen, len;
+
+    if (!((pw1.validated == 1) && (pw1_modes[PW1_MODE_NO81] == 1))){
+        return SW_SECURITY_STATUS_NOT_SATISFIED;
+    }
+
+    if (pw1_status == (uint8_t) 0x00) {
+        pw1_modes[PW1_MODE_NO81] = 0;
+    }
+
+    if (isSigEmpty) {
+        return SW_REFERENCED_DATA_NOT_FOUND;
+    }
+
+    sigLen = (sigCurve != ECC_NONE) ? 2*ECC_KEY_BYTES : (mbedtls_mpi_bitlen(&sigKey.N) + 7) >> 3;
+    if (sigLen > sizeof(sig)) {
+        return SW_UNKNOWN;
+    }
+
+    // The digests are moved to the end of buffer, the signatures fill it from the start
+    uint16_t base = BUFFER_MAX_LENGTH - in_received;
+    while (offset < in_received) {
+        if (buffer[offset] != (uint8_t) 0x80 || offset + 2 > in_received) {
+            return SW_WRONG_DATA;
+        }
+        uint8_t form = buffer[offset + 1];
+        uint16_t header = 2 + ((form & 0x80) ? (form & 0x7F) : 0);
+        if (form > 0x82 || form == 0x80 || offset + header > in_received) {
+            return SW_WRONG_DATA;
+        }
+        len = (form == 0x81) ? buffer[offset + 2] :
+                ((form == 0x82) ? (buffer[offset + 2] << 8 | buffer[offset + 3]) : form);
+        if (len == 0 || offset + header + len > in_received) {
+            return SW_WRONG_DATA;
+        }
+        offset += header + len;
+        count++;
+        // The signature must not reach the digest after it
+        if (count * sigLen > base + offset) {
+            return SW_WRONG_LENGTH;
+        }
+    }
+    if (count == 0) {
+        return SW_WRONG_DATA;
     }
 
-    if (increaseDSCounter() != SW_NO_ERROR) {
+    if (increaseDSCounter(count) != SW_NO_ERROR) {
         return SW_WARNING_STATE_UNCHANGED;
     }
 
-    uint8_t* outOffset = buffer + in_received;
-    if(mbedtls_rsa_pkcs1_encrypt(&sigKey, mbedtls_ctr_drbg_random, &ctr_drbg,
-            MBEDTLS_RSA_PRIVATE, in_received, buffer, outOffset) != 0) {
-        return SW_UNKNOWN;  // Again, not really unknown...
-    }
+    memmove(buffer + base, buffer, in_received);
+    uint8_t* in = buffer + base;
+    for (uint16_t i = 0; i < count; i++) {
+        uint16_t header = 2 + ((in[1] & 0x80) ? (in[1] & 0x7F) : 0);
+        len = (in[1] == 0x81) ? in[2] : ((in[1] == 0x82) ? (in[2] << 8 | in[3]) : in[1]);
+        in += header;
 
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
+        if (sigCurve != ECC_NONE) {
+            uint16_t l;
+            if (eccSign(&sigEcKey, in, len, sig, &l) != 0) {
+                return SW_UNKNOWN;
+            }
+        } else if (keySign(0xB6, &sigKey, in, len, sig) != 0) {
+            return SW_UNKNOWN;
+        }
+        memcpy(buffer + i * sigLen, sig, sigLen);
+        in += len;
+    }
 
-    len = (mbedtls_mpi_bitlen(&sigKey.N) + 7) >> 3;
-    memcpy(buffer, outOffset, len);  // * Rest of buffer is non-empty
-    (*length) = len;
+    (*length) = count * sigLen;
     return SW_NO_ERROR;
 }
 
@@ -867,15 +1944,8 @@ uint16_t decipher(uint16_t* length) {
         return SW_REFERENCED_DATA_NOT_FOUND;
     }
 
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-    mbedtls_entropy_context entropy;
-    mbedtls_entropy_init(&entropy);
-    const char *pers = "decipher";
-
-    if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-                        (const unsigned char *) pers, strlen(pers)) != 0) {
-        return SW_UNKNOWN;  // Same as above
+    if (decCurve != ECC_NONE) {
+        return decipherEc(length);
     }
 
     // Start at offset 1 to omit padding indicator byte
@@ -885,15 +1955,11 @@ uint16_t decipher(uint16_t* length) {
         return SW_DATA_INVALID;
     }
 
-    if(mbedtls_rsa_pkcs1_decrypt(&decKey, mbedtls_ctr_drbg_random, &ctr_drbg,
-            MBEDTLS_RSA_PRIVATE, &len, inOffset, outOffset, (BUFFER_MAX_LENGTH - in_received)) != 0) {
+    if (keyDecrypt(0xB8, &decKey, inOffset, outOffset, &len, (BUFFER_MAX_LENGTH - in_received)) != 0) {
         return SW_UNKNOWN;  // Again, not really unknown...
     }
 
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
-
-    memcpy(buffer, outOffset, len);  // * Rest of buffer is non-empty, again
+    out_offset = in_received;   // Sent from where it is, buffer before it is non-empty
     (*length) = len;
     return SW_NO_ERROR;
 }
@@ -916,28 +1982,17 @@ uint16_t internalAuthenticate(uint16_t* length) {
         return SW_REFERENCED_DATA_NOT_FOUND;
     }
 
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-    mbedtls_entropy_context entropy;
-    mbedtls_entropy_init(&entropy);
-    const char *pers = "internalAuthenticate";
-
-    if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-                        (const unsigned char *) pers, strlen(pers)) != 0) {
-        return SW_UNKNOWN;  // Same as above
+    if (authCurve != ECC_NONE) {
+        return signEc(&authEcKey, length);
     }
 
     uint8_t* outOffset = buffer + in_received;
-    if(mbedtls_rsa_pkcs1_encrypt(&authKey, mbedtls_ctr_drbg_random, &ctr_drbg,
-            MBEDTLS_RSA_PRIVATE, in_received, buffer, outOffset) != 0) {
+    if (keySign(0xA4, &authKey, buffer, in_received, outOffset) != 0) {
         return SW_UNKNOWN;  // Again, not really unknown...
     }
 
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
-
     len = (mbedtls_mpi_bitlen(&authKey.N) + 7) >> 3;
-    memcpy(buffer, outOffset, len);  // * Rest of buffer is non-empty
+    out_offset = in_received;   // Sent from where it is, buffer before it is non-empty
     (*length) = len;
     return SW_NO_ERROR;
 }
@@ -988,82 +2043,184 @@ uint16_t sendPublicKey(mbedtls_rsa_context* key) {
     return offset;
 }
 
+/**
+ * Output the public key of the given ECC key pair, as 7F49 { 86 <point> }.
+ *
+ * @return Length of data written in buffer, 0 if there is no key
+ */
+uint16_t sendEcPublicKey(mbedtls_ecp_keypair* key, uint8_t curve) {
+    uint16_t offset = 0;
+
+    buffer[offset++] = 0x7F;
+    buffer[offset++] = 0x49;
+    uint16_t offsetForLength = offset++;    // Always shorter than 128 bytes
+
+    // 86 - Public key
+    buffer[offset++] = (uint8_t) 0x86;
+    uint16_t len = eccPublicKey(key, curve, buffer + offset + 1);
+    if (len == 0) {
+        return 0;
+    }
+    buffer[offset++] = (uint8_t) len;
+    offset += len;
+
+    buffer[offsetForLength] = (uint8_t) (offset - offsetForLength - 1);
+    return offset;
+}
+
 uint8_t updateKeyStatus() {
-    ERRORCHK(storeVar("isSigEmpty", isSigEmpty, 0, 8), return 1);
-    ERRORCHK(storeVar("isDecEmpty", isDecEmpty, 0, 8), return 1);
-    ERRORCHK(storeVar("isAuthEmpty", isAuthEmpty, 0, 8), return 1);
+    ERRORCHK(saveState(), return 1);
+    return 0;
+}
+
+/**
+ * Key pool. Generating a 2048 bit key takes tens of seconds, longer than
+ * the timeout of most PC/SC hosts, so one spare key pair is generated in
+ * the background and kept in its own key record. GENERATE ASYMMETRIC KEY
+ * PAIR only binds the spare to the requested slot, and the pool is then
+ * refilled while the card is otherwise idle.
+ */
+#define POOL_RETRY_DELAY 10         // Seconds to wait before trying again after a failed generation
+
+static mbedtls_rsa_context poolKey;         // Used only by keyPoolInit and taskKeyPool
+static SemaphoreHandle_t poolMutex = NULL;  // Guards the spare key record
+static TaskHandle_t poolTask = NULL;        // Notified when the spare key has been used
+static uint8_t spareReady = 0;              // Set when the spare key record holds a checked key
+
+/**
+ * Move the spare key into key. The record is removed before the key is
+ * used, so the same key pair is never bound to two slots.
+ *
+ * @return SW_NO_ERROR, or SW_RECORD_NOT_FOUND if no spare key is ready
+ */
+uint16_t takeSpareKey(mbedtls_rsa_context* key) {
+    uint16_t ret = SW_RECORD_NOT_FOUND;
+
+    if (poolMutex == NULL) {
+        return ret;
+    }
+    xSemaphoreTake(poolMutex, portMAX_DELAY);
+    if (spareReady) {
+        ret = loadKey(key, SPARE_KEY);
+        unlink(keyPath(SPARE_KEY, 0));
+        spareReady = 0;
+    }
+    xSemaphoreGive(poolMutex);
+    xTaskNotifyGive(poolTask);      // Refill in the background
+    return ret;
+}
+
+static void taskKeyPool(void *pvParameters) {
+    static const char* TAG = "taskKeyPool";
+    int64_t mark;
+    int ret;
+
+    while(1) {
+        if (spareReady) {           // Sleep until the spare key is taken
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        mbedtls_rsa_init(&poolKey, MBEDTLS_RSA_PKCS_V15, 0);
+        mark = 0;           // See rngRandomYield
+        if ((ret = mbedtls_rsa_gen_key(&poolKey, rngRandomYield, &mark, KEY_SIZE, EXPONENT)) != 0) {
+            ESP_LOGE(TAG, "mbedtls_rsa_gen_key returned %d", ret);
+        } else if (mbedtls_rsa_check_privkey(&poolKey) != 0) {
+            ESP_LOGE(TAG, "Failed hard");
+        } else {
+            xSemaphoreTake(poolMutex, portMAX_DELAY);
+            spareReady = (storeKey(&poolKey, SPARE_KEY) == SW_NO_ERROR);
+            xSemaphoreGive(poolMutex);
+        }
+        mbedtls_rsa_free(&poolKey);
+
+        if (spareReady) {
+            ESP_LOGI(TAG, "Spare key ready");
+        } else {
+            vTaskDelay((POOL_RETRY_DELAY*1000)/portTICK_PERIOD_MS);
+        }
+    }
+}
+
+/**
+ * Start the key pool. A spare key left in the flash memory from before
+ * the last restart is used, if its record is intact. The generator runs
+ * with the lowest priority on APP_CPU, so the crypto worker preempts it
+ * whenever a command arrives.
+ *
+ * @return 0 on success, 1 on failure
+ */
+uint8_t keyPoolInit() {
+    static const char* TAG = "keyPoolInit";
+
+    if ((poolMutex = xSemaphoreCreateMutex()) == NULL) {
+        return 1;
+    }
+
+    mbedtls_rsa_init(&poolKey, MBEDTLS_RSA_PKCS_V15, 0);
+    if (loadKey(&poolKey, SPARE_KEY) == SW_NO_ERROR) {
+        spareReady = 1;
+    } else {
+        unlink(keyPath(SPARE_KEY, 0));  // Either there is none, or it cannot be trusted
+    }
+    mbedtls_rsa_free(&poolKey);
+
+    if (xTaskCreatePinnedToCore(&taskKeyPool, "taskKeyPool", 8192, NULL, 1, &poolTask, APP_CPU_NUM) != pdPASS) {
+        return 1;
+    }
+    diagTask(poolTask, 8192);
+    ESP_LOGI(TAG, "SUCCESS, spare key %s", spareReady ? "restored" : "pending");
     return 0;
 }
 
 int keyGen(uint8_t type) {
     static const char* TAG = "keyGen";
 
-    int ret;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_rsa_context* key;
-    FILE* fpriv = NULL;
+    int64_t mark = 0;       // See rngRandomYield
+    int ret = 1;
     uint8_t* isEmpty;
-    const char* pers = "keyGen";
+    uint8_t* curve;
+    mbedtls_ecp_keypair* ecKey;
+    mbedtls_rsa_context key;        // The slot keeps its key until the new one is stored
+    mbedtls_ecp_keypair generated;
 
-    mbedtls_ctr_drbg_init(&ctr_drbg);
-    mbedtls_entropy_init(&entropy);
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-                               (const unsigned char *) pers, strlen(pers))) != 0) {
-        ESP_LOGE(TAG, "\nError:\tmbedtls_ctr_drbg_seed returned %d\n", ret);
-        goto exitKG;
+    if (keySlot(type, &isEmpty, &curve, &ecKey) != 0) {
+        return 1;
     }
+    mbedtls_rsa_init(&key, MBEDTLS_RSA_PKCS_V15, 0);
+    mbedtls_ecp_keypair_init(&generated);
 
-    if (type == (uint8_t) 0xB6) {
-        key = &sigKey;
-        isEmpty = &isSigEmpty;
-        if ((fpriv = fopen("/spiflash/sigKey.dat", "wb")) == NULL) {
-            ret = 1;
+    if ((*curve) != ECC_NONE) {     // Fast enough to be generated right away
+        if ((ret = eccGenKey(&generated, *curve)) != 0) {
+            ESP_LOGE(TAG, "eccGenKey returned %d", ret);
             goto exitKG;
         }
-    } else if (type == (uint8_t) 0xB8) {
-        key = &decKey;
-        isEmpty = &isDecEmpty;
-        if ((fpriv = fopen("/spiflash/decKey.dat", "wb")) == NULL) {
+        if (storeEcKey(&generated, *curve, type) != SW_NO_ERROR || eccCopyKey(ecKey, &generated) != 0) {
             ret = 1;
             goto exitKG;
         }
-    } else if (type == (uint8_t) 0xA4) {
-        key = &authKey;
-        isEmpty = &isAuthEmpty;
-        if ((fpriv = fopen("/spiflash/authKey.dat", "wb")) == NULL) {
+        keyReplaced(type);
+    } else {
+        if (takeSpareKey(&key) != SW_NO_ERROR) {   // No spare key yet, generate one now
+            mbedtls_rsa_free(&key);     // A spare that failed to load may have left a part of it
+            mbedtls_rsa_init(&key, MBEDTLS_RSA_PKCS_V15, 0);
+            if ((ret = mbedtls_rsa_gen_key(&key, rngRandomYield, &mark, KEY_SIZE, EXPONENT)) != 0){
+                ESP_LOGE(TAG, "\nError:\tmbedtls_rsa_gen_key returned %d\n\n", ret);
+                goto exitKG;
+            }
+
+            if (mbedtls_rsa_check_privkey(&key) != 0) {
+                ESP_LOGE("keyGen", "Failed hard");
+                ret = 1;
+                goto exitKG;
+            }
+        }
+        if (installKey(&key, type) != SW_NO_ERROR) {
             ret = 1;
             goto exitKG;
         }
-    } else {
-        ret = 1;
-        goto exitKG;
-    }
-
-    if ((ret = mbedtls_rsa_gen_key(key, mbedtls_ctr_drbg_random, &ctr_drbg, KEY_SIZE, EXPONENT)) != 0){
-        ESP_LOGE(TAG, "\nError:\tmbedtls_rsa_gen_key returned %d\n\n", ret);
-        goto exitKG;
-    }
-
-    if ((ret = mbedtls_mpi_write_file("N = " , &key->N , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("E = " , &key->E , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("D = " , &key->D , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("P = " , &key->P , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("Q = " , &key->Q , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("DP = ", &key->DP, 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("DQ = ", &key->DQ, 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("QP = ", &key->QP, 16, fpriv)) != 0) {
-        ESP_LOGE(TAG, "\nError:\tmbedtls_mpi_write_file returned %d\n\n", ret);
-        fclose(fpriv);
-        goto exitKG;
     }
-    fclose(fpriv);
 
-    if (mbedtls_rsa_check_privkey(key) != 0) {
-        ESP_LOGE("keyGen", "Failed hard");
-        ret = 1;
-        goto exitKG;
-    }
     (*isEmpty) = 0;
     if (updateKeyStatus() != 0) {
         ret = 1;
@@ -1072,8 +2229,8 @@ int keyGen(uint8_t type) {
     ret = 0;
 
 exitKG:
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
+    mbedtls_rsa_free(&key);     // Zeroes the private components
+    mbedtls_ecp_keypair_free(&generated);
     return ret;
 }
 
@@ -1133,7 +2290,7 @@ uint16_t genAsymKey(uint8_t mode, uint16_t* ret) {
 
         if (buffer[0] == (uint8_t) 0xB6) {
             bzero(ds_counter, sizeof(ds_counter));
-            ERRORCHK(storeBuf("/spiflash/ds_count.dat", ds_counter, sizeof(ds_counter)), return 1);
+            ERRORCHK(saveState(), return 1);
         }
     }
 
@@ -1143,6 +2300,16 @@ uint16_t genAsymKey(uint8_t mode, uint16_t* ret) {
         (*ret) = 0;
         return SW_UNKNOWN;
     }
+
+    uint8_t* curve;
+    mbedtls_ecp_keypair* ecKey;
+    keySlot(buffer[0], NULL, &curve, &ecKey);
+    if ((*curve) != ECC_NONE) {
+        if (((*ret) = sendEcPublicKey(ecKey, *curve)) == 0) {
+            return SW_REFERENCED_DATA_NOT_FOUND;
+        }
+        return SW_NO_ERROR;
+    }
     
     // Output requested key
     (*ret) = sendPublicKey(key);
@@ -1162,795 +2329,802 @@ uint16_t getChallenge(uint16_t len, uint16_t* length) {
     if (len > CHALLENGES_MAX_LENGTH)
         return SW_WRONG_DATA;
 
-    srand((unsigned int) time(NULL));
-    for (int i = 0; i < len; i++) {
-        buffer[i] = (uint8_t) rand() & 0xFF;
+    if (rngGetBytes(buffer, len) != 0) {
+        return SW_UNKNOWN;
     }
 
     (*length) = len;
     return SW_NO_ERROR;
 }
 
-/**
- * Provide the GET DATA command (INS CA)
+/*
+ * The data objects of GET DATA and PUT DATA.
  *
- * Output the data specified with tag.
+ * Each object is described once in dataObjects, sorted by tag:
+ * where its value is, how large it can be, who can read and
+ * write it, and how it persists. getData, putData, the reset in
+ * initialize and the checks of restoreState all go through the
+ * table, so an object is added with a single line.
  *
- * @param tag Tag of the requested data
- * @param ret Length of data written in buffer
+ * The constructed objects (65, 6E, 73, 7A) and the concatenated
+ * ones (C5, C6, CD) are made of the values of their children,
+ * which are read through the table too. A child that can only
+ * be read as a part of them has ACCESS_NEVER to read.
  */
-uint16_t getData(uint16_t tag, uint16_t* ret) {
-    uint16_t offset = 0;
-    uint8_t* bufOffset;
-
-    switch (tag) {
-    // 4F - Application identifier (AID)
-    case (uint16_t) 0x004F:
-        memcpy(buffer, AID, sizeof(AID));
-        (*ret) = sizeof(AID);
-        return SW_NO_ERROR;
-
-    // 5E - Login data
-    case (uint16_t) 0x005E:
-        memcpy(buffer, loginData, loginData_length);
-        (*ret) = loginData_length;
-        return SW_NO_ERROR;
-
-    // 5F50 - URL
-    case (uint16_t) 0x5F50:
-        memcpy(buffer, url, url_length);
-        (*ret) = url_length;
-        return SW_NO_ERROR;
-
-    // 5F52 - Historical bytes
-    case (uint16_t) 0x5F52:
-        memcpy(buffer, HISTORICAL, sizeof(HISTORICAL));
-        (*ret) = sizeof(HISTORICAL);
-        return SW_NO_ERROR;
-
-    // 65 - Cardholder Related Data
-    case (uint16_t) 0x0065:
-
-        // 5B - Name
-        buffer[offset++] = 0x5B;
-        buffer[offset++] = (uint8_t) name_length;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, name, name_length);
-        offset += name_length;
-
-        // 5F2D - Language
-        buffer[offset++] = 0x5F;
-        buffer[offset++] = 0x2D;
-        buffer[offset++] = (uint8_t) lang_length;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, lang, lang_length);
-        offset += lang_length;
-
-        // 5F35 - Sex
-        buffer[offset++] = 0x5F;
-        buffer[offset++] = 0x35;
-        buffer[offset++] = 0x01;
-        buffer[offset++] = sex;
-
-        (*ret) = offset;
-        return SW_NO_ERROR;
-
-    // 6E - Application Related Data
-    case (uint16_t) 0x006E:
-
-        // 4F - AID
-        buffer[offset++] = 0x4F;
-        buffer[offset++] = sizeof(AID);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, AID, sizeof(AID));
-        offset += sizeof(AID);
-
-        // 5F52 - Historical bytes
-        buffer[offset++] = 0x5F;
-        buffer[offset++] = 0x52;
-        buffer[offset++] = (uint8_t) sizeof(HISTORICAL);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, HISTORICAL, sizeof(HISTORICAL));
-        offset += sizeof(HISTORICAL);
-
-        // 73 - Discretionary data objects
-        buffer[offset++] = 0x73;
-        buffer[offset++] = (uint8_t) 0x81; // This field's length will exceed 127 bytes
-        uint16_t ddoLengthOffset = offset;
-        buffer[offset++] = 0x00; // Placeholder for length byte
-
-        // C0 - Extended capabilities
-        buffer[offset++] = (uint8_t) 0xC0;
-        buffer[offset++] = (uint8_t) sizeof(EXTENDED_CAP);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, EXTENDED_CAP, sizeof(EXTENDED_CAP));
-        offset += sizeof(EXTENDED_CAP);
-
-        // C1 - Algorithm attributes signature
-        buffer[offset++] = (uint8_t) 0xC1;
-        buffer[offset++] = (uint8_t) 0x06;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, sigAttributes, sizeof(sigAttributes));
-        offset += sizeof(sigAttributes);
-
-        // C2 - Algorithm attributes decryption
-        buffer[offset++] = (uint8_t) 0xC2;
-        buffer[offset++] = (uint8_t) 0x06;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, decAttributes, sizeof(decAttributes));
-        offset += sizeof(decAttributes);
-
-        // C3 - Algorithm attributes authentication
-        buffer[offset++] = (uint8_t) 0xC3;
-        buffer[offset++] = (uint8_t) 0x06;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, authAttributes, sizeof(authAttributes));
-        offset += sizeof(authAttributes);
-
-        // C4 - PW1 Status bytes
-        buffer[offset++] = (uint8_t) 0xC4;
-        buffer[offset++] = 0x07;
-        buffer[offset++] = pw1_status;
-        buffer[offset++] = PW1_MAX_LENGTH;
-        buffer[offset++] = RC_MAX_LENGTH;
-        buffer[offset++] = PW3_MAX_LENGTH;
-        buffer[offset++] = pw1.remaining;
-        buffer[offset++] = rc.remaining;
-        buffer[offset++] = pw3.remaining;
-
-        // C5 - Fingerprints sign, dec and auth keys
-        buffer[offset++] = (uint8_t) 0xC5;
-        buffer[offset++] = (uint16_t) 60;   // * Doesn't really make sense to cast to 16-bit
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, sigFP, FP_SIZE);
-        offset += FP_SIZE;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, decFP, FP_SIZE);
-        offset += FP_SIZE;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, authFP, FP_SIZE);
-        offset += FP_SIZE;
-
-        // C6 - Fingerprints CA 1, 2 and 3
-        buffer[offset++] = (uint8_t) 0xC6;
-        buffer[offset++] = (uint16_t) 60;   // * Again, 16-bit casting to an 8-bit variable...
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, ca1_fp, FP_LENGTH);
-        offset += FP_LENGTH;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, ca2_fp, FP_LENGTH);
-        offset += FP_LENGTH;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, ca3_fp, FP_LENGTH);
-        offset += FP_LENGTH;
-
-        // CD - Generation times of public key pair
-        buffer[offset++] = (uint8_t) 0xCD;
-        buffer[offset++] = (uint16_t) 12;   // * Hope this is the last time of this casting
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, sigTime, sizeof(sigTime));
-        offset += sizeof(sigTime);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, decTime, sizeof(decTime));
-        offset += sizeof(decTime);
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, authTime, sizeof(authTime));
-        offset += sizeof(authTime);
-
-        // Set length of combined discretionary data objects
-        buffer[ddoLengthOffset] = (uint8_t) (offset - ddoLengthOffset - 1);
-
-        (*ret) = offset;
-        return SW_NO_ERROR;
-
-    // 7A - Security support template
-    case (uint16_t) 0x007A:
-
-        // 93 - Digital signature counter
-        buffer[offset++] = (uint8_t) 0x93;
-        buffer[offset++] = 0x03;
-        bufOffset = buffer + offset;
-        memcpy(bufOffset, ds_counter, sizeof(ds_counter));
-        offset += sizeof(ds_counter);
-
-        (*ret) = offset;
-        return SW_NO_ERROR;
-
-    // 7F21 - Cardholder Certificate
-    case (uint16_t) 0x7F21:
-        if (cert_length > 0) {
-            bufOffset = buffer + offset;
-            memcpy(bufOffset, cert, sizeof(cert));
-            offset += sizeof(cert);
-        }
-
-        (*ret) = offset;
-        return SW_NO_ERROR;
-
-    // C4 - PW Status Bytes
-    case (uint16_t) 0x00C4:
-        buffer[offset++] = pw1_status;
-        buffer[offset++] = PW1_MAX_LENGTH;
-        buffer[offset++] = RC_MAX_LENGTH;
-        buffer[offset++] = PW3_MAX_LENGTH;
-        buffer[offset++] = pw1.remaining;
-        buffer[offset++] = rc.remaining;
-        buffer[offset++] = pw3.remaining;
-
-        (*ret) = offset;
-        return SW_NO_ERROR;
-
-    // 0101 - Private Use DO 1
-    case (uint16_t) 0x0101:
-        memcpy(buffer, private_use_do_1, private_use_do_1_length);
-        offset += private_use_do_1_length;
-        (*ret) = offset;
-        return SW_NO_ERROR;
+#define DATA_CONSTANT 0     // A constant of the firmware
+#define DATA_STATE 1        // In RAM, saved with the state image
+#define DATA_COUNTER 2      // In RAM, journaled with the state image, changed by the card only
+#define DATA_OBJECT 3       // In flash, the object id of libDO.h
+#define DATA_TEMPLATE 4     // The TLVs of its children
+#define DATA_CONCAT 5       // The values of its children, one after the other
+#define DATA_BUILT 6        // Read and written by its functions only
+
+#define ACCESS_ALWAYS 0
+#define ACCESS_PW1 1        // PW1 verified in mode 82
+#define ACCESS_PW3 2
+#define ACCESS_NEVER 3      // Read: only as a part of another object, write: read only
+
+#define DATA_FIXED 0x01         // A value is always max bytes
+#define DATA_WRONG_LENGTH 0x02  // Too long a value answers SW_WRONG_LENGTH, not SW_WRONG_DATA
+
+typedef struct dataObject_t dataObject_t;
+struct dataObject_t {
+    uint16_t tag;
+    uint8_t kind;           // DATA_*
+    uint8_t read;           // ACCESS_* to read it with GET DATA
+    uint8_t write;          // ACCESS_* to write it with PUT DATA
+    uint8_t flags;          // DATA_FIXED, DATA_WRONG_LENGTH
+    const void* ptr;        // The value, or its children (uint16_t tags)
+    uint16_t* length;       // Length of the value, NULL if it is always max bytes
+    uint16_t max;           // Largest value, or number of children
+    uint8_t id;             // DO_* of a DATA_OBJECT
+    uint16_t (*get)(uint16_t offset);           // Write the value at offset, return the offset after it
+    uint16_t (*put)(const dataObject_t* obj);   // Take the value of the command, once it is checked
+};
+
+// Take the value of the command for the object, as it is
+uint16_t dataStore(const dataObject_t* obj) {
+    if (obj->kind == DATA_OBJECT) {
+        return (doWrite(obj->id, buffer, in_received) == ESP_OK) ? SW_NO_ERROR : SW_UNKNOWN;
+    }
+    memcpy((void*) obj->ptr, buffer, in_received);
+    if (obj->length != NULL) {
+        *(obj->length) = in_received;
+    }
+    return saveState();
+}
 
-    // 0102 - Private Use DO 2
-    case (uint16_t) 0x0102:
-        memcpy(buffer, private_use_do_2, private_use_do_2_length);
-        offset += private_use_do_2_length;
-        (*ret) = offset;
-        return SW_NO_ERROR;
+// Write the algorithm attributes of a key: the RSA attributes, or those of its curve
+uint16_t writeAttributes(uint16_t offset, uint8_t* rsaAttributes, uint8_t curve) {
+    if (curve == ECC_NONE) {
+        memcpy(buffer + offset, rsaAttributes, 6);
+        return offset + 6;
+    }
+    return offset + eccAttributes(curve, buffer + offset);
+}
 
-    // 0103 - Private Use DO 3
-    case (uint16_t) 0x0103:
-        // For private use DO 3, PW1 must be verified with mode 82 to read
-        if (!((pw3.validated != 1) && (pw1_modes[PW1_MODE_NO82] == 1))) {
-            return SW_SECURITY_STATUS_NOT_SATISFIED;
-        }
-        memcpy(buffer, private_use_do_3, private_use_do_3_length);
-        offset += private_use_do_3_length;
-        (*ret) = offset;
-        return SW_NO_ERROR;
+static uint16_t getSigAttributes(uint16_t offset) {
+    return writeAttributes(offset, sigAttributes, sigCurve);
+}
 
-    // 0104 - Private Use DO 4
-    case (uint16_t) 0x0104:
-        // For private use DO 4, PW3 must be verified to read
-        if (pw3.validated != 1) {
-            return SW_SECURITY_STATUS_NOT_SATISFIED;
-        }
-        memcpy(buffer, private_use_do_4, private_use_do_4_length);
-        offset += private_use_do_4_length;
-        (*ret) = offset;
-        return SW_NO_ERROR;
+static uint16_t getDecAttributes(uint16_t offset) {
+    return writeAttributes(offset, decAttributes, decCurve);
+}
 
-    default:
-        return SW_RECORD_NOT_FOUND;
-    }
+static uint16_t getAuthAttributes(uint16_t offset) {
+    return writeAttributes(offset, authAttributes, authCurve);
+}
 
-    (*ret) = offset;
-    return SW_NO_ERROR;
+// C4 - PW Status Bytes
+static uint16_t getPWStatus(uint16_t offset) {
+    buffer[offset++] = pw1_status;
+    buffer[offset++] = PW1_MAX_LENGTH;
+    buffer[offset++] = RC_MAX_LENGTH;
+    buffer[offset++] = PW3_MAX_LENGTH;
+    buffer[offset++] = pw1.remaining;
+    buffer[offset++] = rc.remaining;
+    buffer[offset++] = pw3.remaining;
+    return offset;
 }
 
 /**
- * Provide the PUT DATA command (INS DA)
- *
- * Write the data specified using tag.
- *
- * Before using this method PW3 has to be verified.
+ * Set the algorithm attributes of a key (PUT DATA C1, C2 or C3). RSA is
+ * accepted with the modulus size of the card, ECC with the curves of
+ * libECC.h that fit the key. Changing the algorithm removes the key, it
+ * cannot be used with the new one.
  *
- * @param apdu
- * @param tag
- *            Tag of the requested data
+ * @param slot The ECC_SLOT_* flag of the key
  */
-uint16_t putData(uint16_t tag) {
-    if((tag == (uint16_t) 0x0101) || (tag == (uint16_t) 0x0103)) {
-        // Special case for private use DO's 1 and 3: these can be written if
-        // PW1 is verified with mode 82. All others require PW3 verification.
-        if (!((pw1.validated == 1) && pw1_modes[PW1_MODE_NO82])) {
-            return SW_SECURITY_STATUS_NOT_SATISFIED;
-        }
-
-        if (in_received > PRIVATE_DO_MAX_LENGTH) {
-            return SW_WRONG_LENGTH;
-        }
-
-        switch (tag) {
-        // 0101 - Private Use DO 1
-        case (uint16_t) 0x0101:
-            private_use_do_1_length = in_received;
-            memcpy(private_use_do_1, buffer, in_received);
-            ERRORCHK(storeBuf("/spiflash/privdo1.dat", private_use_do_1, in_received), return SW_UNKNOWN);
-            return storeVar("privdo1_len", 0, private_use_do_1_length, 16);
-
-        // 0103 - Private Use DO 3
-        case (uint16_t) 0x0103:
-            private_use_do_3_length = in_received;
-            memcpy(private_use_do_3, buffer, in_received);
-            ERRORCHK(storeBuf("/spiflash/privdo3.dat", private_use_do_3, in_received), return SW_UNKNOWN);
-            return storeVar("privdo3_len", 0, private_use_do_3_length, 16);
-        }
-    }
+uint16_t setAttributes(uint8_t type, uint8_t* rsaAttributes, uint8_t slot) {
+    uint8_t* isEmpty;
+    uint8_t* curve;
+    uint8_t newCurve;
 
-    if (pw3.validated == 0) {
-        return SW_SECURITY_STATUS_NOT_SATISFIED;
+    keySlot(type, &isEmpty, &curve, NULL);
+    if (in_received == 0) {
+        return SW_WRONG_DATA;
     }
-
-    switch (tag) {
-    // 5B - Name
-    case (uint16_t) 0x005B:
-        if (in_received > NAME_MAX_LENGTH) {
-            return SW_WRONG_DATA;
-        }
-        memcpy(name, buffer, in_received);
-        name_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/name.dat", name, in_received), return SW_UNKNOWN);
-        return storeVar("name_length", 0, name_length, 16);
-
-    // 5E - Login data
-    case (uint16_t) 0x005E:
-        if (in_received > LOGINDATA_MAX_LENGTH) {
+    if (buffer[0] == 0x01) {    // RSA
+        if (in_received < 3 || buffer[1] != rsaAttributes[1] || buffer[2] != rsaAttributes[2]) {
             return SW_WRONG_DATA;
         }
-        memcpy(loginData, buffer, in_received);
-        loginData_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/logData.dat", loginData, in_received), return SW_UNKNOWN);
-        return storeVar("loginData_len", 0, loginData_length, 16);
+        newCurve = ECC_NONE;
+    } else if ((newCurve = eccFindCurve(buffer, in_received, slot)) == ECC_NONE) {
+        return SW_WRONG_DATA;
+    }
 
-    // 5F2D - Language preferences
-    case (uint16_t) 0x5F2D:
-        if (in_received > LANG_MAX_LENGTH) {
-            return SW_WRONG_DATA;
-        }
-        memcpy(lang, buffer, in_received);
-        lang_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/lang.dat", lang, in_received), return SW_UNKNOWN);
-        return storeVar("lang_length", 0, lang_length, 16);
+    if (newCurve == (*curve)) {
+        return SW_NO_ERROR;     // Same algorithm, the key stays
+    }
+    (*curve) = newCurve;
+    (*isEmpty) = 1;
+    ERRORCHK(saveState(), return SW_UNKNOWN);
+    unlink(keyPath(type, 0));   // Only once the state no longer points to them
+    unlink(ecKeyPath(type));
+    keyReplaced(type);
+    return SW_NO_ERROR;
+}
 
-    // 5F35 - Sex
-    case (uint16_t) 0x5F35:
-        if (in_received != 1) {
-            return SW_WRONG_DATA;
-        }
+static uint16_t putSigAttributes(const dataObject_t* obj) {
+    return setAttributes(0xB6, sigAttributes, ECC_SLOT_SIG);
+}
 
-        // Check for valid values
-        if (buffer[0] != (uint8_t) 0x31 && buffer[0] != (uint8_t) 0x32
-                && buffer[0] != (uint8_t) 0x39) {
-            return SW_WRONG_DATA;
-        }
-        sex = buffer[0];
-        return storeVar("sex", sex, 0, 8);
+static uint16_t putDecAttributes(const dataObject_t* obj) {
+    return setAttributes(0xB8, decAttributes, ECC_SLOT_DEC);
+}
 
-    // 5F50 - URL
-    case (uint16_t) 0x5F50:
-        if (in_received > URL_MAX_LENGTH) {
-            return SW_WRONG_DATA;
-        }
-        memcpy(url, buffer, in_received);
-        url_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/url.dat", url, in_received), return SW_UNKNOWN);
-        return storeVar("url_length", 0, url_length, 16);
+static uint16_t putAuthAttributes(const dataObject_t* obj) {
+    return setAttributes(0xA4, authAttributes, ECC_SLOT_AUTH);
+}
 
-    // 7F21 - Cardholder certificate
-    case (uint16_t) 0x7F21:
-        if (in_received > CERT_MAX_LENGTH) {
-            return SW_WRONG_DATA;
-        }
-        memcpy(cert, buffer, in_received);
-        cert_length = in_received;
-        ERRORCHK(storeBuf("/spiflash/cert.dat", cert, in_received), return SW_UNKNOWN);
-        return storeVar("cert_length", 0, cert_length, 16);
+// C4 - PW Status Bytes, only the first one can be written
+static uint16_t putPWStatus(const dataObject_t* obj) {
+    if (buffer[0] != (uint8_t) 0x00 && buffer[0] != (uint8_t) 0x01) {
+        return SW_WRONG_DATA;
+    }
+    return dataStore(obj);
+}
 
-    // C4 - PW Status Bytes
-    case (uint16_t) 0x00C4:
-        if (in_received != 1) {
-            return SW_WRONG_DATA;
-        }
-        // Check for valid values
-        if (buffer[0] != (uint8_t) 0x00 && buffer[0] != (uint8_t) 0x01) {
-            return SW_WRONG_DATA;
-        }
-        pw1_status = buffer[0];
-        return storeVar("pw1_status", pw1_status, 0, 8);
+// 5F35 - Sex
+static uint16_t putSex(const dataObject_t* obj) {
+    if (buffer[0] != (uint8_t) 0x31 && buffer[0] != (uint8_t) 0x32
+            && buffer[0] != (uint8_t) 0x39) {
+        return SW_WRONG_DATA;
+    }
+    return dataStore(obj);
+}
 
-    // C7 - Fingerprint signature key
-    case (uint16_t) 0x00C7:
-        if (in_received != FP_SIZE) {   // * Redundant check in the Java implementation
-            return SW_WRONG_DATA;       // Method setFingerprint performs limit checking
+// D3 - Resetting Code
+static uint16_t putResettingCode(const dataObject_t* obj) {
+    if (in_received == 0) {
+        rc_length = 0;
+        return saveState();
+    } else if (in_received >= RC_MIN_LENGTH) {
+        rc_length = (uint8_t) in_received;
+        if (updatePIN(&rc, buffer, 0, (uint8_t) in_received) != 0) {
+            return SW_UNKNOWN;
         }
-        memcpy(sigFP, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/sigFP.dat", sigFP, in_received), return SW_UNKNOWN);
         return SW_NO_ERROR;
+    }
+    return SW_WRONG_DATA;
+}
 
-    // C8 - Fingerprint decryption key
-    case (uint16_t) 0x00C8:
-        if (in_received != FP_SIZE) {   // * Redundant check in the Java implementation
-            return SW_WRONG_DATA;       // Method setFingerprint performs limit checking
+static const uint16_t DATA_65[] = { 0x005B, 0x5F2D, 0x5F35 };
+static const uint16_t DATA_6E[] = { 0x004F, 0x5F52, 0x0073 };
+static const uint16_t DATA_73[] = { 0x00C0, 0x00C1, 0x00C2, 0x00C3, 0x00C4, 0x00C5, 0x00C6, 0x00CD };
+static const uint16_t DATA_7A[] = { 0x0093 };
+static const uint16_t DATA_C5[] = { 0x00C7, 0x00C8, 0x00C9 };
+static const uint16_t DATA_C6[] = { 0x00CA, 0x00CB, 0x00CC };
+static const uint16_t DATA_CD[] = { 0x00CE, 0x00CF, 0x00D0 };
+
+#define CONSTANT(t, x, r) { t, DATA_CONSTANT, r, ACCESS_NEVER, DATA_FIXED, x, NULL, sizeof(x), 0, NULL, NULL }
+#define STATE(t, x, len, w) { t, DATA_STATE, ACCESS_NEVER, w, 0, x, &(len), sizeof(x), 0, NULL, NULL }
+#define FIXED(t, x, w, put) { t, DATA_STATE, ACCESS_NEVER, w, DATA_FIXED, &(x), NULL, sizeof(x), 0, NULL, put }
+#define COUNTED(t, x) { t, DATA_COUNTER, ACCESS_NEVER, ACCESS_NEVER, DATA_FIXED, x, NULL, sizeof(x), 0, NULL, NULL }
+#define OBJECT(t, i, m, r, w, f) { t, DATA_OBJECT, r, w, f, NULL, NULL, m, i, NULL, NULL }
+#define TEMPLATE(t, c, r) { t, DATA_TEMPLATE, r, ACCESS_NEVER, 0, c, NULL, sizeof(c)/sizeof(c[0]), 0, NULL, NULL }
+#define CONCAT(t, c) { t, DATA_CONCAT, ACCESS_NEVER, ACCESS_NEVER, 0, c, NULL, sizeof(c)/sizeof(c[0]), 0, NULL, NULL }
+#define BUILT(t, r, w, m, get, put) { t, DATA_BUILT, r, w, 0, NULL, NULL, m, 0, get, put }
+
+static const dataObject_t dataObjects[] = {
+    CONSTANT(0x004F, AID, ACCESS_ALWAYS),                   // Application identifier (AID)
+    STATE(0x005B, name, name_length, ACCESS_PW3),           // Name
+    OBJECT(0x005E, DO_LOGIN, LOGINDATA_MAX_LENGTH, ACCESS_ALWAYS, ACCESS_PW3, 0),      // Login data
+    TEMPLATE(0x0065, DATA_65, ACCESS_ALWAYS),               // Cardholder Related Data
+    TEMPLATE(0x006E, DATA_6E, ACCESS_ALWAYS),               // Application Related Data
+    TEMPLATE(0x0073, DATA_73, ACCESS_NEVER),                // Discretionary data objects
+    TEMPLATE(0x007A, DATA_7A, ACCESS_ALWAYS),               // Security support template
+    COUNTED(0x0093, ds_counter),                            // Digital signature counter
+    CONSTANT(0x00C0, EXTENDED_CAP, ACCESS_NEVER),           // Extended capabilities
+    BUILT(0x00C1, ACCESS_NEVER, ACCESS_PW3, COMMAND_MAX_LENGTH, getSigAttributes, putSigAttributes),
+    BUILT(0x00C2, ACCESS_NEVER, ACCESS_PW3, COMMAND_MAX_LENGTH, getDecAttributes, putDecAttributes),
+    BUILT(0x00C3, ACCESS_NEVER, ACCESS_PW3, COMMAND_MAX_LENGTH, getAuthAttributes, putAuthAttributes),
+    { 0x00C4, DATA_BUILT, ACCESS_ALWAYS, ACCESS_PW3, DATA_FIXED, &pw1_status, NULL, 1, 0,
+            getPWStatus, putPWStatus },                     // PW Status Bytes, pw1_status is written
+    CONCAT(0x00C5, DATA_C5),                                // Fingerprints sign, dec and auth keys
+    CONCAT(0x00C6, DATA_C6),                                // Fingerprints CA 1, 2 and 3
+    FIXED(0x00C7, sigFP, ACCESS_PW3, NULL),                 // Fingerprint signature key
+    FIXED(0x00C8, decFP, ACCESS_PW3, NULL),                 // Fingerprint decryption key
+    FIXED(0x00C9, authFP, ACCESS_PW3, NULL),                // Fingerprint authentication key
+    FIXED(0x00CA, ca1_fp, ACCESS_PW3, NULL),                // Fingerprint Certification Authority 1
+    FIXED(0x00CB, ca2_fp, ACCESS_PW3, NULL),                // Fingerprint Certification Authority 2
+    FIXED(0x00CC, ca3_fp, ACCESS_PW3, NULL),                // Fingerprint Certification Authority 3
+    CONCAT(0x00CD, DATA_CD),                                // Generation times of public key pair
+    FIXED(0x00CE, sigTime, ACCESS_PW3, NULL),               // Signature key generation date/time
+    FIXED(0x00CF, decTime, ACCESS_PW3, NULL),               // Decryption key generation date/time
+    FIXED(0x00D0, authTime, ACCESS_PW3, NULL),              // Authentication key generation date/time
+    BUILT(0x00D3, ACCESS_NEVER, ACCESS_PW3, RC_MAX_LENGTH, NULL, putResettingCode),    // Resetting Code
+    OBJECT(0x0101, DO_PRIVATE_1, PRIVATE_DO_MAX_LENGTH, ACCESS_ALWAYS, ACCESS_PW1, DATA_WRONG_LENGTH),
+    OBJECT(0x0102, DO_PRIVATE_2, PRIVATE_DO_MAX_LENGTH, ACCESS_ALWAYS, ACCESS_PW3, DATA_WRONG_LENGTH),
+    OBJECT(0x0103, DO_PRIVATE_3, PRIVATE_DO_MAX_LENGTH, ACCESS_PW1, ACCESS_PW1, DATA_WRONG_LENGTH),
+    OBJECT(0x0104, DO_PRIVATE_4, PRIVATE_DO_MAX_LENGTH, ACCESS_PW3, ACCESS_PW3, DATA_WRONG_LENGTH),
+    STATE(0x5F2D, lang, lang_length, ACCESS_PW3),           // Language preferences
+    FIXED(0x5F35, sex, ACCESS_PW3, putSex),                 // Sex
+    OBJECT(0x5F50, DO_URL, URL_MAX_LENGTH, ACCESS_ALWAYS, ACCESS_PW3, 0),              // URL
+    CONSTANT(0x5F52, HISTORICAL, ACCESS_ALWAYS),            // Historical bytes
+    OBJECT(0x7F21, DO_CERT, CERT_MAX_LENGTH, ACCESS_ALWAYS, ACCESS_PW3, 0),            // Cardholder certificate
+};
+
+#define DATA_OBJECTS (sizeof(dataObjects)/sizeof(dataObjects[0]))
+
+// The object with the given tag, or NULL if there is none
+const dataObject_t* dataFind(uint16_t tag) {
+    uint8_t low = 0, high = DATA_OBJECTS;
+
+    while (low < high) {        // dataObjects is sorted by tag
+        uint8_t mid = (low + high) / 2;
+        if (dataObjects[mid].tag == tag) {
+            return &dataObjects[mid];
+        } else if (dataObjects[mid].tag < tag) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        memcpy(decFP, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/decFP.dat", decFP, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+    }
+    return NULL;
+}
 
-    // C9 - Fingerprint authentication key
-    case (uint16_t) 0x00C9:
-        if (in_received != FP_SIZE) {   // * Redundant check in the Java implementation
-            return SW_WRONG_DATA;       // Method setFingerprint performs limit checking
-        }
-        memcpy(authFP, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/authFP.dat", authFP, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+// Whether the PINs verified so far grant the access
+uint8_t dataAccess(uint8_t access) {
+    switch (access) {
+    case ACCESS_ALWAYS:
+        return 1;
+    case ACCESS_PW1:
+        return (pw1.validated == 1) && pw1_modes[PW1_MODE_NO82];
+    case ACCESS_PW3:
+        return pw3.validated == 1;
+    default:
+        return 0;
+    }
+}
 
-    // CA - Fingerprint Certification Authority 1
-    case (uint16_t) 0x00CA:
-        if (in_received != FP_LENGTH) {
-            return SW_WRONG_DATA;
-        }
-        memcpy(ca1_fp, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/ca1_fp.dat", ca1_fp, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+uint16_t dataValue(const dataObject_t* obj, uint16_t offset, uint16_t* status);
 
-    // CB - Fingerprint Certification Authority 2
-    case (uint16_t) 0x00CB:
-        if (in_received != FP_LENGTH) {
-            return SW_WRONG_DATA;
-        }
-        memcpy(ca2_fp, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/ca2_fp.dat", ca2_fp, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+// Write a TLV of the object at offset, the length goes in front once the value is written
+uint16_t dataTLV(const dataObject_t* obj, uint16_t offset, uint16_t* status) {
+    uint8_t tagBytes = (obj->tag > 0xFF) ? 2 : 1;
+    uint16_t start = offset + tagBytes + 3;     // Room for the longest length
+    uint16_t end = dataValue(obj, start, status);
+    uint16_t len = end - start;
+    uint8_t lenBytes = (len < 0x80) ? 1 : ((len <= 0xFF) ? 2 : 3);
 
-    // CC - Fingerprint Certification Authority 3
-    case (uint16_t) 0x00CC:
-        if (in_received != FP_LENGTH) {
-            return SW_WRONG_DATA;
-        }
-        memcpy(ca3_fp, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/ca3_fp.dat", ca3_fp, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+    if (tagBytes == 2) {
+        buffer[offset++] = (uint8_t) (obj->tag >> 8);
+    }
+    buffer[offset++] = (uint8_t) obj->tag;
+    if (lenBytes == 3) {
+        buffer[offset++] = (uint8_t) 0x82;
+        buffer[offset++] = (uint8_t) (len >> 8);
+    } else if (lenBytes == 2) {
+        buffer[offset++] = (uint8_t) 0x81;
+    }
+    buffer[offset++] = (uint8_t) len;
+    memmove(buffer + offset, buffer + start, len);
+    return offset + len;
+}
 
-    // CE - Signature key generation date/time
-    case (uint16_t) 0x00CE:
-        if (in_received != 4) {     // * Redundant check in the Java implementation
-            return SW_WRONG_DATA;   // Method setTime performs limit checking
-        }
-        memcpy(sigTime, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/sigTime.dat", sigTime, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+/**
+ * Write the value of the object at offset, without its tag and length.
+ *
+ * @return The offset after the value, status is set on failure
+ */
+uint16_t dataValue(const dataObject_t* obj, uint16_t offset, uint16_t* status) {
+    const uint16_t* children = (const uint16_t*) obj->ptr;
+    uint16_t len;
 
-    // CF - Decryption key generation date/time
-    case (uint16_t) 0x00CF:
-        if (in_received != 4) {     // * Redundant check in the Java implementation
-            return SW_WRONG_DATA;   // Method setTime performs limit checking
-        }
-        memcpy(decTime, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/decTime.dat", decTime, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+    switch (obj->kind) {
+    case DATA_CONSTANT:
+    case DATA_STATE:
+    case DATA_COUNTER:
+        len = (obj->length != NULL) ? *(obj->length) : obj->max;
+        memcpy(buffer + offset, obj->ptr, len);
+        return offset + len;
 
-    // D0 - Authentication key generation date/time
-    case (uint16_t) 0x00D0:
-        if (in_received != 4) {     // * Redundant check in the Java implementation
-            return SW_WRONG_DATA;   // Method setTime performs limit checking
+    case DATA_OBJECT:
+        if (doRead(obj->id, buffer + offset, &len) != ESP_OK) {
+            (*status) = SW_UNKNOWN;
         }
-        memcpy(authTime, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/authTime.dat", authTime, in_received), return SW_UNKNOWN);
-        return SW_NO_ERROR;
+        return offset + len;
 
-    // D3 - Resetting Code
-    case (uint16_t) 0x00D3:
-        if (in_received == 0) {
-            rc_length = 0;
-            return storeVar("rc_length", rc_length, 0, 8);
-        } else if (in_received >= RC_MIN_LENGTH
-                && in_received <= RC_MAX_LENGTH) {
-            rc_length = (uint8_t) in_received;
-            if (updatePIN(&rc, buffer, 0, (uint8_t) in_received) != 0) {
-                return SW_UNKNOWN;
-            }
-            return SW_NO_ERROR;
-        } else {
-            return SW_WRONG_DATA;
+    case DATA_TEMPLATE:
+        for (uint8_t i = 0; i < obj->max; i++) {
+            offset = dataTLV(dataFind(children[i]), offset, status);
         }
+        return offset;
 
-    // 0102 - Private Use DO 2
-    case 0x0102:
-        if (in_received > PRIVATE_DO_MAX_LENGTH) {
-            return SW_WRONG_LENGTH;
+    case DATA_CONCAT:
+        for (uint8_t i = 0; i < obj->max; i++) {
+            offset = dataValue(dataFind(children[i]), offset, status);
         }
-        memcpy(private_use_do_2, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/private_use_do_2.dat", private_use_do_2, in_received), return SW_UNKNOWN);
-        private_use_do_2_length = in_received;
-        return storeVar("private_use_do_2_length", 0, private_use_do_2_length, 16);
+        return offset;
 
-    // 0104 - Private Use DO 4
-    case 0x0104:
-        if (in_received > PRIVATE_DO_MAX_LENGTH) {
-            return SW_WRONG_LENGTH;
-        }
-        memcpy(private_use_do_4, buffer, in_received);
-        ERRORCHK(storeBuf("/spiflash/private_use_do_4.dat", private_use_do_4, in_received), return SW_UNKNOWN);
-        private_use_do_4_length = in_received;
-        return storeVar("private_use_do_4_length", 0, private_use_do_4_length, 16);
+    default:
+        return (obj->get != NULL) ? obj->get(offset) : offset;
+    }
+}
 
-    default:
-        return SW_RECORD_NOT_FOUND;
+// Empty the values in RAM, for a new card
+void dataReset() {
+    for (uint8_t i = 0; i < DATA_OBJECTS; i++) {
+        const dataObject_t* obj = &dataObjects[i];
+        if (obj->kind == DATA_STATE || obj->kind == DATA_COUNTER) {
+            bzero((void*) obj->ptr, obj->max);
+            if (obj->length != NULL) {
+                *(obj->length) = 0;
+            }
+        }
     }
 }
 
 /**
- * Get number of bytes needed to represent length for TLV element.
+ * Check the lengths of the values in RAM, just restored. A value cannot
+ * be longer than its variable.
  *
- * @param length
- *            Length of value
- * @return Number of bytes needed to represent length
+ * @return 0, or 1 if a length is wrong
  */
-uint16_t getLengthBytes(uint16_t length) {
-    if (length <= 127) {
-        return 1;
-    } else if (length <= 255) {
-        return 2;
-    } else {
-        return 3;
+uint8_t dataCheck() {
+    static const char* TAG = "dataCheck";
+    for (uint8_t i = 0; i < DATA_OBJECTS; i++) {
+        const dataObject_t* obj = &dataObjects[i];
+        if (obj->length != NULL && *(obj->length) > obj->max) {
+            ESP_LOGE(TAG, "Length %u of %04X is past %u", *(obj->length), obj->tag, obj->max);
+            return 1;
+        }
     }
+    return 0;
 }
 
 /**
- * Get length of TLV element.
+ * Provide the GET DATA command (INS CA)
  *
- * @param data
- *            Byte array
- * @param offset
- *            Offset within byte array containing first byte
- * @return Length of value
+ * Output the data specified with tag.
+ *
+ * @param tag Tag of the requested data
+ * @param ret Length of data written in buffer
  */
-uint16_t getLength(uint8_t* data, uint16_t offset, uint16_t* status) {
-    uint16_t len = 0;
+uint16_t getData(uint16_t tag, uint16_t* ret) {
+    const dataObject_t* obj = dataFind(tag);
+    uint16_t status = SW_NO_ERROR;
 
-    if ((data[offset] & (uint8_t) 0x80) == (uint8_t) 0x00) {
-        len = data[offset];
-        (*status) = SW_NO_ERROR;
-    } else if ((data[offset] & (uint8_t) 0x7F) == (uint8_t) 0x01) {
-        len = data[(uint16_t) (offset + 1)];
-        len &= 0x00FF;
-        (*status) = SW_NO_ERROR;
-    } else if ((data[offset] & (uint8_t) 0x7F) == (uint8_t) 0x02) {
-        len = (uint16_t) (data[(uint16_t) (offset + 1)] << 8) | data[(uint16_t) (offset + 2)];
-        (*status) = SW_NO_ERROR;
-    } else {
-        (*status) = SW_UNKNOWN;
+    if (obj == NULL || obj->read == ACCESS_NEVER) {
+        return SW_RECORD_NOT_FOUND;
     }
-
-    return len;
+    if (!dataAccess(obj->read)) {
+        return SW_SECURITY_STATUS_NOT_SATISFIED;
+    }
+    (*ret) = dataValue(obj, 0, &status);
+    return status;
 }
 
 /**
- * Provide functionality for importing keys.
+ * Provide the PUT DATA command (INS DA)
  *
- * @param apdu
+ * Write the data specified using tag, if the PINs verified allow it.
+ *
+ * @param tag
+ *            Tag of the requested data
  */
-uint16_t importKey() {
-    uint16_t status;
-    uint8_t* bufOffset;
-    uint16_t offset = 0;
-    FILE* fpriv = NULL;
-    uint8_t* isEmpty;
+uint16_t putData(uint16_t tag) {
+    const dataObject_t* obj = dataFind(tag);
 
-    if (pw3.validated == 0) {
+    if (obj == NULL || obj->write == ACCESS_NEVER) {
+        return SW_RECORD_NOT_FOUND;
+    }
+    if (!dataAccess(obj->write)) {
         return SW_SECURITY_STATUS_NOT_SATISFIED;
     }
+    if (in_received > obj->max) {
+        return (obj->flags & DATA_WRONG_LENGTH) ? SW_WRONG_LENGTH : SW_WRONG_DATA;
+    }
+    if ((obj->flags & DATA_FIXED) && in_received != obj->max) {
+        return SW_WRONG_DATA;
+    }
+    return (obj->put != NULL) ? obj->put(obj) : dataStore(obj);
+}
 
-    // Check for tag 4D
-    if (buffer[offset++] != 0x4D) {
-        return SW_DATA_INVALID;
+/**
+ * Key import (odd PUT DATA 3FFF). The extended header list is parsed as
+ * its chained commands come, rather than being collected in buffer:
+ *
+ *    4D L | Type 00 | 7F48 L Template | 5F48 L Data
+ *
+ * Everything up to the data of 5F48 is gathered in the header, whose
+ * template then gives the tag and the length of each component of the
+ * data, in order. The bytes of the data go straight to the component they
+ * belong to, so the memory used does not depend on the size of the key.
+ * Only E (91), P (92) and Q (93) of an RSA key are kept, the rest is
+ * derived again, and of an ECC key its private key (92).
+ */
+#define IMPORT_MORE 0               // The header is not complete yet
+#define IMPORT_HEADER_MAX 64
+#define IMPORT_ENTRIES_MAX 10       // Entries of the template, and one for what follows them
+#define IMPORT_RSA_NEEDED 0x07      // The entries 91, 92 and 93
+
+typedef struct importStream_t {
+    uint8_t active;             // Set between the commands of an import
+    uint8_t header[IMPORT_HEADER_MAX];
+    uint16_t headerLength;
+    uint8_t parsed;             // Set once the header is complete, the data follows
+    uint8_t type;               // Of the key
+    uint8_t count;              // Entries of the template
+    uint8_t tags[IMPORT_ENTRIES_MAX];
+    uint16_t lengths[IMPORT_ENTRIES_MAX];
+    uint8_t current;            // Entry the next byte of the data belongs to
+    uint16_t left;              // Bytes of it still to come
+    mbedtls_mpi E, P, Q;        // Of an RSA key
+    uint8_t ecKey[ECC_KEY_BYTES];   // Of an ECC key
+    uint16_t ecLength;
+} importStream_t;
+
+static importStream_t import;
+
+// Drop what has been received of an import
+void importReset() {
+    if (!import.active) {
+        return;
     }
+    mbedtls_mpi_free(&import.E);
+    mbedtls_mpi_free(&import.P);
+    mbedtls_mpi_free(&import.Q);
+    bzero(&import, sizeof(import));
+}
 
-    // Length of 4D
-    uint16_t len = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len);
-    } else {
-        return status;
+// Whether all of the data of 5F48 has come
+static uint8_t importDone() {
+    if (!import.parsed || import.left != 0) {
+        return 0;
+    }
+    for (uint8_t i = import.current + 1; i < import.count; i++) {
+        if (import.lengths[i] != 0) {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    // Get key for Control Reference Template
-    uint8_t type = buffer[offset++];
-    uint8_t err;
-    mbedtls_rsa_context* key = getKey(type, &err);
-    if (err != 0) {
+/**
+ * Read a TLV length at *offset of the n bytes of data, and move past it.
+ *
+ * @return SW_NO_ERROR, IMPORT_MORE if it goes beyond n, or SW_UNKNOWN
+ */
+static uint16_t importLength(const uint8_t* data, uint16_t n, uint16_t* offset, uint16_t* length) {
+    uint16_t o = *offset;
+
+    if (o >= n) {
+        return IMPORT_MORE;
+    }
+    if ((data[o] & (uint8_t) 0x80) == 0) {
+        *length = data[o];
+        *offset = o + 1;
+    } else if (data[o] == (uint8_t) 0x81) {
+        if (o + 2 > n) {
+            return IMPORT_MORE;
+        }
+        *length = data[o + 1];
+        *offset = o + 2;
+    } else if (data[o] == (uint8_t) 0x82) {
+        if (o + 3 > n) {
+            return IMPORT_MORE;
+        }
+        *length = (uint16_t) (data[o + 1] << 8) | data[o + 2];
+        *offset = o + 3;
+    } else {
         return SW_UNKNOWN;
     }
+    return SW_NO_ERROR;
+}
 
-    // Skip empty length of CRT
-    offset++;
+/**
+ * Parse the header gathered so far.
+ *
+ * @return SW_NO_ERROR with the length of the header in used, IMPORT_MORE
+ *         if it is not complete yet, or the SW of what is wrong with it
+ */
+static uint16_t importHeader(uint16_t* used) {
+    const uint8_t* h = import.header;
+    uint16_t n = import.headerLength, offset = 0, length, end;
+    uint32_t sum = 0;
+    uint8_t* curve;
+    uint8_t seen = 0;
+    uint16_t status;
 
-    // Check for tag 7F48
-    if (buffer[offset++] != 0x7F || buffer[offset++] != 0x48) {
+    if (n < 1) {
+        return IMPORT_MORE;
+    }
+    if (h[offset++] != 0x4D) {
         return SW_DATA_INVALID;
     }
-    uint16_t len_template = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_template);
-    } else {
+    if ((status = importLength(h, n, &offset, &length)) != SW_NO_ERROR) {
         return status;
     }
 
-    uint16_t offset_data = (uint16_t) (offset + len_template);
-
-    if (buffer[offset++] != (uint8_t) 0x91) {
-        return SW_DATA_INVALID;
+    // Control Reference Template of the key, with what it may hold
+    if (offset + 2 > n) {
+        return IMPORT_MORE;
     }
-    uint16_t len_e = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_e);
-    } else {
-        return status;
+    import.type = h[offset++];
+    if (keySlot(import.type, NULL, &curve, NULL) != 0) {
+        return SW_UNKNOWN;
     }
+    offset += 1 + h[offset];
 
-    if (buffer[offset++] != (uint8_t) 0x92) {
+    if (offset + 2 > n) {
+        return IMPORT_MORE;
+    }
+    if (h[offset++] != 0x7F || h[offset++] != 0x48) {
         return SW_DATA_INVALID;
     }
-    uint16_t len_p = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_p);
-    } else {
+    if ((status = importLength(h, n, &offset, &length)) != SW_NO_ERROR) {
         return status;
     }
-
-    if (buffer[offset++] != (uint8_t) 0x93) {
-        return SW_DATA_INVALID;
+    end = offset + length;
+    if (end > n) {
+        return (end > IMPORT_HEADER_MAX) ? SW_WRONG_DATA : IMPORT_MORE;
     }
-    uint16_t len_q = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_q);
-    } else {
-        return status;
+    import.count = 0;
+    while (offset < end) {
+        if (import.count == IMPORT_ENTRIES_MAX - 1) {
+            return SW_WRONG_DATA;
+        }
+        uint8_t tag = h[offset++];
+        if ((status = importLength(h, end, &offset, &length)) != SW_NO_ERROR) {
+            return (status == IMPORT_MORE) ? SW_DATA_INVALID : status;
+        }
+        if (tag >= (uint8_t) 0x91 && tag <= (uint8_t) 0x93) {
+            if (seen & (1 << (tag - 0x91))) {
+                return SW_DATA_INVALID;
+            }
+            seen |= 1 << (tag - 0x91);
+        }
+        import.tags[import.count] = tag;
+        import.lengths[import.count++] = length;
+        sum += length;
     }
 
-    if (buffer[offset++] != (uint8_t) 0x94) {
+    if (offset + 2 > n) {
+        return IMPORT_MORE;
+    }
+    if (h[offset++] != 0x5F || h[offset++] != 0x48) {
         return SW_DATA_INVALID;
     }
-    uint16_t len_pq = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_pq);
-    } else {
+    if ((status = importLength(h, n, &offset, &length)) != SW_NO_ERROR) {
         return status;
     }
+    if (sum > length) {
+        return SW_WRONG_DATA;
+    }
+    if (sum < length) {         // Skipped
+        import.tags[import.count] = 0;
+        import.lengths[import.count++] = length - sum;
+    }
 
-    if (buffer[offset++] != (uint8_t) 0x95) {
+    // The components that are kept must fit the key
+    for (uint8_t i = 0; i < import.count; i++) {
+        uint16_t l = import.lengths[i];
+        uint8_t tag = import.tags[i];
+        if ((*curve) != ECC_NONE) {
+            if (tag == (uint8_t) 0x92 && (l == 0 || l > ECC_KEY_BYTES)) {
+                return SW_WRONG_DATA;
+            }
+        } else if ((tag == (uint8_t) 0x91 && (l == 0 || l > KEY_E_BYTES)) ||
+                ((tag == (uint8_t) 0x92 || tag == (uint8_t) 0x93) && (l == 0 || l > KEY_SIZE_BYTES/2))) {
+            return SW_WRONG_DATA;   // Only RSA 2048 can be stored
+        }
+    }
+    if (((*curve) != ECC_NONE) ? !(seen & 0x02) : (seen != IMPORT_RSA_NEEDED)) {
         return SW_DATA_INVALID;
     }
-    uint16_t len_dp1 = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_dp1);
-    } else {
-        return status;
+
+    import.current = 0;
+    import.left = import.lengths[0];
+    *used = offset;
+    return SW_NO_ERROR;
+}
+
+// Append the len bytes of data to the big-endian value of X
+static int importAppend(mbedtls_mpi* X, const uint8_t* data, uint16_t len) {
+    mbedtls_mpi T;
+    int ret;
+
+    mbedtls_mpi_init(&T);
+    if ((ret = mbedtls_mpi_read_binary(&T, data, len)) == 0 &&
+        (ret = mbedtls_mpi_shift_l(X, 8 * len)) == 0) {
+        ret = mbedtls_mpi_add_abs(X, X, &T);
     }
+    mbedtls_mpi_free(&T);
+    return ret;
+}
 
-    if (buffer[offset++] != (uint8_t) 0x96) {
-        return SW_DATA_INVALID;
+// Take len bytes of the data of 5F48
+static uint16_t importData(const uint8_t* data, uint16_t len) {
+    uint8_t* curve;
+
+    keySlot(import.type, NULL, &curve, NULL);
+    while (len > 0) {
+        while (import.left == 0 && import.current < import.count) {
+            if (++import.current < import.count) {
+                import.left = import.lengths[import.current];
+            }
+        }
+        if (import.current == import.count) {
+            return SW_WRONG_DATA;   // Beyond 5F48
+        }
+
+        uint16_t l = (len < import.left) ? len : import.left;
+        uint8_t tag = import.tags[import.current];
+        int ret = 0;
+        if ((*curve) != ECC_NONE) {
+            if (tag == (uint8_t) 0x92) {
+                memcpy(import.ecKey + import.ecLength, data, l);
+                import.ecLength += l;
+            }
+        } else if (tag == (uint8_t) 0x91) {
+            ret = importAppend(&import.E, data, l);
+        } else if (tag == (uint8_t) 0x92) {
+            ret = importAppend(&import.P, data, l);
+        } else if (tag == (uint8_t) 0x93) {
+            ret = importAppend(&import.Q, data, l);
+        }
+        if (ret != 0) {
+            return SW_UNKNOWN;
+        }
+        import.left -= l;
+        data += l;
+        len -= l;
     }
-    uint16_t len_dq1 = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_dq1);
-    } else {
-        return status;
+    return SW_NO_ERROR;
+}
+
+// Take the data of a command of the import
+static uint16_t importConsume(const uint8_t* data, uint16_t len) {
+    uint16_t used = 0, status;
+
+    if (import.parsed) {
+        return importData(data, len);
     }
 
-    if (buffer[offset++] != (uint8_t) 0x97) {
-        return SW_DATA_INVALID;
+    // Gather what may be header, what comes after it is data
+    uint16_t room = IMPORT_HEADER_MAX - import.headerLength;
+    uint16_t l = (len < room) ? len : room;
+    memcpy(import.header + import.headerLength, data, l);
+    import.headerLength += l;
+    if ((status = importHeader(&used)) == IMPORT_MORE) {
+        return (import.headerLength == IMPORT_HEADER_MAX) ? SW_WRONG_DATA : SW_NO_ERROR;
+    } else if (status != SW_NO_ERROR) {
+        return status;
     }
-    uint16_t len_modulus = getLength(buffer, offset, &status);
-    if (status == SW_NO_ERROR) {
-        offset += getLengthBytes(len_modulus);
-    } else {
+    import.parsed = 1;
+    if ((status = importData(import.header + used, import.headerLength - used)) != SW_NO_ERROR) {
         return status;
     }
+    return importData(data + l, len - l);
+}
 
-    if (buffer[offset_data++] != 0x5F || buffer[offset_data++] != 0x48) {
-        return SW_DATA_INVALID;
+/**
+ * Store the ECC key that has been imported. The public key is derived
+ * from the private key again.
+ */
+static uint16_t importEcKey(uint8_t type) {
+    mbedtls_ecp_keypair* key;
+    uint8_t* isEmpty;
+    uint8_t* curve;
+    mbedtls_ecp_keypair imported;   // The slot keeps its key until this one is stored
+    uint16_t status = SW_UNKNOWN;
+
+    keySlot(type, &isEmpty, &curve, &key);
+    mbedtls_ecp_keypair_init(&imported);
+    if (eccSetKey(&imported, *curve, import.ecKey, import.ecLength) != 0) {
+        ESP_LOGE("importEcKey", "Failed hard");
+        status = SW_WRONG_DATA;
+        goto cleanup;
+    }
+    if (storeEcKey(&imported, *curve, type) != SW_NO_ERROR || eccCopyKey(key, &imported) != 0) {
+        goto cleanup;
+    }
+    keyReplaced(type);
+    (*isEmpty) = 0;
+    if (updateKeyStatus() != 0) {
+        goto cleanup;
     }
-    len = getLength(buffer, offset_data, &status);
-    offset_data += getLengthBytes(len);
+    status = SW_NO_ERROR;
+
+cleanup:
+    mbedtls_ecp_keypair_free(&imported);
+    return status;
+}
 
+/**
+ * Store the RSA key that has been imported, with the components derived
+ * from E, P and Q.
+ */
+static uint16_t importRsaKey(uint8_t type) {
+    uint16_t status = SW_UNKNOWN;
+    uint8_t* isEmpty;
+    mbedtls_rsa_context key;    // The slot keeps its key until this one is stored
     mbedtls_mpi P1, Q1, H;
+
+    if (keySlot(type, &isEmpty, NULL, NULL) != 0) {
+        return SW_UNKNOWN;
+    }
+
+    mbedtls_rsa_init(&key, MBEDTLS_RSA_PKCS_V15, 0);
     mbedtls_mpi_init(&P1);
     mbedtls_mpi_init(&Q1);
     mbedtls_mpi_init(&H);
 
-    bufOffset = buffer + offset_data;
-    if((mbedtls_mpi_read_binary(&key->E, bufOffset, len_e) != 0)) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_copy(&key.E, &import.E) != 0 ||
+        mbedtls_mpi_copy(&key.P, &import.P) != 0 ||
+        mbedtls_mpi_copy(&key.Q, &import.Q) != 0) {
         goto cleanup;
     }
-    offset_data += len_e;
-
-    bufOffset = buffer + offset_data;
-    if((mbedtls_mpi_read_binary(&key->P, bufOffset, len_p) != 0)) {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-    offset_data += len_p;
-
-    bufOffset = buffer + offset_data;
-    if((mbedtls_mpi_read_binary(&key->Q, bufOffset, len_q) != 0)) {
-        status = SW_UNKNOWN;
+    // mbedtls_rsa_check_privkey only checks that the components agree with each other
+    if (mbedtls_mpi_is_prime(&key.P, rngRandom, NULL) != 0 ||
+        mbedtls_mpi_is_prime(&key.Q, rngRandom, NULL) != 0) {
+        ESP_LOGE("importKey", "P or Q is not prime");
+        status = SW_WRONG_DATA;
         goto cleanup;
     }
 
-    if (mbedtls_mpi_mul_mpi(&key->N, &key->P, &key->Q) != 0) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_mul_mpi(&key.N, &key.P, &key.Q) != 0) {
         goto cleanup;
     }
-    if (mbedtls_mpi_sub_int(&P1, &key->P, 1) != 0) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_sub_int(&P1, &key.P, 1) != 0) {
         goto cleanup;
     }
-    if (mbedtls_mpi_sub_int(&Q1, &key->Q, 1) != 0) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_sub_int(&Q1, &key.Q, 1) != 0) {
         goto cleanup;
     }
     if (mbedtls_mpi_mul_mpi(&H, &P1, &Q1) != 0) {
-        status = SW_UNKNOWN;
         goto cleanup;
     }
-    if (mbedtls_mpi_inv_mod(&key->D , &key->E, &H) != 0) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_inv_mod(&key.D , &key.E, &H) != 0) {
         goto cleanup;
     }
-    if (mbedtls_mpi_mod_mpi(&key->DP, &key->D, &P1) != 0) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_mod_mpi(&key.DP, &key.D, &P1) != 0) {
         goto cleanup;
     }
-    if (mbedtls_mpi_mod_mpi(&key->DQ, &key->D, &Q1) != 0) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_mod_mpi(&key.DQ, &key.D, &Q1) != 0) {
         goto cleanup;
     }
-    if (mbedtls_mpi_inv_mod(&key->QP, &key->Q, &key->P) != 0) {
-        status = SW_UNKNOWN;
+    if (mbedtls_mpi_inv_mod(&key.QP, &key.Q, &key.P) != 0) {
         goto cleanup;
     }
+    key.len = (mbedtls_mpi_bitlen(&key.N) + 7) >> 3;
 
     // Check the key
-    if (mbedtls_rsa_check_privkey(key) != 0) {
+    if (mbedtls_rsa_check_privkey(&key) != 0) {
         ESP_LOGE("importKey", "Failed hard");
-        status = SW_UNKNOWN;
         goto cleanup;
     }
 
-    // Store the key to the flash memory
-    if (type == (uint8_t) 0xB6) {
-        isEmpty = &isSigEmpty;
-        if ((fpriv = fopen("/spiflash/sigKey.dat", "wb")) == NULL) {
-            status = SW_UNKNOWN;
-            goto cleanup;
-        }
-    } else if (type == (uint8_t) 0xB8) {
-        isEmpty = &isDecEmpty;
-        if ((fpriv = fopen("/spiflash/decKey.dat", "wb")) == NULL) {
-            status = SW_UNKNOWN;
-            goto cleanup;
-        }
-    } else if (type == (uint8_t) 0xA4) {
-        isEmpty = &isAuthEmpty;
-        if ((fpriv = fopen("/spiflash/authKey.dat", "wb")) == NULL) {
-            status = SW_UNKNOWN;
-            goto cleanup;
-        }
-    } else {
-        status = SW_UNKNOWN;
-        goto cleanup;
-    }
-
-    int ret;    // Write the key to a file in the flash memory
-    if ((ret = mbedtls_mpi_write_file("N = " , &key->N , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("E = " , &key->E , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("D = " , &key->D , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("P = " , &key->P , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("Q = " , &key->Q , 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("DP = ", &key->DP, 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("DQ = ", &key->DQ, 16, fpriv)) != 0 ||
-        (ret = mbedtls_mpi_write_file("QP = ", &key->QP, 16, fpriv)) != 0) {
-        ESP_LOGE("importKey", "\nError:\tmbedtls_mpi_write_file returned %d\n\n", ret);
-        fclose(fpriv);
-        status = SW_UNKNOWN;
+    // Store the key to the flash memory, then put it in the slot
+    if (installKey(&key, type) != SW_NO_ERROR) {
         goto cleanup;
     }
-    fclose(fpriv);
 
-    key->len = (mbedtls_mpi_bitlen(&key->N) + 7) >> 3;
     (*isEmpty) = 0;
     if (updateKeyStatus() != 0) {
-        return SW_UNKNOWN;
+        goto cleanup;
     }
 
     status = SW_NO_ERROR;
@@ -1959,6 +3133,44 @@ cleanup:
     mbedtls_mpi_free(&P1);
     mbedtls_mpi_free(&Q1);
     mbedtls_mpi_free(&H);
+    mbedtls_rsa_free(&key);     // Zeroes the private components
+    return status;
+}
+
+/**
+ * Provide functionality for importing keys, one command of the chain at
+ * a time. The key is stored once the last command has come.
+ *
+ * @param apdu
+ */
+uint16_t importKey(apdu_t* apdu) {
+    uint8_t last = (apdu->CLA & (uint8_t) 0x10) == 0;
+    uint8_t* curve;
+    uint16_t status;
+
+    if (pw3.validated == 0) {
+        importReset();
+        return SW_SECURITY_STATUS_NOT_SATISFIED;
+    }
+    if (!import.active) {
+        import.active = 1;
+        mbedtls_mpi_init(&import.E);
+        mbedtls_mpi_init(&import.P);
+        mbedtls_mpi_init(&import.Q);
+    }
+
+    status = importConsume(apdu->data, apdu->Lc);
+    if (status == SW_NO_ERROR && last) {
+        if (!importDone()) {
+            status = SW_WRONG_LENGTH;   // The data ended before the key
+        } else {
+            keySlot(import.type, NULL, &curve, NULL);
+            status = ((*curve) != ECC_NONE) ? importEcKey(import.type) : importRsaKey(import.type);
+        }
+    }
+    if (status != SW_NO_ERROR || last) {
+        importReset();
+    }
     return status;
 }
 
@@ -1969,17 +3181,15 @@ uint16_t setPinRetries(uint8_t pin_retries, uint8_t reset_retries, uint8_t admin
     if (pin_retries != 0) {
         pw1_length = (uint8_t) sizeof(PW1_DEFAULT)/sizeof(PW1_DEFAULT[0]);
         pw1.limit = pin_retries;
-        ERRORCHK(storeVar("pw1_limit", pw1.limit, 0, 8), return SW_UNKNOWN);
         if (updatePIN(&pw1, PW1_DEFAULT, 0, pw1_length) != 0) {
             return SW_UNKNOWN;
         }
         pw1_status = 0x00;
-        ERRORCHK(storeVar("pw1_status", pw1_status, 0, 8), return SW_UNKNOWN);
+        ERRORCHK(saveState(), return SW_UNKNOWN);
     }
     if (reset_retries != 0) {
         rc_length = 0;
         rc.limit = reset_retries;
-        ERRORCHK(storeVar("rc_limit", rc.limit, 0, 8), return SW_UNKNOWN);
         if (updatePIN(&rc, &zero, 0, rc_length) != 0) {
             return SW_UNKNOWN;
         }
@@ -1987,7 +3197,6 @@ uint16_t setPinRetries(uint8_t pin_retries, uint8_t reset_retries, uint8_t admin
     if (admin_retries != 0) {
         pw3_length = (uint8_t) sizeof(PW3_DEFAULT)/sizeof(PW3_DEFAULT[0]);
         pw3.limit = admin_retries;
-        ERRORCHK(storeVar("pw3_limit", pw3.limit, 0, 8), return SW_UNKNOWN);
         if (updatePIN(&pw3, PW3_DEFAULT, 0, pw3_length) != 0) {
             return SW_UNKNOWN;
         }
@@ -2002,12 +3211,19 @@ uint16_t setPinRetries(uint8_t pin_retries, uint8_t reset_retries, uint8_t admin
  * @param status Status to send
  * @param output The struct that will hold the output
  */
-uint16_t sendNext(apdu_t apdu, uint16_t status, outData* output) {
+uint16_t sendNext(apdu_t* apdu, uint16_t status, outData* output) {
     uint8_t* bufOffset;
 
-    // Determine maximum size of the messages
+    // Determine maximum size of the messages, an extended Le gets it all at once
     uint16_t max_length;
-    max_length = RESPONSE_MAX_LENGTH;
+    if (apdu->extended) {
+        max_length = RESPONSE_MAX_LENGTH;
+        if (apdu->Le != 0 && apdu->Le < max_length) {
+            max_length = apdu->Le;
+        }
+    } else {
+        max_length = SHORT_MAX_LENGTH;
+    }
 
     if (max_length > out_left) {
         max_length = out_left;
@@ -2025,8 +3241,8 @@ uint16_t sendNext(apdu_t apdu, uint16_t status, outData* output) {
         out_sent += max_length;
 
         // Determine new status word
-        if (out_left > max_length) {
-            statusNew = (uint16_t) (SW_BYTES_REMAINING_00 | max_length);
+        if (out_left > SHORT_MAX_LENGTH) {
+            statusNew = (uint16_t) (SW_BYTES_REMAINING_00 | SHORT_MAX_LENGTH);
         } else {
             statusNew = (uint16_t) (SW_BYTES_REMAINING_00 | out_left);
         }
@@ -2045,15 +3261,16 @@ uint16_t sendNext(apdu_t apdu, uint16_t status, outData* output) {
 }
 
 /**
- * Send len bytes from buffer. If len is greater than RESPONSE_MAX_LENGTH,
- * remaining data can be retrieved using GET RESPONSE.
+ * Send len bytes from buffer, starting at out_offset. If len is greater than what the command
+ * accepts (SHORT_MAX_LENGTH without an extended Le), remaining data can be
+ * retrieved using GET RESPONSE.
  *
  * @param apdu
  * @param len The byte length of the data to send
  * @param output The struct that will hold the output
  */
-void sendBuffer(apdu_t apdu, uint16_t len, outData* output) {
-    out_sent = 0;
+void sendBuffer(apdu_t* apdu, uint16_t len, outData* output) {
+    out_sent = out_offset;
     out_left = len;
     sendNext(apdu, SW_NO_ERROR, output);
 }
@@ -2065,7 +3282,7 @@ void sendBuffer(apdu_t apdu, uint16_t len, outData* output) {
  * @param status Status to send
  * @param output The struct that will hold the output
  */
-void sendError(apdu_t apdu, uint16_t status, outData* output) {
+void sendError(apdu_t* apdu, uint16_t status, outData* output) {
     out_sent = 0;
     out_left = 0;
     sendNext(apdu, status, output);
@@ -2075,124 +3292,75 @@ uint8_t initialize() {
     static const char* TAG = "initialize";
     bzero(buffer, sizeof(buffer));
     pw1_modes[PW1_MODE_NO81] = 0;
-    ERRORCHK(storeVar("PW1_MODE_NO81", pw1_modes[PW1_MODE_NO81], 0, 8), return 1);
     pw1_modes[PW1_MODE_NO82] = 0;
-    ERRORCHK(storeVar("PW1_MODE_NO82", pw1_modes[PW1_MODE_NO82], 0, 8), return 1);
 
     pw1_length = (uint8_t) sizeof(PW1_DEFAULT)/sizeof(PW1_DEFAULT[0]);
     pw1.limit = PIN_LIMIT;
-    ERRORCHK(storeVar("pw1_limit", pw1.limit, 0, 8), return 1);
     if (updatePIN(&pw1, PW1_DEFAULT, 0, pw1_length) != 0) {
         return 1;
     }
     pw1_status = 0x00;
-    ERRORCHK(storeVar("pw1_status", pw1_status, 0, 8), return 1);
 
     rc_length = 0;
     rc.limit = PIN_LIMIT;
-    ERRORCHK(storeVar("rc_limit", rc.limit, 0, 8), return 1);
     if (updatePIN(&rc, &zero, 0, rc_length) != 0) {
         return 1;
     }
 
     pw3_length = (uint8_t) sizeof(PW3_DEFAULT)/sizeof(PW3_DEFAULT[0]);
     pw3.limit = PIN_LIMIT;
-    ERRORCHK(storeVar("pw3_limit", pw3.limit, 0, 8), return 1);
     if (updatePIN(&pw3, PW3_DEFAULT, 0, pw3_length) != 0) {
         return 1;
     }
 
     mbedtls_rsa_init(&sigKey, MBEDTLS_RSA_PKCS_V15, 0);
+    mbedtls_ecp_keypair_init(&sigEcKey);
+    sigCurve = ECC_NONE;
     isSigEmpty = 1;
     sigAttributes[1] = (uint8_t) (KEY_SIZE >> 8);
     sigAttributes[2] = (uint8_t) (KEY_SIZE & 0x00FF);
     sigAttributes[3] = (uint8_t) (EXPONENT_SIZE >> 8);
     sigAttributes[4] = (uint8_t) (EXPONENT_SIZE & 0x00FF);
-    ERRORCHK(storeBuf("/spiflash/sigAttr.dat", sigAttributes, sizeof(sigAttributes)), return 1);
-    bzero(sigFP, sizeof(sigFP));
-    ERRORCHK(storeBuf("/spiflash/sigFP.dat", sigFP, sizeof(sigFP)), return 1);
-    bzero(sigTime, sizeof(sigTime));
-    ERRORCHK(storeBuf("/spiflash/sigTime.dat", sigTime, sizeof(sigTime)), return 1);
 
     mbedtls_rsa_init(&decKey, MBEDTLS_RSA_PKCS_V15, 0);
+    mbedtls_ecp_keypair_init(&decEcKey);
+    decCurve = ECC_NONE;
     isDecEmpty = 1;
     decAttributes[1] = (uint8_t) (KEY_SIZE >> 8);
     decAttributes[2] = (uint8_t) (KEY_SIZE & 0x00FF);
     decAttributes[3] = (uint8_t) (EXPONENT_SIZE >> 8);
     decAttributes[4] = (uint8_t) (EXPONENT_SIZE & 0x00FF);
-    ERRORCHK(storeBuf("/spiflash/decAttr.dat", decAttributes, sizeof(decAttributes)), return 1);
-    bzero(decFP, sizeof(decFP));
-    ERRORCHK(storeBuf("/spiflash/decFP.dat", decFP, sizeof(decFP)), return 1);
-    bzero(decTime, sizeof(decTime));
-    ERRORCHK(storeBuf("/spiflash/decTime.dat", decTime, sizeof(decTime)), return 1);
 
     mbedtls_rsa_init(&authKey, MBEDTLS_RSA_PKCS_V15, 0);
+    mbedtls_ecp_keypair_init(&authEcKey);
+    authCurve = ECC_NONE;
     isAuthEmpty = 1;
     authAttributes[1] = (uint8_t) (KEY_SIZE >> 8);
     authAttributes[2] = (uint8_t) (KEY_SIZE & 0x00FF);
     authAttributes[3] = (uint8_t) (EXPONENT_SIZE >> 8);
     authAttributes[4] = (uint8_t) (EXPONENT_SIZE & 0x00FF);
-    ERRORCHK(storeBuf("/spiflash/autAttr.dat", authAttributes, sizeof(authAttributes)), return 1);
-    bzero(authFP, sizeof(authFP));
-    ERRORCHK(storeBuf("/spiflash/authFP.dat", authFP, sizeof(authFP)), return 1);
-    bzero(authTime, sizeof(authTime));
-    ERRORCHK(storeBuf("/spiflash/authTime.dat", authTime, sizeof(authTime)), return 1);
+
+#ifdef KEY_DS
+    // The provisioned keys stay over a factory reset
+    isSigEmpty = (loadDsKey(&sigKey, 0xB6) != SW_NO_ERROR);
+    isDecEmpty = (loadDsKey(&decKey, 0xB8) != SW_NO_ERROR);
+    isAuthEmpty = (loadDsKey(&authKey, 0xA4) != SW_NO_ERROR);
+#endif
 
     if (updateKeyStatus() != 0) {
         return 1;
     }
 
-    loginData_length = 0;
-    ERRORCHK(storeVar("loginData_len", 0, loginData_length, 16), return 1);
-    bzero(loginData, LOGINDATA_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/logData.dat", loginData, loginData_length), return 1);
-
-    url_length = 0;
-    ERRORCHK(storeVar("url_length", 0, url_length, 16), return 1);
-    bzero(url, URL_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/url.dat", url, url_length), return 1);
-
-    name_length = 0;
-    ERRORCHK(storeVar("name_length", 0, name_length, 16), return 1);
-    bzero(name, NAME_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/name.dat", name, name_length), return 1);
-
-    lang_length = 0;
-    ERRORCHK(storeVar("lang_length", 0, lang_length, 16), return 1);
-    bzero(lang, LANG_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/lang.dat", lang, lang_length), return 1);
-
-    cert_length = 0;
-    ERRORCHK(storeVar("cert_length", 0, cert_length, 16), return 1);
-    bzero(cert, CERT_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/cert.dat", cert, cert_length), return 1);
-
+    dataReset();    // Fingerprints, times, cardholder related data, counter
     sex = 0x39;
-    ERRORCHK(storeVar("sex", sex, 0, 8), return 1);
 
-    private_use_do_1_length = 0;
-    ERRORCHK(storeVar("privdo1_len", 0, private_use_do_1_length, 16), return 1);
-    bzero(private_use_do_1, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo1.dat", private_use_do_1, private_use_do_1_length), return 1);
-
-    private_use_do_2_length = 0;
-    ERRORCHK(storeVar("privdo2_len", 0, private_use_do_2_length, 16), return 1);
-    bzero(private_use_do_2, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo2.dat", private_use_do_2, private_use_do_2_length), return 1);
-
-    private_use_do_3_length = 0;
-    ERRORCHK(storeVar("privdo3_len", 0, private_use_do_3_length, 16), return 1);
-    bzero(private_use_do_3, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo3.dat", private_use_do_3, private_use_do_3_length), return 1);
-
-    private_use_do_4_length = 0;
-    ERRORCHK(storeVar("privdo4_len", 0, private_use_do_4_length, 16), return 1);
-    bzero(private_use_do_4, PRIVATE_DO_MAX_LENGTH);
-    ERRORCHK(storeBuf("/spiflash/privdo4.dat", private_use_do_4, private_use_do_4_length), return 1);
+    if (doEraseAll() != ESP_OK) {
+        return 1;
+    }
 
     terminated = 0;
-    ERRORCHK(storeVar("terminated", terminated, 0, 8), return 1);
 
+    ERRORCHK(saveState(), return 1);
     ERRORCHK(storeVar("initialized", 1, 0, 8), return 1);
     ESP_LOGI(TAG, "SUCCESS");
 
@@ -2205,43 +3373,95 @@ void invalidate() {     // Invalidate the PINs
     pw3.validated = 0;
 }
 
-void process(apdu_t apdu, outData* output) {
+void process(apdu_t* apdu, outData* output) {
     static const char* TAG = "process";
     uint16_t status = SW_NO_ERROR;
     uint16_t len = 0;
 
-    if (apdu.INS == 0xA4) {
+    out_offset = 0;     // Unless the command leaves its response elsewhere
+
+    if (apdu->INS == 0xA4) {
         // Reset PW1 modes
         pw1_modes[PW1_MODE_NO81] = 0;
-        ERRORCHK(storeVar("PW1_MODE_NO81", pw1_modes[PW1_MODE_NO81], 0, 8), return);
         pw1_modes[PW1_MODE_NO82] = 0;
-        ERRORCHK(storeVar("PW1_MODE_NO82", pw1_modes[PW1_MODE_NO82], 0, 8), return);
+        ERRORCHK(saveState(), { sendError(apdu, SW_UNKNOWN, output); return; });
         sendBuffer(apdu, 0, output);
         return;
     }
 
-    if (apdu.INS == 0x55) {     // Custom command INS to invalidate/PIN reset
+    if (apdu->INS == 0x55) {     // Custom command INS to invalidate/PIN reset
         invalidate();
+        sendBuffer(apdu, 0, output);
         return;
     }
 
-    // Support for command chaining
-    if ((status = commandChaining(apdu)) != 0){
-        goto exit;
+    if (apdu->INS == 0x56) {     // Custom command INS to read/reset the statistics (libStats.h)
+        if (apdu->P1 == 0x01) {
+            statsReset();
+            sendBuffer(apdu, 0, output);
+        } else if ((len = statsOutput(apdu->P2, buffer)) == 0) {
+            sendError(apdu, SW_REFERENCED_DATA_NOT_FOUND, output);
+        } else {
+            sendBuffer(apdu, len, output);
+        }
+        return;
+    }
+
+    if (apdu->INS == 0x57) {     // Custom command INS to set the trace level (libTrace.h)
+        if (apdu->P1 > TRACE_FULL) {
+            sendError(apdu, SW_INCORRECT_P1P2, output);
+        } else {
+            traceLevel = apdu->P1;
+            sendBuffer(apdu, 0, output);
+        }
+        return;
+    }
+
+    if (apdu->INS == 0x59) {     // Custom command INS to read the diagnostics (libDiag.h)
+        if (apdu->P1 == 0x00) {
+            sendBuffer(apdu, diagHeap(buffer), output);
+        } else if (apdu->P1 == 0x01) {
+            if ((len = diagTaskOutput(apdu->P2, buffer)) == 0) {
+                sendError(apdu, SW_REFERENCED_DATA_NOT_FOUND, output);
+            } else {
+                sendBuffer(apdu, len, output);
+            }
+        } else if (apdu->P1 == 0x02) {
+            diagReset();
+            sendBuffer(apdu, 0, output);
+        } else {
+            sendError(apdu, SW_INCORRECT_P1P2, output);
+        }
+        return;
+    }
+
+    // Support for command chaining. A key import takes each command as it
+    // comes (importKey), the others are collected in buffer
+    if (apdu->INS == (uint8_t) 0xDB && apdu->P1P2 == (uint16_t) 0x3FFF) {
+        if (chain == 1) {   // Chained command expected
+            resetChaining();
+            status = SW_UNKNOWN;
+            goto exit;
+        }
+    } else {
+        importReset();
+        if ((status = commandChaining(apdu)) != 0){
+            goto exit;
+        }
     }
 
     // Reset buffer for GET RESPONSE
-    if (apdu.INS != (uint8_t) 0xC0) {
+    if (apdu->INS != (uint8_t) 0xC0) {
         out_sent = 0;
         out_left = 0;
     }
 
-    if (terminated == 1 && apdu.INS != 0x44) {
+    if (terminated == 1 && apdu->INS != 0x44) {
         status = SW_CONDITIONS_NOT_SATISFIED;
         goto exit;
     }
 
-    switch(apdu.INS) {
+    switch(apdu->INS) {
         // GET RESPONSE
         case (uint8_t) 0xC0:
             // Will be handled at the exit
@@ -2250,33 +3470,33 @@ void process(apdu_t apdu, outData* output) {
 
         // VERIFY
         case (uint8_t) 0x20:
-            status = verify(apdu.P2);
+            status = verify(apdu->P2);
             break;
 
         // CHANGE REFERENCE DATA
         case (uint8_t) 0x24:
-            status = changeReferenceData(apdu.P2);
+            status = changeReferenceData(apdu->P2);
             break;
 
         // RESET RETRY COUNTER
         case (uint8_t) 0x2C:
             // Reset only available for PW1
-            if (apdu.P2 != (uint8_t) 0x81) {
+            if (apdu->P2 != (uint8_t) 0x81) {
                 status = SW_INCORRECT_P1P2;
                 goto exit;
             }
 
-            status = resetRetryCounter(apdu.P1);
+            status = resetRetryCounter(apdu->P1);
             break;
 
         // PERFORM SECURITY OPERATION
         case (uint8_t) 0x2A:
             // COMPUTE DIGITAL SIGNATURE
-            if (apdu.P1P2 == (uint16_t) 0x9E9A) {
+            if (apdu->P1P2 == (uint16_t) 0x9E9A) {
                 status = computeDigitalSignature(&len);
             }
             // DECIPHER
-            else if (apdu.P1P2 == (uint16_t) 0x8086) {
+            else if (apdu->P1P2 == (uint16_t) 0x8086) {
                 status = decipher(&len);
             } else {
                 status = SW_WRONG_P1P2;
@@ -2284,6 +3504,15 @@ void process(apdu_t apdu, outData* output) {
             }
             break;
 
+        // BATCH SIGN (custom)
+        case (uint8_t) 0x58:
+            if (apdu->P1P2 != (uint16_t) 0x0000) {
+                status = SW_INCORRECT_P1P2;
+                goto exit;
+            }
+            status = batchSign(&len);
+            break;
+
         // INTERNAL AUTHENTICATE
         case (uint8_t) 0x88:
             status = internalAuthenticate(&len);
@@ -2291,30 +3520,30 @@ void process(apdu_t apdu, outData* output) {
 
         // GENERATE ASYMMETRIC KEY PAIR
         case (uint8_t) 0x47:
-            status = genAsymKey(apdu.P1, &len);
+            status = genAsymKey(apdu->P1, &len);
             break;
 
         // GET CHALLENGE
         case (uint8_t) 0x84:
-            status = getChallenge(apdu.Le, &len);
+            status = getChallenge(apdu->Le, &len);
             break;
 
         // GET DATA
         case (uint8_t) 0xCA:
-            status = getData(apdu.P1P2, &len);
+            status = getData(apdu->P1P2, &len);
             break;
 
         // PUT DATA
         case (uint8_t) 0xDA:
-            status = putData(apdu.P1P2);
+            status = putData(apdu->P1P2);
             break;
 
         // DB - PUT DATA (Odd)
         case (uint8_t) 0xDB:
             // Odd PUT DATA only supported for importing keys
             // 4D - Extended Header list
-            if (apdu.P1P2 == (uint16_t) 0x3FFF) {
-                status = importKey();
+            if (apdu->P1P2 == (uint16_t) 0x3FFF) {
+                status = importKey(apdu);
             } else {
                 status = SW_RECORD_NOT_FOUND;
             }
@@ -2324,7 +3553,7 @@ void process(apdu_t apdu, outData* output) {
         case (uint8_t) 0xE6:
             if ((pw1.remaining == 0) && (pw3.remaining == 0)) {
                 terminated = 1;
-                status = storeVar("terminated", terminated, 0, 8);
+                status = saveState();
             } else {
                 status = SW_CONDITIONS_NOT_SATISFIED;
             }
@@ -2335,7 +3564,7 @@ void process(apdu_t apdu, outData* output) {
             if (terminated == 1) {
                 initialize();
                 terminated = 0;
-                status = storeVar("terminated", terminated, 0, 8);
+                status = saveState();
             } else {
                 status = SW_CONDITIONS_NOT_SATISFIED;
             }
@@ -2350,10 +3579,10 @@ void process(apdu_t apdu, outData* output) {
 
         // SET RETRIES (vendor specific)
         case (uint8_t) 0xF2:
-            if (apdu.Lc != 3) {
+            if (apdu->Lc != 3) {
                 status = SW_WRONG_DATA;
             } else {
-                status = setPinRetries(apdu.data[0], apdu.data[1], apdu.data[2]);
+                status = setPinRetries(apdu->data[0], apdu->data[1], apdu->data[2]);
             }
             break;
 
@@ -2366,7 +3595,7 @@ exit:
         sendError(apdu, status, output);
     } else {
         // GET RESPONSE
-        if (apdu.INS == (uint8_t) 0xC0) {
+        if (apdu->INS == (uint8_t) 0xC0) {
             sendNext(apdu, SW_NO_ERROR, output);
         } else {
             sendBuffer(apdu, len, output);
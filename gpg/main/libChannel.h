@@ -0,0 +1,465 @@
+/*
+ * The encrypted channel between the ESP32 and the host relay.
+ *
+ * Both ends share a long-term key (PSK), set once by pairing. A
+ * session starts with a hello from the ESP32 and a reply from the
+ * relay, in the clear, on the frames of the session protocol:
+ *
+ *    CHANNEL_MAGIC | Mode | Session id (8) | Nonce (16) [| Point (65)]
+ *        [| Wrapped PSK (32)]
+ *
+ * The mode of the hello is CHANNEL_NEW, CHANNEL_RESUME with the id
+ * of the last session, or CHANNEL_PAIR if the ESP32 has no PSK. The
+ * reply has the mode the relay went with and the id of the session.
+ *
+ * For CHANNEL_PAIR both ends add an ephemeral P-256 public key
+ * (uncompressed), and the reply the PSK of the relay XOR
+ * HMAC-SHA256(ECDH secret, "WSC1 pair" | Nonce ESP32 | Nonce relay),
+ * so the PSK never goes in the clear. The relay only pairs while it is
+ * told to, and the ESP32 only takes the PSK once the proceed button is
+ * pressed: pairing needs a hand on the ESP32, which also keeps an
+ * active attacker of the network to a window of a few seconds.
+ *
+ * The secret of a session is HMAC-SHA256(PSK, "WSC1 master" | Id |
+ * Nonce ESP32 | Nonce relay), both ends keep it for CHANNEL_RESUME_TIME
+ * seconds so that a reconnect resumes it. The keys of a connection are
+ * HMAC-SHA256(Secret, "WSC1 keys" | Nonce ESP32 | Nonce relay), the
+ * first half each way: ESP32 to relay, then relay to ESP32. A frame
+ * is then the AES-128-GCM ciphertext of its data and the tag, with
+ * the count of the frames sent before it that way as nonce, so that
+ * the handshake is two HMACs and a frame a few us of the hardware AES
+ * (CONFIG_MBEDTLS_HARDWARE_AES). The keep-alives stay empty frames.
+ *
+ * Nothing is sent before the relay has shown it knows the PSK: a wrong
+ * one fails the first command, whose tag doesn't match.
+ *
+ * Handles:
+ *    The PSK, in NVS
+ *    The tag of the beacons of the relay
+ *    The handshake, and the resumption of the last session
+ *    Sealing and opening the frames
+ */
+#ifndef __LIBCHANNEL_H__
+#define __LIBCHANNEL_H__
+
+#include "mbedtls/ecdh.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/md.h"
+#include "nvs.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "libRNG.h"
+
+#define CHANNEL_MAGIC "WSC1"
+#define CHANNEL_MAGIC_LENGTH 4
+#define CHANNEL_KEY_LENGTH 32           // The PSK and the secret of a session
+#define CHANNEL_ID_LENGTH 8
+#define CHANNEL_NONCE_LENGTH 16
+#define CHANNEL_TAG_LENGTH 16
+#define CHANNEL_POINT_LENGTH 65         // A P-256 public key, uncompressed
+#define CHANNEL_HELLO_LENGTH (CHANNEL_MAGIC_LENGTH + 1 + CHANNEL_ID_LENGTH + CHANNEL_NONCE_LENGTH)
+#define CHANNEL_PAIR_LENGTH (CHANNEL_HELLO_LENGTH + CHANNEL_POINT_LENGTH)
+#define CHANNEL_REPLY_MAX (CHANNEL_PAIR_LENGTH + CHANNEL_KEY_LENGTH)
+#define CHANNEL_RESUME_TIME 3600        // Seconds a session can be resumed
+#define CHANNEL_PSK_KEY "channel_psk"   // In the "storage" namespace of NVS
+#define CHANNEL_BEACON_NONCE_LENGTH 8
+#define CHANNEL_BEACON_TAG_LENGTH 16
+#define CHANNEL_BEACON_LENGTH (2 + CHANNEL_BEACON_NONCE_LENGTH + CHANNEL_BEACON_TAG_LENGTH)
+
+#define CHANNEL_NEW 0
+#define CHANNEL_RESUME 1
+#define CHANNEL_PAIR 2
+
+static uint8_t channelPsk[CHANNEL_KEY_LENGTH];
+static uint8_t channelPaired = 0;           // Set once channelPsk holds the PSK
+static uint8_t channelId[CHANNEL_ID_LENGTH];        // Of the session that can be resumed
+static uint8_t channelSecret[CHANNEL_KEY_LENGTH];
+static int64_t channelUntil = 0;            // When it can no longer be resumed, 0 if there is none
+static uint8_t channelNonce[CHANNEL_NONCE_LENGTH];  // Of the last hello
+static uint8_t channelReply[CHANNEL_REPLY_MAX];     // The reply to it, until the pairing is confirmed
+static mbedtls_ecp_keypair channelPairKey;  // The ephemeral key of a pairing
+static mbedtls_gcm_context channelSend, channelRecv;
+static uint64_t channelSent, channelReceived;       // Frames each way on this connection
+static uint8_t channelActive = 0;           // Set while the frames are encrypted
+
+/**
+ * Read the PSK from NVS, if the ESP32 has been paired.
+ *
+ * @return 0, or 1 if NVS can't be read
+ */
+uint8_t channelInit() {
+    nvs_handle handle;
+    size_t len = sizeof(channelPsk);
+    esp_err_t err;
+
+    mbedtls_gcm_init(&channelSend);
+    mbedtls_gcm_init(&channelRecv);
+    mbedtls_ecp_keypair_init(&channelPairKey);
+    if (nvs_open("storage", NVS_READWRITE, &handle) != ESP_OK) {
+        return 1;
+    }
+    err = nvs_get_blob(handle, CHANNEL_PSK_KEY, channelPsk, &len);
+    nvs_close(handle);
+    channelPaired = (err == ESP_OK && len == sizeof(channelPsk));
+    ESP_LOGI("channelInit", "%s", channelPaired ? "Paired" : "Not paired yet");
+    return (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) ? 0 : 1;
+}
+
+// HMAC-SHA256 of label | a | b | c with key, to out
+static int channelHmac(const uint8_t* key, const char* label, const uint8_t* a, size_t aLen,
+        const uint8_t* b, const uint8_t* c, uint8_t* out) {
+    uint8_t in[16 + CHANNEL_ID_LENGTH + 2*CHANNEL_NONCE_LENGTH];
+    size_t len = strlen(label);
+
+    memcpy(in, label, len);
+    memcpy(in + len, a, aLen);
+    len += aLen;
+    memcpy(in + len, b, CHANNEL_NONCE_LENGTH);
+    len += CHANNEL_NONCE_LENGTH;
+    if (c != NULL) {
+        memcpy(in + len, c, CHANNEL_NONCE_LENGTH);
+        len += CHANNEL_NONCE_LENGTH;
+    }
+    return mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+            key, CHANNEL_KEY_LENGTH, in, len, out);
+}
+
+// The session can no longer be used nor resumed
+static void channelDrop() {
+    bzero(channelSecret, sizeof(channelSecret));
+    channelUntil = 0;
+    channelActive = 0;
+}
+
+/**
+ * Write the hello of a new connection to out. The last session is
+ * resumed if it is recent enough.
+ *
+ * @return Length of the hello, CHANNEL_HELLO_LENGTH if the key of a
+ *         pairing can't be made, which the relay refuses
+ */
+uint16_t channelHello(uint8_t* out) {
+    uint8_t mode = CHANNEL_NEW;
+    size_t len;
+
+    channelActive = 0;
+    if (!channelPaired) {
+        mode = CHANNEL_PAIR;
+    } else if (channelUntil != 0 && esp_timer_get_time() < channelUntil) {
+        mode = CHANNEL_RESUME;
+    }
+    if (mode != CHANNEL_RESUME) {
+        channelDrop();
+        bzero(channelId, sizeof(channelId));
+    }
+    rngRandom(NULL, channelNonce, sizeof(channelNonce));
+
+    memcpy(out, CHANNEL_MAGIC, CHANNEL_MAGIC_LENGTH);
+    out[CHANNEL_MAGIC_LENGTH] = mode;
+    memcpy(out + CHANNEL_MAGIC_LENGTH + 1, channelId, CHANNEL_ID_LENGTH);
+    memcpy(out + CHANNEL_MAGIC_LENGTH + 1 + CHANNEL_ID_LENGTH, channelNonce, CHANNEL_NONCE_LENGTH);
+
+    if (mode == CHANNEL_PAIR) {
+        mbedtls_ecp_keypair_free(&channelPairKey);
+        mbedtls_ecp_keypair_init(&channelPairKey);
+        if (mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, &channelPairKey, rngRandom, NULL) != 0
+                || mbedtls_ecp_point_write_binary(&channelPairKey.grp, &channelPairKey.Q,
+                    MBEDTLS_ECP_PF_UNCOMPRESSED, &len, out + CHANNEL_HELLO_LENGTH,
+                    CHANNEL_POINT_LENGTH) != 0) {
+            return CHANNEL_HELLO_LENGTH;
+        }
+        return CHANNEL_PAIR_LENGTH;
+    }
+    return CHANNEL_HELLO_LENGTH;
+}
+
+/**
+ * Unwrap the PSK of a pairing reply to psk, with the ECDH secret of the
+ * key of the hello and the point of the relay.
+ *
+ * @return 0, or the error of mbedtls
+ */
+static int channelUnwrap(const uint8_t* nonce, const uint8_t* point, const uint8_t* wrapped,
+        uint8_t* psk) {
+    uint8_t shared[CHANNEL_KEY_LENGTH];
+    uint8_t pad[CHANNEL_KEY_LENGTH];
+    mbedtls_ecp_point Q;
+    mbedtls_mpi z;
+    int ret;
+
+    mbedtls_ecp_point_init(&Q);
+    mbedtls_mpi_init(&z);
+    if ((ret = mbedtls_ecp_point_read_binary(&channelPairKey.grp, &Q, point, CHANNEL_POINT_LENGTH)) == 0 &&
+        (ret = mbedtls_ecp_check_pubkey(&channelPairKey.grp, &Q)) == 0 &&
+        (ret = mbedtls_ecdh_compute_shared(&channelPairKey.grp, &z, &Q, &channelPairKey.d,
+            rngRandom, NULL)) == 0 &&
+        (ret = mbedtls_mpi_write_binary(&z, shared, sizeof(shared))) == 0 &&
+        (ret = channelHmac(shared, "WSC1 pair", channelNonce, CHANNEL_NONCE_LENGTH,
+            nonce, NULL, pad)) == 0) {
+        for (int i = 0; i < CHANNEL_KEY_LENGTH; i++) {
+            psk[i] = wrapped[i] ^ pad[i];
+        }
+    }
+    bzero(shared, sizeof(shared));
+    bzero(pad, sizeof(pad));
+    mbedtls_mpi_free(&z);
+    mbedtls_ecp_point_free(&Q);
+    mbedtls_ecp_keypair_free(&channelPairKey);  // Good for one reply only
+    mbedtls_ecp_keypair_init(&channelPairKey);
+    return ret;
+}
+
+// Derive the keys of the connection from the secret and the nonces, and start using them
+static int channelStart(const uint8_t* nonce) {
+    uint8_t keys[CHANNEL_KEY_LENGTH];
+    int ret;
+
+    if ((ret = channelHmac(channelSecret, "WSC1 keys", channelNonce, CHANNEL_NONCE_LENGTH,
+            nonce, NULL, keys)) == 0 &&
+        (ret = mbedtls_gcm_setkey(&channelSend, MBEDTLS_CIPHER_ID_AES, keys, 128)) == 0) {
+        ret = mbedtls_gcm_setkey(&channelRecv, MBEDTLS_CIPHER_ID_AES, keys + 16, 128);
+    }
+    bzero(keys, sizeof(keys));
+    if (ret != 0) {
+        channelDrop();
+        return -1;
+    }
+    channelUntil = esp_timer_get_time() + (int64_t) CHANNEL_RESUME_TIME*1000000;
+    channelSent = 0;
+    channelReceived = 0;
+    channelActive = 1;
+    return 0;
+}
+
+// A new session, with the secret from the PSK
+static int channelNew(const uint8_t* nonce) {
+    if (channelHmac(channelPsk, "WSC1 master", channelId, CHANNEL_ID_LENGTH,
+            channelNonce, nonce, channelSecret) != 0) {
+        channelDrop();
+        return -1;
+    }
+    return channelStart(nonce);
+}
+
+/**
+ * Take the reply of the relay to the hello.
+ *
+ * @return 0 once the frames are encrypted, CHANNEL_PAIR if the relay
+ *         sent a PSK, which channelPair takes, or -1 if the reply can't
+ *         be used
+ */
+int channelAccept(const uint8_t* reply, int len) {
+    const uint8_t* id = reply + CHANNEL_MAGIC_LENGTH + 1;
+    const uint8_t* nonce = id + CHANNEL_ID_LENGTH;
+
+    if (len < CHANNEL_HELLO_LENGTH || memcmp(reply, CHANNEL_MAGIC, CHANNEL_MAGIC_LENGTH) != 0) {
+        return -1;
+    }
+    switch (reply[CHANNEL_MAGIC_LENGTH]) {
+    case CHANNEL_RESUME:
+        if (len != CHANNEL_HELLO_LENGTH || channelUntil == 0
+                || memcmp(id, channelId, CHANNEL_ID_LENGTH) != 0) {
+            return -1;
+        }
+        return channelStart(nonce);
+    case CHANNEL_NEW:
+        if (len != CHANNEL_HELLO_LENGTH || !channelPaired) {
+            return -1;
+        }
+        memcpy(channelId, id, CHANNEL_ID_LENGTH);
+        return channelNew(nonce);
+    case CHANNEL_PAIR:
+        if (len != CHANNEL_REPLY_MAX || channelPaired || channelPairKey.grp.id == MBEDTLS_ECP_DP_NONE) {
+            return -1;      // A paired ESP32 is paired again after a factory reset only
+        }
+        memcpy(channelReply, reply, len);
+        return CHANNEL_PAIR;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Keep the PSK of the reply that asked for the pairing, once the user
+ * has confirmed it, and start the session with it.
+ *
+ * @return 0, or -1 if it can't be unwrapped or stored
+ */
+int channelPair() {
+    const uint8_t* id = channelReply + CHANNEL_MAGIC_LENGTH + 1;
+    const uint8_t* nonce = id + CHANNEL_ID_LENGTH;
+    const uint8_t* point = nonce + CHANNEL_NONCE_LENGTH;
+    uint8_t psk[CHANNEL_KEY_LENGTH];
+    nvs_handle handle;
+    esp_err_t err;
+    int ret;
+
+    if ((ret = channelUnwrap(nonce, point, point + CHANNEL_POINT_LENGTH, psk)) != 0) {
+        ESP_LOGE("channelPair", "The PSK could not be unwrapped (-0x%x)", -ret);
+        bzero(channelReply, sizeof(channelReply));
+        return -1;
+    }
+    if ((err = nvs_open("storage", NVS_READWRITE, &handle)) == ESP_OK) {
+        if ((err = nvs_set_blob(handle, CHANNEL_PSK_KEY, psk, CHANNEL_KEY_LENGTH)) == ESP_OK) {
+            err = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE("channelPair", "The PSK could not be stored (0x%x)", err);
+        bzero(psk, sizeof(psk));
+        bzero(channelReply, sizeof(channelReply));
+        return -1;
+    }
+    memcpy(channelPsk, psk, CHANNEL_KEY_LENGTH);
+    bzero(psk, sizeof(psk));
+    memcpy(channelId, id, CHANNEL_ID_LENGTH);
+    channelPaired = 1;
+    ret = channelNew(nonce);
+    bzero(channelReply, sizeof(channelReply));
+    return ret;
+}
+
+/**
+ * Check a beacon of the relay, Port (2) | Nonce (8) | Tag (16) after its
+ * magic, sent from addr (network byte order). The tag is the start of
+ * HMAC-SHA256(PSK, "WSC1 beacon" | Address | Port | Nonce): a paired
+ * ESP32 only follows a relay that knows the PSK, to the address it
+ * broadcasts from. One that isn't paired yet has no PSK to check it
+ * with and follows any beacon, as its pairing needs the button anyway.
+ *
+ * @return 1 if the beacon can be followed, 0 if not
+ */
+uint8_t channelBeacon(uint32_t addr, const uint8_t* beacon, int len) {
+    uint8_t in[11 + 4 + 2 + CHANNEL_BEACON_NONCE_LENGTH];
+    uint8_t tag[32];
+    uint8_t diff = 0;
+
+    if (!channelPaired) {
+        return len >= 2;
+    }
+    if (len != CHANNEL_BEACON_LENGTH) {
+        return 0;
+    }
+    memcpy(in, "WSC1 beacon", 11);
+    memcpy(in + 11, &addr, 4);
+    memcpy(in + 15, beacon, 2 + CHANNEL_BEACON_NONCE_LENGTH);
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+            channelPsk, CHANNEL_KEY_LENGTH, in, sizeof(in), tag) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < CHANNEL_BEACON_TAG_LENGTH; i++) {   // In constant time
+        diff |= tag[i] ^ beacon[2 + CHANNEL_BEACON_NONCE_LENGTH + i];
+    }
+    return diff == 0;
+}
+
+// Forget the PSK, with the rest of the card (factory reset)
+void channelForget(nvs_handle handle) {
+    nvs_erase_key(handle, CHANNEL_PSK_KEY);
+    bzero(channelPsk, sizeof(channelPsk));
+    channelPaired = 0;
+    channelDrop();
+}
+
+// The GCM nonce of a frame: 4 zero bytes, then its count on 8 bytes big-endian
+static void channelIV(uint8_t* iv, uint64_t count) {
+    bzero(iv, 4);
+    for (int8_t i = 11; i >= 4; i--, count >>= 8) {
+        iv[i] = (uint8_t) count;
+    }
+}
+
+/**
+ * Encrypt the len bytes of data in place. data must have room for the
+ * tag after them.
+ *
+ * @return The length of the frame, or -1 on failure
+ */
+int channelSeal(uint8_t* data, uint16_t len) {
+    uint8_t iv[12];
+
+    if (len > 0xFFFF - CHANNEL_TAG_LENGTH) {
+        return -1;
+    }
+    channelIV(iv, channelSent++);
+    if (mbedtls_gcm_crypt_and_tag(&channelSend, MBEDTLS_GCM_ENCRYPT, len, iv, sizeof(iv),
+            NULL, 0, data, data, CHANNEL_TAG_LENGTH, data + len) != 0) {
+        return -1;
+    }
+    return len + CHANNEL_TAG_LENGTH;
+}
+
+/**
+ * Decrypt and check a frame in place. A frame that doesn't check ends
+ * the session, which can't be resumed then either.
+ *
+ * @return The length of the data, or -1 if it doesn't check
+ */
+int channelOpen(uint8_t* frame, uint16_t len) {
+    uint8_t iv[12];
+
+    if (len < CHANNEL_TAG_LENGTH) {
+        channelDrop();
+        return -1;
+    }
+    len -= CHANNEL_TAG_LENGTH;
+    channelIV(iv, channelReceived++);
+    if (mbedtls_gcm_auth_decrypt(&channelRecv, len, iv, sizeof(iv), NULL, 0,
+            frame + len, CHANNEL_TAG_LENGTH, frame, frame) != 0) {
+        ESP_LOGE("channelOpen", "Frame rejected, ending the session");
+        channelDrop();
+        return -1;
+    }
+    return len;
+}
+
+/**
+ * Decrypt a frame too long to be held at once, a piece at a time:
+ * channelOpenStart, channelOpenUpdate for each piece of the data (all
+ * of them but the last a multiple of 16 bytes long), then
+ * channelOpenFinish with the tag. The data is only known to be genuine
+ * once channelOpenFinish returns 0.
+ *
+ * @return 0, or -1 on failure, which ends the session
+ */
+int channelOpenStart() {
+    uint8_t iv[12];
+
+    channelIV(iv, channelReceived++);
+    if (mbedtls_gcm_starts(&channelRecv, MBEDTLS_GCM_DECRYPT, iv, sizeof(iv), NULL, 0) != 0) {
+        channelDrop();
+        return -1;
+    }
+    return 0;
+}
+
+int channelOpenUpdate(uint8_t* data, uint16_t len) {
+    if (mbedtls_gcm_update(&channelRecv, len, data, data) != 0) {
+        channelDrop();
+        return -1;
+    }
+    return 0;
+}
+
+int channelOpenFinish(const uint8_t* tag) {
+    uint8_t check[CHANNEL_TAG_LENGTH];
+    uint8_t diff = 0;
+
+    if (mbedtls_gcm_finish(&channelRecv, check, sizeof(check)) != 0) {
+        channelDrop();
+        return -1;
+    }
+    for (int i = 0; i < CHANNEL_TAG_LENGTH; i++) {     // In constant time
+        diff |= check[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        ESP_LOGE("channelOpenFinish", "Frame rejected, ending the session");
+        channelDrop();
+        return -1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ * The large data objects of the card, kept in flash instead of
+ * in memory.
+ *
+ * The certificate, the private use DOs, the login data and the
+ * URL are rarely read, and only change with PUT DATA. None of
+ * them are kept in memory: they live in the raw data partition
+ * DO_PARTITION (see partitions.csv), which is mapped into the
+ * address space once, the first time one of them is needed.
+ * GET DATA copies an object straight from the mapping into the
+ * response buffer, so the only RAM they take is the cache of
+ * the flash, while they are being read.
+ *
+ * Each object has two sectors. A sector holds a header and the
+ * data, the CRC of the header covers the data. A write goes to
+ * the sector that doesn't hold the current copy, with the next
+ * sequence number, and writes the header last, so a power loss
+ * during a write leaves the old copy as the current one. On
+ * mount, the valid copy with the highest sequence number wins.
+ *
+ * Handles:
+ *    Mapping the partition and finding the current copies
+ *    Reading and writing the objects
+ */
+#ifndef __LIBDO_H__
+#define __LIBDO_H__
+
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+#include "esp_log.h"
+#include "rom/crc.h"
+
+#include "libStats.h"
+
+#define DO_PARTITION "dos"
+#define DO_SECTOR 4096              // Flash erase size
+#define DO_MAGIC 0x4F444750         // "PGDO"
+
+#define DO_CERT 0                   // 7F21 - Cardholder certificate
+#define DO_PRIVATE_1 1              // 0101 - 0104 - Private use DOs
+#define DO_PRIVATE_2 2
+#define DO_PRIVATE_3 3
+#define DO_PRIVATE_4 4
+#define DO_LOGIN 5                  // 5E - Login data
+#define DO_URL 6                    // 5F50 - URL
+#define DO_COUNT 7
+
+#define DO_NONE 0xFF                // No valid copy of the object
+
+typedef struct doHeader_t {
+    uint32_t magic;     // DO_MAGIC
+    uint32_t sequence;  // Higher is newer
+    uint16_t length;    // Length of the data that follows
+    uint16_t id;        // DO_* of the object
+    uint32_t crc;       // CRC32 of the data
+} doHeader_t;
+
+#define DO_MAX_LENGTH (DO_SECTOR - sizeof(doHeader_t))
+
+static const esp_partition_t* doPartition = NULL;
+static const uint8_t* doMap = NULL;         // The partition, mapped
+static spi_flash_mmap_handle_t doMapHandle;
+static uint8_t doCurrent[DO_COUNT];         // Sector (0 or 1) of the current copy, or DO_NONE
+static uint32_t doSequence[DO_COUNT];       // Sequence number of the current copy
+
+// Offset of a sector of an object in the partition
+static inline uint32_t doOffset(uint8_t id, uint8_t sector) {
+    return (2 * id + sector) * DO_SECTOR;
+}
+
+// The header of a sector, or NULL if it doesn't hold a valid copy of the object
+const doHeader_t* doCopy(uint8_t id, uint8_t sector) {
+    const doHeader_t* header = (const doHeader_t*) (doMap + doOffset(id, sector));
+
+    if (header->magic != DO_MAGIC || header->id != id || header->length > DO_MAX_LENGTH) {
+        return NULL;
+    }
+    if (crc32_le(0, (const uint8_t*) (header + 1), header->length) != header->crc) {
+        return NULL;
+    }
+    return header;
+}
+
+// (Re)map the partition. The cache may hold pages of a sector that was just written.
+esp_err_t doRemap() {
+    if (doMap != NULL) {
+        spi_flash_munmap(doMapHandle);
+        doMap = NULL;
+    }
+    return esp_partition_mmap(doPartition, 0, doPartition->size, SPI_FLASH_MMAP_DATA,
+            (const void**) &doMap, &doMapHandle);
+}
+
+/**
+ * Map the partition and find the current copy of each object. Does
+ * nothing once it has succeeded.
+ *
+ * @return ESP_OK, or the error of finding or mapping the partition
+ */
+esp_err_t doMount() {
+    static const char* TAG = "doMount";
+    esp_err_t err;
+
+    if (doMap != NULL) {
+        return ESP_OK;
+    }
+
+    doPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+            ESP_PARTITION_SUBTYPE_ANY, DO_PARTITION);
+    if (doPartition == NULL || doPartition->size < doOffset(DO_COUNT, 0)) {
+        ESP_LOGE(TAG, "No partition %s", DO_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if ((err = doRemap()) != ESP_OK) {
+        ESP_LOGE(TAG, "mmap failed, code: %d", err);
+        return err;
+    }
+
+    for (uint8_t id = 0; id < DO_COUNT; id++) {
+        doCurrent[id] = DO_NONE;
+        doSequence[id] = 0;
+        for (uint8_t sector = 0; sector < 2; sector++) {
+            const doHeader_t* header = doCopy(id, sector);
+            if (header != NULL && (doCurrent[id] == DO_NONE
+                    || header->sequence > doSequence[id])) {
+                doCurrent[id] = sector;
+                doSequence[id] = header->sequence;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Copy the object id to out, which must have room for the largest
+ * value that can be written to it. An object that was never written
+ * is empty.
+ *
+ * @return ESP_OK, or the error of doMount
+ */
+esp_err_t doRead(uint8_t id, uint8_t* out, uint16_t* len) {
+    esp_err_t err;
+
+    (*len) = 0;
+    if ((err = doMount()) != ESP_OK) {
+        return err;
+    }
+    if (doCurrent[id] != DO_NONE) {
+        const doHeader_t* header = (const doHeader_t*) (doMap + doOffset(id, doCurrent[id]));
+        memcpy(out, header + 1, header->length);
+        (*len) = header->length;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Replace the object id with len bytes of data. The old value stays
+ * the current one until the new one is completely written.
+ *
+ * @return ESP_OK, or the error of the flash operation that failed
+ */
+esp_err_t doWrite(uint8_t id, const uint8_t* data, uint16_t len) {
+    static const char* TAG = "doWrite";
+    int64_t start = esp_timer_get_time();
+    doHeader_t header;
+    esp_err_t err;
+
+    if ((err = doMount()) != ESP_OK) {
+        goto exitDW;
+    }
+    if (len > DO_MAX_LENGTH) {
+        err = ESP_ERR_INVALID_SIZE;
+        goto exitDW;
+    }
+
+    uint8_t sector = (doCurrent[id] == 0) ? 1 : 0;
+    uint32_t offset = doOffset(id, sector);
+
+    header.magic = DO_MAGIC;
+    header.sequence = doSequence[id] + 1;
+    header.length = len;
+    header.id = id;
+    header.crc = crc32_le(0, data, len);
+
+    if ((err = esp_partition_erase_range(doPartition, offset, DO_SECTOR)) != ESP_OK) {
+        goto exitDW;
+    }
+    if (len > 0 && (err = esp_partition_write(doPartition, offset + sizeof(header),
+            data, len)) != ESP_OK) {
+        goto exitDW;
+    }
+    if ((err = esp_partition_write(doPartition, offset, &header, sizeof(header))) != ESP_OK) {
+        goto exitDW;
+    }
+
+    doCurrent[id] = sector;
+    doSequence[id] = header.sequence;
+    err = doRemap();
+
+exitDW:
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Writing object %d failed, code: %d", id, err);
+    }
+    statsFlash(start);
+    return err;
+}
+
+// Empty all of the objects that are not empty already
+esp_err_t doEraseAll() {
+    esp_err_t err;
+    uint16_t len;
+
+    if ((err = doMount()) != ESP_OK) {
+        return err;
+    }
+    for (uint8_t id = 0; id < DO_COUNT; id++) {
+        len = 0;
+        if (doCurrent[id] != DO_NONE) {
+            len = ((const doHeader_t*) (doMap + doOffset(id, doCurrent[id])))->length;
+        }
+        if (len > 0 && (err = doWrite(id, NULL, 0)) != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Memory and task diagnostics.
+ *
+ * Reports what the heap and the task stacks actually use, to
+ * size them from figures instead of guesses: the free, lowest
+ * free and largest free block of each kind of heap, the
+ * memory held by mbedtls (RSA contexts, key generation) and
+ * its peak, and the stack high-water mark of each task.
+ *
+ * The allocations of mbedtls are counted through its platform
+ * hooks, each block carries its size in a small header. The
+ * hooks are only there when mbedtls is built with
+ * MBEDTLS_PLATFORM_MEMORY, the figures stay at 0 otherwise.
+ *
+ * The diagnostics are read with the custom INS 59:
+ *    P1 = 00: Heap, as described below
+ *    P1 = 01: The task P2, 6A88 once P2 is past the last one
+ *    P1 = 02: Reset the mbedtls peak to what is in use
+ *
+ * The heap reads as Caps | Free | Lowest free | Largest block
+ * for each of DIAG_CAPS, then mbedtls In use | Peak | Failed
+ * allocations, all 4 bytes big-endian. A task reads as its
+ * name (DIAG_NAME_LENGTH bytes, padded with 0) | Stack size |
+ * Lowest free stack, in bytes.
+ *
+ * Handles:
+ *    Counting the allocations of mbedtls
+ *    The tasks and their stacks
+ *    The output of the diagnostics APDU and the periodic log
+ */
+#ifndef __LIBDIAG_H__
+#define __LIBDIAG_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "mbedtls/config.h"
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+#include "mbedtls/platform.h"
+#endif
+
+#define DIAG_TASKS 12               // Tasks that can be registered
+#define DIAG_NAME_LENGTH 16         // configMAX_TASK_NAME_LEN
+#define DIAG_CAP_COUNT 3
+#define DIAG_HEADER 8               // Header of an mbedtls block, keeps the 8 byte alignment
+
+static const uint32_t DIAG_CAPS[DIAG_CAP_COUNT] = { MALLOC_CAP_INTERNAL, MALLOC_CAP_DMA, MALLOC_CAP_SPIRAM };
+
+typedef struct diagTask_t {
+    TaskHandle_t handle;
+    uint32_t stack;             // Stack size it was created with, in bytes
+} diagTask_t;
+
+static diagTask_t diagTasks[DIAG_TASKS];
+static uint8_t diagUsed = 0;
+static portMUX_TYPE diagMux = portMUX_INITIALIZER_UNLOCKED;    // mbedtls runs on both CPUs
+static uint32_t diagInUse = 0;      // Bytes held by mbedtls
+static uint32_t diagPeak = 0;       // Most bytes held by mbedtls at once
+static uint32_t diagFailed = 0;     // Allocations of mbedtls that failed
+static uint32_t diagPeriod = 0;     // Seconds between two log lines, 0 for none
+
+// Write value to out, big-endian
+static uint16_t diagPut(uint8_t* out, uint32_t value) {
+    for (int8_t s = 24; s >= 0; s -= 8) {
+        *(out++) = (uint8_t) (value >> s);
+    }
+    return 4;
+}
+
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+static void* diagCalloc(size_t n, size_t size) {
+    size_t total = n * size;
+    uint8_t* block = NULL;
+
+    if (size == 0 || total / size == n) {
+        block = calloc(1, DIAG_HEADER + total);
+    }
+    portENTER_CRITICAL(&diagMux);
+    if (block == NULL) {
+        diagFailed++;
+    } else {
+        diagInUse += total;
+        if (diagInUse > diagPeak) {
+            diagPeak = diagInUse;
+        }
+    }
+    portEXIT_CRITICAL(&diagMux);
+    if (block == NULL) {
+        return NULL;
+    }
+    *((size_t*) block) = total;
+    return block + DIAG_HEADER;
+}
+
+static void diagFree(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    uint8_t* block = (uint8_t*) ptr - DIAG_HEADER;
+    portENTER_CRITICAL(&diagMux);
+    diagInUse -= *((size_t*) block);
+    portEXIT_CRITICAL(&diagMux);
+    free(block);
+}
+#endif
+
+/**
+ * Register a task, right after it has been created. A task without a
+ * handle, or past DIAG_TASKS of them, is left out.
+ *
+ * @param stack The stack size it was created with
+ */
+void diagTask(TaskHandle_t handle, uint32_t stack) {
+    if (handle != NULL && diagUsed < DIAG_TASKS) {
+        diagTasks[diagUsed].handle = handle;
+        diagTasks[diagUsed].stack = stack;
+        diagUsed++;
+    }
+}
+
+// Set the mbedtls peak back to what it holds now
+void diagReset() {
+    portENTER_CRITICAL(&diagMux);
+    diagPeak = diagInUse;
+    diagFailed = 0;
+    portEXIT_CRITICAL(&diagMux);
+}
+
+/**
+ * Write the heap figures to out, as described above.
+ *
+ * @return Length written to out
+ */
+uint16_t diagHeap(uint8_t* out) {
+    uint16_t offset = 0;
+
+    for (uint8_t i = 0; i < DIAG_CAP_COUNT; i++) {
+        offset += diagPut(out + offset, DIAG_CAPS[i]);
+        offset += diagPut(out + offset, heap_caps_get_free_size(DIAG_CAPS[i]));
+        offset += diagPut(out + offset, heap_caps_get_minimum_free_size(DIAG_CAPS[i]));
+        offset += diagPut(out + offset, heap_caps_get_largest_free_block(DIAG_CAPS[i]));
+    }
+    portENTER_CRITICAL(&diagMux);
+    uint32_t inUse = diagInUse, peak = diagPeak, failed = diagFailed;
+    portEXIT_CRITICAL(&diagMux);
+    offset += diagPut(out + offset, inUse);
+    offset += diagPut(out + offset, peak);
+    offset += diagPut(out + offset, failed);
+    return offset;
+}
+
+/**
+ * Write the task index to out, as described above.
+ *
+ * @return Length written to out, 0 if there is no such task
+ */
+uint16_t diagTaskOutput(uint8_t index, uint8_t* out) {
+    uint16_t offset = 0;
+
+    if (index >= diagUsed) {
+        return 0;
+    }
+    diagTask_t* t = &diagTasks[index];
+    bzero(out, DIAG_NAME_LENGTH);
+    strncpy((char*) out, pcTaskGetTaskName(t->handle), DIAG_NAME_LENGTH);
+    offset += DIAG_NAME_LENGTH;
+    offset += diagPut(out + offset, t->stack);
+    offset += diagPut(out + offset, uxTaskGetStackHighWaterMark(t->handle));
+    return offset;
+}
+
+static void taskDiag(void *pvParameters) {    // Log the figures every diagPeriod seconds
+    static const char* TAG = "diag";
+    while (1) {
+        vTaskDelay((diagPeriod*1000)/portTICK_PERIOD_MS);
+        ESP_LOGI(TAG, "Heap free %u (lowest %u, largest block %u), mbedtls %u (peak %u, failed %u)",
+                (unsigned) heap_caps_get_free_size(MALLOC_CAP_INTERNAL),
+                (unsigned) heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+                (unsigned) heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+                (unsigned) diagInUse, (unsigned) diagPeak, (unsigned) diagFailed);
+        for (uint8_t i = 0; i < diagUsed; i++) {
+            ESP_LOGI(TAG, "Task %s: %u of %u bytes of stack never used",
+                    pcTaskGetTaskName(diagTasks[i].handle),
+                    (unsigned) uxTaskGetStackHighWaterMark(diagTasks[i].handle),
+                    (unsigned) diagTasks[i].stack);
+        }
+    }
+}
+
+/**
+ * Start counting the allocations of mbedtls, before its first one.
+ *
+ * @param period Seconds between two log lines of the figures, 0 for none
+ */
+void diagInit(uint32_t period) {
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+    mbedtls_platform_set_calloc_free(diagCalloc, diagFree);
+#endif
+    diagPeriod = period;
+    if (period != 0) {
+        TaskHandle_t handle = NULL;
+        xTaskCreatePinnedToCore(&taskDiag, "taskDiag", 2048, NULL, 1, &handle, PRO_CPU_NUM);
+        diagTask(handle, 2048);
+    }
+}
+
+#endif
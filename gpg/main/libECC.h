@@ -0,0 +1,264 @@
+/*
+ * Elliptic curve keys of the OpenPGP card.
+ *
+ * The curves are the ones the mbedtls of the ESP-IDF can
+ * operate on: NIST P-256 for ECDSA and ECDH, and Curve25519
+ * for ECDH (X25519). Ed25519 would need EdDSA, which mbedtls
+ * does not provide, so it is not offered.
+ *
+ * All of the operations work on a mbedtls_ecp_keypair and
+ * a curve index (ECC_*). Parsing of the APDUs and storage of
+ * the keys are left to libAPDU.h.
+ *
+ * Handles:
+ *    The supported curves and their algorithm attributes
+ *    Key generation and import
+ *    ECDSA signatures and ECDH key agreement
+ *    Encoding of the public key and of the stored private key
+ */
+#ifndef __LIBECC_H__
+#define __LIBECC_H__
+
+#include "mbedtls/ecp.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/ecdh.h"
+
+#include "libRNG.h"
+
+#define ECC_NONE 0                  // No curve, the key is RSA
+#define ECC_P256_ECDSA 1            // NIST P-256, signatures (C1, C3)
+#define ECC_P256_ECDH 2             // NIST P-256, decryption (C2)
+#define ECC_X25519 3                // Curve25519, decryption (C2)
+#define ECC_CURVES 4
+
+#define ECC_KEY_BYTES 32            // Size of the private key and of a coordinate
+#define ECC_RECORD_LENGTH (1 + ECC_KEY_BYTES)   // Curve | D
+#define ECC_POINT_MAX_LENGTH (1 + 2*ECC_KEY_BYTES)
+
+#define ECC_SLOT_SIG 0x01           // The curve can be used for the signature key
+#define ECC_SLOT_DEC 0x02           // The curve can be used for the decryption key
+#define ECC_SLOT_AUTH 0x04          // The curve can be used for the authentication key
+
+#define ALGO_ECDH 0x12              // OpenPGP algorithm IDs
+#define ALGO_ECDSA 0x13
+
+static const uint8_t OID_P256[8] = { 0x2A, (uint8_t) 0x86, 0x48, (uint8_t) 0xCE, \
+                    0x3D, 0x03, 0x01, 0x07 };
+static const uint8_t OID_X25519[10] = { 0x2B, 0x06, 0x01, 0x04, 0x01, (uint8_t) 0x97, \
+                    0x55, 0x01, 0x05, 0x01 };
+
+typedef struct eccCurve_t {
+    mbedtls_ecp_group_id id;        // The curve in mbedtls
+    uint8_t algo;                   // ALGO_ECDH or ALGO_ECDSA
+    const uint8_t* oid;             // The algorithm attributes are algo | OID
+    uint8_t oidLength;
+    uint8_t slots;                  // ECC_SLOT_* flags of the keys that may use it
+} eccCurve_t;
+
+static const eccCurve_t eccCurves[ECC_CURVES] = {
+    { MBEDTLS_ECP_DP_NONE, 0, NULL, 0, 0 },
+    { MBEDTLS_ECP_DP_SECP256R1, ALGO_ECDSA, OID_P256, sizeof(OID_P256), ECC_SLOT_SIG | ECC_SLOT_AUTH },
+    { MBEDTLS_ECP_DP_SECP256R1, ALGO_ECDH, OID_P256, sizeof(OID_P256), ECC_SLOT_DEC },
+    { MBEDTLS_ECP_DP_CURVE25519, ALGO_ECDH, OID_X25519, sizeof(OID_X25519), ECC_SLOT_DEC },
+};
+
+// Curve25519 values are little-endian on the wire, mbedtls works in big-endian
+static void eccReverse(uint8_t* data, uint16_t len) {
+    uint8_t tmp;
+    for (uint16_t i = 0; i < len/2; i++) {
+        tmp = data[i];
+        data[i] = data[len - 1 - i];
+        data[len - 1 - i] = tmp;
+    }
+}
+
+/**
+ * Find the curve described by the algorithm attributes attr, for a key
+ * that uses the ECC_SLOT_* flag slot. A trailing import format byte
+ * (FF, public key included) is accepted.
+ *
+ * @return The curve, or ECC_NONE if it is not supported
+ */
+uint8_t eccFindCurve(uint8_t* attr, uint16_t len, uint8_t slot) {
+    for (uint8_t i = 1; i < ECC_CURVES; i++) {
+        const eccCurve_t* c = &eccCurves[i];
+        if ((c->slots & slot) == 0 || attr[0] != c->algo) {
+            continue;
+        }
+        if ((len != 1 + c->oidLength) && !(len == 2 + c->oidLength && attr[len-1] == (uint8_t) 0xFF)) {
+            continue;
+        }
+        if (memcmp(attr + 1, c->oid, c->oidLength) == 0) {
+            return i;
+        }
+    }
+    return ECC_NONE;
+}
+
+// Write the algorithm attributes of curve to out, return their length
+uint8_t eccAttributes(uint8_t curve, uint8_t* out) {
+    const eccCurve_t* c = &eccCurves[curve];
+    out[0] = c->algo;
+    memcpy(out + 1, c->oid, c->oidLength);
+    return 1 + c->oidLength;
+}
+
+/**
+ * Generate a new key on curve.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int eccGenKey(mbedtls_ecp_keypair* key, uint8_t curve) {
+    mbedtls_ecp_keypair_free(key);
+    mbedtls_ecp_keypair_init(key);
+    return mbedtls_ecp_gen_key(eccCurves[curve].id, key, rngRandom, NULL);
+}
+
+/**
+ * Set the private key d (big-endian) of a key on curve, derive its public
+ * key and check both.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int eccSetKey(mbedtls_ecp_keypair* key, uint8_t curve, uint8_t* d, uint16_t len) {
+    int ret;
+
+    mbedtls_ecp_keypair_free(key);
+    mbedtls_ecp_keypair_init(key);
+    if ((ret = mbedtls_ecp_group_load(&key->grp, eccCurves[curve].id)) != 0 ||
+        (ret = mbedtls_mpi_read_binary(&key->d, d, len)) != 0 ||
+        (ret = mbedtls_ecp_check_privkey(&key->grp, &key->d)) != 0 ||
+        (ret = mbedtls_ecp_mul(&key->grp, &key->Q, &key->d, &key->grp.G, rngRandom, NULL)) != 0) {
+        mbedtls_ecp_keypair_free(key);
+        mbedtls_ecp_keypair_init(key);
+    }
+    return ret;
+}
+
+/**
+ * Copy the key src to dst, in place of the key dst holds.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int eccCopyKey(mbedtls_ecp_keypair* dst, const mbedtls_ecp_keypair* src) {
+    int ret;
+
+    if ((ret = mbedtls_ecp_group_copy(&dst->grp, &src->grp)) != 0 ||
+        (ret = mbedtls_mpi_copy(&dst->d, &src->d)) != 0 ||
+        (ret = mbedtls_ecp_copy(&dst->Q, &src->Q)) != 0) {
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ * Encode the public key: 04 | X | Y for P-256, X (little-endian) for
+ * Curve25519.
+ *
+ * @return Length written to out, 0 on failure
+ */
+uint16_t eccPublicKey(mbedtls_ecp_keypair* key, uint8_t curve, uint8_t* out) {
+    size_t len = 0;
+
+    if (curve == ECC_X25519) {
+        if (mbedtls_mpi_write_binary(&key->Q.X, out, ECC_KEY_BYTES) != 0) {
+            return 0;
+        }
+        eccReverse(out, ECC_KEY_BYTES);
+        return ECC_KEY_BYTES;
+    }
+    if (mbedtls_ecp_point_write_binary(&key->grp, &key->Q, MBEDTLS_ECP_PF_UNCOMPRESSED,
+                                       &len, out, ECC_POINT_MAX_LENGTH) != 0) {
+        return 0;
+    }
+    return len;
+}
+
+/**
+ * ECDSA signature of the hash given, output as r | s.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int eccSign(mbedtls_ecp_keypair* key, uint8_t* hash, uint16_t len, uint8_t* out, uint16_t* outLen) {
+    mbedtls_mpi r, s;
+    int ret;
+
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    if ((ret = mbedtls_ecdsa_sign(&key->grp, &r, &s, &key->d, hash, len, rngRandom, NULL)) == 0 &&
+        (ret = mbedtls_mpi_write_binary(&r, out, ECC_KEY_BYTES)) == 0 &&
+        (ret = mbedtls_mpi_write_binary(&s, out + ECC_KEY_BYTES, ECC_KEY_BYTES)) == 0) {
+        (*outLen) = 2*ECC_KEY_BYTES;
+    }
+    mbedtls_mpi_free(&r);
+    mbedtls_mpi_free(&s);
+    return ret;
+}
+
+/**
+ * ECDH with the public key of the other party, encoded as by
+ * eccPublicKey (a Curve25519 key may also carry the 40 prefix of
+ * OpenPGP). The shared secret is X, little-endian for Curve25519.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int eccAgree(mbedtls_ecp_keypair* key, uint8_t curve, uint8_t* point, uint16_t len,
+             uint8_t* out, uint16_t* outLen) {
+    uint8_t x[ECC_KEY_BYTES];
+    mbedtls_ecp_point Q;
+    mbedtls_mpi z;
+    int ret = MBEDTLS_ERR_ECP_BAD_INPUT_DATA;
+
+    mbedtls_ecp_point_init(&Q);
+    mbedtls_mpi_init(&z);
+    if (curve == ECC_X25519) {
+        if (len == ECC_KEY_BYTES + 1 && point[0] == 0x40) {
+            point++;
+            len--;
+        }
+        if (len != ECC_KEY_BYTES) {
+            goto exitEA;
+        }
+        memcpy(x, point, ECC_KEY_BYTES);
+        x[ECC_KEY_BYTES-1] &= 0x7F;     // RFC 7748, the top bit is ignored
+        eccReverse(x, ECC_KEY_BYTES);
+        if ((ret = mbedtls_mpi_read_binary(&Q.X, x, ECC_KEY_BYTES)) != 0 ||
+            (ret = mbedtls_mpi_lset(&Q.Z, 1)) != 0) {
+            goto exitEA;
+        }
+    } else if ((ret = mbedtls_ecp_point_read_binary(&key->grp, &Q, point, len)) != 0) {
+        goto exitEA;
+    }
+
+    if ((ret = mbedtls_ecp_check_pubkey(&key->grp, &Q)) != 0 ||
+        (ret = mbedtls_ecdh_compute_shared(&key->grp, &z, &Q, &key->d, rngRandom, NULL)) != 0 ||
+        (ret = mbedtls_mpi_write_binary(&z, out, ECC_KEY_BYTES)) != 0) {
+        goto exitEA;
+    }
+    if (curve == ECC_X25519) {
+        eccReverse(out, ECC_KEY_BYTES);
+    }
+    (*outLen) = ECC_KEY_BYTES;
+
+exitEA:
+    bzero(x, sizeof(x));
+    mbedtls_ecp_point_free(&Q);
+    mbedtls_mpi_free(&z);
+    return ret;
+}
+
+// Pack the private key for storage, as Curve | D
+int eccWriteRecord(mbedtls_ecp_keypair* key, uint8_t curve, uint8_t* record) {
+    record[0] = curve;
+    return mbedtls_mpi_write_binary(&key->d, record + 1, ECC_KEY_BYTES);
+}
+
+// Unpack a private key packed by eccWriteRecord
+int eccReadRecord(mbedtls_ecp_keypair* key, uint8_t* record) {
+    if (record[0] == ECC_NONE || record[0] >= ECC_CURVES) {
+        return MBEDTLS_ERR_ECP_BAD_INPUT_DATA;
+    }
+    return eccSetKey(key, record[0], record + 1, ECC_KEY_BYTES);
+}
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ * Backends of the private RSA key operations.
+ *
+ * The signatures and decryptions of each of the three keys go
+ * through the backend of its slot:
+ *    Software: mbedtls on the key in RAM, loaded from its key
+ *              record. Only the MPI exponentiation is done by
+ *              the hardware. Every ESP32 has it
+ *    DS:       the Digital Signature peripheral of the newer
+ *              chips (S2, S3, C3...) does the whole private
+ *              operation on a key blob that only the HMAC key
+ *              in eFuse (KEY_DS_HMAC) decrypts, so the private
+ *              key is never seen by the firmware
+ *
+ * A DS blob can't be made on the card, the HMAC key is needed
+ * for it: it is made at provisioning, before the HMAC key is
+ * burned, and put in the .ds file of the slot (see libAPDU.h)
+ * with the public key. A slot with a blob uses the DS, from
+ * the boot on, and keeps it over a factory reset. A key that is
+ * generated or imported to the slot afterwards replaces it with
+ * a software key.
+ *
+ * The ECC keys keep using libECC.h.
+ *
+ * On the first private operation with a software key, mbedtls makes
+ * the blinding pair (a modular inversion and an exponentiation by E)
+ * and the Montgomery constants of N, P and Q, and keeps them in the
+ * context for the next ones. keyPrepareNext does that ahead of time,
+ * between the commands, so that the first signature after the boot or
+ * after a new key only pays for the exponentiation, like the others.
+ *
+ * Handles:
+ *    The backend of each key slot
+ *    PKCS#1 v1.5 signatures and decryptions with it
+ *    Preparing the contexts of the software keys
+ */
+#ifndef __LIBKEY_H__
+#define __LIBKEY_H__
+
+#include <inttypes.h>
+
+#include "mbedtls/rsa.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "libRNG.h"
+
+#if defined(__has_include)
+#if __has_include("soc/soc_caps.h")
+#include "soc/soc_caps.h"
+#endif
+#endif
+
+#if defined(SOC_DIG_SIGN_SUPPORTED) && SOC_DIG_SIGN_SUPPORTED
+#define KEY_DS 1
+#include "esp_ds.h"
+#endif
+
+#define KEY_SLOTS 3                 // B6, B8 and A4
+
+typedef struct keyBackend_t {
+    const char* name;
+    // PKCS#1 v1.5 signature of the len bytes of in, out gets a modulus worth of bytes
+    int (*sign)(uint8_t slot, mbedtls_rsa_context* key, const uint8_t* in, size_t len, uint8_t* out);
+    // PKCS#1 v1.5 decryption of a modulus worth of bytes of in, at most max bytes to out
+    int (*decrypt)(uint8_t slot, mbedtls_rsa_context* key, const uint8_t* in, uint8_t* out,
+            size_t* len, size_t max);
+} keyBackend_t;
+
+/**
+ * The slot of the key of the given type (B6, B8 or A4).
+ *
+ * @return 0 to KEY_SLOTS-1, or KEY_SLOTS if the type is unknown
+ */
+uint8_t keySlotIndex(uint8_t type) {
+    if (type == (uint8_t) 0xB6) {
+        return 0;
+    } else if (type == (uint8_t) 0xB8) {
+        return 1;
+    } else if (type == (uint8_t) 0xA4) {
+        return 2;
+    }
+    return KEY_SLOTS;
+}
+
+static int keySoftSign(uint8_t slot, mbedtls_rsa_context* key, const uint8_t* in, size_t len, uint8_t* out) {
+    return mbedtls_rsa_pkcs1_encrypt(key, rngRandom, NULL, MBEDTLS_RSA_PRIVATE, len, in, out);
+}
+
+static int keySoftDecrypt(uint8_t slot, mbedtls_rsa_context* key, const uint8_t* in, uint8_t* out,
+        size_t* len, size_t max) {
+    return mbedtls_rsa_pkcs1_decrypt(key, rngRandom, NULL, MBEDTLS_RSA_PRIVATE, len, in, out, max);
+}
+
+static const keyBackend_t keySoft = { "software", keySoftSign, keySoftDecrypt };
+
+#ifdef KEY_DS
+#define KEY_DS_HMAC HMAC_KEY0       // The eFuse key block the blobs are made for
+#define KEY_DS_MAX_BYTES (SOC_RSA_MAX_BIT_LEN / 8)
+
+static esp_ds_data_t* keyDsData[KEY_SLOTS];     // The blob of each slot, NULL if it has none
+
+/**
+ * The raw private operation, in and out are len bytes big-endian. The
+ * DS takes and returns little-endian words.
+ */
+static int keyDsRaw(uint8_t slot, const uint8_t* in, uint8_t* out, size_t len) {
+    static uint32_t msg[KEY_DS_MAX_BYTES / 4], sig[KEY_DS_MAX_BYTES / 4];
+    int ret = 0;
+
+    if (keyDsData[slot] == NULL || len > KEY_DS_MAX_BYTES ||
+            len != (keyDsData[slot]->rsa_length + 1) * 4) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        ((uint8_t*) msg)[i] = in[len - 1 - i];
+    }
+    if (esp_ds_sign(msg, keyDsData[slot], KEY_DS_HMAC, sig) != ESP_OK) {
+        ret = -1;
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            out[i] = ((uint8_t*) sig)[len - 1 - i];
+        }
+    }
+    bzero(msg, sizeof(msg));
+    bzero(sig, sizeof(sig));
+    return ret;
+}
+
+// EMSA-PKCS1-v1_5: 00 | 01 | FF... | 00 | in, then the DS
+static int keyDsSign(uint8_t slot, mbedtls_rsa_context* key, const uint8_t* in, size_t len, uint8_t* out) {
+    static uint8_t em[KEY_DS_MAX_BYTES];
+    size_t k = key->len;
+
+    if (k > sizeof(em) || len + 11 > k) {
+        return -1;
+    }
+    em[0] = 0x00;
+    em[1] = 0x01;
+    memset(em + 2, 0xFF, k - len - 3);
+    em[k - len - 1] = 0x00;
+    memcpy(em + k - len, in, len);
+    return keyDsRaw(slot, em, out, k);
+}
+
+// The DS, then EME-PKCS1-v1_5: 00 | 02 | 8 or more non-zero bytes | 00 | message
+static int keyDsDecrypt(uint8_t slot, mbedtls_rsa_context* key, const uint8_t* in, uint8_t* out,
+        size_t* len, size_t max) {
+    static uint8_t em[KEY_DS_MAX_BYTES];
+    size_t k = key->len, sep = 0;
+    int ret = -1;
+
+    if (k > sizeof(em) || keyDsRaw(slot, in, em, k) != 0) {
+        return -1;
+    }
+    // Look at every byte whatever the padding, it must not tell where it is wrong
+    uint8_t bad = em[0] | (em[1] ^ 0x02);
+    for (size_t i = 2; i < k; i++) {
+        uint8_t found = (sep == 0) & (em[i] == 0);
+        sep |= found * i;
+    }
+    bad |= (sep < 10);
+    if (!bad && k - sep - 1 <= max) {
+        *len = k - sep - 1;
+        memcpy(out, em + sep + 1, *len);
+        ret = 0;
+    }
+    bzero(em, sizeof(em));
+    return ret;
+}
+
+static const keyBackend_t keyDs = { "DS", keyDsSign, keyDsDecrypt };
+#endif
+
+static const keyBackend_t* keyBackends[KEY_SLOTS] = { &keySoft, &keySoft, &keySoft };
+
+/**
+ * Sign with the key of the given type, and its backend.
+ *
+ * @return 0, or non-zero on failure
+ */
+int keySign(uint8_t type, mbedtls_rsa_context* key, const uint8_t* in, size_t len, uint8_t* out) {
+    uint8_t slot = keySlotIndex(type);
+    if (slot >= KEY_SLOTS) {
+        return -1;
+    }
+    return keyBackends[slot]->sign(slot, key, in, len, out);
+}
+
+/**
+ * Decrypt with the key of the given type, and its backend.
+ *
+ * @return 0, or non-zero on failure
+ */
+int keyDecrypt(uint8_t type, mbedtls_rsa_context* key, const uint8_t* in, uint8_t* out,
+        size_t* len, size_t max) {
+    uint8_t slot = keySlotIndex(type);
+    if (slot >= KEY_SLOTS) {
+        return -1;
+    }
+    return keyBackends[slot]->decrypt(slot, key, in, out, len, max);
+}
+
+// The key of the given type is now in RAM, e.g. just generated or imported
+void keyUseSoft(uint8_t type) {
+    uint8_t slot = keySlotIndex(type);
+    if (slot >= KEY_SLOTS) {
+        return;
+    }
+#ifdef KEY_DS
+    if (keyDsData[slot] != NULL) {
+        free(keyDsData[slot]);
+        keyDsData[slot] = NULL;
+    }
+#endif
+    keyBackends[slot] = &keySoft;
+}
+
+#ifdef KEY_DS
+/**
+ * Use the DS for the key of the given type, with blob. The public key
+ * goes to key, whose private components stay unused.
+ *
+ * @return 0, or 1 if the slot or the blob cannot be used
+ */
+uint8_t keyUseDs(uint8_t type, const esp_ds_data_t* blob, mbedtls_rsa_context* key) {
+    uint8_t slot = keySlotIndex(type);
+    esp_ds_data_t* data;
+
+    if (slot >= KEY_SLOTS || (blob->rsa_length + 1) * 4 != key->len ||
+            (data = malloc(sizeof(esp_ds_data_t))) == NULL) {
+        return 1;
+    }
+    memcpy(data, blob, sizeof(esp_ds_data_t));
+    keyUseSoft(type);
+    keyDsData[slot] = data;
+    keyBackends[slot] = &keyDs;
+    return 0;
+}
+#endif
+
+static mbedtls_rsa_context* keyToPrepare[KEY_SLOTS];   // The keys to prepare, NULL once done
+
+/**
+ * The key of the given type has a new value. What the context kept for
+ * the old one is dropped, the constants are of the old modulus and the
+ * blinding pair of the old exponent, and the key is prepared again.
+ */
+void keyChanged(uint8_t type, mbedtls_rsa_context* key) {
+    uint8_t slot = keySlotIndex(type);
+    if (slot >= KEY_SLOTS) {
+        return;
+    }
+    mbedtls_mpi_free(&key->RN);
+    mbedtls_mpi_free(&key->RP);
+    mbedtls_mpi_free(&key->RQ);
+    mbedtls_mpi_free(&key->Vi);
+    mbedtls_mpi_free(&key->Vf);
+    keyToPrepare[slot] = key;
+}
+
+// Whether a key is still to be prepared
+uint8_t keyPending() {
+    for (uint8_t slot = 0; slot < KEY_SLOTS; slot++) {
+        if (keyToPrepare[slot] != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fill the Montgomery constants and the blinding pair of key the way
+ * mbedtls_rsa_private would on its first use. A pair that is only half
+ * made is dropped, mbedtls would take it as it is.
+ *
+ * @return 0, or the mbedtls error
+ */
+static int keyPrepare(mbedtls_rsa_context* key) {
+    mbedtls_mpi one, t;
+    int ret = 0, count = 0;
+
+    if (mbedtls_mpi_bitlen(&key->P) == 0) {
+        return 0;   // No private key in the slot
+    }
+    mbedtls_mpi_init(&one);
+    mbedtls_mpi_init(&t);
+    MBEDTLS_MPI_CHK(mbedtls_mpi_lset(&one, 1));
+    // The cheapest exponentiations there are, for the constants only
+    if (key->RP.p == NULL) {
+        MBEDTLS_MPI_CHK(mbedtls_mpi_exp_mod(&t, &one, &one, &key->P, &key->RP));
+    }
+    if (key->RQ.p == NULL) {
+        MBEDTLS_MPI_CHK(mbedtls_mpi_exp_mod(&t, &one, &one, &key->Q, &key->RQ));
+    }
+    if (key->Vf.p == NULL) {    // Vf random and invertible mod N, Vi = Vf^-E mod N
+        do {
+            if (count++ > 10) {
+                ret = MBEDTLS_ERR_RSA_RNG_FAILED;
+                goto cleanup;
+            }
+            MBEDTLS_MPI_CHK(mbedtls_mpi_fill_random(&key->Vf, key->len - 1, rngRandom, NULL));
+            MBEDTLS_MPI_CHK(mbedtls_mpi_gcd(&t, &key->Vf, &key->N));
+        } while (mbedtls_mpi_cmp_int(&t, 1) != 0);
+        MBEDTLS_MPI_CHK(mbedtls_mpi_inv_mod(&key->Vi, &key->Vf, &key->N));
+        MBEDTLS_MPI_CHK(mbedtls_mpi_exp_mod(&key->Vi, &key->Vi, &key->E, &key->N, &key->RN));
+    } else if (key->RN.p == NULL) {
+        MBEDTLS_MPI_CHK(mbedtls_mpi_exp_mod(&t, &one, &one, &key->N, &key->RN));
+    }
+
+cleanup:
+    if (ret != 0) {
+        mbedtls_mpi_free(&key->Vi);
+        mbedtls_mpi_free(&key->Vf);
+    }
+    mbedtls_mpi_free(&one);
+    mbedtls_mpi_free(&t);
+    return ret;
+}
+
+/**
+ * Prepare the next key that needs it. Only the crypto worker may call
+ * it, or nothing else uses the keys yet: it changes the context the
+ * private operations use. One key takes a few tens of ms.
+ */
+void keyPrepareNext() {
+    static const char* TAG = "keyPrepareNext";
+
+    for (uint8_t slot = 0; slot < KEY_SLOTS; slot++) {
+        mbedtls_rsa_context* key = keyToPrepare[slot];
+        if (key == NULL) {
+            continue;
+        }
+        keyToPrepare[slot] = NULL;
+        if (keyBackends[slot] != &keySoft) {
+            return;     // The DS doesn't use the context
+        }
+        int64_t start = esp_timer_get_time();
+        int ret = keyPrepare(key);
+        if (ret != 0) {     // mbedtls makes them on the next operation then
+            ESP_LOGE(TAG, "Slot %d not prepared (-0x%04x)", slot, -ret);
+        } else {
+            ESP_LOGD(TAG, "Slot %d ready in %" PRId64 " us", slot, esp_timer_get_time() - start);
+        }
+        return;
+    }
+}
+
+// Name of the backend of the key of the given type, for the logs
+const char* keyBackendName(uint8_t type) {
+    uint8_t slot = keySlotIndex(type);
+    return (slot < KEY_SLOTS) ? keyBackends[slot]->name : "none";
+}
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Random number service of the ESP32.
+ *
+ * A single CTR_DRBG is seeded once at boot from the entropy
+ * sources of mbedtls, which on the ESP32 are backed by the
+ * hardware RNG. A background task reseeds it periodically
+ * and keeps a pool of random bytes ready, so that short
+ * requests (such as GET CHALLENGE) are served without any
+ * DRBG work at all.
+ *
+ * Handles:
+ *    Seeding and reseeding of the shared DRBG
+ *    The prefilled random byte pool
+ *    The f_rng callback used by the RSA operations
+ *    The f_rng callback of the key generations, which yields now and then
+ */
+#ifndef __LIBRNG_H__
+#define __LIBRNG_H__
+
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "libDiag.h"
+
+#define RNG_POOL_SIZE 256           // Size of the prefilled pool, enough for a full GET CHALLENGE
+#define RNG_RESEED_PERIOD 60        // Seconds between two reseeds of the DRBG
+#define RNG_YIELD_PERIOD 1000       // Milliseconds between two yields of rngRandomYield, well below the task watchdog
+
+static mbedtls_entropy_context rngEntropy;
+static mbedtls_ctr_drbg_context rngDrbg;
+static SemaphoreHandle_t rngMutex = NULL;   // The DRBG and the pool are shared between tasks
+static TaskHandle_t rngTask = NULL;         // Notified when the pool needs a refill
+
+static uint8_t rngPool[RNG_POOL_SIZE];
+static uint16_t rngPoolLeft = 0;            // Unused bytes, taken from the end of the pool
+
+/**
+ * Random callback with the mbedtls f_rng signature, to be passed with a
+ * NULL context to the mbedtls functions that need randomness.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int rngRandom(void* p_rng, unsigned char* output, size_t len) {
+    int ret = 0;
+    size_t chunk;
+
+    xSemaphoreTake(rngMutex, portMAX_DELAY);
+    while (len > 0 && ret == 0) {   // The DRBG limits the size of each request
+        chunk = (len > MBEDTLS_CTR_DRBG_MAX_REQUEST) ? MBEDTLS_CTR_DRBG_MAX_REQUEST : len;
+        ret = mbedtls_ctr_drbg_random(&rngDrbg, output, chunk);
+        output += chunk;
+        len -= chunk;
+    }
+    xSemaphoreGive(rngMutex);
+    return ret;
+}
+
+/**
+ * rngRandom for the long computations on APP_CPU, such as a key generation,
+ * which asks for random bytes for every prime candidate. Once every
+ * RNG_YIELD_PERIOD it sleeps for a tick, so that the idle task of the core
+ * runs and the task watchdog keeps watching it. The context is an int64_t
+ * of the caller, set to 0 before the computation, where the time of the
+ * last yield is kept.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int rngRandomYield(void* p_rng, unsigned char* output, size_t len) {
+    int64_t* mark = (int64_t*) p_rng;
+    int64_t now = esp_timer_get_time();
+
+    if (*mark == 0) {
+        *mark = now;
+    } else if (now - *mark >= RNG_YIELD_PERIOD*1000) {
+        vTaskDelay(1);
+        *mark = esp_timer_get_time();
+    }
+    return rngRandom(NULL, output, len);
+}
+
+/**
+ * Fill output with len random bytes. The bytes are taken from the pool
+ * when it holds enough of them, otherwise straight from the DRBG.
+ *
+ * @return 0 on success, or an mbedtls error code
+ */
+int rngGetBytes(uint8_t* output, uint16_t len) {
+    xSemaphoreTake(rngMutex, portMAX_DELAY);
+    if (len <= rngPoolLeft) {
+        rngPoolLeft -= len;
+        memcpy(output, rngPool + rngPoolLeft, len);
+        bzero(rngPool + rngPoolLeft, len);  // Never hand out the same bytes twice
+        xSemaphoreGive(rngMutex);
+        xTaskNotifyGive(rngTask);           // Refill in the background
+        return 0;
+    }
+    xSemaphoreGive(rngMutex);
+    return rngRandom(NULL, output, len);
+}
+
+static void taskRNG(void *pvParameters) {
+    static const char* TAG = "taskRNG";
+    int ret;
+
+    while(1) {
+        // Either the pool has been used, or it is time to reseed
+        if (ulTaskNotifyTake(pdTRUE, (RNG_RESEED_PERIOD*1000)/portTICK_PERIOD_MS) == 0) {
+            xSemaphoreTake(rngMutex, portMAX_DELAY);
+            ret = mbedtls_ctr_drbg_reseed(&rngDrbg, NULL, 0);
+            xSemaphoreGive(rngMutex);
+            if (ret != 0) {
+                ESP_LOGE(TAG, "mbedtls_ctr_drbg_reseed returned %d", ret);
+            }
+        }
+
+        xSemaphoreTake(rngMutex, portMAX_DELAY);
+        if (rngPoolLeft < RNG_POOL_SIZE) {
+            if ((ret = mbedtls_ctr_drbg_random(&rngDrbg, rngPool, RNG_POOL_SIZE)) == 0) {
+                rngPoolLeft = RNG_POOL_SIZE;
+            } else {
+                ESP_LOGE(TAG, "mbedtls_ctr_drbg_random returned %d", ret);
+            }
+        }
+        xSemaphoreGive(rngMutex);
+    }
+}
+
+/**
+ * Seed the DRBG, fill the pool and start the reseeding task. Has to be
+ * called once, before any other function of this file.
+ *
+ * @return 0 on success, 1 on failure
+ */
+uint8_t rngInit() {
+    static const char* TAG = "rngInit";
+    const char* pers = "WiFi-Smartcard";
+    int ret;
+
+    mbedtls_ctr_drbg_init(&rngDrbg);
+    mbedtls_entropy_init(&rngEntropy);
+    if ((ret = mbedtls_ctr_drbg_seed(&rngDrbg, mbedtls_entropy_func, &rngEntropy,
+                               (const unsigned char *) pers, strlen(pers))) != 0) {
+        ESP_LOGE(TAG, "mbedtls_ctr_drbg_seed returned %d", ret);
+        goto exitRI;
+    }
+
+    if ((ret = mbedtls_ctr_drbg_random(&rngDrbg, rngPool, RNG_POOL_SIZE)) != 0) {
+        ESP_LOGE(TAG, "mbedtls_ctr_drbg_random returned %d", ret);
+        goto exitRI;
+    }
+    rngPoolLeft = RNG_POOL_SIZE;
+
+    if ((rngMutex = xSemaphoreCreateMutex()) == NULL) {
+        goto exitRI;
+    }
+    if (xTaskCreate(&taskRNG, "taskRNG", 4096, NULL, 4, &rngTask) != pdPASS) {
+        goto exitRI;
+    }
+    diagTask(rngTask, 4096);
+    ESP_LOGI(TAG, "SUCCESS");
+    return 0;
+
+exitRI:
+    mbedtls_ctr_drbg_free(&rngDrbg);
+    mbedtls_entropy_free(&rngEntropy);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Latency statistics of the APDU commands.
+ *
+ * Every command is counted in a bucket of its INS and P1P2,
+ * along with the commands that ended with an error status.
+ * The time spent in each phase of the command is added to a
+ * histogram of its bucket, with log2 bins of microseconds.
+ * The counters are always on, each command only costs a few
+ * reads of the timer and a few increments.
+ *
+ * The statistics are read and reset with the custom INS 56:
+ *    P1 = 00: Read the bucket P2, 6A88 once P2 is past the last one
+ *    P1 = 01: Reset all of them
+ *
+ * A bucket reads as INS | P1P2 | Count | Errors | Bins, all
+ * big-endian. Count and Errors are 4 bytes, the bins are 2
+ * bytes each, STATS_BINS per phase, in the order of the
+ * STATS_* phases. Bin 0 counts up to 128us, each bin after
+ * that doubles the limit (~2s for the one before the last),
+ * and the last one counts the rest.
+ *
+ * Handles:
+ *    Timing the phases of a command
+ *    The buckets and their histograms
+ *    The output of the statistics APDU
+ */
+#ifndef __LIBSTATS_H__
+#define __LIBSTATS_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#define STATS_PARSE 0           // Parsing the APDU of a frame
+#define STATS_BUTTON 1          // Waiting for the proceed button
+#define STATS_CRYPTO 2          // Processing the command, except for the flash writes
+#define STATS_FLASH 3           // Writing the state and the keys to the flash memory
+#define STATS_WRITE 4           // Writing the response to the socket
+#define STATS_PHASES 5
+
+#define STATS_BINS 16           // Log2 bins of the time of a phase
+#define STATS_BIN_SHIFT 7       // Bin 0 holds up to 2^7 us
+#define STATS_BUCKETS 16        // The last one takes every command that doesn't fit anymore
+#define STATS_RECORD_LENGTH (3 + 4 + 4 + 2*STATS_PHASES*STATS_BINS)
+
+typedef struct statsBucket_t {
+    uint8_t INS;
+    uint16_t P1P2;
+    uint32_t count;             // Commands
+    uint32_t errors;            // Commands that didn't end with 9000
+    uint16_t bins[STATS_PHASES][STATS_BINS];    // Saturate instead of wrapping around
+} statsBucket_t;
+
+static statsBucket_t statsBuckets[STATS_BUCKETS];
+static uint8_t statsUsed = 0;           // Buckets in use
+static int64_t statsFlashTime = 0;      // Flash time of the current command, in us
+static TaskHandle_t statsFlashTask = NULL;  // The task running the command
+
+/**
+ * Add the time since start (from esp_timer_get_time) to the flash time of
+ * the command. Only the writes of the task running it count, not those of
+ * the key pool refilling in the background.
+ */
+void statsFlash(int64_t start) {
+    if (xTaskGetCurrentTaskHandle() == statsFlashTask) {
+        statsFlashTime += esp_timer_get_time() - start;
+    }
+}
+
+// Clear the flash time, at the start of each command, on the task running it
+void statsFlashClear() {
+    statsFlashTime = 0;
+    statsFlashTask = xTaskGetCurrentTaskHandle();
+}
+
+static statsBucket_t* statsFind(uint8_t INS, uint16_t P1P2) {
+    for (uint8_t i = 0; i < statsUsed; i++) {
+        if (statsBuckets[i].INS == INS && statsBuckets[i].P1P2 == P1P2) {
+            return &statsBuckets[i];
+        }
+    }
+    if (statsUsed < STATS_BUCKETS) {
+        statsBucket_t* b = &statsBuckets[statsUsed++];
+        b->INS = INS;
+        b->P1P2 = P1P2;
+        return b;
+    }
+    return &statsBuckets[STATS_BUCKETS-1];  // Out of buckets, lump the rest together
+}
+
+/**
+ * Count a command.
+ *
+ * @param phases Time taken by each phase, in us
+ * @param sw Status word of the response
+ */
+void statsRecord(uint8_t INS, uint16_t P1P2, uint16_t sw, int64_t phases[STATS_PHASES]) {
+    statsBucket_t* b = statsFind(INS, P1P2);
+    b->count++;
+    if (sw != 0x9000) {
+        b->errors++;
+    }
+    for (uint8_t p = 0; p < STATS_PHASES; p++) {
+        uint8_t bin = 0;
+        int64_t t = (phases[p] > 0 ? phases[p] : 0) >> STATS_BIN_SHIFT;
+        while (t > 0 && bin < STATS_BINS - 1) {
+            t >>= 1;
+            bin++;
+        }
+        if (b->bins[p][bin] < 0xFFFF) {
+            b->bins[p][bin]++;
+        }
+    }
+}
+
+void statsReset() {
+    bzero(statsBuckets, sizeof(statsBuckets));
+    statsUsed = 0;
+}
+
+/**
+ * Write the bucket index to out, as described above.
+ *
+ * @return Length written to out, 0 if there is no such bucket
+ */
+uint16_t statsOutput(uint8_t index, uint8_t* out) {
+    uint16_t offset = 0;
+
+    if (index >= statsUsed) {
+        return 0;
+    }
+    statsBucket_t* b = &statsBuckets[index];
+    out[offset++] = b->INS;
+    out[offset++] = (uint8_t) (b->P1P2 >> 8);
+    out[offset++] = (uint8_t) (b->P1P2 & 0x00FF);
+    for (int8_t s = 24; s >= 0; s -= 8) {
+        out[offset++] = (uint8_t) (b->count >> s);
+    }
+    for (int8_t s = 24; s >= 0; s -= 8) {
+        out[offset++] = (uint8_t) (b->errors >> s);
+    }
+    for (uint8_t p = 0; p < STATS_PHASES; p++) {
+        for (uint8_t i = 0; i < STATS_BINS; i++) {
+            out[offset++] = (uint8_t) (b->bins[p][i] >> 8);
+            out[offset++] = (uint8_t) (b->bins[p][i] & 0x00FF);
+        }
+    }
+    return offset;
+}
+
+#endif
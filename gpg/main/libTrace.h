@@ -0,0 +1,145 @@
+/*
+ * Trace of the APDU commands and responses.
+ *
+ * The APDU path only copies a binary record into a ring
+ * buffer, the printing to the UART is left to a task with
+ * the lowest priority. There is one writer (taskConnect) and
+ * one reader (taskTrace), both on PRO_CPU, so the ring needs
+ * no lock: each side only moves its own index. When the ring
+ * is full the record is dropped and counted, the APDU path
+ * never waits for the UART.
+ *
+ * The level is set with the custom INS 57, P1 = TRACE_*:
+ *    00: Off
+ *    01: CLA INS P1 P2 of the commands, SW of the responses
+ *    02: Complete commands and responses
+ *
+ * Handles:
+ *    The trace ring buffer and its level
+ *    Printing the records
+ */
+#ifndef __LIBTRACE_H__
+#define __LIBTRACE_H__
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "libDiag.h"
+
+#define TRACE_OFF 0
+#define TRACE_HEADER 1
+#define TRACE_FULL 2
+
+#define TRACE_COMMAND 0x43      // 'C'
+#define TRACE_RESPONSE 0x52     // 'R'
+
+#define TRACE_RING_SIZE 4096    // Has to be a power of 2
+#define TRACE_DRAIN_PERIOD 100  // Milliseconds between two runs of taskTrace
+
+typedef struct traceHeader_t {
+    uint8_t kind;               // TRACE_COMMAND or TRACE_RESPONSE
+    uint16_t stored;            // Bytes of the APDU that follow
+    uint16_t length;            // Length of the whole APDU
+    uint32_t time;              // Milliseconds since boot
+} __attribute__((packed)) traceHeader_t;
+
+uint8_t traceLevel = TRACE_OFF;
+
+static uint8_t traceRing[TRACE_RING_SIZE];
+static volatile uint32_t traceHead = 0;     // Only moved by traceRecord
+static volatile uint32_t traceTail = 0;     // Only moved by taskTrace
+static volatile uint32_t traceDropped = 0;  // Records that didn't fit
+
+// Copy len bytes to the ring, starting at pos
+static void traceWrite(uint32_t pos, const uint8_t* data, uint16_t len) {
+    uint32_t offset = pos & (TRACE_RING_SIZE - 1);
+    uint32_t first = (len < TRACE_RING_SIZE - offset) ? len : TRACE_RING_SIZE - offset;
+    memcpy(traceRing + offset, data, first);
+    memcpy(traceRing, data + first, len - first);
+}
+
+// Copy len bytes from the ring, starting at pos
+static void traceRead(uint32_t pos, uint8_t* data, uint16_t len) {
+    uint32_t offset = pos & (TRACE_RING_SIZE - 1);
+    uint32_t first = (len < TRACE_RING_SIZE - offset) ? len : TRACE_RING_SIZE - offset;
+    memcpy(data, traceRing + offset, first);
+    memcpy(data + first, traceRing, len - first);
+}
+
+/**
+ * Add a command or a response to the trace, as much of it as the level
+ * asks for. Only called from the APDU path.
+ *
+ * @param kind TRACE_COMMAND or TRACE_RESPONSE
+ */
+void traceRecord(uint8_t kind, const uint8_t* data, uint16_t len) {
+    traceHeader_t header;
+
+    if (traceLevel == TRACE_OFF) {
+        return;
+    }
+
+    header.kind = kind;
+    header.length = len;
+    header.time = (uint32_t) (esp_timer_get_time() / 1000);
+    header.stored = len;
+    if (traceLevel == TRACE_HEADER) {
+        if (kind == TRACE_COMMAND) {
+            header.stored = (len < 4) ? len : 4;        // CLA INS P1 P2
+        } else {
+            header.stored = (len < 2) ? len : 2;        // SW1 SW2
+            data += len - header.stored;
+        }
+    }
+
+    uint32_t head = traceHead;
+    if (sizeof(header) + header.stored > TRACE_RING_SIZE - (head - traceTail)) {
+        traceDropped++;
+        return;
+    }
+    traceWrite(head, (uint8_t*) &header, sizeof(header));
+    traceWrite(head + sizeof(header), data, header.stored);
+    traceHead = head + sizeof(header) + header.stored;  // Publish the record
+}
+
+static void taskTrace(void *pvParameters) {
+    static uint8_t data[TRACE_RING_SIZE];
+    traceHeader_t header;
+    uint32_t reported = 0;
+
+    while(1) {
+        while (traceTail != traceHead) {
+            uint32_t tail = traceTail;
+            traceRead(tail, (uint8_t*) &header, sizeof(header));
+            traceRead(tail + sizeof(header), data, header.stored);
+            traceTail = tail + sizeof(header) + header.stored;  // Free the record
+
+            printf("%c %u ms\tLength: %d\t", header.kind, header.time, header.length);
+            for (uint16_t i = 0; i < header.stored; i++) {
+                printf("%02X ", data[i]);
+            }
+            printf((header.stored < header.length) ? "...\n" : "\n");
+        }
+        if (traceDropped != reported) {
+            reported = traceDropped;
+            printf("Trace: %u records dropped\n", reported);
+        }
+        fflush(stdout);
+        vTaskDelay(TRACE_DRAIN_PERIOD/portTICK_PERIOD_MS);
+    }
+}
+
+/**
+ * Start the task that prints the trace.
+ *
+ * @param level The level to start with
+ */
+void traceInit(uint8_t level) {
+    traceLevel = level;
+    TaskHandle_t handle = NULL;
+    xTaskCreatePinnedToCore(&taskTrace, "taskTrace", 3072, NULL, 1, &handle, PRO_CPU_NUM);
+    diagTask(handle, 3072);
+}
+
+#endif
@@ -52,6 +52,6 @@ char* IP[NUMOFNETS] = {
     IP0, IP1, IP2, IP3
 };
 
-int nextNet, currNet;
+int currNet;    // The network in use, selected in gpg.c
 
 #endif
\ No newline at end of file
@@ -1,4 +1,8 @@
 #!/bin/sh
+# The PSK file of vpcd-relay. Until it exists, the relay makes it and pairs the first ESP32
+# whose button is pressed. Empty for a firmware built with PLAINTEXT (gpg/main/gpg.c), the only
+# one that vicc --esp32 can serve when vpcd-relay isn't installed
+PSK=/etc/vpcd-relay.psk
 while true
 do
 	if [ ! `pgrep pcscd` ] ; then
@@ -8,7 +12,18 @@ do
 			exit
 		fi
 	fi
-	if [ ! `pgrep vicc` ] ; then
+	if [ -x /usr/local/bin/vpcd-relay ] ; then
+		if [ ! `pgrep vpcd-relay` ] ; then
+			PAIR=
+			if [ -n "$PSK" ] && [ ! -e "$PSK" ] ; then
+				PAIR=-p
+			fi
+			/usr/local/bin/vpcd-relay ${PSK:+-k "$PSK"} $PAIR
+		fi
+	elif [ -n "$PSK" ] ; then
+		echo "A firmware built without PLAINTEXT needs vpcd-relay, vicc --esp32 only speaks to a PLAINTEXT one"
+		exit 1
+	elif [ ! `pgrep vicc` ] ; then
 		/usr/local/bin/vicc --esp32
 	fi
 	sleep 2
@@ -0,0 +1,184 @@
+"""
+esp32hostSmoke.py    15/10/2026
+
+SYNOPSIS
+
+    esp32hostSmoke.py path/to/libgpgcard.so
+
+DESCRIPTION
+
+    A smoke test of the card firmware built for the host
+    (gpg/host). The library is loaded through ESP32HostOS,
+    as vicc --type=esp32host does, with its state kept in
+    a temporary directory. A key pair is generated, and
+    SELECT, VERIFY and PSO:CDS are run against it. The
+    card is then started again from the same directory,
+    in a process of its own, and has to sign with the
+    same key. Each status word is checked, and so is
+    each signature, against the public key.
+
+    Exits with 0 if every check passed.
+"""
+import os
+import sys
+import shutil
+import hashlib
+import tempfile
+import binascii
+import subprocess
+
+VPICC = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                     "..", "virtualsmartcard-0.8", "src", "vpicc")
+sys.path.insert(0, VPICC)
+
+from virtualsmartcard.CardGenerator import CardGenerator
+from virtualsmartcard.cards.ESP32Host import ESP32HostOS
+
+SELECT = "\x00\xA4\x04\x00\x06\xD2\x76\x00\x01\x24\x01"
+INVALIDATE = "\x00\x55\x00\x00\x00"
+PW1 = "123456"
+PW3 = "12345678"
+# DigestInfo prefix of SHA-256 (PKCS #1 v1.5)
+SHA256_PREFIX = binascii.unhexlify("3031300d060960864801650304020105000420")
+
+failures = 0
+
+
+def check(name, sw, expected):
+    global failures
+    if sw in expected:
+        print "OK    %-40s %04X" % (name, sw)
+    else:
+        print "FAIL  %-40s %04X, expected %s" % (name, sw,
+              " or ".join("%04X" % e for e in expected))
+        failures += 1
+
+
+def transmit(card, apdu):
+    """ Run apdu, and collect the rest of the response with GET RESPONSE """
+    response = card.execute(apdu)
+    data, sw = response[:-2], ord(response[-2]) << 8 | ord(response[-1])
+    while sw & 0xFF00 == 0x6100:
+        response = card.execute("\x00\xC0\x00\x00" + chr(sw & 0xFF))
+        data += response[:-2]
+        sw = ord(response[-2]) << 8 | ord(response[-1])
+    return data, sw
+
+
+def tlv(data, tag):
+    """ Value of the first tag (1 or 2 bytes) in data, searching nested TLVs """
+    i = 0
+    while i < len(data):
+        t = ord(data[i])
+        i += 1
+        if t & 0x1F == 0x1F:
+            t = t << 8 | ord(data[i])
+            i += 1
+        length = ord(data[i])
+        i += 1
+        if length & 0x80:
+            n = length & 0x7F
+            length = int(binascii.hexlify(data[i:i+n]), 16)
+            i += n
+        value = data[i:i+length]
+        if t == tag:
+            return value
+        if t in (0x7F49, 0x65, 0x6E, 0x73):     # Constructed
+            found = tlv(value, tag)
+            if found is not None:
+                return found
+        i += length
+    return None
+
+
+def verify(name, card, pin, p2):
+    data, sw = transmit(card, "\x00\x20\x00" + chr(p2) + chr(len(pin)) + pin)
+    check(name, sw, [0x9000])
+
+
+def sign(card, n, e, message):
+    digest = SHA256_PREFIX + hashlib.sha256(message).digest()
+    verify("VERIFY PW1 (81)", card, PW1, 0x81)
+    sig, sw = transmit(card, "\x00\x2A\x9E\x9A" + chr(len(digest)) + digest +
+                       "\x00")
+    check("PSO:CDS", sw, [0x9000])
+    if sw != 0x9000:
+        return
+    # PKCS #1 v1.5: 00 01 FF .. FF 00 DigestInfo
+    k = (n.bit_length() + 7) // 8
+    expected = "\x00\x01" + "\xFF" * (k - 3 - len(digest)) + "\x00" + digest
+    m = pow(int(binascii.hexlify(sig), 16), e, n)
+    good = m == int(binascii.hexlify(expected), 16)
+    check("Signature of PSO:CDS", 0x9000 if good else 0x6F00, [0x9000])
+
+
+def open_card(lib, state):
+    mf, sam = CardGenerator("esp32host").getCard()
+    card = ESP32HostOS(mf, sam, lib, state)
+    data, sw = transmit(card, INVALIDATE)
+    check("INVALIDATE (INS 55)", sw, [0x9000])
+    data, sw = transmit(card, SELECT)
+    check("SELECT", sw, [0x9000])
+    return card
+
+
+def first(lib, state):
+    card = open_card(lib, state)
+
+    data, sw = transmit(card, "\x00\x20\x00")
+    check("Frame shorter than a header", sw, [0x6700])
+    data, sw = transmit(card, "\x00\x20\x00\x81\x08" + PW1)
+    check("Data shorter than Lc", sw, [0x6700])
+    data, sw = transmit(card, "\x00\x20\x00\x81\x06" + "654321")
+    check("VERIFY PW1 (81), wrong PIN", sw, [0x6982])
+
+    verify("VERIFY PW3", card, PW3, 0x83)
+    key, sw = transmit(card, "\x00\x47\x80\x00\x00\x00\x02\xB6\x00\x00\x00")
+    check("GENERATE ASYMMETRIC KEY PAIR (B6)", sw, [0x9000])
+    if sw != 0x9000:
+        return None
+    n = int(binascii.hexlify(tlv(key, 0x81)), 16)
+    e = int(binascii.hexlify(tlv(key, 0x82)), 16)
+
+    sign(card, n, e, "first")
+    sign(card, n, e, "second")
+    data, sw = transmit(card, "\x00\x2A\x9E\x9A\x03\x01\x02\x03\x00")
+    check("PSO:CDS without VERIFY", sw, [0x6982])
+    return n, e
+
+
+def again(lib, state, n, e):
+    card = open_card(lib, state)
+    sign(card, n, e, "after a restart")
+
+
+def main():
+    global failures
+    if len(sys.argv) == 6 and sys.argv[1] == "--again":
+        again(sys.argv[2], sys.argv[3], int(sys.argv[4], 16), int(sys.argv[5], 16))
+        sys.exit(1 if failures else 0)
+    if len(sys.argv) != 2:
+        print "Usage: %s path/to/libgpgcard.so" % sys.argv[0]
+        sys.exit(2)
+
+    lib = os.path.abspath(sys.argv[1])
+    state = tempfile.mkdtemp(prefix="esp32host-")
+    try:
+        key = first(lib, state)
+        if key is not None:
+            print "... starting the card again from %s" % state
+            sys.stdout.flush()
+            if subprocess.call([sys.executable, os.path.abspath(__file__),
+                                "--again", lib, state, "%x" % key[0],
+                                "%x" % key[1]]) != 0:
+                failures += 1
+    finally:
+        shutil.rmtree(state)
+
+    print "%s, %d failure(s)" % ("PASSED" if failures == 0 else "FAILED",
+                                  failures)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -20,12 +20,20 @@ DESCRIPTION
     on the ESP32 in order to measure the time 
     that was taken in order to complete each 
     operation.
+
+    The firmware must be built with PLAINTEXT (see
+    gpg/main/gpg.c). The default build encrypts the
+    session, which only vpcd-relay speaks.
 """
+import os
 import sys
 import time
 import numpy
 import base64
 import threading
+import select
+import socket
+import struct
 import SocketServer
 from random import randint
 from getpass import getpass
@@ -855,8 +863,32 @@ def setPinRetries():
         print "\tOperation failed\n"
 
 
+KEEPALIVE = 10      # Seconds of inactivity after which a keep-alive is sent
+CHANNEL_MAGIC = "WSC1"  # The hello of a firmware built without PLAINTEXT
+HELLO_WAIT = 1      # Seconds to wait for that hello at the start of a session
+
+
+def recvall(sock, size):
+    msg = ""
+    while len(msg) < size:
+        chunk = sock.recv(size - len(msg))
+        if not chunk:
+            raise SocketError("ESP32 closed the session")
+        msg += chunk
+    return msg
+
+
+def sendFrame(sock, msg):   # Every message is prefixed with its length on 2 bytes
+    sock.sendall(struct.pack('!H', len(msg)) + str(msg))
+
+
+def recvFrame(sock):
+    size = struct.unpack('!H', recvall(sock, 2))[0]
+    return recvall(sock, size)
+
+
 class handleConnection(SocketServer.BaseRequestHandler):
-    def handle(self):
+    def handle(self):       # One session with the ESP32, kept open between commands
         global command      # The command APDU
         global response     # The response APDU
         global condCommand  # Condition to wait until a new APDU command arrives
@@ -865,20 +897,44 @@ class handleConnection(SocketServer.BaseRequestHandler):
         global processing   # Flag for the run function that the processing has finished
         global err          # Flag for the run function that an error happened
 
-        with condCommand:
-            while (newCommand == 0):
-                condCommand.wait()
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
 
-        with condResponse:
+        # Without PLAINTEXT the firmware opens the session with the hello of
+        # its encrypted channel, which only vpcd-relay speaks
+        if select.select([self.request], [], [], HELLO_WAIT)[0]:
             try:
-                self.request.sendall(command)   # Send the command APDU to the ESP32
-                response = self.request.recv(257).strip()   # Get the response APDU
-            except SocketError:     # ESP32 probably disconnected
-                err = 1             # Set the error flag
+                hello = recvFrame(self.request)
+            except SocketError:
+                return
+            if hello.startswith(CHANNEL_MAGIC):
+                print "\nThe firmware was built without PLAINTEXT and needs vpcd-relay"
+                os._exit(1)
 
-            processing = 0          # Processing finished, got the response
-            newCommand = 0          # Reset the newCommand flag
-            condResponse.notify()
+        while True:
+            with condCommand:
+                if (newCommand == 0):
+                    condCommand.wait(KEEPALIVE)
+                if (newCommand == 0):   # Nothing to send, keep the session alive
+                    try:
+                        sendFrame(self.request, "")
+                        recvFrame(self.request)
+                    except SocketError:
+                        return
+                    continue
+
+            with condResponse:
+                try:
+                    sendFrame(self.request, command)    # Send the command APDU to the ESP32
+                    response = recvFrame(self.request)  # Get the response APDU
+                except SocketError:     # ESP32 probably disconnected
+                    err = 1             # Set the error flag
+
+                processing = 0          # Processing finished, got the response
+                newCommand = 0          # Reset the newCommand flag
+                condResponse.notify()
+
+            if (err == 1):
+                return
 
 
 if __name__ == '__main__':
@@ -898,6 +954,7 @@ if __name__ == '__main__':
     global processing   # Flag for the run function that the processing has finished
     global err          # Flag for the run function that an error happened
 
+    newCommand = 0      # The ESP32 may connect before the first command
     condCommand = threading.Condition()
     condResponse = threading.Condition()
 
@@ -34,7 +34,12 @@
 /* pcscd allows at most 16 readers. Apple's SmartCardServices on OS X 10.10
  * freaks out if more than 8 slots are registered. We want only two slots... */
 //#define VICC_MAX_SLOTS (VPCDSLOTS <= PCSCLITE_MAX_READERS_CONTEXTS ? VPCDSLOTS : PCSCLITE_MAX_READERS_CONTEXTS)
+#ifdef VPCDMUX
+/* A fleet of tokens shares a single port, one slot each */
+#define VICC_MAX_SLOTS (VPCDSLOTS <= PCSCLITE_MAX_READERS_CONTEXTS ? VPCDSLOTS : PCSCLITE_MAX_READERS_CONTEXTS)
+#else
 #define VICC_MAX_SLOTS 1    // MODIFIED CODE: We don't really need more than 1
+#endif
 
 const unsigned char vicc_max_slots = VICC_MAX_SLOTS;
 
@@ -106,6 +111,512 @@ void log_msg(const int priority, const char *fmt, ...)
 static struct vicc_ctx *ctx[VICC_MAX_SLOTS];
 const char *hostname = NULL;
 static const char openport[] = "/dev/null";
+#ifdef VPCDMUX
+/* listener of the slots waiting on the shared port, and how many these are */
+static struct vicc_mux *mux = NULL;
+static size_t mux_users = 0;
+
+/* all slots wait on the port of the first one */
+#define WAIT_PORT(Channel, slot) (Channel)
+
+static struct vicc_ctx *init_muxed(unsigned short port)
+{
+    struct vicc_ctx *r;
+
+    if (!mux) {
+        mux = vicc_mux_init(port);
+        if (!mux) {
+            Log2(PCSC_LOG_ERROR, "Could not open port %hu for virtual ICCs", port);
+            return NULL;
+        }
+    }
+
+    r = vicc_init_muxed(mux);
+    if (r) {
+        mux_users++;
+    } else if (!mux_users) {
+        vicc_mux_exit(mux);
+        mux = NULL;
+    }
+
+    return r;
+}
+#else
+#define WAIT_PORT(Channel, slot) ((Channel)+(slot))
+#endif
+
+#ifdef VPCDPOOL
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* The last POOL_FRONTS slots are the pool: readers without a token of their
+ * own, in front of the tokens in the other slots, which all carry the same
+ * key.
+ *
+ * A client of the pool leases a token, which serves nobody else meanwhile.
+ * A client that hasn't sent a VERIFY gives the token back after each APDU,
+ * so the next one goes to whichever token is free. Once it has sent a
+ * VERIFY, the PIN state lives on its token: it keeps the token until it
+ * releases it, resets the pool or is silent for POOL_IDLE_MS, and the token
+ * is reset before it serves anybody else. A transaction keeps the token,
+ * too.
+ *
+ * A token that is gone or fails a transmit is left alone for
+ * POOL_BACKOFF_MS. The APDU is sent again to another token if the client
+ * had no PIN state, otherwise the transmit fails and the client has to
+ * start over, as with a card that was pulled.
+ *
+ * The lease goes by the slot of the pool, as pcscd runs the transmits of a
+ * slot one at a time and the card handles of pcsclite-vpcd are the slots: the
+ * clients of one slot share its token and PIN state. Build with
+ * VPCDPOOLFRONTS set to keep as many tokens busy at once.
+ *
+ * Nothing talks to a token with pool_lock held, as a transmit may take as
+ * long as a press of its button: the leases go by the presence of the
+ * tokens as last checked (pool_refresh), and the tokens given back with PIN
+ * state are reset once the lock is released (pool_flush). */
+#ifndef VPCDPOOLFRONTS
+#define VPCDPOOLFRONTS 1
+#endif
+#define POOL_FRONTS VPCDPOOLFRONTS
+/* the first slot of the pool, which is the number of tokens, too */
+#define POOL_SLOT (VICC_MAX_SLOTS - POOL_FRONTS)
+#define POOL_MAX_LEASES 64
+#define POOL_IDLE_MS 30000
+#define POOL_BACKOFF_MS 10000
+/* how long a client waits for a free token */
+#define POOL_WAIT_MS 30000
+
+#define IS_POOL(slot) ((slot) >= POOL_SLOT)
+
+struct lease {
+    int used;
+    unsigned long client;
+    /* slot of the token, -1 for none */
+    int member;
+    /* the token has PIN state of the client */
+    int verified;
+    /* transactions begun and not ended yet */
+    size_t held;
+    long long last;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct lease leases[POOL_MAX_LEASES];
+/* the lease of each token, or NULL */
+static struct lease *leased[VICC_MAX_SLOTS];
+static long long down_until[VICC_MAX_SLOTS];
+/* presence of each token as last checked */
+static int present[VICC_MAX_SLOTS];
+/* leased[] of a token to be reset before it serves anybody else, and of one
+ * being reset */
+static struct lease pool_dirty, pool_resetting;
+/* the token after the last one leased is tried first */
+static size_t pool_next = 0;
+/* incremented by ifd_vpcd_cancel for the pool */
+static unsigned long pool_cancels = 0;
+/* slots of the pool with an open channel */
+static size_t pool_fronts = 0;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Called with the lock */
+static int pool_healthy(size_t member)
+{
+    return ctx[member] && now_ms() >= down_until[member] && present[member];
+}
+
+/* Check the presence of the tokens that are neither leased nor down.
+ * Called without the lock */
+static void pool_refresh(void)
+{
+    size_t member;
+    int skip, p;
+
+    for (member = 0; member < POOL_SLOT; member++) {
+        pthread_mutex_lock(&pool_lock);
+        skip = !ctx[member] || leased[member] || now_ms() < down_until[member];
+        pthread_mutex_unlock(&pool_lock);
+        if (skip)
+            continue;
+
+        p = vicc_present(ctx[member]) == 1;
+
+        pthread_mutex_lock(&pool_lock);
+        present[member] = p;
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/* Reset the tokens given back with PIN state, then free them. Called
+ * without the lock */
+static void pool_flush(void)
+{
+    size_t member;
+    int reset;
+
+    for (member = 0; member < POOL_SLOT; member++) {
+        pthread_mutex_lock(&pool_lock);
+        reset = leased[member] == &pool_dirty;
+        if (reset)
+            leased[member] = &pool_resetting;
+        pthread_mutex_unlock(&pool_lock);
+        if (!reset)
+            continue;
+
+        if (vicc_reset(ctx[member]) < 0)
+            Log2(PCSC_LOG_ERROR, "Could not reset token in slot %d", (int) member);
+
+        pthread_mutex_lock(&pool_lock);
+        leased[member] = NULL;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/* Give the token of l back, it is reset by pool_flush if it has PIN state.
+ * Called with the lock */
+static void pool_return(struct lease *l, int reset)
+{
+    if (l->member >= 0) {
+        if (reset && l->verified) {
+            leased[l->member] = &pool_dirty;
+        } else {
+            leased[l->member] = NULL;
+            pthread_cond_broadcast(&pool_cond);
+        }
+        l->member = -1;
+    }
+    l->verified = 0;
+    if (!l->held)
+        l->used = 0;
+}
+
+static struct lease *pool_lease(unsigned long client, int create)
+{
+    struct lease *free_lease = NULL;
+    size_t i;
+
+    for (i = 0; i < POOL_MAX_LEASES; i++) {
+        if (leases[i].used && leases[i].client == client)
+            return &leases[i];
+        if (!leases[i].used && !free_lease)
+            free_lease = &leases[i];
+    }
+    if (!create || !free_lease) {
+        if (create)
+            errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(free_lease, 0, sizeof *free_lease);
+    free_lease->used = 1;
+    free_lease->client = client;
+    free_lease->member = -1;
+
+    return free_lease;
+}
+
+/* Reset the tokens of the clients that went quiet. Called with the lock */
+static void pool_expire(void)
+{
+    long long now = now_ms();
+    size_t i;
+
+    for (i = 0; i < POOL_MAX_LEASES; i++) {
+        if (leases[i].used && leases[i].member >= 0
+                && now - leases[i].last > POOL_IDLE_MS)
+            pool_return(&leases[i], 1);
+    }
+}
+
+static void pool_wait(long long until)
+{
+    struct timeval tv;
+    struct timespec ts;
+    long long left = until - now_ms();
+
+    if (left <= 0)
+        return;
+    /* a token that backs off may be back before anyone returns a lease */
+    if (left > POOL_BACKOFF_MS)
+        left = POOL_BACKOFF_MS;
+
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + left / 1000;
+    ts.tv_nsec = tv.tv_usec * 1000 + (left % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&pool_cond, &pool_lock, &ts);
+}
+
+/* Lease a free and healthy token to l. Called with the lock, which is
+ * released meanwhile */
+static int pool_acquire(struct lease *l)
+{
+    unsigned long cancels = pool_cancels;
+    long long until = now_ms() + POOL_WAIT_MS;
+    size_t i, member, healthy;
+    int refreshed = 0;
+
+    while (1) {
+        pool_expire();
+        healthy = 0;
+        for (i = 0; i < POOL_SLOT; i++) {
+            member = (pool_next + i) % POOL_SLOT;
+            if (leased[member]) {
+                /* busy, but there */
+                if (ctx[member])
+                    healthy++;
+                continue;
+            }
+            if (!pool_healthy(member))
+                continue;
+            healthy++;
+            leased[member] = l;
+            l->member = (int) member;
+            l->verified = 0;
+            pool_next = member + 1;
+            return 0;
+        }
+
+        if (!refreshed) {
+            /* a token may have come back or been freed by a reset */
+            refreshed = 1;
+            pthread_mutex_unlock(&pool_lock);
+            pool_flush();
+            pool_refresh();
+            pthread_mutex_lock(&pool_lock);
+            continue;
+        }
+        refreshed = 0;
+
+        if (pool_cancels != cancels) {
+            errno = ECANCELED;
+            return -1;
+        }
+        if (now_ms() >= until) {
+            errno = healthy ? ETIMEDOUT : ENODEV;
+            return -1;
+        }
+        pool_wait(until);
+    }
+}
+
+static RESPONSECODE pool_transmit(unsigned long client, PUCHAR TxBuffer,
+        DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength)
+{
+    struct lease *l;
+    ssize_t size = -1;
+    int member, e = ENODEV;
+    size_t attempt;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_expire();
+    l = pool_lease(client, 1);
+    if (!l) {
+        Log1(PCSC_LOG_ERROR, "Too many clients of the pool");
+        pthread_mutex_unlock(&pool_lock);
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    for (attempt = 0; attempt < POOL_SLOT; attempt++) {
+        if (l->member < 0 && pool_acquire(l) < 0) {
+            e = errno;
+            break;
+        }
+        member = l->member;
+        if (TxLength >= 2 && TxBuffer[1] == 0x20)
+            /* VERIFY: from now on the PIN state is on this token */
+            l->verified = 1;
+        l->last = now_ms();
+
+        pthread_mutex_unlock(&pool_lock);
+        size = vicc_transmit_into(ctx[member], TxLength, TxBuffer,
+                *RxLength, RxBuffer);
+        e = errno;
+        pthread_mutex_lock(&pool_lock);
+
+        if (size >= 0) {
+            l->last = now_ms();
+            if (!l->verified && !l->held
+                    && !vicc_sequence_continues(TxLength, TxBuffer,
+                        (size_t) size, RxBuffer))
+                pool_return(l, 0);
+            break;
+        }
+        if (e == ENOBUFS || e == ECANCELED)
+            break;
+
+        Log2(PCSC_LOG_ERROR, "Token in slot %d failed, leaving it alone", member);
+        down_until[member] = now_ms() + POOL_BACKOFF_MS;
+        present[member] = 0;
+        if (l->verified || l->held) {
+            /* the state of the client is lost with the token */
+            l->held = 0;
+            pool_return(l, 0);
+            break;
+        }
+        pool_return(l, 0);
+    }
+
+    if (size < 0 && !l->held && l->member < 0)
+        l->used = 0;
+    pthread_mutex_unlock(&pool_lock);
+    pool_flush();
+
+    if (size < 0) {
+        if (e == ETIMEDOUT) {
+            Log1(PCSC_LOG_ERROR, "Timeout waiting for a token of the pool");
+            errno = e;
+            return IFD_RESPONSE_TIMEOUT;
+        }
+        if (e == ENODEV)
+            Log1(PCSC_LOG_ERROR, "No token of the pool is available");
+        errno = e;
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    *RxLength = size;
+    return IFD_SUCCESS;
+}
+
+static int pool_present(void)
+{
+    size_t member;
+    int r = 0;
+
+    pool_refresh();
+    pthread_mutex_lock(&pool_lock);
+    for (member = 0; member < POOL_SLOT && !r; member++) {
+        if ((leased[member] && ctx[member]) || pool_healthy(member))
+            r = 1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return r;
+}
+
+/* ATR of the token of client, or of the first healthy one */
+static ssize_t pool_getatr(unsigned long client, unsigned char **atr)
+{
+    struct lease *l;
+    size_t member;
+    int m = -1;
+
+    pool_refresh();
+    pthread_mutex_lock(&pool_lock);
+    l = pool_lease(client, 0);
+    if (l)
+        m = l->member;
+    for (member = 0; member < POOL_SLOT && m < 0; member++) {
+        if (pool_healthy(member))
+            m = (int) member;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (m >= 0)
+        return vicc_getatr(ctx[m], atr);
+    return 0;
+}
+
+RESPONSECODE
+ifd_vpcd_pool_transmit (DWORD Lun, unsigned long client, PUCHAR TxBuffer,
+        DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength)
+{
+    if (!IS_POOL(Lun & 0xffff) || !RxLength) {
+        if (RxLength)
+            *RxLength = 0;
+        return IFD_COMMUNICATION_ERROR;
+    }
+    return pool_transmit(client, TxBuffer, TxLength, RxBuffer, RxLength);
+}
+
+int
+ifd_vpcd_pool_hold (unsigned long client, int hold)
+{
+    struct lease *l;
+    int r = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    l = pool_lease(client, hold);
+    if (!l) {
+        r = -1;
+    } else if (hold) {
+        l->held++;
+    } else if (!l->held) {
+        errno = EPERM;
+        r = -1;
+    } else if (--l->held == 0 && !l->verified) {
+        pool_return(l, 0);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return r;
+}
+
+void
+ifd_vpcd_pool_release (unsigned long client)
+{
+    struct lease *l;
+
+    pthread_mutex_lock(&pool_lock);
+    l = pool_lease(client, 0);
+    if (l) {
+        l->held = 0;
+        pool_return(l, 1);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    pool_flush();
+}
+
+int
+ifd_vpcd_is_pool (DWORD Lun)
+{
+    return IS_POOL(Lun & 0xffff);
+}
+
+/* State of each token as IFD_VPCD_CTL_POOL describes */
+static RESPONSECODE control_pool (PUCHAR RxBuffer, DWORD RxLength,
+        LPDWORD pdwBytesReturned)
+{
+    size_t member;
+
+    if (!RxBuffer || !pdwBytesReturned || RxLength < POOL_SLOT) {
+        Log1(PCSC_LOG_ERROR, "Not enough memory for the state of the pool");
+        return IFD_ERROR_INSUFFICIENT_BUFFER;
+    }
+
+    pool_refresh();
+    pthread_mutex_lock(&pool_lock);
+    for (member = 0; member < POOL_SLOT; member++) {
+        if (!ctx[member])
+            RxBuffer[member] = IFD_VPCD_POOL_ABSENT;
+        else if (now_ms() < down_until[member])
+            RxBuffer[member] = IFD_VPCD_POOL_DOWN;
+        else if (leased[member])
+            RxBuffer[member] = IFD_VPCD_POOL_LEASED;
+        else if (!present[member])
+            RxBuffer[member] = IFD_VPCD_POOL_ABSENT;
+        else
+            RxBuffer[member] = IFD_VPCD_POOL_FREE;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    *pdwBytesReturned = POOL_SLOT;
+
+    return IFD_SUCCESS;
+}
+#else
+#define IS_POOL(slot) 0
+#endif
 
 RESPONSECODE
 IFDHCreateChannel (DWORD Lun, DWORD Channel)
@@ -114,9 +625,25 @@ IFDHCreateChannel (DWORD Lun, DWORD Channel)
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
+#ifdef VPCDPOOL
+    if (IS_POOL(slot)) {
+        Log3(PCSC_LOG_INFO,
+                "Slot %d is a pool of the tokens in the first %d slots",
+                (int) slot, (int) POOL_SLOT);
+        pthread_mutex_lock(&pool_lock);
+        pool_fronts++;
+        pthread_mutex_unlock(&pool_lock);
+        return IFD_SUCCESS;
+    }
+#endif
     if (!hostname)
         Log2(PCSC_LOG_INFO, "Waiting for virtual ICC on port %hu",
-                (unsigned short) (Channel+slot));
+                (unsigned short) WAIT_PORT(Channel, slot));
+#ifdef VPCDMUX
+    if (!hostname)
+        ctx[slot] = init_muxed((unsigned short) Channel);
+    else
+#endif
     ctx[slot] = vicc_init(hostname, Channel+slot);
     if (!ctx[slot]) {
         Log1(PCSC_LOG_ERROR, "Could not initialize connection to virtual ICC");
@@ -179,10 +706,114 @@ err:
     return r;
 }
 
+static RESPONSECODE
+control_batch (struct vicc_ctx *slot_ctx, PUCHAR TxBuffer, DWORD TxLength,
+        PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
+{
+    unsigned char *rbatch = NULL;
+    ssize_t size;
+    RESPONSECODE r = IFD_COMMUNICATION_ERROR;
+
+    if (!TxBuffer || !RxBuffer || !pdwBytesReturned) {
+        Log1(PCSC_LOG_ERROR, "Invalid input data");
+        return IFD_COMMUNICATION_ERROR;
+    }
+
+    size = vicc_transmit_batch(slot_ctx, TxLength, TxBuffer, &rbatch);
+    if (size < 0) {
+        if (errno == ETIMEDOUT) {
+            Log1(PCSC_LOG_ERROR, "Timeout waiting for the batch of rapdus");
+            r = IFD_RESPONSE_TIMEOUT;
+        } else {
+            Log1(PCSC_LOG_ERROR, "could not send the batch of apdus");
+        }
+        goto err;
+    }
+    if ((size_t) size > RxLength) {
+        Log1(PCSC_LOG_ERROR, "Not enough memory for the batch of rapdus");
+        r = IFD_ERROR_INSUFFICIENT_BUFFER;
+        goto err;
+    }
+
+    memcpy(RxBuffer, rbatch, size);
+    *pdwBytesReturned = (DWORD) size;
+    r = IFD_SUCCESS;
+
+err:
+    free(rbatch);
+
+    return r;
+}
+
 RESPONSECODE
 IFDHControl (DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength,
         PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
 {
+    size_t slot = Lun & 0xffff;
+
+    if (pdwBytesReturned)
+        *pdwBytesReturned = 0;
+
+#ifdef VPCDPOOL
+    if (IS_POOL(slot)) {
+        size_t member;
+
+        switch (dwControlCode) {
+            case IFD_VPCD_CTL_CANCEL:
+                ifd_vpcd_cancel(Lun);
+                return IFD_SUCCESS;
+
+            case IFD_VPCD_CTL_TIMEOUT:
+                /* for all of the tokens */
+                for (member = 0; member < POOL_SLOT; member++) {
+                    RESPONSECODE r = IFDHControl((DWORD) member, dwControlCode,
+                            TxBuffer, TxLength, RxBuffer, RxLength,
+                            pdwBytesReturned);
+                    if (r != IFD_SUCCESS)
+                        return r;
+                }
+                return IFD_SUCCESS;
+
+            case IFD_VPCD_CTL_POOL:
+                return control_pool(RxBuffer, RxLength, pdwBytesReturned);
+
+            default:
+                /* a batch would need a token for all of its APDUs */
+                return IFD_ERROR_NOT_SUPPORTED;
+        }
+    }
+#endif
+
+    switch (dwControlCode) {
+        case IFD_VPCD_CTL_CANCEL:
+            if (slot >= vicc_max_slots)
+                return IFD_COMMUNICATION_ERROR;
+            vicc_cancel(ctx[slot]);
+            return IFD_SUCCESS;
+
+        case IFD_VPCD_CTL_TIMEOUT:
+            if (slot >= vicc_max_slots)
+                return IFD_COMMUNICATION_ERROR;
+            if (!TxBuffer || TxLength != 4) {
+                Log1(PCSC_LOG_ERROR, "Invalid input data");
+                return IFD_COMMUNICATION_ERROR;
+            }
+            vicc_set_timeout(ctx[slot], (long) ((unsigned long) TxBuffer[0] << 24
+                        | (unsigned long) TxBuffer[1] << 16
+                        | (unsigned long) TxBuffer[2] << 8
+                        | (unsigned long) TxBuffer[3]));
+            return IFD_SUCCESS;
+
+        case IFD_VPCD_CTL_BATCH:
+            if (slot >= vicc_max_slots)
+                return IFD_COMMUNICATION_ERROR;
+            return control_batch(ctx[slot], TxBuffer, TxLength,
+                    RxBuffer, RxLength, pdwBytesReturned);
+
+        default:
+            break;
+    }
+
     Log9(PCSC_LOG_DEBUG, "IFDHControl not supported (Lun=%u ControlCode=%u TxBuffer=%p TxLength=%u RxBuffer=%p RxLength=%u pBytesReturned=%p)%s",
             (unsigned int) Lun, (unsigned int) dwControlCode,
             (unsigned char *) TxBuffer, (unsigned int) TxLength,
@@ -200,11 +831,43 @@ IFDHCloseChannel (DWORD Lun)
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
+#ifdef VPCDPOOL
+    if (IS_POOL(slot)) {
+        size_t i;
+
+        pthread_mutex_lock(&pool_lock);
+        if (pool_fronts)
+            pool_fronts--;
+        if (pool_fronts) {
+            /* the other slots of the pool keep their tokens */
+            pthread_mutex_unlock(&pool_lock);
+            ifd_vpcd_pool_release(slot);
+            return IFD_SUCCESS;
+        }
+        for (i = 0; i < POOL_MAX_LEASES; i++) {
+            leases[i].held = 0;
+            pool_return(&leases[i], 1);
+        }
+        pthread_mutex_unlock(&pool_lock);
+        pool_flush();
+        return IFD_SUCCESS;
+    }
+#endif
+#ifdef VPCDMUX
+    int muxed = ctx[slot] && ctx[slot]->mux;
+#endif
     if (vicc_exit(ctx[slot]) < 0) {
         Log1(PCSC_LOG_ERROR, "Could not close connection to virtual ICC");
         return IFD_COMMUNICATION_ERROR;
     }
     ctx[slot] = NULL;
+#ifdef VPCDMUX
+    /* the last slot on the shared port closes it */
+    if (muxed && --mux_users == 0) {
+        vicc_mux_exit(mux);
+        mux = NULL;
+    }
+#endif
 
     return IFD_SUCCESS;
 }
@@ -226,6 +889,11 @@ IFDHGetCapabilities (DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
     switch (Tag) {
         case TAG_IFD_ATR:
 
+#ifdef VPCDPOOL
+            if (IS_POOL(slot))
+                size = pool_getatr(slot, &atr);
+            else
+#endif
             size = vicc_getatr(ctx[slot], &atr);
             if (size < 0) {
                 Log1(PCSC_LOG_ERROR, "could not get ATR");
@@ -332,6 +1000,22 @@ IFDHPowerICC (DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
         goto err;
     }
 
+#ifdef VPCDPOOL
+    if (IS_POOL(slot)) {
+        /* a new session with the pool, the tokens of the others stay as
+         * they are */
+        ifd_vpcd_pool_release(slot);
+        if (Action == IFD_POWER_DOWN)
+            return IFD_SUCCESS;
+        if (Action != IFD_POWER_UP && Action != IFD_RESET) {
+            r = IFD_NOT_SUPPORTED;
+            goto err;
+        }
+        r = IFD_SUCCESS;
+        goto err;
+    }
+#endif
+
     switch (Action) {
         case IFD_POWER_DOWN:
             if (vicc_poweroff(ctx[slot]) < 0) {
@@ -379,7 +1063,6 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength,
         PSCARD_IO_HEADER RecvPci)
 {
-    unsigned char *rapdu = NULL;
     ssize_t size;
     RESPONSECODE r = IFD_COMMUNICATION_ERROR;
     size_t slot = Lun & 0xffff;
@@ -393,20 +1076,37 @@ IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer,
         goto err;
     }
 
-    size = vicc_transmit(ctx[slot], TxLength, TxBuffer, &rapdu);
-
-    if (size < 0) {
-        Log1(PCSC_LOG_ERROR, "could not send apdu or receive rapdu");
+#ifdef VPCDPOOL
+    if (IS_POOL(slot)) {
+        r = pool_transmit(slot, TxBuffer, TxLength, RxBuffer, RxLength);
+        if (r == IFD_SUCCESS)
+            RecvPci->Protocol = 1;
         goto err;
     }
+#endif
+
+    /* the response goes straight to RxBuffer */
+    size = vicc_transmit_into(ctx[slot], TxLength, TxBuffer, *RxLength, RxBuffer);
 
-    if (*RxLength < size) {
-        Log1(PCSC_LOG_ERROR, "Not enough memory for rapdu");
+    if (size < 0) {
+        int e = errno;
+        if (e == ENOBUFS) {
+            Log1(PCSC_LOG_ERROR, "Not enough memory for rapdu");
+        } else if (e == ETIMEDOUT) {
+            /* the card is still there, the caller may retry */
+            Log1(PCSC_LOG_ERROR, "Timeout waiting for rapdu");
+            r = IFD_RESPONSE_TIMEOUT;
+        } else if (e == ECANCELED) {
+            Log1(PCSC_LOG_INFO, "Transmit cancelled");
+        } else {
+            Log1(PCSC_LOG_ERROR, "could not send apdu or receive rapdu");
+        }
+        /* tell pcsclite-vpcd a cancellation from a failure */
+        errno = e;
         goto err;
     }
 
     *RxLength = size;
-    memcpy(RxBuffer, rapdu, size);
     RecvPci->Protocol = 1;
 
     r = IFD_SUCCESS;
@@ -415,11 +1115,38 @@ err:
     if (r != IFD_SUCCESS && RxLength)
         *RxLength = 0;
 
-    free(rapdu);
-
     return r;
 }
 
+void
+ifd_vpcd_cancel (DWORD Lun)
+{
+    size_t slot = Lun & 0xffff;
+#ifdef VPCDPOOL
+    if (IS_POOL(slot)) {
+        /* the clients waiting for a token give up, the transmits in
+         * progress are cancelled with the slots of their tokens */
+        pthread_mutex_lock(&pool_lock);
+        pool_cancels++;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+#endif
+    if (slot < vicc_max_slots)
+        vicc_cancel(ctx[slot]);
+}
+
+SOCKET
+ifd_vpcd_eventsock (DWORD Lun)
+{
+    size_t slot = Lun & 0xffff;
+    if (slot >= vicc_max_slots) {
+        return INVALID_SOCKET;
+    }
+    return vicc_eventsock(ctx[slot]);
+}
+
 RESPONSECODE
 IFDHICCPresence (DWORD Lun)
 {
@@ -427,6 +1154,10 @@ IFDHICCPresence (DWORD Lun)
     if (slot >= vicc_max_slots) {
         return IFD_COMMUNICATION_ERROR;
     }
+#ifdef VPCDPOOL
+    if (IS_POOL(slot))
+        return pool_present() ? IFD_ICC_PRESENT : IFD_ICC_NOT_PRESENT;
+#endif
     switch (vicc_present(ctx[slot])) {
         case 0:
             return IFD_ICC_NOT_PRESENT;
@@ -19,13 +19,70 @@
 #ifndef _IFD_VPCD_H_
 #define _IFD_VPCD_H_
 
+#include "vpcd.h"
+#include <wintypes.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Control codes of IFDHControl, as built by SCARD_CTL_CODE of pcsc-lite */
+#define IFD_VPCD_CTL_CODE(code)  (0x42000000 + (code))
+/* Make the transmit in progress on the slot give up, no data */
+#define IFD_VPCD_CTL_CANCEL      IFD_VPCD_CTL_CODE(3600)
+/* Set the timeout of the transmits on the slot: milliseconds on 4 bytes,
+ * big-endian, 0 for no limit */
+#define IFD_VPCD_CTL_TIMEOUT     IFD_VPCD_CTL_CODE(3601)
+/* Send several APDUs in one round trip, see vicc_transmit_batch: the APDUs
+ * in, the responses out, each prefixed with its length on 2 bytes */
+#define IFD_VPCD_CTL_BATCH       IFD_VPCD_CTL_CODE(3602)
+/* Statistics of the request queue of the reader, no data in, out
+ * IFD_VPCD_QUEUE_FIELDS numbers of 8 bytes, big-endian: requests waiting,
+ * most requests waiting at once, requests served, milliseconds waited in
+ * total and at most, transactions. Only pcsclite-vpcd has a queue, pcscd
+ * schedules its clients itself */
+#define IFD_VPCD_CTL_QUEUE       IFD_VPCD_CTL_CODE(3603)
+#define IFD_VPCD_QUEUE_FIELDS    6
+/* State of the tokens behind the pool reader (VPCDPOOL), no data in, out
+ * one of IFD_VPCD_POOL_* per token, in the order of their slots */
+#define IFD_VPCD_CTL_POOL        IFD_VPCD_CTL_CODE(3604)
+#define IFD_VPCD_POOL_ABSENT     0
+#define IFD_VPCD_POOL_FREE       1
+#define IFD_VPCD_POOL_LEASED     2
+/* failed recently, left alone for a while */
+#define IFD_VPCD_POOL_DOWN       3
+
 extern const unsigned char vicc_max_slots;
 extern const char *hostname;
 
+/* Socket to wait on for a change of the card in the slot of Lun, see
+ * vicc_eventsock. Used by pcsclite-vpcd to wait for card events. */
+SOCKET ifd_vpcd_eventsock(DWORD Lun);
+
+/* Make the transmit in progress on the slot of Lun give up, see
+ * vicc_cancel. Used by pcsclite-vpcd for SCardCancel. */
+void ifd_vpcd_cancel(DWORD Lun);
+
+#ifdef VPCDPOOL
+#include <ifdhandler.h>
+
+/* Whether Lun is a slot of the pool */
+int ifd_vpcd_is_pool(DWORD Lun);
+
+/* Send an APDU of client to a token of the pool, which IFDHTransmitToICC does
+ * with the slot as client. Used by pcsclite-vpcd to give each card handle a
+ * token of its own. */
+RESPONSECODE ifd_vpcd_pool_transmit(DWORD Lun, unsigned long client,
+        PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength);
+
+/* Begin (hold != 0) or end a transaction of client, which keeps its token.
+ * Returns -1 with errno EPERM for an end without a begin. */
+int ifd_vpcd_pool_hold(unsigned long client, int hold);
+
+/* Give the token of client back, resetting it if it has PIN state */
+void ifd_vpcd_pool_release(unsigned long client);
+#endif
+
 #ifdef  __cplusplus
 }
 #endif
@@ -20,12 +20,9 @@
 #include <config.h>
 #endif
 
-#ifdef _WIN32
-#define sleep(s) Sleep((s*1000))
-#endif
-
 #include "ifd-vpcd.h"
 #include "vpcd.h"
+#include <errno.h>
 #include <ifdhandler.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -33,16 +30,40 @@
 #include <string.h>
 #include <winscard.h>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <fcntl.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/* Longest wait for an event when there is no socket to wait on (vpcd connects
+ * to vicc and has to retry) or, on Windows, between checks for SCardCancel */
+#define POLL_INTERVAL_MS 1000
+
 struct card {
     DWORD dwShareMode;
     size_t usage_counter;
+    /* requests of the card handles of this reader, one at a time */
+    struct vicc_queue *queue;
 };
 
+/* A card handle is the reader (its Lun) and the number of the connection, so
+ * that the requests of different connections can be told apart */
+#define HANDLE2LUN(hCard) ((DWORD) ((hCard) & 0xFF))
+
 #define SET_R_TEST(value) { r = value; if (r != SCARD_S_SUCCESS) { goto err; } }
 
 static struct card cards[PCSCLITE_MAX_READERS_CONTEXTS];
-static int cancel_status = 0;
+static volatile int cancel_status = 0;
+#ifndef _WIN32
+/* SCardCancel writes to the pipe to wake up SCardGetStatusChange */
+static int cancel_pipe[2] = {-1, -1};
+#endif
 static size_t context_count = 0;
+static SCARDHANDLE connection_count = 0;
 
 static const char reader_format_str[] = "Virtual PCD %02"SCNu32;
 static const SCARDHANDLE validhandle = 1;
@@ -86,11 +107,21 @@ static void initialize_globals(void)
     DWORD Channel = VPCDPORT;
     const char *hostname_old = hostname;
 
+#ifndef _WIN32
+    if (pipe(cancel_pipe) == 0) {
+        fcntl(cancel_pipe[0], F_SETFL, fcntl(cancel_pipe[0], F_GETFL) | O_NONBLOCK);
+        fcntl(cancel_pipe[1], F_SETFL, fcntl(cancel_pipe[1], F_GETFL) | O_NONBLOCK);
+    } else {
+        cancel_pipe[0] = cancel_pipe[1] = -1;
+    }
+#endif
+
     hostname = VPCDHOST;
     for (index = 0;
             index < PCSCLITE_MAX_READERS_CONTEXTS && index < vicc_max_slots;
             index++) {
         IFDHCreateChannel ((DWORD) index, Channel);
+        cards[index].queue = vicc_queue_create();
     }
     hostname = hostname_old;
 }
@@ -102,18 +133,26 @@ static void release_globals(void)
             index < PCSCLITE_MAX_READERS_CONTEXTS && index < vicc_max_slots;
             index++) {
         IFDHCloseChannel ((DWORD) index);
+        vicc_queue_free(cards[index].queue);
     }
     memset(cards, 0, sizeof cards);
+#ifndef _WIN32
+    if (cancel_pipe[0] >= 0) {
+        close(cancel_pipe[0]);
+        close(cancel_pipe[1]);
+        cancel_pipe[0] = cancel_pipe[1] = -1;
+    }
+#endif
 }
 
 static LONG handle2card(SCARDHANDLE hCard, struct card **card)
 {
-    uint32_t index = (uint32_t) hCard;
+    uint32_t index = (uint32_t) HANDLE2LUN(hCard);
 
     if (!card)
         return SCARD_F_INTERNAL_ERROR;
 
-    if (index >= PCSCLITE_MAX_READERS_CONTEXTS)
+    if (index >= PCSCLITE_MAX_READERS_CONTEXTS || !cards[index].queue)
         return SCARD_E_INVALID_HANDLE;
 
     *card = &cards[index];
@@ -281,6 +320,9 @@ PCSC_API LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShare
     LONG r;
 
     SET_R_TEST( reader2card(szReader, &card, phCard));
+    connection_count++;
+    if (phCard)
+        *phCard |= connection_count << 8;
 
     if (card->usage_counter) {
         /* card/reader already in use */
@@ -320,7 +362,7 @@ err:
 
 PCSC_API LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
 {
-    DWORD Lun = hCard;
+    DWORD Lun = HANDLE2LUN(hCard);
     LONG r;
     UCHAR Atr[MAX_ATR_SIZE];
     DWORD AtrLength = sizeof Atr;
@@ -333,6 +375,13 @@ PCSC_API LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
         goto err;
     }
     card->usage_counter--;
+    /* a transaction or a chain left open must not block the others */
+    vicc_queue_release(card->queue, hCard);
+#ifdef VPCDPOOL
+    /* nor the token of the pool that it leased */
+    if (ifd_vpcd_is_pool(Lun))
+        ifd_vpcd_pool_release(hCard);
+#endif
 
     switch (dwDisposition) {
         case SCARD_LEAVE_CARD:
@@ -375,11 +424,18 @@ PCSC_API LONG SCardBeginTransaction(SCARDHANDLE hCard)
 
     SET_R_TEST( handle2card(hCard, &card));
 
-    /* we don't have a strategy if an other card handle is active */
-    if (card->usage_counter != 1)
-        return SCARD_E_SHARING_VIOLATION;
+#ifdef VPCDPOOL
+    /* the others go on with the other tokens */
+    if (ifd_vpcd_is_pool(HANDLE2LUN(hCard))) {
+        if (ifd_vpcd_pool_hold(hCard, 1) != 0)
+            r = SCARD_E_NO_MEMORY;
+        goto err;
+    }
+#endif
 
-    card->dwShareMode = SCARD_SHARE_EXCLUSIVE;
+    /* wait until the other card handles are done with the card */
+    if (vicc_queue_begin(card->queue, hCard) != 0)
+        r = SCARD_E_CANCELLED;
 
 err:
     return r;
@@ -387,12 +443,45 @@ err:
 
 PCSC_API LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
 {
+    DWORD Lun = HANDLE2LUN(hCard);
+    UCHAR Atr[MAX_ATR_SIZE];
+    DWORD AtrLength = sizeof Atr;
     struct card *card;
     LONG r;
 
     SET_R_TEST( handle2card(hCard, &card));
 
-    card->dwShareMode = dwDisposition;
+#ifdef VPCDPOOL
+    if (ifd_vpcd_is_pool(Lun)) {
+        if (ifd_vpcd_pool_hold(hCard, 0) != 0)
+            r = SCARD_E_NOT_TRANSACTED;
+        else if (dwDisposition != SCARD_LEAVE_CARD)
+            /* only the token of this card handle */
+            ifd_vpcd_pool_release(hCard);
+        goto err;
+    }
+#endif
+
+    switch (dwDisposition) {
+        case SCARD_LEAVE_CARD:
+            break;
+        case SCARD_RESET_CARD:
+            SET_R_TEST( responsecode2long(
+                        IFDHPowerICC (Lun, IFD_RESET, Atr, &AtrLength)));
+            break;
+        case SCARD_EJECT_CARD:
+            /* fall through */
+        case SCARD_UNPOWER_CARD:
+            SET_R_TEST( responsecode2long(
+                        IFDHPowerICC (Lun, IFD_POWER_DOWN, Atr, &AtrLength)));
+            break;
+        default:
+            r = SCARD_E_INVALID_PARAMETER;
+            goto err;
+    }
+
+    if (vicc_queue_end(card->queue, hCard) != 0)
+        r = SCARD_E_NOT_TRANSACTED;
 
 err:
     return r;
@@ -407,29 +496,126 @@ PCSC_API LONG SCardStatus(SCARDHANDLE hCard, LPSTR mszReaderName, LPDWORD pcchRe
 {
     LONG r;
 
-    SET_R_TEST( handle2reader(hCard, mszReaderName, pcchReaderLen));
-    SET_R_TEST( handle2atr(hCard, pbAtr, pcbAtrLen));
+    SET_R_TEST( handle2reader(HANDLE2LUN(hCard), mszReaderName, pcchReaderLen));
+    SET_R_TEST( handle2atr(HANDLE2LUN(hCard), pbAtr, pcbAtrLen));
 
 err:
     return r;
 }
 
-PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATE rgReaderStates, DWORD cReaders)
+static long long now_ms(void)
 {
+#ifdef _WIN32
+    return (long long) GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Forget the cancellations that have been handled */
+static void clear_cancel(void)
+{
+#ifndef _WIN32
+    char c;
+    if (cancel_pipe[0] >= 0)
+        while (read(cancel_pipe[0], &c, 1) > 0);
+#endif
+    cancel_status = 0;
+}
+
+/*
+ * Wait up to msecs (-1 for ever) until the state of one of the readers may
+ * have changed, or until SCardCancel is called.
+ *
+ * Returns 1 if cancelled, 0 otherwise.
+ */
+static int wait_for_event(LPSCARD_READERSTATE rgReaderStates, DWORD cReaders,
+        long long msecs)
+{
+    fd_set rfds;
+    struct timeval tv;
+    SOCKET sock;
     SCARDHANDLE hCard;
-    size_t i, seconds, event_count = 0;
     struct card *card;
+    int maxfd = -1, sockets = 0, polling = 0;
+    size_t i;
+
+    FD_ZERO(&rfds);
+    for (i = 0; i < cReaders; i++) {
+        if (rgReaderStates[i].dwCurrentState & SCARD_STATE_IGNORE)
+            continue;
+        if (SCARD_S_SUCCESS != reader2card(rgReaderStates[i].szReader,
+                    &card, &hCard))
+            /* includes the PnP notification, which never changes */
+            continue;
+
+        /* a late response keeps the socket readable only until the next
+         * check of the presence, which drops it without waiting on the
+         * transmits in flight (see vicc_present) */
+        sock = ifd_vpcd_eventsock((DWORD) hCard);
+        if (sock == INVALID_SOCKET) {
+            polling = 1;
+            continue;
+        }
+#if _WIN32
+#pragma warning(disable:4127)
+        FD_SET(sock, &rfds);
+#pragma warning(default:4127)
+#else
+        FD_SET(sock, &rfds);
+#endif
+        if ((int) sock > maxfd)
+            maxfd = (int) sock;
+        sockets++;
+    }
+#ifdef _WIN32
+    polling = 1;
+#else
+    if (cancel_pipe[0] >= 0) {
+        FD_SET(cancel_pipe[0], &rfds);
+        if (cancel_pipe[0] > maxfd)
+            maxfd = cancel_pipe[0];
+    } else {
+        polling = 1;
+    }
+#endif
 
-    cancel_status = 0;
+    if (polling && (msecs < 0 || msecs > POLL_INTERVAL_MS))
+        msecs = POLL_INTERVAL_MS;
 
-    if (dwTimeout == INFINITE) {
-        /* "infinite" timeout */
-        seconds = 60;
+    if (maxfd < 0) {
+        /* nothing to wait on, simply sleep */
+#ifdef _WIN32
+        Sleep((DWORD) msecs);
+#else
+        tv.tv_sec = (long) (msecs / 1000);
+        tv.tv_usec = (long) (msecs % 1000) * 1000;
+        select(0, NULL, NULL, NULL, &tv);
+#endif
     } else {
-        seconds = dwTimeout/1000;
+        tv.tv_sec = (long) (msecs / 1000);
+        tv.tv_usec = (long) (msecs % 1000) * 1000;
+        select(maxfd+1, &rfds, NULL, NULL, msecs < 0 ? NULL : &tv);
     }
 
-    do {
+    return cancel_status;
+}
+
+PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATE rgReaderStates, DWORD cReaders)
+{
+    SCARDHANDLE hCard;
+    size_t i, event_count = 0;
+    struct card *card;
+    long long deadline = 0, left = -1;
+
+    clear_cancel();
+
+    if (dwTimeout != INFINITE)
+        deadline = now_ms() + dwTimeout;
+
+    while (1) {
         for (i = 0; i < cReaders; i++) {
             if (rgReaderStates[i].dwCurrentState & SCARD_STATE_IGNORE)
                 /* this reader should be ignored */
@@ -479,13 +665,20 @@ PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCA
             }
         }
 
-        if (!seconds || event_count)
+        if (event_count)
             break;
 
-        sleep(1);
-        seconds--;
+        if (dwTimeout != INFINITE) {
+            left = deadline - now_ms();
+            if (left <= 0)
+                break;
+        }
 
-    } while (!cancel_status);
+        if (wait_for_event(rgReaderStates, cReaders, left)) {
+            clear_cancel();
+            return SCARD_E_CANCELLED;
+        }
+    }
 
     if (!event_count)
         return SCARD_E_TIMEOUT;
@@ -495,28 +688,114 @@ PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCA
 
 PCSC_API LONG SCardCancel(SCARDHANDLE hCard)
 {
+    uint32_t index;
+
+    /* the transmits waiting for a card give up, too */
+    for (index = 0;
+            index < PCSCLITE_MAX_READERS_CONTEXTS && index < vicc_max_slots;
+            index++) {
+        ifd_vpcd_cancel((DWORD) index);
+        if (cards[index].queue)
+            vicc_queue_cancel(cards[index].queue);
+    }
+
     cancel_status = 1;
+#ifndef _WIN32
+    if (cancel_pipe[1] >= 0 && write(cancel_pipe[1], "", 1) < 0) {
+        /* the pipe is full, a wake-up is pending anyway */
+    }
+#endif
+    return SCARD_S_SUCCESS;
+}
+
+/* Write the statistics of the queue as IFD_VPCD_CTL_QUEUE describes */
+static LONG queue_stats(struct card *card, LPBYTE pbRecvBuffer,
+        DWORD cbRecvLength, LPDWORD lpBytesReturned)
+{
+    struct vicc_queue_stats stats;
+    unsigned long long fields[IFD_VPCD_QUEUE_FIELDS];
+    size_t i, j;
+
+    if (!lpBytesReturned)
+        return SCARD_E_INVALID_PARAMETER;
+    if (cbRecvLength < sizeof fields || !pbRecvBuffer)
+        return SCARD_E_INSUFFICIENT_BUFFER;
+
+    vicc_queue_stats(card->queue, &stats);
+    fields[0] = stats.depth;
+    fields[1] = stats.max_depth;
+    fields[2] = stats.served;
+    fields[3] = stats.wait_ms;
+    fields[4] = stats.max_wait_ms;
+    fields[5] = stats.transactions;
+    for (i = 0; i < IFD_VPCD_QUEUE_FIELDS; i++) {
+        for (j = 0; j < 8; j++)
+            pbRecvBuffer[8*i + j] = (BYTE) (fields[i] >> (56 - 8*j));
+    }
+    *lpBytesReturned = sizeof fields;
+
     return SCARD_S_SUCCESS;
 }
 
 PCSC_API LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID pbSendBuffer, DWORD cbSendLength, LPVOID pbRecvBuffer, DWORD cbRecvLength, LPDWORD lpBytesReturned)
 {
+    struct card *card;
+    LONG r;
+
+    if (dwControlCode == IFD_VPCD_CTL_QUEUE) {
+        SET_R_TEST( handle2card(hCard, &card));
+        return queue_stats(card, pbRecvBuffer, cbRecvLength, lpBytesReturned);
+    }
+
     return responsecode2long(
-            IFDHControl (hCard, dwControlCode, (PUCHAR) pbSendBuffer,
+            IFDHControl (HANDLE2LUN(hCard), dwControlCode, (PUCHAR) pbSendBuffer,
                 cbSendLength, pbRecvBuffer, cbRecvLength, lpBytesReturned));
+
+err:
+    return r;
 }
 
 PCSC_API LONG SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPSCARD_IO_REQUEST pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
 {
-    DWORD Lun = hCard;
+    DWORD Lun = HANDLE2LUN(hCard);
+    struct card *card;
     LONG r;
     /* ignored */
     SCARD_IO_HEADER SendPci, RecvPci;
 
+    SET_R_TEST( handle2card(hCard, &card));
+
+#ifdef VPCDPOOL
+    /* each card handle has a token of its own, no need to queue */
+    if (ifd_vpcd_is_pool(Lun)) {
+        r = responsecode2long(
+                ifd_vpcd_pool_transmit (Lun, hCard, (PUCHAR) pbSendBuffer,
+                    cbSendLength, pbRecvBuffer, pcbRecvLength));
+        if (r == SCARD_F_COMM_ERROR && errno == ECANCELED)
+            r = SCARD_E_CANCELLED;
+        goto err;
+    }
+#endif
+
+    /* wait for the turn of this card handle */
+    if (vicc_queue_enter(card->queue, hCard) != 0) {
+        r = SCARD_E_CANCELLED;
+        goto err;
+    }
+
     /* transceive data */
-    SET_R_TEST( responsecode2long(
+    r = responsecode2long(
                 IFDHTransmitToICC (Lun, SendPci, (PUCHAR) pbSendBuffer,
-                    cbSendLength, pbRecvBuffer, pcbRecvLength, &RecvPci)));
+                    cbSendLength, pbRecvBuffer, pcbRecvLength, &RecvPci));
+    if (r == SCARD_F_COMM_ERROR && errno == ECANCELED)
+        r = SCARD_E_CANCELLED;
+
+    /* keep the card for the rest of a chain or of a response */
+    vicc_queue_leave(card->queue, hCard, r == SCARD_S_SUCCESS
+            && vicc_sequence_continues(cbSendLength, pbSendBuffer,
+                *pcbRecvLength, pbRecvBuffer));
+    if (r != SCARD_S_SUCCESS)
+        goto err;
 
 err:
     return r;
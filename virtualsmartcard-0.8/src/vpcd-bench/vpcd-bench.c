@@ -0,0 +1,620 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator for the whole path from a PC/SC client to the ESP32.
+ *
+ * Each client is a thread with a context and a card handle of its own, as
+ * separate applications would have. It sends a mix of OpenPGP card commands,
+ * picked at random by weight, and measures the time of each in the
+ * SCardTransmit calls, including the GET RESPONSEs of a long response.
+ *
+ * With a rate, the clients start their commands on a schedule and a command
+ * that starts late is measured from when it should have started, so a slow
+ * card shows up in the latency instead of only lowering the rate.
+ *
+ * The results go to stdout as a single JSON object.
+ *
+ * A signature needs PW1 verified with mode 81 right before it, so each one
+ * is preceded by a VERIFY, which counts as a verify. A decryption verifies
+ * mode 82 once per client. Its cryptogram is random: the card does the
+ * private key operation and then rejects the padding with 6F00, which is
+ * counted as a success.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <winscard.h>
+
+#ifndef SCARD_AUTOALLOCATE
+#define SCARD_AUTOALLOCATE (DWORD)(-1)
+#endif
+
+#define BENCH_CLIENTS_MAX   64
+#define BENCH_RESPONSE_MAX  (0xFFFF + 2)
+/* Longest wait for a card before the run */
+#define BENCH_CARD_WAIT_MS  30000
+
+enum {
+    OP_SELECT,
+    OP_GETDATA,
+    OP_VERIFY,
+    OP_SIGN,
+    OP_DECIPHER,
+    OP_CHALLENGE,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "select", "getdata", "verify", "sign", "decipher", "challenge"
+};
+
+/* SELECT of the OpenPGP application */
+static const unsigned char apdu_select[] = {
+    0x00, 0xA4, 0x04, 0x00, 0x06, 0xD2, 0x76, 0x00, 0x01, 0x24, 0x01, 0x00
+};
+/* GET DATA of the application related data */
+static const unsigned char apdu_getdata[] = {0x00, 0xCA, 0x00, 0x6E, 0x00};
+static const unsigned char apdu_challenge[] = {0x00, 0x84, 0x00, 0x00, 0x20};
+/* DigestInfo of SHA-256, the hash follows */
+static const unsigned char digest_info[] = {
+    0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03,
+    0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+struct sample {
+    unsigned char op;
+    unsigned char ok;
+    uint32_t us;
+};
+
+struct client {
+    pthread_t thread;
+    int index;
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    int verified82;
+    unsigned int seed;
+    /* samples taken, each command adds one or two */
+    struct sample *samples;
+    size_t used, size;
+    /* failures of PC/SC itself, the client stops at the first one */
+    LONG error;
+};
+
+struct bench {
+    const char *reader;
+    const char *pin;
+    unsigned int weights[OP_COUNT];
+    unsigned int weight_total;
+    unsigned int clients;
+    unsigned long count;
+    double rate;
+    size_t key_bytes;
+};
+
+static struct bench bench;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(long long until)
+{
+    long long left = until - now_us();
+    struct timespec ts;
+
+    if (left <= 0)
+        return;
+    ts.tv_sec = left / 1000000;
+    ts.tv_nsec = (left % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+static int add_sample(struct client *c, int op, int ok, long long us)
+{
+    if (c->used == c->size) {
+        size_t size = c->size ? 2 * c->size : 256;
+        struct sample *p = realloc(c->samples, size * sizeof *p);
+        if (!p)
+            return -1;
+        c->samples = p;
+        c->size = size;
+    }
+    c->samples[c->used].op = (unsigned char) op;
+    c->samples[c->used].ok = (unsigned char) ok;
+    c->samples[c->used].us = us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+    c->used++;
+    return 0;
+}
+
+/* Send an APDU and fetch the rest of a long response. Returns the status
+ * word, or -1 if PC/SC failed */
+static int transmit(struct client *c, const unsigned char *apdu, size_t len)
+{
+    static const unsigned char get_response[] = {0x00, 0xC0, 0x00, 0x00, 0x00};
+    unsigned char response[BENCH_RESPONSE_MAX], next[sizeof get_response];
+    DWORD response_len;
+    int sw;
+
+    while (1) {
+        response_len = sizeof response;
+        c->error = SCardTransmit(c->card, SCARD_PCI_T1, apdu, (DWORD) len,
+                NULL, response, &response_len);
+        if (c->error != SCARD_S_SUCCESS)
+            return -1;
+        if (response_len < 2) {
+            c->error = SCARD_F_COMM_ERROR;
+            return -1;
+        }
+        sw = response[response_len - 2] << 8 | response[response_len - 1];
+        if ((sw & 0xFF00) != 0x6100)
+            return sw;
+        memcpy(next, get_response, sizeof next);
+        next[4] = (unsigned char) (sw & 0xFF);
+        apdu = next;
+        len = sizeof next;
+    }
+}
+
+static int verify(struct client *c, unsigned char mode)
+{
+    unsigned char apdu[5 + 255];
+    size_t pin_len = strlen(bench.pin);
+    long long start = now_us();
+    int sw;
+
+    apdu[0] = 0x00;
+    apdu[1] = 0x20;
+    apdu[2] = 0x00;
+    apdu[3] = mode;
+    apdu[4] = (unsigned char) pin_len;
+    memcpy(apdu + 5, bench.pin, pin_len);
+
+    sw = transmit(c, apdu, 5 + pin_len);
+    if (sw < 0)
+        return -1;
+    if (add_sample(c, OP_VERIFY, sw == 0x9000, now_us() - start) != 0)
+        return -1;
+    return sw == 0x9000 ? 0 : 1;
+}
+
+static void random_bytes(struct client *c, unsigned char *out, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        out[i] = (unsigned char) rand_r(&c->seed);
+}
+
+/* Run a command of the mix. start is when it should have started */
+static int run_op(struct client *c, int op, long long start)
+{
+    unsigned char apdu[7 + 0x10000 + 2];
+    size_t len = 0;
+    int sw, ok;
+
+    switch (op) {
+        case OP_SELECT:
+            memcpy(apdu, apdu_select, sizeof apdu_select);
+            len = sizeof apdu_select;
+            break;
+        case OP_GETDATA:
+            memcpy(apdu, apdu_getdata, sizeof apdu_getdata);
+            len = sizeof apdu_getdata;
+            break;
+        case OP_VERIFY:
+            return verify(c, 0x82) < 0 ? -1 : 0;
+        case OP_SIGN:
+            /* mode 81 is only valid for the next signature */
+            if (verify(c, 0x81) < 0)
+                return -1;
+            if (start < now_us())
+                start = now_us();
+            apdu[0] = 0x00;
+            apdu[1] = 0x2A;
+            apdu[2] = 0x9E;
+            apdu[3] = 0x9A;
+            apdu[4] = sizeof digest_info + 32;
+            memcpy(apdu + 5, digest_info, sizeof digest_info);
+            random_bytes(c, apdu + 5 + sizeof digest_info, 32);
+            len = 5 + sizeof digest_info + 32;
+            apdu[len++] = 0x00;
+            break;
+        case OP_DECIPHER:
+            if (!c->verified82) {
+                if (verify(c, 0x82) < 0)
+                    return -1;
+                c->verified82 = 1;
+                if (start < now_us())
+                    start = now_us();
+            }
+            /* padding indicator and cryptogram, extended length */
+            apdu[0] = 0x00;
+            apdu[1] = 0x2A;
+            apdu[2] = 0x80;
+            apdu[3] = 0x86;
+            apdu[4] = 0x00;
+            apdu[5] = (unsigned char) ((bench.key_bytes + 1) >> 8);
+            apdu[6] = (unsigned char) ((bench.key_bytes + 1) & 0xFF);
+            apdu[7] = 0x00;
+            random_bytes(c, apdu + 8, bench.key_bytes);
+            /* below the modulus */
+            apdu[8] &= 0x7F;
+            len = 8 + bench.key_bytes;
+            apdu[len++] = 0x00;
+            apdu[len++] = 0x00;
+            break;
+        case OP_CHALLENGE:
+            memcpy(apdu, apdu_challenge, sizeof apdu_challenge);
+            len = sizeof apdu_challenge;
+            break;
+        default:
+            return -1;
+    }
+
+    sw = transmit(c, apdu, len);
+    if (sw < 0)
+        return -1;
+    ok = sw == 0x9000 || (op == OP_DECIPHER && sw == 0x6F00);
+    return add_sample(c, op, ok, now_us() - start);
+}
+
+static int pick_op(struct client *c)
+{
+    unsigned int r = (unsigned int) rand_r(&c->seed) % bench.weight_total;
+    int op;
+
+    for (op = 0; op < OP_COUNT; op++) {
+        if (r < bench.weights[op])
+            return op;
+        r -= bench.weights[op];
+    }
+    return OP_SELECT;
+}
+
+static void *client_run(void *arg)
+{
+    struct client *c = arg;
+    DWORD protocol;
+    long long start, interval = 0, next;
+    unsigned long i;
+
+    c->error = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &c->context);
+    if (c->error != SCARD_S_SUCCESS)
+        return NULL;
+    c->error = SCardConnect(c->context, bench.reader, SCARD_SHARE_SHARED,
+            SCARD_PROTOCOL_T1, &c->card, &protocol);
+    if (c->error != SCARD_S_SUCCESS)
+        goto err;
+
+    if (bench.rate > 0)
+        interval = (long long) (1000000.0 * bench.clients / bench.rate);
+    /* spread the clients over the first interval */
+    next = now_us() + interval * c->index / bench.clients;
+
+    for (i = 0; i < bench.count; i++) {
+        if (interval > 0) {
+            sleep_until(next);
+            start = next;
+            next += interval;
+        } else {
+            start = now_us();
+        }
+        if (run_op(c, pick_op(c), start) != 0)
+            break;
+    }
+
+    SCardDisconnect(c->card, SCARD_LEAVE_CARD);
+err:
+    SCardReleaseContext(c->context);
+    return NULL;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted values */
+static double percentile(const uint32_t *sorted, size_t n, double p)
+{
+    size_t rank;
+
+    if (n == 0)
+        return 0;
+    rank = (size_t) (p / 100.0 * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1] / 1000.0;
+}
+
+/* Latencies of the samples of op, or of all of them for OP_COUNT */
+static void print_latency(struct client *clients, int op, uint32_t *values,
+        double seconds)
+{
+    size_t n = 0, errors = 0;
+    unsigned int i;
+    size_t j;
+
+    for (i = 0; i < bench.clients; i++) {
+        for (j = 0; j < clients[i].used; j++) {
+            struct sample *s = &clients[i].samples[j];
+            if (op != OP_COUNT && s->op != op)
+                continue;
+            if (!s->ok)
+                errors++;
+            values[n++] = s->us;
+        }
+    }
+    qsort(values, n, sizeof *values, compare_us);
+
+    printf("\"count\": %zu, \"errors\": %zu, \"ops_per_s\": %.2f, "
+            "\"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+            n, errors, seconds > 0 ? n / seconds : 0,
+            percentile(values, n, 50), percentile(values, n, 90),
+            percentile(values, n, 99), n ? values[n - 1] / 1000.0 : 0);
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            putchar('\\');
+        if ((unsigned char) *s >= 0x20)
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static int parse_mix(const char *mix)
+{
+    char *copy = strdup(mix), *item, *save = NULL, *colon;
+    int op, r = -1;
+
+    if (!copy)
+        return -1;
+    memset(bench.weights, 0, sizeof bench.weights);
+    bench.weight_total = 0;
+    for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        colon = strchr(item, ':');
+        if (colon)
+            *colon++ = '\0';
+        for (op = 0; op < OP_COUNT; op++) {
+            if (strcmp(item, op_names[op]) == 0)
+                break;
+        }
+        if (op == OP_COUNT) {
+            fprintf(stderr, "Unknown command in the mix: %s\n", item);
+            goto err;
+        }
+        bench.weights[op] = colon ? (unsigned int) strtoul(colon, NULL, 10) : 1;
+        bench.weight_total += bench.weights[op];
+    }
+    if (bench.weight_total == 0) {
+        fprintf(stderr, "The mix is empty\n");
+        goto err;
+    }
+    r = 0;
+
+err:
+    free(copy);
+    return r;
+}
+
+/* The first reader, if none has been given */
+static char *first_reader(SCARDCONTEXT context)
+{
+    LPSTR readers = NULL;
+    DWORD len = SCARD_AUTOALLOCATE;
+    char *r = NULL;
+
+    if (SCardListReaders(context, NULL, (LPSTR) &readers, &len) == SCARD_S_SUCCESS
+            && readers && *readers)
+        r = strdup(readers);
+    if (readers)
+        SCardFreeMemory(context, readers);
+
+    return r;
+}
+
+/* Wait until there is a card in the reader */
+static LONG wait_card(SCARDCONTEXT context)
+{
+    SCARD_READERSTATE state;
+    LONG r;
+
+    memset(&state, 0, sizeof state);
+    state.szReader = bench.reader;
+    state.dwCurrentState = SCARD_STATE_UNAWARE;
+    while (1) {
+        r = SCardGetStatusChange(context, BENCH_CARD_WAIT_MS, &state, 1);
+        if (r != SCARD_S_SUCCESS)
+            return r;
+        if (state.dwEventState & SCARD_STATE_PRESENT)
+            return SCARD_S_SUCCESS;
+        state.dwCurrentState = state.dwEventState;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-r reader] [-c clients] [-n count] [-t rate] [-m mix] [-p PIN] [-k bits]\n"
+            "Send a mix of OpenPGP card commands through PC/SC and print the latencies as JSON.\n"
+            "  -r  reader (default: the first one)\n"
+            "  -c  clients at once, each with its own context and card handle (default: 1)\n"
+            "  -n  commands of each client (default: 100)\n"
+            "  -t  commands per second of all clients together (default: as fast as possible)\n"
+            "  -m  commands and their weights (default: select:1,getdata:4,verify:1,sign:2,decipher:1,challenge:2)\n"
+            "  -p  PIN of PW1 (default: 123456)\n"
+            "  -k  size of the decryption key in bits (default: 2048)\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct client *clients = NULL;
+    SCARDCONTEXT context;
+    LONG rv;
+    char *reader = NULL;
+    uint32_t *values;
+    size_t total = 0;
+    long long start, end;
+    double seconds;
+    unsigned int i;
+    int opt, op, r = 1;
+
+    bench.pin = "123456";
+    bench.clients = 1;
+    bench.count = 100;
+    bench.key_bytes = 256;
+    if (parse_mix("select:1,getdata:4,verify:1,sign:2,decipher:1,challenge:2") != 0)
+        return 1;
+
+    while ((opt = getopt(argc, argv, "r:c:n:t:m:p:k:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                bench.reader = optarg;
+                break;
+            case 'c':
+                bench.clients = (unsigned int) strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                bench.count = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                bench.rate = strtod(optarg, NULL);
+                break;
+            case 'm':
+                if (parse_mix(optarg) != 0)
+                    return 1;
+                break;
+            case 'p':
+                bench.pin = optarg;
+                break;
+            case 'k':
+                bench.key_bytes = (strtoul(optarg, NULL, 10) + 7) / 8;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (bench.clients < 1 || bench.clients > BENCH_CLIENTS_MAX
+            || strlen(bench.pin) > 255
+            || bench.key_bytes < 1 || bench.key_bytes >= 0xFFFF) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* held for the whole run, so that the readers stay up between the
+     * contexts of the clients */
+    if (SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &context) != SCARD_S_SUCCESS) {
+        fprintf(stderr, "Could not connect to PC/SC\n");
+        return 1;
+    }
+    if (!bench.reader) {
+        reader = first_reader(context);
+        if (!reader) {
+            fprintf(stderr, "No reader found\n");
+            goto err;
+        }
+        bench.reader = reader;
+    }
+    rv = wait_card(context);
+    if (rv != SCARD_S_SUCCESS) {
+        fprintf(stderr, "No card in %s: %s\n", bench.reader,
+                pcsc_stringify_error(rv));
+        goto err;
+    }
+
+    clients = calloc(bench.clients, sizeof *clients);
+    if (!clients)
+        goto err;
+
+    start = now_us();
+    for (i = 0; i < bench.clients; i++) {
+        clients[i].index = (int) i;
+        clients[i].seed = (unsigned int) (start + i);
+        if (pthread_create(&clients[i].thread, NULL, client_run, &clients[i]) != 0) {
+            fprintf(stderr, "Could not start client %u\n", i);
+            bench.clients = i;
+            break;
+        }
+    }
+    for (i = 0; i < bench.clients; i++)
+        pthread_join(clients[i].thread, NULL);
+    end = now_us();
+    seconds = (end - start) / 1000000.0;
+
+    for (i = 0; i < bench.clients; i++) {
+        total += clients[i].used;
+        if (clients[i].error != SCARD_S_SUCCESS)
+            fprintf(stderr, "Client %u stopped: %s\n", i,
+                    pcsc_stringify_error(clients[i].error));
+    }
+    values = malloc((total ? total : 1) * sizeof *values);
+    if (!values)
+        goto err;
+
+    printf("{\"reader\": ");
+    print_json_string(bench.reader);
+    printf(", \"clients\": %u, \"rate\": %.2f, \"seconds\": %.3f, ",
+            bench.clients, bench.rate, seconds);
+    print_latency(clients, OP_COUNT, values, seconds);
+    printf(", \"commands\": {");
+    for (op = 0, i = 0; op < OP_COUNT; op++) {
+        if (!bench.weights[op] && !(op == OP_VERIFY
+                    && (bench.weights[OP_SIGN] || bench.weights[OP_DECIPHER])))
+            continue;
+        printf("%s\"%s\": {", i++ ? ", " : "", op_names[op]);
+        print_latency(clients, op, values, seconds);
+        printf("}");
+    }
+    printf("}}\n");
+    free(values);
+    r = 0;
+
+err:
+    if (clients) {
+        for (i = 0; i < bench.clients; i++)
+            free(clients[i].samples);
+        free(clients);
+    }
+    free(reader);
+    SCardReleaseContext(context);
+
+    return r;
+}
@@ -20,6 +20,7 @@
 #include "config.h"
 #endif
 #include <stdio.h>
+#include <string.h>
 #include "vpcd.h"
 
 extern const char *local_ip (void);
@@ -28,12 +29,18 @@ extern const char *local_ip (void);
 #define VICC_MAX_SLOTS 1
 #include <process.h>
 #include <string.h>
+#elif defined VPCDMUX
+/* all slots share the same port */
+#define VICC_MAX_SLOTS 1
 #else
 #define VICC_MAX_SLOTS VPCDSLOTS
 #endif
 
 #define ERROR_STRING "Unable to guess local IP address"
 
+/* The PSK file of vpcd-relay -k, 64 hex digits */
+#define PSK_HEX_LEN 64
+
 
 
 #ifdef HAVE_QRENCODE
@@ -74,6 +81,37 @@ void print_qrcode(const char *uri)
 #endif
 
 
+/* Show the PSK of vpcd-relay, for setting up an ESP32 by hand */
+static int print_psk(const char *path)
+{
+    char hex[PSK_HEX_LEN + 2];
+    char uri[PSK_HEX_LEN + 10];
+    FILE *f = fopen(path, "r");
+    size_t len;
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    if (!fgets(hex, sizeof hex, f)) {
+        hex[0] = '\0';
+    }
+    fclose(f);
+    len = strcspn(hex, "\r\n");
+    hex[len] = '\0';
+    if (len != PSK_HEX_LEN || strspn(hex, "0123456789abcdefABCDEF") != len) {
+        fprintf(stderr, "%s doesn't hold a PSK\n", path);
+        return 1;
+    }
+
+    printf("Relay PSK:      %s\n", hex);
+    printf("Keep it secret, it is all it takes to use the ESP32 token:\n");
+    sprintf(uri, "wsc1:psk=%.64s", hex);
+    print_qrcode(uri);
+    return 0;
+}
+
+
 int main ( int argc , char *argv[] )
 {
     char slot;
@@ -81,6 +119,13 @@ int main ( int argc , char *argv[] )
     const char *ip = NULL;
     int fail = 1, port;
 
+    if (argc == 3 && strcmp(argv[1], "-k") == 0)
+        return print_psk(argv[2]);
+    if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-k PSK file of vpcd-relay]\n", argv[0]);
+        return 1;
+    }
+
     ip = local_ip();
     if (!ip)
         goto err;
@@ -0,0 +1,372 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#endif
+
+void channel_hex(const unsigned char *psk, char *out)
+{
+    size_t i;
+
+    for (i = 0; i < CHANNEL_KEY_LEN; i++)
+        sprintf(out + 2*i, "%02x", psk[i]);
+    out[2*CHANNEL_KEY_LEN] = '\0';
+}
+
+static int channel_unhex(const char *hex, unsigned char *psk)
+{
+    size_t i;
+    unsigned int byte;
+
+    for (i = 0; i < CHANNEL_KEY_LEN; i++) {
+        if (sscanf(hex + 2*i, "%2x", &byte) != 1)
+            return -1;
+        psk[i] = (unsigned char) byte;
+    }
+    return 0;
+}
+
+#ifdef HAVE_OPENSSL
+
+static time_t channel_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+int channel_load(struct channel *ch, const char *path, int create)
+{
+    char hex[2*CHANNEL_KEY_LEN + 2];
+    FILE *f;
+    int fd;
+
+    memset(ch, 0, sizeof *ch);
+    f = fopen(path, "r");
+    if (!f && errno == ENOENT && create) {
+        /* Only the owner may read it, it is all it takes to talk to the ESP32 */
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 || RAND_bytes(ch->psk, sizeof ch->psk) != 1) {
+            perror(path);
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+        channel_hex(ch->psk, hex);
+        strcat(hex, "\n");
+        if (write(fd, hex, strlen(hex)) != (ssize_t) strlen(hex)) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        fprintf(stderr, "New PSK written to %s\n", path);
+        return 0;
+    }
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    if (!fgets(hex, sizeof hex, f) || channel_unhex(hex, ch->psk) != 0) {
+        fprintf(stderr, "%s doesn't hold a PSK\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* HMAC-SHA256 of label | a | b | c with key, to out */
+static int channel_hmac(const unsigned char *key, const char *label,
+        const unsigned char *a, size_t a_len, const unsigned char *b,
+        const unsigned char *c, unsigned char *out)
+{
+    unsigned char in[16 + CHANNEL_ID_LEN + 2*CHANNEL_NONCE_LEN];
+    unsigned int out_len = CHANNEL_KEY_LEN;
+    size_t len = strlen(label);
+
+    memcpy(in, label, len);
+    memcpy(in + len, a, a_len);
+    len += a_len;
+    memcpy(in + len, b, CHANNEL_NONCE_LEN);
+    len += CHANNEL_NONCE_LEN;
+    if (c) {
+        memcpy(in + len, c, CHANNEL_NONCE_LEN);
+        len += CHANNEL_NONCE_LEN;
+    }
+    return HMAC(EVP_sha256(), key, CHANNEL_KEY_LEN, in, len, out, &out_len) ? 0 : -1;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#define EVP_PKEY_set1_encoded_public_key EVP_PKEY_set1_tls_encodedpoint
+#define EVP_PKEY_get1_encoded_public_key EVP_PKEY_get1_tls_encodedpoint
+#endif
+
+/*
+ * Wrap the PSK for an ESP32 that pairs: make an ephemeral P-256 key, write
+ * its point to out, then the PSK XOR HMAC-SHA256(ECDH secret, "WSC1 pair" |
+ * Nonce ESP32 | Nonce relay), so that the PSK never goes in the clear.
+ * Returns 0 or -1.
+ */
+static int channel_wrap(struct channel *ch, const unsigned char *point,
+        const unsigned char *nonce_esp, const unsigned char *nonce,
+        unsigned char *out)
+{
+    EVP_PKEY_CTX *ctx;
+    EVP_PKEY *key = NULL, *peer = NULL;
+    unsigned char shared[CHANNEL_KEY_LEN], pad[CHANNEL_KEY_LEN];
+    unsigned char *own = NULL;
+    size_t shared_len = sizeof shared;
+    size_t i;
+    int ok;
+
+    ok = (ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) != NULL
+        && EVP_PKEY_keygen_init(ctx) == 1
+        && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) == 1
+        && EVP_PKEY_keygen(ctx, &key) == 1
+        && (peer = EVP_PKEY_new()) != NULL
+        && EVP_PKEY_copy_parameters(peer, key) == 1
+        /* Checks that the point is on the curve */
+        && EVP_PKEY_set1_encoded_public_key(peer, point, CHANNEL_POINT_LEN) == 1
+        && EVP_PKEY_get1_encoded_public_key(key, &own) == CHANNEL_POINT_LEN;
+    EVP_PKEY_CTX_free(ctx);
+    ctx = NULL;
+    ok = ok && (ctx = EVP_PKEY_CTX_new(key, NULL)) != NULL
+        && EVP_PKEY_derive_init(ctx) == 1
+        && EVP_PKEY_derive_set_peer(ctx, peer) == 1
+        && EVP_PKEY_derive(ctx, shared, &shared_len) == 1
+        && shared_len == sizeof shared
+        && channel_hmac(shared, "WSC1 pair", nonce_esp, CHANNEL_NONCE_LEN,
+                nonce, NULL, pad) == 0;
+    if (ok) {
+        memcpy(out, own, CHANNEL_POINT_LEN);
+        for (i = 0; i < CHANNEL_KEY_LEN; i++)
+            out[CHANNEL_POINT_LEN + i] = ch->psk[i] ^ pad[i];
+    }
+    EVP_PKEY_CTX_free(ctx);
+    OPENSSL_free(own);
+    EVP_PKEY_free(peer);
+    EVP_PKEY_free(key);
+    OPENSSL_cleanse(shared, sizeof shared);
+    OPENSSL_cleanse(pad, sizeof pad);
+    return ok ? 0 : -1;
+}
+
+int channel_beacon(struct channel *ch, struct in_addr addr, unsigned char *beacon)
+{
+    unsigned char in[11 + 4 + 2 + CHANNEL_BEACON_NONCE_LEN];
+    unsigned char tag[EVP_MAX_MD_SIZE];
+    unsigned int tag_len = sizeof tag;
+
+    if (RAND_bytes(beacon + 2, CHANNEL_BEACON_NONCE_LEN) != 1)
+        return -1;
+    memcpy(in, "WSC1 beacon", 11);
+    memcpy(in + 11, &addr.s_addr, 4);   /* In network byte order */
+    memcpy(in + 15, beacon, 2 + CHANNEL_BEACON_NONCE_LEN);
+    if (!HMAC(EVP_sha256(), ch->psk, CHANNEL_KEY_LEN, in, sizeof in, tag, &tag_len))
+        return -1;
+    memcpy(beacon + 2 + CHANNEL_BEACON_NONCE_LEN, tag, CHANNEL_BEACON_TAG_LEN);
+    return 0;
+}
+
+static void channel_drop(struct channel *ch)
+{
+    OPENSSL_cleanse(ch->secret, sizeof ch->secret);
+    ch->until = 0;
+    ch->active = 0;
+}
+
+ssize_t channel_reply(struct channel *ch, const unsigned char *hello,
+        size_t len, unsigned char *out)
+{
+    const unsigned char *nonce_esp = hello + CHANNEL_MAGIC_LEN + 1 + CHANNEL_ID_LEN;
+    unsigned char *id = out + CHANNEL_MAGIC_LEN + 1;
+    unsigned char *nonce = id + CHANNEL_ID_LEN;
+    unsigned char keys[CHANNEL_KEY_LEN];
+    unsigned char mode;
+    size_t reply_len = CHANNEL_HELLO_LEN;
+
+    ch->active = 0;
+    ch->verified = 0;
+    if (len < CHANNEL_HELLO_LEN || memcmp(hello, CHANNEL_MAGIC, CHANNEL_MAGIC_LEN) != 0
+            || len != (hello[CHANNEL_MAGIC_LEN] == CHANNEL_PAIR ? CHANNEL_PAIR_LEN : CHANNEL_HELLO_LEN)) {
+        fprintf(stderr, "Not a hello of the channel, is the ESP32 built with PLAINTEXT?\n");
+        return -1;
+    }
+    mode = hello[CHANNEL_MAGIC_LEN];
+    if (mode == CHANNEL_PAIR && !ch->pairing) {
+        fprintf(stderr, "The ESP32 asks to pair, run with -p to let it\n");
+        return -1;
+    }
+    if (mode == CHANNEL_RESUME && !(ch->until && channel_now() < ch->until
+                && memcmp(hello + CHANNEL_MAGIC_LEN + 1, ch->id, CHANNEL_ID_LEN) == 0))
+        mode = CHANNEL_NEW;     /* Unknown or too old, start a new session */
+    else if (mode != CHANNEL_RESUME && mode != CHANNEL_PAIR)
+        mode = CHANNEL_NEW;
+
+    if (RAND_bytes(nonce, CHANNEL_NONCE_LEN) != 1)
+        return -1;
+    if (mode != CHANNEL_RESUME) {
+        channel_drop(ch);
+        if (RAND_bytes(ch->id, CHANNEL_ID_LEN) != 1
+                || channel_hmac(ch->psk, "WSC1 master", ch->id, CHANNEL_ID_LEN,
+                    nonce_esp, nonce, ch->secret) != 0)
+            return -1;
+    }
+    if (channel_hmac(ch->secret, "WSC1 keys", nonce_esp, CHANNEL_NONCE_LEN,
+                nonce, NULL, keys) != 0) {
+        channel_drop(ch);
+        return -1;
+    }
+    /* The first half is the way of the ESP32 */
+    memcpy(ch->recv_key, keys, sizeof ch->recv_key);
+    memcpy(ch->send_key, keys + 16, sizeof ch->send_key);
+    OPENSSL_cleanse(keys, sizeof keys);
+    ch->until = channel_now() + CHANNEL_RESUME_TIME;
+    ch->sent = ch->received = 0;
+    ch->active = 1;
+
+    memcpy(out, CHANNEL_MAGIC, CHANNEL_MAGIC_LEN);
+    out[CHANNEL_MAGIC_LEN] = mode;
+    memcpy(id, ch->id, CHANNEL_ID_LEN);
+    if (mode == CHANNEL_PAIR) {
+        if (channel_wrap(ch, hello + CHANNEL_HELLO_LEN, nonce_esp, nonce,
+                    nonce + CHANNEL_NONCE_LEN) != 0) {
+            channel_drop(ch);
+            return -1;
+        }
+        reply_len += CHANNEL_POINT_LEN + CHANNEL_KEY_LEN;
+        fprintf(stderr, "Pairing the ESP32, press its button\n");
+    }
+    return (ssize_t) reply_len;
+}
+
+/* The GCM nonce of a frame: 4 zero bytes, then its count on 8 bytes big-endian */
+static void channel_iv(unsigned char *iv, uint64_t count)
+{
+    int i;
+
+    memset(iv, 0, 4);
+    for (i = 11; i >= 4; i--, count >>= 8)
+        iv[i] = (unsigned char) count;
+}
+
+ssize_t channel_seal(struct channel *ch, const unsigned char *in, size_t len,
+        unsigned char *out)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    unsigned char iv[12];
+    int n, ok;
+
+    if (!ctx)
+        return -1;
+    channel_iv(iv, ch->sent++);
+    ok = EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, ch->send_key, iv) == 1
+        && EVP_EncryptUpdate(ctx, out, &n, in, (int) len) == 1
+        && EVP_EncryptFinal_ex(ctx, out + n, &n) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHANNEL_TAG_LEN, out + len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok ? (ssize_t) (len + CHANNEL_TAG_LEN) : -1;
+}
+
+ssize_t channel_open(struct channel *ch, unsigned char *frame, size_t len)
+{
+    EVP_CIPHER_CTX *ctx;
+    unsigned char iv[12];
+    int n, ok;
+
+    if (len < CHANNEL_TAG_LEN || !(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+    len -= CHANNEL_TAG_LEN;
+    channel_iv(iv, ch->received++);
+    ok = EVP_DecryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, ch->recv_key, iv) == 1
+        && EVP_DecryptUpdate(ctx, frame, &n, frame, (int) len) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, CHANNEL_TAG_LEN, frame + len) == 1
+        && EVP_DecryptFinal_ex(ctx, frame + n, &n) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    if (!ok) {
+        fprintf(stderr, "Frame of the ESP32 rejected, does it have another PSK?\n");
+        channel_drop(ch);
+        return -1;
+    }
+    ch->verified = 1;
+    return (ssize_t) len;
+}
+
+void channel_end(struct channel *ch)
+{
+    if (ch->active && !ch->verified)
+        channel_drop(ch);
+    ch->active = 0;
+    OPENSSL_cleanse(ch->send_key, sizeof ch->send_key);
+    OPENSSL_cleanse(ch->recv_key, sizeof ch->recv_key);
+}
+
+#else
+
+int channel_load(struct channel *ch, const char *path, int create)
+{
+    memset(ch, 0, sizeof *ch);
+    fprintf(stderr, "vpcd-relay was built without OpenSSL, it can't encrypt the session\n");
+    return -1;
+}
+
+int channel_beacon(struct channel *ch, struct in_addr addr, unsigned char *beacon)
+{
+    return -1;
+}
+
+ssize_t channel_reply(struct channel *ch, const unsigned char *hello,
+        size_t len, unsigned char *out)
+{
+    return -1;
+}
+
+ssize_t channel_seal(struct channel *ch, const unsigned char *in, size_t len,
+        unsigned char *out)
+{
+    return -1;
+}
+
+ssize_t channel_open(struct channel *ch, unsigned char *frame, size_t len)
+{
+    return -1;
+}
+
+void channel_end(struct channel *ch)
+{
+    ch->active = 0;
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The encrypted channel with the ESP32, the relay side of libChannel.h in
+ * the firmware, which describes the protocol.
+ */
+#ifndef _CHANNEL_H
+#define _CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define CHANNEL_MAGIC       "WSC1"
+#define CHANNEL_MAGIC_LEN   4
+#define CHANNEL_KEY_LEN     32      /* The PSK and the secret of a session */
+#define CHANNEL_ID_LEN      8
+#define CHANNEL_NONCE_LEN   16
+#define CHANNEL_TAG_LEN     16
+#define CHANNEL_POINT_LEN   65      /* A P-256 public key, uncompressed */
+#define CHANNEL_HELLO_LEN   (CHANNEL_MAGIC_LEN + 1 + CHANNEL_ID_LEN + CHANNEL_NONCE_LEN)
+#define CHANNEL_PAIR_LEN    (CHANNEL_HELLO_LEN + CHANNEL_POINT_LEN)
+#define CHANNEL_REPLY_MAX   (CHANNEL_PAIR_LEN + CHANNEL_KEY_LEN)
+#define CHANNEL_RESUME_TIME 3600    /* Seconds a session can be resumed */
+#define CHANNEL_BEACON_NONCE_LEN 8
+#define CHANNEL_BEACON_TAG_LEN 16
+/* A beacon after its magic: Port (2) | Nonce | Tag */
+#define CHANNEL_BEACON_LEN  (2 + CHANNEL_BEACON_NONCE_LEN + CHANNEL_BEACON_TAG_LEN)
+
+#define CHANNEL_NEW     0
+#define CHANNEL_RESUME  1
+#define CHANNEL_PAIR    2
+
+struct channel {
+    unsigned char psk[CHANNEL_KEY_LEN];
+    int pairing;        /* Give the PSK to an ESP32 that has none */
+    unsigned char id[CHANNEL_ID_LEN];   /* Of the session that can be resumed */
+    unsigned char secret[CHANNEL_KEY_LEN];
+    time_t until;       /* When it can no longer be resumed, 0 if there is none */
+    unsigned char send_key[16];
+    unsigned char recv_key[16];
+    uint64_t sent;
+    uint64_t received;
+    int active;         /* The frames are encrypted */
+    int verified;       /* A frame of the ESP32 has checked on this connection */
+};
+
+/*
+ * Read the PSK from path, a line of 64 hex digits. With create, a missing
+ * file is made with a new PSK, for pairing. Returns 0 or -1.
+ */
+int channel_load(struct channel *ch, const char *path, int create);
+
+/* Write the PSK to out, in hex (2 * CHANNEL_KEY_LEN + 1 bytes) */
+void channel_hex(const unsigned char *psk, char *out);
+
+/*
+ * Complete a beacon sent from addr, whose port is in the first 2 bytes of
+ * beacon: write a new nonce after it and the first CHANNEL_BEACON_TAG_LEN
+ * bytes of HMAC-SHA256(PSK, "WSC1 beacon" | Address | Port | Nonce), so
+ * that a paired ESP32 only follows the beacons of a relay that knows the
+ * PSK, to the address they came from. Returns 0 or -1.
+ */
+int channel_beacon(struct channel *ch, struct in_addr addr, unsigned char *beacon);
+
+/*
+ * Take the hello of the ESP32 and write the reply to out, which has room
+ * for CHANNEL_REPLY_MAX bytes. The frames are encrypted from then on.
+ * Returns the length of the reply, or -1 if the session can't go on.
+ */
+ssize_t channel_reply(struct channel *ch, const unsigned char *hello,
+        size_t len, unsigned char *out);
+
+/* Encrypt len bytes of in to out, which has room for CHANNEL_TAG_LEN more.
+ * Returns the length of the frame or -1. */
+ssize_t channel_seal(struct channel *ch, const unsigned char *in, size_t len,
+        unsigned char *out);
+
+/* Decrypt and check a frame in place. Returns the length of its data, or -1
+ * if it doesn't check */
+ssize_t channel_open(struct channel *ch, unsigned char *frame, size_t len);
+
+/* The connection has ended. A session that never got a frame of the ESP32
+ * through is not resumed. */
+void channel_end(struct channel *ch);
+
+#endif
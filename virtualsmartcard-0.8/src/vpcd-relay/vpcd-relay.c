@@ -0,0 +1,1005 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Relay between vpcd and the ESP32, in place of `vicc --esp32`.
+ *
+ * The relay plays the part of the virtual ICC towards vpcd and of the host
+ * towards the ESP32. Both sides frame their messages with the length on 2
+ * bytes (network byte order); on the ESP32 side an empty frame is a
+ * keep-alive, which the ESP32 echoes back.
+ *
+ * The relay broadcasts a beacon every second (see gpg.c in the firmware),
+ * with a tag of the PSK when it has one: a paired ESP32 only follows the
+ * beacons of its relay. The tag covers the address the beacon goes out
+ * from, on a host with several interfaces use -L for the one of the ESP32.
+ *
+ * With a PSK (-k), the session is encrypted: the first frame of the ESP32
+ * is its hello, the relay replies and every other non-empty frame is then
+ * sealed with AES-128-GCM (see channel.h). A reconnect within the hour
+ * resumes the session without the PSK. With -p an ESP32 that has no PSK
+ * yet gets it, wrapped with an ephemeral ECDH key, once its button is
+ * pressed.
+ *
+ * With -t every frame between vpcd and the card is written to a trace, with
+ * its time (see trace.h), for vpcd-replay to play it again later.
+ *
+ * Everything runs in a single epoll loop, so the relay sleeps until either
+ * side has something to say. The card is only connected to vpcd while an
+ * ESP32 session is up: pcscd sees the card being removed when the ESP32
+ * goes away, and inserted again when it comes back.
+ *
+ * The reads of the static data objects that scdaemon repeats on every card
+ * status check (AID, application related data, cardholder data, the public
+ * keys...) are answered from a cache. The relay sees every command on its
+ * way to the card, so the cache is flushed by any command that may change
+ * one of these, by anything it doesn't know and by a reset.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "vpcd.h"
+#include "channel.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if (!defined HAVE_DECL_MSG_NOSIGNAL) || !HAVE_DECL_MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define ESP_PORT            5511    /* The port the ESP32 connects to */
+#define ESP_BEACON_PORT     5512    /* The UDP port the beacons are broadcast to */
+#define ESP_BEACON_MAGIC    "WSCB"
+#define ESP_KEEPALIVE       10      /* Seconds of silence before a keep-alive */
+#define VPCD_RETRY          1       /* Seconds between two connects to vpcd */
+
+#define FRAME_MAX   (2 + 0xFFFF)
+#define PENDING_MAX 4
+#define CACHE_MAX   16      /* Responses kept, the oldest one goes first */
+
+/* The custom INS that resets the PINs of the ESP32, sent on a reset */
+static const unsigned char esp_reset[] = {0x00, 0x55, 0x00, 0x00, 0x00};
+
+/* The ATR of `vicc --esp32`: ISO 7816 card with extended length */
+static const unsigned char esp_atr[] = {
+    0x3b, 0x95, 0x13, 0x81, 0x01, 0x80, 0x73, 0xff, 0x01, 0x40, 0x4b,
+};
+
+/* What each frame sent to the ESP32 is waiting for */
+enum pending {
+    PENDING_APDU,       /* The response goes to vpcd */
+    PENDING_RESET,      /* The response is dropped */
+    PENDING_KEEPALIVE,  /* An empty frame comes back */
+    PENDING_FILL,       /* The response goes to vpcd and to the cache */
+};
+
+/* What a command does to the cache */
+enum cache_op {
+    CACHE_KEEP,         /* Changes none of the cached responses */
+    CACHE_READ,         /* Reads a static data object, may be cached */
+    CACHE_FLUSH,        /* May change anything */
+};
+
+struct cache_entry {
+    unsigned char *apdu;
+    size_t apdu_len;
+    unsigned char *rapdu;
+    size_t rapdu_len;
+};
+
+struct conn {
+    int fd;
+    unsigned char in[FRAME_MAX];
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+};
+
+struct relay {
+    int epfd;
+    int esp_server;
+    int beacon_sock;
+    int beacon_timer;
+    struct in_addr local_addr;  /* Of -L, INADDR_ANY without it */
+    int keepalive_timer;
+    int vpcd_timer;
+    struct conn esp;
+    struct conn vpcd;
+    enum pending pending[PENDING_MAX];
+    size_t pending_len;
+    int esp_idle;       /* Keep-alive ticks without any frame from the ESP32 */
+    const char *vpcd_host;
+    unsigned short vpcd_port;
+    struct cache_entry cache[CACHE_MAX];
+    size_t cache_len;
+    struct cache_entry fill;    /* The command of the PENDING_FILL */
+    int no_cache;
+    int hello;          /* Introduce the card to vpcd, for a shared port */
+    char esp_id[VICC_ID_MAX + 1];   /* Address of the ESP32, names the card */
+    struct channel channel;
+    struct vicc_trace trace;    /* Capture, its file is NULL without -t */
+    int encrypt;        /* The session starts with the hello of the channel */
+    int handshake;      /* The hello hasn't come yet */
+    int pairing;        /* The ESP32 waits for its button to take the PSK */
+    int verbose;
+};
+
+#define DEBUG(r, ...) do { if ((r)->verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Add a frame to the capture. It is flushed with each answer, so that a
+ * trace is whole up to the last one when the relay is stopped */
+static void trace_frame(struct relay *r, int kind, const unsigned char *data,
+        size_t len)
+{
+    if (!r->trace.file)
+        return;
+    if (vicc_trace_write(&r->trace, kind, now_us(), data, len) != 0
+            || (kind != VICC_TRACE_COMMAND && fflush(r->trace.file) != 0)) {
+        fprintf(stderr, "Trace not written, capture stopped: %s\n", strerror(errno));
+        vicc_trace_close(&r->trace);
+    }
+}
+
+static void conn_init(struct conn *c)
+{
+    c->fd = -1;
+    c->in_len = 0;
+    c->out = NULL;
+    c->out_len = 0;
+}
+
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int watch(struct relay *r, int op, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(r->epfd, op, fd, &ev);
+}
+
+static int timer_open(struct relay *r, time_t secs, int repeat)
+{
+    struct itimerspec its;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+
+    if (fd < 0)
+        return -1;
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = secs;
+    if (repeat)
+        its.it_interval.tv_sec = secs;
+    if (timerfd_settime(fd, 0, &its, NULL) != 0
+            || watch(r, EPOLL_CTL_ADD, fd, EPOLLIN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void timer_ack(int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof expirations) < 0) {
+        /* spurious wake-up, nothing to acknowledge */
+    }
+}
+
+static void conn_close(struct relay *r, struct conn *c)
+{
+    if (c->fd >= 0) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    free(c->out);
+    conn_init(c);
+}
+
+/* Data objects that are always readable and only change through PUT DATA
+ * or a key import or generation */
+static const uint16_t cache_dos[] = {
+    0x004F,     /* Application identifier */
+    0x005E,     /* Login data */
+    0x0065,     /* Cardholder related data */
+    0x006E,     /* Application related data */
+    0x0101,     /* Private DO 1 */
+    0x0102,     /* Private DO 2 */
+    0x5F50,     /* URL */
+    0x5F52,     /* Historical bytes */
+    0x7F21,     /* Cardholder certificate */
+};
+
+static enum cache_op cache_classify(const unsigned char *apdu, size_t len)
+{
+    size_t i;
+    uint16_t p1p2;
+
+    if (len < 4)
+        return CACHE_FLUSH;
+    p1p2 = (uint16_t) (apdu[2] << 8 | apdu[3]);
+
+    switch (apdu[1]) {
+        case 0xCA:      /* GET DATA */
+            for (i = 0; i < sizeof cache_dos / sizeof cache_dos[0]; i++) {
+                if (cache_dos[i] == p1p2)
+                    return apdu[0] == 0x00 ? CACHE_READ : CACHE_KEEP;
+            }
+            return CACHE_KEEP;
+        case 0x47:      /* GENERATE ASYMMETRIC KEY PAIR */
+            /* 81 reads the public key, 80 replaces it */
+            return apdu[2] == 0x81 && apdu[0] == 0x00 ? CACHE_READ : CACHE_FLUSH;
+        case 0xA4:      /* SELECT */
+        case 0x2A:      /* PERFORM SECURITY OPERATION */
+        case 0x88:      /* INTERNAL AUTHENTICATE */
+        case 0x58:      /* BATCH SIGN */
+        case 0x84:      /* GET CHALLENGE */
+        case 0xC0:      /* GET RESPONSE */
+        case 0x56:      /* Statistics */
+        case 0x57:      /* Trace level */
+        case 0x59:      /* Diagnostics */
+            return CACHE_KEEP;
+        default:
+            /* VERIFY and the other PIN commands change the retry counters
+             * in the application related data, PUT DATA the rest */
+            return CACHE_FLUSH;
+    }
+}
+
+static void cache_entry_free(struct cache_entry *e)
+{
+    free(e->apdu);
+    free(e->rapdu);
+    memset(e, 0, sizeof *e);
+}
+
+static void cache_flush(struct relay *r)
+{
+    size_t i;
+
+    if (r->cache_len)
+        DEBUG(r, "Cache flushed\n");
+    for (i = 0; i < r->cache_len; i++)
+        cache_entry_free(&r->cache[i]);
+    r->cache_len = 0;
+    cache_entry_free(&r->fill);
+}
+
+static const struct cache_entry *cache_find(struct relay *r,
+        const unsigned char *apdu, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < r->cache_len; i++) {
+        if (r->cache[i].apdu_len == len && memcmp(r->cache[i].apdu, apdu, len) == 0)
+            return &r->cache[i];
+    }
+    return NULL;
+}
+
+/* Keep the response to the command of r->fill if it is complete */
+static void cache_store(struct relay *r, const unsigned char *rapdu, size_t len)
+{
+    struct cache_entry *e;
+
+    if (!r->fill.apdu || len < 2 || rapdu[len-2] != 0x90 || rapdu[len-1] != 0x00
+            || cache_find(r, r->fill.apdu, r->fill.apdu_len)) {
+        /* 61 XX needs a GET RESPONSE, which isn't cached */
+        cache_entry_free(&r->fill);
+        return;
+    }
+
+    if (r->cache_len == CACHE_MAX) {
+        cache_entry_free(&r->cache[0]);
+        memmove(r->cache, r->cache + 1, (CACHE_MAX - 1) * sizeof r->cache[0]);
+        r->cache_len--;
+    }
+    e = &r->cache[r->cache_len];
+    e->rapdu = malloc(len);
+    if (!e->rapdu) {
+        cache_entry_free(&r->fill);
+        return;
+    }
+    memcpy(e->rapdu, rapdu, len);
+    e->rapdu_len = len;
+    e->apdu = r->fill.apdu;
+    e->apdu_len = r->fill.apdu_len;
+    r->fill.apdu = NULL;
+    r->fill.apdu_len = 0;
+    r->cache_len++;
+}
+
+/* Queue a frame on c and write as much of it as the socket takes */
+static int conn_send(struct relay *r, struct conn *c,
+        const unsigned char *buf, size_t len)
+{
+    unsigned char *p;
+    ssize_t n;
+    size_t sent = 0;
+
+    if (c->fd < 0 || len > 0xFFFF)
+        return -1;
+
+    p = realloc(c->out, c->out_len + 2 + len);
+    if (!p)
+        return -1;
+    c->out = p;
+    p += c->out_len;
+    p[0] = (unsigned char) (len >> 8);
+    p[1] = (unsigned char) (len & 0xFF);
+    memcpy(p + 2, buf, len);
+    c->out_len += 2 + len;
+
+    while (sent < c->out_len) {
+        n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+
+    return watch(r, EPOLL_CTL_MOD, c->fd,
+            c->out_len ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/* Write what is left of the queued frames, once c can take more */
+static int conn_flush(struct relay *r, struct conn *c)
+{
+    ssize_t n;
+
+    while (c->out_len) {
+        n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+    return watch(r, EPOLL_CTL_MOD, c->fd, EPOLLIN);
+}
+
+/*
+ * Read what is available on c. Returns the length of the next complete
+ * frame (its data at c->in + 2), -2 if more is needed and -1 once c is
+ * closed or failed. The frame is consumed with conn_consume.
+ */
+static ssize_t conn_frame(struct conn *c)
+{
+    size_t len;
+    ssize_t n;
+
+    while (1) {
+        if (c->in_len >= 2) {
+            len = (size_t) (c->in[0] << 8 | c->in[1]);
+            if (c->in_len >= 2 + len)
+                return (ssize_t) len;
+        }
+        n = recv(c->fd, c->in + c->in_len, sizeof c->in - c->in_len, 0);
+        if (n == 0)
+            return -1;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return -2;
+            return -1;
+        }
+        c->in_len += n;
+    }
+}
+
+static void conn_consume(struct conn *c, size_t len)
+{
+    memmove(c->in, c->in + 2 + len, c->in_len - 2 - len);
+    c->in_len -= 2 + len;
+}
+
+static void vpcd_connect(struct relay *r)
+{
+    struct addrinfo hints, *res = NULL, *cur;
+    char port[10];
+    int fd = -1;
+
+    snprintf(port, sizeof port, "%hu", r->vpcd_port);
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    if (getaddrinfo(r->vpcd_host, port, &hints, &res) == 0) {
+        for (cur = res; cur; cur = cur->ai_next) {
+            fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, cur->ai_addr, cur->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+    }
+
+    if (fd < 0 || set_nonblock(fd) != 0
+            || watch(r, EPOLL_CTL_ADD, fd, EPOLLIN) != 0) {
+        if (fd >= 0)
+            close(fd);
+        DEBUG(r, "vpcd not reachable on %s:%hu, retrying\n",
+                r->vpcd_host, r->vpcd_port);
+        if (r->vpcd_timer < 0)
+            r->vpcd_timer = timer_open(r, VPCD_RETRY, 1);
+        return;
+    }
+
+    r->vpcd.fd = fd;
+    fprintf(stderr, "Connected to vpcd at %s:%hu\n", r->vpcd_host, r->vpcd_port);
+    if (r->hello) {
+        /* Give the card the same slot each time it comes back */
+        unsigned char hello[VICC_HELLO_LEN + VICC_ID_MAX];
+        size_t id_len = strlen(r->esp_id);
+
+        memcpy(hello, VICC_HELLO, VICC_HELLO_LEN);
+        memcpy(hello + VICC_HELLO_LEN, r->esp_id, id_len);
+        if (conn_send(r, &r->vpcd, hello, VICC_HELLO_LEN + id_len) != 0) {
+            conn_close(r, &r->vpcd);
+            if (r->vpcd_timer < 0)
+                r->vpcd_timer = timer_open(r, VPCD_RETRY, 1);
+            return;
+        }
+    }
+    if (r->vpcd_timer >= 0) {
+        close(r->vpcd_timer);
+        r->vpcd_timer = -1;
+    }
+}
+
+/* End the ESP32 session, which also takes the card out of vpcd */
+static void session_end(struct relay *r)
+{
+    if (r->esp.fd >= 0)
+        fprintf(stderr, "ESP32 session ended\n");
+    conn_close(r, &r->esp);
+    conn_close(r, &r->vpcd);
+    if (r->vpcd_timer >= 0) {
+        close(r->vpcd_timer);
+        r->vpcd_timer = -1;
+    }
+    if (r->keepalive_timer >= 0) {
+        close(r->keepalive_timer);
+        r->keepalive_timer = -1;
+    }
+    r->pending_len = 0;
+    r->handshake = r->pairing = 0;
+    channel_end(&r->channel);
+    /* the next session may be with another card, or a card reset by hand */
+    cache_flush(r);
+}
+
+static int esp_send(struct relay *r, enum pending kind,
+        const unsigned char *buf, size_t len)
+{
+    static unsigned char sealed[0xFFFF];
+    ssize_t n;
+
+    if (r->pending_len == PENDING_MAX)
+        return -1;
+    if (r->channel.active && len > 0) {
+        if (len > sizeof sealed - CHANNEL_TAG_LEN
+                || (n = channel_seal(&r->channel, buf, len, sealed)) < 0)
+            return -1;
+        buf = sealed;
+        len = (size_t) n;
+    }
+    if (conn_send(r, &r->esp, buf, len) != 0)
+        return -1;
+    r->pending[r->pending_len++] = kind;
+    return 0;
+}
+
+/* Whether a response is on its way to vpcd, which must come before any */
+static int apdu_pending(struct relay *r)
+{
+    size_t i;
+
+    for (i = 0; i < r->pending_len; i++) {
+        if (r->pending[i] == PENDING_APDU || r->pending[i] == PENDING_FILL)
+            return 1;
+    }
+    return 0;
+}
+
+/* Answer a command from the cache or send it to the ESP32 */
+static int esp_command(struct relay *r, const unsigned char *apdu, size_t len)
+{
+    const struct cache_entry *e;
+    enum cache_op op = CACHE_FLUSH;
+    size_t offset, size;
+
+    if (r->no_cache)
+        return esp_send(r, PENDING_APDU, apdu, len);
+
+    if (apdu[0] == VPCD_CTRL_BATCH) {
+        /* not cached, but it may change what is */
+        op = CACHE_KEEP;
+        for (offset = 1; offset + 2 <= len && op != CACHE_FLUSH; offset += 2 + size) {
+            size = (size_t) (apdu[offset] << 8 | apdu[offset+1]);
+            if (offset + 2 + size > len || cache_classify(apdu + offset + 2, size) == CACHE_FLUSH)
+                op = CACHE_FLUSH;
+        }
+        if (op == CACHE_FLUSH)
+            cache_flush(r);
+        return esp_send(r, PENDING_APDU, apdu, len);
+    }
+
+    op = cache_classify(apdu, len);
+    if (op == CACHE_FLUSH)
+        cache_flush(r);
+    if (op != CACHE_READ || apdu_pending(r))
+        return esp_send(r, PENDING_APDU, apdu, len);
+
+    e = cache_find(r, apdu, len);
+    if (e) {
+        DEBUG(r, "Response APDU (%zu bytes) from the cache\n", e->rapdu_len);
+        trace_frame(r, VICC_TRACE_CACHED, e->rapdu, e->rapdu_len);
+        if (conn_send(r, &r->vpcd, e->rapdu, e->rapdu_len) != 0) {
+            conn_close(r, &r->vpcd);
+            vpcd_connect(r);
+        }
+        return 0;
+    }
+
+    cache_entry_free(&r->fill);
+    r->fill.apdu = malloc(len);
+    if (!r->fill.apdu)
+        return esp_send(r, PENDING_APDU, apdu, len);
+    memcpy(r->fill.apdu, apdu, len);
+    r->fill.apdu_len = len;
+    return esp_send(r, PENDING_FILL, apdu, len);
+}
+
+static void esp_accept(struct relay *r)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof addr;
+    int yes = 1;
+    int idle = 10, interval = 5, count = 3;
+    int fd = accept(r->esp_server, (struct sockaddr *) &addr, &addr_len);
+
+    if (fd < 0)
+        return;
+
+    /* A new session means the ESP32 gave up on the old one */
+    session_end(r);
+
+    if (set_nonblock(fd) != 0
+            || setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes) != 0
+            || setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof yes) != 0
+            || setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle) != 0
+            || setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof interval) != 0
+            || setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof count) != 0
+            || watch(r, EPOLL_CTL_ADD, fd, EPOLLIN) != 0) {
+        close(fd);
+        return;
+    }
+    r->esp.fd = fd;
+    r->esp_idle = 0;
+    r->keepalive_timer = timer_open(r, ESP_KEEPALIVE, 1);
+    snprintf(r->esp_id, sizeof r->esp_id, "%s", inet_ntoa(addr.sin_addr));
+    fprintf(stderr, "ESP32 session started from %s\n", r->esp_id);
+
+    if (r->encrypt)
+        r->handshake = 1;   /* The card is there once the channel is */
+    else
+        vpcd_connect(r);
+}
+
+/* Take the hello of the ESP32 and reply to it */
+static int esp_hello(struct relay *r, const unsigned char *hello, size_t len)
+{
+    unsigned char reply[CHANNEL_REPLY_MAX];
+    ssize_t n = channel_reply(&r->channel, hello, len, reply);
+
+    if (n < 0 || conn_send(r, &r->esp, reply, (size_t) n) != 0)
+        return -1;
+    DEBUG(r, "Channel %s\n", reply[CHANNEL_MAGIC_LEN] == CHANNEL_RESUME ? "resumed"
+            : reply[CHANNEL_MAGIC_LEN] == CHANNEL_PAIR ? "paired" : "started");
+    r->handshake = 0;
+    r->pairing = reply[CHANNEL_MAGIC_LEN] == CHANNEL_PAIR;
+    vpcd_connect(r);
+    return 0;
+}
+
+static void esp_keepalive(struct relay *r)
+{
+    if (r->handshake || r->pairing
+            || (r->pending_len && r->pending[0] != PENDING_KEEPALIVE)) {
+        /* The ESP32 is busy with a command (a key generation, or waiting
+         * for its button), TCP keep-alives watch the link meanwhile */
+        r->esp_idle = 0;
+        return;
+    }
+    if (r->esp_idle++ == 0)
+        return;
+    if (r->esp_idle > 2) {      /* Not even the keep-alive came back */
+        session_end(r);
+        return;
+    }
+    if (r->pending_len == 0 && esp_send(r, PENDING_KEEPALIVE, NULL, 0) != 0)
+        session_end(r);
+}
+
+static void esp_read(struct relay *r)
+{
+    ssize_t len, data_len;
+
+    while ((len = conn_frame(&r->esp)) >= 0) {
+        r->esp_idle = 0;
+        r->pairing = 0;
+        data_len = len;
+        if (r->handshake) {
+            if (esp_hello(r, r->esp.in + 2, (size_t) len) != 0) {
+                session_end(r);
+                return;
+            }
+            conn_consume(&r->esp, len);
+            continue;
+        }
+        if (r->channel.active && len > 0
+                && (data_len = channel_open(&r->channel, r->esp.in + 2, (size_t) len)) < 0) {
+            session_end(r);
+            return;
+        }
+        if (r->pending_len == 0) {
+            DEBUG(r, "Unexpected frame from the ESP32 dropped\n");
+        } else {
+            enum pending kind = r->pending[0];
+            memmove(r->pending, r->pending + 1,
+                    (r->pending_len - 1) * sizeof r->pending[0]);
+            r->pending_len--;
+            if (kind == PENDING_FILL)
+                cache_store(r, r->esp.in + 2, data_len);
+            if (kind == PENDING_APDU || kind == PENDING_FILL) {
+                DEBUG(r, "Response APDU (%zd bytes)\n", data_len);
+                trace_frame(r, VICC_TRACE_RESPONSE, r->esp.in + 2, data_len);
+                if (conn_send(r, &r->vpcd, r->esp.in + 2, data_len) != 0) {
+                    conn_close(r, &r->vpcd);
+                    vpcd_connect(r);
+                }
+            }
+        }
+        conn_consume(&r->esp, len);
+    }
+    if (len == -1)
+        session_end(r);
+}
+
+static void vpcd_read(struct relay *r)
+{
+    ssize_t len;
+    int ok = 1;
+
+    while (ok && (len = conn_frame(&r->vpcd)) >= 0) {
+        const unsigned char *msg = r->vpcd.in + 2;
+
+        if (len == VPCD_CTRL_LEN) {
+            switch (msg[0]) {
+                case VPCD_CTRL_OFF:
+                case VPCD_CTRL_ON:
+                    break;
+                case VPCD_CTRL_RESET:
+                    DEBUG(r, "Reset\n");
+                    trace_frame(r, VICC_TRACE_RESET, NULL, 0);
+                    cache_flush(r);
+                    ok = esp_send(r, PENDING_RESET, esp_reset, sizeof esp_reset) == 0;
+                    break;
+                case VPCD_CTRL_ATR:
+                    ok = conn_send(r, &r->vpcd, esp_atr, sizeof esp_atr) == 0;
+                    break;
+                default:
+                    DEBUG(r, "Unknown control command\n");
+                    break;
+            }
+        } else if (len > 0) {
+            DEBUG(r, "%s (%zd bytes)\n",
+                    msg[0] == VPCD_CTRL_BATCH ? "Batch of APDUs" : "Command APDU", len);
+            trace_frame(r, VICC_TRACE_COMMAND, msg, len);
+            ok = esp_command(r, msg, len) == 0;
+        }
+        conn_consume(&r->vpcd, len);
+    }
+
+    if (!ok) {
+        session_end(r);
+    } else if (len == -1) {
+        fprintf(stderr, "vpcd closed the connection\n");
+        conn_close(r, &r->vpcd);
+        vpcd_connect(r);
+    }
+}
+
+/* The address the beacons to "to" go out from, which the tag covers */
+static int beacon_source(struct relay *r, const struct sockaddr_in *to,
+        struct in_addr *addr)
+{
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof from;
+    int yes = 1;
+    int fd;
+
+    if (r->local_addr.s_addr != htonl(INADDR_ANY)) {
+        *addr = r->local_addr;
+        return 0;
+    }
+    /* Let the kernel pick it, as it does for the beacon, nothing is sent */
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof yes) != 0
+            || connect(fd, (const struct sockaddr *) to, sizeof *to) != 0
+            || getsockname(fd, (struct sockaddr *) &from, &from_len) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    *addr = from.sin_addr;
+    return 0;
+}
+
+static void beacon_send(struct relay *r)
+{
+    unsigned char beacon[sizeof ESP_BEACON_MAGIC - 1 + CHANNEL_BEACON_LEN];
+    size_t len = sizeof ESP_BEACON_MAGIC - 1 + 2;
+    struct sockaddr_in to;
+    struct in_addr from;
+
+    memcpy(beacon, ESP_BEACON_MAGIC, sizeof ESP_BEACON_MAGIC - 1);
+    beacon[sizeof ESP_BEACON_MAGIC - 1] = (unsigned char) (ESP_PORT >> 8);
+    beacon[sizeof ESP_BEACON_MAGIC] = (unsigned char) (ESP_PORT & 0xFF);
+
+    memset(&to, 0, sizeof to);
+    to.sin_family = AF_INET;
+    to.sin_port = htons(ESP_BEACON_PORT);
+    to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    if (r->encrypt) {       /* A paired ESP32 only follows a beacon with the tag */
+        if (beacon_source(r, &to, &from) != 0
+                || channel_beacon(&r->channel, from, beacon + sizeof ESP_BEACON_MAGIC - 1) != 0) {
+            DEBUG(r, "Beacon not sent: no tag\n");
+            return;
+        }
+        len = sizeof beacon;
+    }
+    if (sendto(r->beacon_sock, beacon, len, 0,
+                (struct sockaddr *) &to, sizeof to) < 0)
+        DEBUG(r, "Beacon not sent: %s\n", strerror(errno));
+}
+
+static int relay_open(struct relay *r, const char *local_ip)
+{
+    struct sockaddr_in addr;
+    int yes = 1;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (local_ip && inet_pton(AF_INET, local_ip, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid local IP %s\n", local_ip);
+        return -1;
+    }
+    r->local_addr = addr.sin_addr;
+
+    r->epfd = epoll_create1(0);
+    if (r->epfd < 0)
+        return -1;
+
+    r->esp_server = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_port = htons(ESP_PORT);
+    if (r->esp_server < 0
+            || setsockopt(r->esp_server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) != 0
+            || bind(r->esp_server, (struct sockaddr *) &addr, sizeof addr) != 0
+            || listen(r->esp_server, 1) != 0
+            || watch(r, EPOLL_CTL_ADD, r->esp_server, EPOLLIN) != 0) {
+        perror("ESP32 port");
+        return -1;
+    }
+
+    /* The beacons go out from the address the ESP32 connects to */
+    r->beacon_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_port = 0;
+    if (r->beacon_sock < 0
+            || setsockopt(r->beacon_sock, SOL_SOCKET, SO_BROADCAST, &yes, sizeof yes) != 0
+            || bind(r->beacon_sock, (struct sockaddr *) &addr, sizeof addr) != 0) {
+        perror("Beacon socket");
+        return -1;
+    }
+    r->beacon_timer = timer_open(r, 1, 1);
+    if (r->beacon_timer < 0)
+        return -1;
+
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-L local IP] [-H vpcd host] [-P vpcd port] [-k PSK file [-p]] [-t trace] [-m] [-n] [-v]\n"
+            "Relay the APDUs of vpcd to the ESP32 over WiFi.\n"
+            "  -L  local IP the ESP32 connects to (default: any)\n"
+            "  -H  host name of vpcd (default: localhost)\n"
+            "  -P  port of vpcd (default: %d)\n"
+            "  -k  encrypt the session with the PSK in the file\n"
+            "  -p  give the PSK to an ESP32 that has none, making the file if needed\n"
+            "  -t  write every command and response to the trace file, for vpcd-replay\n"
+            "  -m  vpcd shares its port among the slots (--enable-vpcdmux)\n"
+            "  -n  send every command to the ESP32, without the cache\n"
+            "  -v  print each APDU and event\n",
+            name, VPCDPORT);
+}
+
+int main(int argc, char *argv[])
+{
+    struct relay r;
+    struct epoll_event events[8];
+    const char *local_ip = NULL;
+    const char *psk_file = NULL;
+    const char *trace_file = NULL;
+    int pair = 0;
+    int opt, n, i;
+
+    memset(&r, 0, sizeof r);
+    r.beacon_timer = r.keepalive_timer = r.vpcd_timer = -1;
+    r.vpcd_host = "localhost";
+    r.vpcd_port = VPCDPORT;
+    conn_init(&r.esp);
+    conn_init(&r.vpcd);
+
+    while ((opt = getopt(argc, argv, "L:H:P:k:pt:mnvh")) != -1) {
+        switch (opt) {
+            case 'L':
+                local_ip = optarg;
+                break;
+            case 'H':
+                r.vpcd_host = optarg;
+                break;
+            case 'P':
+                r.vpcd_port = (unsigned short) strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                psk_file = optarg;
+                break;
+            case 'p':
+                pair = 1;
+                break;
+            case 't':
+                trace_file = optarg;
+                break;
+            case 'm':
+                r.hello = 1;
+                break;
+            case 'n':
+                r.no_cache = 1;
+                break;
+            case 'v':
+                r.verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (pair && !psk_file) {
+        fprintf(stderr, "-p needs the PSK file of -k\n");
+        return 1;
+    }
+    if (psk_file) {
+        if (channel_load(&r.channel, psk_file, pair) != 0)
+            return 1;
+        r.channel.pairing = pair;
+        r.encrypt = 1;
+    }
+
+    if (trace_file && vicc_trace_create(&r.trace, trace_file) != 0) {
+        perror(trace_file);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (relay_open(&r, local_ip) != 0)
+        return 1;
+    fprintf(stderr, "Waiting for the ESP32 on port %d\n", ESP_PORT);
+    beacon_send(&r);
+
+    while (1) {
+        n = epoll_wait(r.epfd, events, sizeof events / sizeof events[0], -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            /* Any handler may close the descriptors of the others */
+            if (fd == r.esp_server) {
+                esp_accept(&r);
+            } else if (fd == r.beacon_timer) {
+                timer_ack(fd);
+                beacon_send(&r);
+            } else if (fd == r.keepalive_timer) {
+                timer_ack(fd);
+                esp_keepalive(&r);
+            } else if (fd == r.vpcd_timer) {
+                timer_ack(fd);
+                if (r.esp.fd >= 0 && r.vpcd.fd < 0)
+                    vpcd_connect(&r);
+            } else if (fd == r.esp.fd) {
+                if ((events[i].events & EPOLLOUT) && conn_flush(&r, &r.esp) != 0)
+                    session_end(&r);
+                else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    esp_read(&r);
+            } else if (fd == r.vpcd.fd) {
+                if ((events[i].events & EPOLLOUT) && conn_flush(&r, &r.vpcd) != 0)
+                    session_end(&r);
+                else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    vpcd_read(&r);
+            }
+        }
+    }
+}
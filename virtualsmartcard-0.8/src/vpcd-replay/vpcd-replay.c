@@ -0,0 +1,581 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replay of a trace of vpcd-relay -t through PC/SC, to compare the latency
+ * of each command between two builds of the card with the same session.
+ *
+ * The commands are sent as they were, with the pause the client made after
+ * each response, divided by the speed. A batch of APDUs is sent one by one,
+ * as PC/SC has no batches, and stops where the card stopped it (see
+ * vicc_transmit_batch), its latency is the one of all of them. A reset is a
+ * SCardReconnect.
+ *
+ * Each command of the trace is printed with its time in the trace and in
+ * the replay, the difference and the status word, with a * where the status
+ * word has changed. A summary by instruction follows. Two traces can be
+ * compared the same way without a card.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <winscard.h>
+
+#ifndef SCARD_AUTOALLOCATE
+#define SCARD_AUTOALLOCATE (DWORD)(-1)
+#endif
+
+#define REPLAY_RESPONSE_MAX 0xFFFF
+/* Longest wait for a card before the replay */
+#define REPLAY_CARD_WAIT_MS 30000
+/* The first byte of a batch of APDUs, VPCD_CTRL_BATCH of vpcd.h */
+#define REPLAY_BATCH        0xFF
+
+/* A command of a trace and its response */
+struct exchange {
+    int reset;
+    unsigned char *command;
+    size_t len;
+    long long gap;      /* Microseconds from the response before */
+    long long latency;  /* Microseconds to the response, -1 without one */
+    int sw;             /* Of the (last) response, -1 without one */
+    int cached;         /* Answered by the relay */
+};
+
+struct session {
+    struct exchange *exchanges;
+    size_t used, size;
+};
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(long long until)
+{
+    long long left = until - now_us();
+    struct timespec ts;
+
+    if (left <= 0)
+        return;
+    ts.tv_sec = left / 1000000;
+    ts.tv_nsec = (left % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+static void session_free(struct session *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->used; i++)
+        free(s->exchanges[i].command);
+    free(s->exchanges);
+    memset(s, 0, sizeof *s);
+}
+
+static struct exchange *session_add(struct session *s)
+{
+    struct exchange *e;
+
+    if (s->used == s->size) {
+        size_t size = s->size ? 2 * s->size : 256;
+        e = realloc(s->exchanges, size * sizeof *e);
+        if (!e)
+            return NULL;
+        s->exchanges = e;
+        s->size = size;
+    }
+    e = &s->exchanges[s->used++];
+    memset(e, 0, sizeof *e);
+    e->latency = -1;
+    e->sw = -1;
+    return e;
+}
+
+/* The status word at the end of a response, which for a batch is the one of
+ * its last APDU */
+static int status_word(const unsigned char *response, size_t len)
+{
+    if (len < 2)
+        return -1;
+    return response[len - 2] << 8 | response[len - 1];
+}
+
+static int session_load(struct session *s, const char *path)
+{
+    static struct vicc_trace_record record;
+    struct vicc_trace trace;
+    struct exchange *e = NULL;
+    long long last = 0, sent = 0;
+    int r;
+
+    memset(s, 0, sizeof *s);
+    if (vicc_trace_open(&trace, path) != 0) {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s is not a trace of vpcd-relay\n", path);
+        else
+            perror(path);
+        return -1;
+    }
+
+    while ((r = vicc_trace_read(&trace, &record)) == 1) {
+        switch (record.kind) {
+            case VICC_TRACE_COMMAND:
+            case VICC_TRACE_RESET:
+                e = session_add(s);
+                if (!e)
+                    goto err;
+                e->gap = record.us - last;
+                sent = record.us;
+                if (record.kind == VICC_TRACE_RESET) {
+                    /* done once vpcd has sent it */
+                    e->reset = 1;
+                    e->latency = 0;
+                    e = NULL;
+                    break;
+                }
+                if (record.len < 4)
+                    goto err;
+                e->command = malloc(record.len);
+                if (!e->command)
+                    goto err;
+                memcpy(e->command, record.data, record.len);
+                e->len = record.len;
+                break;
+            case VICC_TRACE_RESPONSE:
+            case VICC_TRACE_CACHED:
+                if (e) {
+                    e->latency = record.us - sent;
+                    e->sw = status_word(record.data, record.len);
+                    e->cached = record.kind == VICC_TRACE_CACHED;
+                    e = NULL;
+                }
+                break;
+            default:
+                break;
+        }
+        last = record.us;
+    }
+    if (r < 0)
+        goto err;
+    vicc_trace_close(&trace);
+    return 0;
+
+err:
+    fprintf(stderr, "%s is cut short or damaged\n", path);
+    vicc_trace_close(&trace);
+    session_free(s);
+    return -1;
+}
+
+/* Append an entry of length len to the response of a batch */
+static void batch_append(unsigned char *frame, size_t *frame_len,
+        const unsigned char *response, size_t len)
+{
+    if (*frame_len + 2 + len > REPLAY_RESPONSE_MAX)
+        return;
+    frame[*frame_len] = (unsigned char) (len >> 8);
+    frame[*frame_len + 1] = (unsigned char) (len & 0xFF);
+    memcpy(frame + *frame_len + 2, response, len);
+    *frame_len += 2 + len;
+}
+
+/* Send a command of the trace, each APDU of a batch in turn. Writes its
+ * response in the form of the trace to frame. Returns the status word, or -1
+ * if PC/SC failed */
+static int transmit(SCARDHANDLE card, const struct exchange *e,
+        unsigned char *frame, size_t *frame_len, LONG *rv)
+{
+    unsigned char response[REPLAY_RESPONSE_MAX + 2];
+    DWORD response_len;
+    size_t offset, size;
+    int sw;
+
+    if (e->command[0] != REPLAY_BATCH) {
+        response_len = REPLAY_RESPONSE_MAX;
+        *rv = SCardTransmit(card, SCARD_PCI_T1, e->command, (DWORD) e->len,
+                NULL, frame, &response_len);
+        if (*rv != SCARD_S_SUCCESS)
+            return -1;
+        *frame_len = response_len;
+        return status_word(frame, response_len);
+    }
+
+    frame[0] = REPLAY_BATCH;
+    *frame_len = 1;
+    sw = -1;
+    for (offset = 1; offset + 2 <= e->len; offset += 2 + size) {
+        size = (size_t) (e->command[offset] << 8 | e->command[offset + 1]);
+        if (offset + 2 + size > e->len)
+            break;
+        response_len = sizeof response;
+        *rv = SCardTransmit(card, SCARD_PCI_T1, e->command + offset + 2,
+                (DWORD) size, NULL, response, &response_len);
+        if (*rv != SCARD_S_SUCCESS)
+            return -1;
+        batch_append(frame, frame_len, response, response_len);
+        sw = status_word(response, response_len);
+        /* the commands after it only go on after 90 00 or 61 XX */
+        if (sw != 0x9000 && (sw & 0xFF00) != 0x6100)
+            break;
+    }
+    return sw;
+}
+
+/* Replay the session on the card. run gets the times of the replay, out the
+ * frames if it is open */
+static int replay(SCARDHANDLE card, const struct session *base, double speed,
+        struct session *run, struct vicc_trace *out)
+{
+    static unsigned char frame[REPLAY_RESPONSE_MAX];
+    size_t frame_len, i;
+    long long last = now_us(), start;
+    DWORD protocol;
+    LONG rv = SCARD_S_SUCCESS;
+
+    for (i = 0; i < base->used; i++) {
+        const struct exchange *b = &base->exchanges[i];
+        struct exchange *e = session_add(run);
+        if (!e)
+            return -1;
+
+        if (speed > 0)
+            sleep_until(last + (long long) (b->gap / speed));
+        start = now_us();
+        e->gap = start - last;
+        e->reset = b->reset;
+        if (b->reset) {
+            if (out->file)
+                vicc_trace_write(out, VICC_TRACE_RESET, start, NULL, 0);
+            rv = SCardReconnect(card, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1,
+                    SCARD_RESET_CARD, &protocol);
+            if (rv != SCARD_S_SUCCESS)
+                break;
+        } else {
+            if (out->file)
+                vicc_trace_write(out, VICC_TRACE_COMMAND, start, b->command, b->len);
+            e->sw = transmit(card, b, frame, &frame_len, &rv);
+            if (rv != SCARD_S_SUCCESS)
+                break;
+        }
+        last = now_us();
+        e->latency = last - start;
+        if (out->file && !b->reset)
+            vicc_trace_write(out, VICC_TRACE_RESPONSE, last, frame, frame_len);
+    }
+
+    if (rv != SCARD_S_SUCCESS) {
+        fprintf(stderr, "Replay stopped at command %zu: %s\n", i,
+                pcsc_stringify_error(rv));
+        run->used--;
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted values, in milliseconds */
+static double percentile(const long long *sorted, size_t n, double p)
+{
+    size_t rank;
+
+    if (n == 0)
+        return 0;
+    rank = (size_t) (p / 100.0 * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1] / 1000.0;
+}
+
+/* What a command is, for the report: its header, or its first APDU and the
+ * number of them for a batch */
+static void describe(const struct exchange *e, char *out, size_t len)
+{
+    const unsigned char *apdu = e->command;
+    size_t count = 0, offset, size;
+
+    if (e->reset) {
+        snprintf(out, len, "reset");
+        return;
+    }
+    if (apdu[0] != REPLAY_BATCH) {
+        snprintf(out, len, "%02X %02X %02X %02X", apdu[0], apdu[1], apdu[2], apdu[3]);
+        return;
+    }
+    for (offset = 1; offset + 2 <= e->len; offset += 2 + size) {
+        size = (size_t) (e->command[offset] << 8 | e->command[offset + 1]);
+        count++;
+    }
+    if (e->len < 7) {
+        snprintf(out, len, "batch");
+        return;
+    }
+    apdu += 3;
+    snprintf(out, len, "%02X %02X %02X %02X +%zu", apdu[0], apdu[1], apdu[2],
+            apdu[3], count - 1);
+}
+
+/* The instruction of a command, the one of the first APDU of a batch, or
+ * 0x100 for a reset */
+static int instruction(const struct exchange *e)
+{
+    if (e->reset)
+        return 0x100;
+    if (e->command[0] == REPLAY_BATCH)
+        return e->len >= 7 ? e->command[4] : 0;
+    return e->command[1];
+}
+
+/* The status word for the report, ---- without one */
+static const char *sw_text(int sw, char *out, size_t len)
+{
+    if (sw < 0)
+        return "----";
+    snprintf(out, len, "%04X", sw & 0xFFFF);
+    return out;
+}
+
+static void print_report(const struct session *base, const struct session *run)
+{
+    size_t n = base->used < run->used ? base->used : run->used;
+    long long *b, *r, *d;
+    size_t i, count, differ = 0;
+    char name[32], x_sw[8], y_sw[8];
+    int ins;
+
+    printf("%6s  %-17s %10s %10s %10s  %-4s %-4s\n",
+            "#", "Command", "Base ms", "Run ms", "Delta ms", "Base", "Run");
+    for (i = 0; i < n; i++) {
+        const struct exchange *x = &base->exchanges[i], *y = &run->exchanges[i];
+        int changed = x->sw != y->sw;
+
+        describe(x, name, sizeof name);
+        if (x->reset != y->reset || (!x->reset && (x->len != y->len
+                    || memcmp(x->command, y->command, x->len) != 0))) {
+            printf("%6zu  The commands of the traces part here\n", i);
+            n = i;
+            break;
+        }
+        differ += changed;
+        printf("%6zu  %-17s %10.3f %10.3f %+10.3f  %-4s %-4s%s%s\n", i, name,
+                x->latency / 1000.0, y->latency / 1000.0,
+                (y->latency - x->latency) / 1000.0,
+                sw_text(x->sw, x_sw, sizeof x_sw), sw_text(y->sw, y_sw, sizeof y_sw),
+                changed ? " *" : "",
+                x->cached || y->cached ? " (cached)" : "");
+    }
+
+    b = malloc((n ? n : 1) * sizeof *b);
+    r = malloc((n ? n : 1) * sizeof *r);
+    d = malloc((n ? n : 1) * sizeof *d);
+    if (!b || !r || !d)
+        goto err;
+
+    printf("\n%-6s %6s %10s %10s %10s %10s\n",
+            "INS", "Count", "Base p50", "Run p50", "Delta p50", "Delta p90");
+    for (ins = 0; ins <= 0x100; ins++) {
+        count = 0;
+        for (i = 0; i < n; i++) {
+            const struct exchange *x = &base->exchanges[i], *y = &run->exchanges[i];
+            if (instruction(x) != ins || x->latency < 0 || y->latency < 0)
+                continue;
+            b[count] = x->latency;
+            r[count] = y->latency;
+            d[count] = y->latency - x->latency;
+            count++;
+        }
+        if (!count)
+            continue;
+        qsort(b, count, sizeof *b, compare_us);
+        qsort(r, count, sizeof *r, compare_us);
+        qsort(d, count, sizeof *d, compare_us);
+        if (ins == 0x100)
+            snprintf(name, sizeof name, "reset");
+        else
+            snprintf(name, sizeof name, "%02X", ins);
+        printf("%-6s %6zu %10.3f %10.3f %+10.3f %+10.3f\n", name, count,
+                percentile(b, count, 50), percentile(r, count, 50),
+                percentile(d, count, 50), percentile(d, count, 90));
+    }
+    printf("\n%zu of %zu commands compared, %zu with another status word\n",
+            n, base->used, differ);
+
+err:
+    free(b);
+    free(r);
+    free(d);
+}
+
+/* The first reader, if none has been given */
+static char *first_reader(SCARDCONTEXT context)
+{
+    LPSTR readers = NULL;
+    DWORD len = SCARD_AUTOALLOCATE;
+    char *r = NULL;
+
+    if (SCardListReaders(context, NULL, (LPSTR) &readers, &len) == SCARD_S_SUCCESS
+            && readers && *readers)
+        r = strdup(readers);
+    if (readers)
+        SCardFreeMemory(context, readers);
+
+    return r;
+}
+
+/* Wait until there is a card in the reader */
+static LONG wait_card(SCARDCONTEXT context, const char *reader)
+{
+    SCARD_READERSTATE state;
+    LONG r;
+
+    memset(&state, 0, sizeof state);
+    state.szReader = reader;
+    state.dwCurrentState = SCARD_STATE_UNAWARE;
+    while (1) {
+        r = SCardGetStatusChange(context, REPLAY_CARD_WAIT_MS, &state, 1);
+        if (r != SCARD_S_SUCCESS)
+            return r;
+        if (state.dwEventState & SCARD_STATE_PRESENT)
+            return SCARD_S_SUCCESS;
+        state.dwCurrentState = state.dwEventState;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-r reader] [-s speed] [-o trace] trace\n"
+            "       %s -c base trace\n"
+            "Replay a trace of vpcd-relay -t through PC/SC and compare the latency of each command.\n"
+            "  -r  reader (default: the first one)\n"
+            "  -s  pace of the client, 1 as in the trace, 2 twice as fast, 0 without pauses (default: 1)\n"
+            "  -o  write the replay to this trace\n"
+            "  -c  compare the trace with base, without a card\n",
+            name, name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct session base, run;
+    struct vicc_trace out;
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    DWORD protocol;
+    LONG rv;
+    const char *reader = NULL, *compare = NULL, *out_file = NULL;
+    char *first = NULL;
+    double speed = 1;
+    int opt, r = 1;
+
+    while ((opt = getopt(argc, argv, "r:s:o:c:h")) != -1) {
+        switch (opt) {
+            case 'r':
+                reader = optarg;
+                break;
+            case 's':
+                speed = strtod(optarg, NULL);
+                break;
+            case 'o':
+                out_file = optarg;
+                break;
+            case 'c':
+                compare = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind + 1 != argc || speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    memset(&run, 0, sizeof run);
+    memset(&out, 0, sizeof out);
+    if (session_load(&base, compare ? compare : argv[optind]) != 0)
+        return 1;
+    if (compare) {
+        if (session_load(&run, argv[optind]) != 0)
+            goto err;
+        print_report(&base, &run);
+        r = 0;
+        goto err;
+    }
+
+    if (out_file && vicc_trace_create(&out, out_file) != 0) {
+        perror(out_file);
+        goto err;
+    }
+    if (SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &context) != SCARD_S_SUCCESS) {
+        fprintf(stderr, "Could not connect to PC/SC\n");
+        goto err;
+    }
+    if (!reader) {
+        reader = first = first_reader(context);
+        if (!reader) {
+            fprintf(stderr, "No reader found\n");
+            goto err_context;
+        }
+    }
+    rv = wait_card(context, reader);
+    if (rv == SCARD_S_SUCCESS)
+        rv = SCardConnect(context, reader, SCARD_SHARE_SHARED,
+                SCARD_PROTOCOL_T1, &card, &protocol);
+    if (rv != SCARD_S_SUCCESS) {
+        fprintf(stderr, "No card in %s: %s\n", reader, pcsc_stringify_error(rv));
+        goto err_context;
+    }
+
+    /* a replay that stopped is still reported, up to where it stopped */
+    r = replay(card, &base, speed, &run, &out) == 0 ? 0 : 1;
+    print_report(&base, &run);
+    SCardDisconnect(card, SCARD_LEAVE_CARD);
+
+err_context:
+    SCardReleaseContext(context);
+err:
+    if (vicc_trace_close(&out) != 0) {
+        perror(out_file);
+        r = 1;
+    }
+    free(first);
+    session_free(&base);
+    session_free(&run);
+    return r;
+}
@@ -16,6 +16,9 @@
  * You should have received a copy of the GNU General Public License along with
  * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include <stdlib.h>
 
@@ -34,6 +37,11 @@ int unlock(void *io_lock)
     return 1;
 }
 
+int trylock(void *io_lock)
+{
+    return TryEnterCriticalSection(io_lock) ? 1 : 0;
+}
+
 void *create_lock(void)
 {
     CRITICAL_SECTION *io_lock = malloc(sizeof *io_lock);
@@ -55,7 +63,7 @@ void free_lock(void *io_lock)
 
 int lock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_lock(io_lock))
         r = 1;
     return r;
@@ -63,17 +71,26 @@ int lock(void *io_lock)
 
 int unlock(void *io_lock)
 {
-    r = 0;
+    int r = 0;
     if (0 == pthread_mutex_unlock(io_lock))
         r = 1;
     return r;
 }
 
+int trylock(void *io_lock)
+{
+    int r = 0;
+    if (0 == pthread_mutex_trylock(io_lock))
+        r = 1;
+    return r;
+}
+
 void *create_lock(void)
 {
     pthread_mutex_t *io_lock = malloc(sizeof *io_lock);
-    if (io_lock) {
-        *io_lock = PTHREAD_MUTEX_INITIALIZER;
+    if (io_lock && 0 != pthread_mutex_init(io_lock, NULL)) {
+        free(io_lock);
+        io_lock = NULL;
     }
     return io_lock;
 }
@@ -96,6 +113,11 @@ int unlock(void *io_lock)
     return 1;
 }
 
+int trylock(void *io_lock)
+{
+    return 1;
+}
+
 void *create_lock(void)
 {
     return (void *) 1;
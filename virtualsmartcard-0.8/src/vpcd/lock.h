@@ -25,6 +25,8 @@ extern "C" {
 
 int lock(void *io_lock);
 int unlock(void *io_lock);
+/* lock without waiting, returns 0 if the lock is taken */
+int trylock(void *io_lock);
 void *create_lock(void);
 void free_lock(void *io_lock);
 #ifdef  __cplusplus
@@ -0,0 +1,461 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Multiplexed listener: a single port for all slots.
+ *
+ * A thread accepts the virtual ICCs on the port and waits for their hello
+ * frame (VICC_HELLO | identifier) with epoll (Linux) or kqueue (BSD, macOS).
+ * Each virtual ICC is then handed to a free slot, preferably the one it had
+ * before. A virtual ICC that doesn't send a hello (such as vicc, which only
+ * answers) is handed to a slot once VICC_HELLO_TIMEOUT has passed.
+ */
+#include "vpcd.h"
+#include "lock.h"
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+
+#if (HAVE_SYS_EPOLL_H || HAVE_SYS_EVENT_H) && HAVE_PTHREAD
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+#define MUX_MAX_SLOTS   64
+#define MUX_MAX_PENDING 32
+#define MUX_MAX_EVENTS  16
+
+struct pending {
+    SOCKET sock;
+    unsigned char buf[2 + VICC_HELLO_LEN + VICC_ID_MAX];
+    size_t len;
+    long long deadline;
+};
+
+struct vicc_mux {
+    SOCKET server_sock;
+    int poller;
+    int stop[2];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct vicc_ctx *slots[MUX_MAX_SLOTS];
+    /* identifier of the virtual ICC each slot had last */
+    char ids[MUX_MAX_SLOTS][VICC_ID_MAX + 1];
+    size_t slot_count;
+    struct pending pending[MUX_MAX_PENDING];
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#if HAVE_SYS_EPOLL_H
+
+static int poller_create(void)
+{
+    return epoll_create1(0);
+}
+
+static int poller_add(int poller, int fd)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(poller, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void poller_del(int poller, int fd)
+{
+    epoll_ctl(poller, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int poller_wait(int poller, int *fds, int max, int msecs)
+{
+    struct epoll_event ev[MUX_MAX_EVENTS];
+    int i, n = epoll_wait(poller, ev, max < MUX_MAX_EVENTS ? max : MUX_MAX_EVENTS, msecs);
+    for (i = 0; i < n; i++)
+        fds[i] = ev[i].data.fd;
+    return n;
+}
+
+#else
+
+static int poller_create(void)
+{
+    return kqueue();
+}
+
+static int poller_add(int poller, int fd)
+{
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    return kevent(poller, &ev, 1, NULL, 0, NULL);
+}
+
+static void poller_del(int poller, int fd)
+{
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(poller, &ev, 1, NULL, 0, NULL);
+}
+
+static int poller_wait(int poller, int *fds, int max, int msecs)
+{
+    struct kevent ev[MUX_MAX_EVENTS];
+    struct timespec ts;
+    int i, n;
+
+    ts.tv_sec = msecs / 1000;
+    ts.tv_nsec = (msecs % 1000) * 1000000L;
+    n = kevent(poller, NULL, 0, ev, max < MUX_MAX_EVENTS ? max : MUX_MAX_EVENTS,
+            msecs < 0 ? NULL : &ts);
+    for (i = 0; i < n; i++)
+        fds[i] = (int) ev[i].ident;
+    return n;
+}
+
+#endif
+
+/* Hand the virtual ICC with the given identifier to a free slot */
+static void assign(struct vicc_mux *mux, SOCKET sock, const char *id)
+{
+    size_t i, slot = MUX_MAX_SLOTS;
+    int yes = 1;
+
+    pthread_mutex_lock(&mux->lock);
+
+    /* the slot it had before, then one that nobody had, then any free one */
+    for (i = 0; i < mux->slot_count && slot == MUX_MAX_SLOTS; i++)
+        if (mux->slots[i] && mux->slots[i]->client_sock == INVALID_SOCKET
+                && *id && strcmp(mux->ids[i], id) == 0)
+            slot = i;
+    for (i = 0; i < mux->slot_count && slot == MUX_MAX_SLOTS; i++)
+        if (mux->slots[i] && mux->slots[i]->client_sock == INVALID_SOCKET
+                && !*mux->ids[i])
+            slot = i;
+    for (i = 0; i < mux->slot_count && slot == MUX_MAX_SLOTS; i++)
+        if (mux->slots[i] && mux->slots[i]->client_sock == INVALID_SOCKET)
+            slot = i;
+
+    if (slot == MUX_MAX_SLOTS) {
+        /* every slot is taken */
+        close(sock);
+    } else {
+        struct vicc_ctx *ctx = mux->slots[slot];
+
+        /* the slot's socket is used in blocking mode */
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &yes, sizeof yes);
+
+        if (lock(ctx->io_lock)) {
+            ctx->client_sock = sock;
+            unlock(ctx->io_lock);
+        }
+        strcpy(mux->ids[slot], id);
+        /* wake up whoever waits for a card on this slot */
+        if (write(ctx->wake[1], "", 1) < 0) {
+            /* a wake-up is pending anyway */
+        }
+    }
+
+    pthread_mutex_unlock(&mux->lock);
+}
+
+static void pending_drop(struct vicc_mux *mux, struct pending *p, int close_sock)
+{
+    poller_del(mux->poller, p->sock);
+    if (close_sock)
+        close(p->sock);
+    p->sock = INVALID_SOCKET;
+}
+
+static void accept_client(struct vicc_mux *mux)
+{
+    size_t i;
+    SOCKET sock = accept(mux->server_sock, NULL, NULL);
+
+    if (sock == INVALID_SOCKET)
+        return;
+
+    for (i = 0; i < MUX_MAX_PENDING; i++) {
+        if (mux->pending[i].sock == INVALID_SOCKET)
+            break;
+    }
+    if (i == MUX_MAX_PENDING
+            || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != 0
+            || poller_add(mux->poller, sock) != 0) {
+        close(sock);
+        return;
+    }
+
+    mux->pending[i].sock = sock;
+    mux->pending[i].len = 0;
+    mux->pending[i].deadline = now_ms() + VICC_HELLO_TIMEOUT;
+}
+
+static void read_hello(struct vicc_mux *mux, struct pending *p)
+{
+    char id[VICC_ID_MAX + 1];
+    SOCKET sock = p->sock;
+    size_t size;
+    ssize_t r;
+
+    r = recv(p->sock, p->buf + p->len, sizeof p->buf - p->len, 0);
+    if (r <= 0) {
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        pending_drop(mux, p, 1);
+        return;
+    }
+    p->len += r;
+
+    if (p->len < 2)
+        return;
+    size = (size_t) (p->buf[0] << 8 | p->buf[1]);
+    if (size < VICC_HELLO_LEN || size > VICC_HELLO_LEN + VICC_ID_MAX
+            || (p->len >= 2 + VICC_HELLO_LEN
+                && memcmp(p->buf + 2, VICC_HELLO, VICC_HELLO_LEN) != 0)
+            || p->len > 2 + size) {
+        /* not a hello, and virtual ICCs without a hello never speak first */
+        pending_drop(mux, p, 1);
+        return;
+    }
+    if (p->len < 2 + size)
+        return;
+
+    memcpy(id, p->buf + 2 + VICC_HELLO_LEN, size - VICC_HELLO_LEN);
+    id[size - VICC_HELLO_LEN] = '\0';
+    pending_drop(mux, p, 0);
+    assign(mux, sock, id);
+}
+
+static void *mux_thread(void *arg)
+{
+    struct vicc_mux *mux = arg;
+    int fds[MUX_MAX_EVENTS];
+    int i, n, msecs;
+    size_t j;
+    long long now, next;
+
+    while (1) {
+        /* sleep until an event or the next hello times out */
+        next = -1;
+        for (j = 0; j < MUX_MAX_PENDING; j++) {
+            if (mux->pending[j].sock != INVALID_SOCKET
+                    && (next < 0 || mux->pending[j].deadline < next))
+                next = mux->pending[j].deadline;
+        }
+        now = now_ms();
+        msecs = next < 0 ? -1 : (next > now ? (int) (next - now) : 0);
+
+        n = poller_wait(mux->poller, fds, MUX_MAX_EVENTS, msecs);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        for (i = 0; i < n; i++) {
+            if (fds[i] == mux->stop[0])
+                return NULL;
+            if (fds[i] == mux->server_sock) {
+                accept_client(mux);
+                continue;
+            }
+            for (j = 0; j < MUX_MAX_PENDING; j++) {
+                if (mux->pending[j].sock == fds[i]) {
+                    read_hello(mux, &mux->pending[j]);
+                    break;
+                }
+            }
+        }
+
+        /* silent virtual ICCs get a slot without an identifier */
+        now = now_ms();
+        for (j = 0; j < MUX_MAX_PENDING; j++) {
+            struct pending *p = &mux->pending[j];
+            if (p->sock != INVALID_SOCKET && p->deadline <= now) {
+                if (p->len) {
+                    /* a hello that never completed */
+                    pending_drop(mux, p, 1);
+                } else {
+                    SOCKET sock = p->sock;
+                    pending_drop(mux, p, 0);
+                    assign(mux, sock, "");
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+struct vicc_mux *vicc_mux_init(unsigned short port)
+{
+    struct vicc_mux *mux;
+    struct sockaddr_in addr;
+    int yes = 1;
+    size_t i;
+
+    mux = calloc(1, sizeof *mux);
+    if (!mux)
+        return NULL;
+
+    mux->server_sock = INVALID_SOCKET;
+    mux->poller = -1;
+    mux->stop[0] = mux->stop[1] = -1;
+    for (i = 0; i < MUX_MAX_PENDING; i++)
+        mux->pending[i].sock = INVALID_SOCKET;
+    if (pthread_mutex_init(&mux->lock, NULL) != 0) {
+        free(mux);
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    mux->server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (mux->server_sock == INVALID_SOCKET
+            || setsockopt(mux->server_sock, SOL_SOCKET, SO_REUSEADDR, (void *) &yes, sizeof yes) != 0
+            || bind(mux->server_sock, (struct sockaddr *) &addr, sizeof addr) != 0
+            || listen(mux->server_sock, MUX_MAX_PENDING) != 0
+            || (mux->poller = poller_create()) < 0
+            || pipe(mux->stop) != 0
+            || poller_add(mux->poller, mux->server_sock) != 0
+            || poller_add(mux->poller, mux->stop[0]) != 0
+            || pthread_create(&mux->thread, NULL, mux_thread, mux) != 0)
+        goto err;
+
+    return mux;
+
+err:
+    if (mux->server_sock != INVALID_SOCKET)
+        close(mux->server_sock);
+    if (mux->poller >= 0)
+        close(mux->poller);
+    if (mux->stop[0] >= 0) {
+        close(mux->stop[0]);
+        close(mux->stop[1]);
+    }
+    pthread_mutex_destroy(&mux->lock);
+    free(mux);
+    return NULL;
+}
+
+int vicc_mux_exit(struct vicc_mux *mux)
+{
+    size_t i;
+
+    if (!mux)
+        return 0;
+
+    if (write(mux->stop[1], "", 1) == 1)
+        pthread_join(mux->thread, NULL);
+
+    for (i = 0; i < MUX_MAX_PENDING; i++)
+        if (mux->pending[i].sock != INVALID_SOCKET)
+            close(mux->pending[i].sock);
+    close(mux->server_sock);
+    close(mux->poller);
+    close(mux->stop[0]);
+    close(mux->stop[1]);
+    pthread_mutex_destroy(&mux->lock);
+    free(mux);
+
+    return 0;
+}
+
+int vicc_mux_attach(struct vicc_mux *mux, struct vicc_ctx *ctx)
+{
+    size_t i;
+    int r = -1;
+
+    pthread_mutex_lock(&mux->lock);
+    for (i = 0; i < MUX_MAX_SLOTS; i++) {
+        if (!mux->slots[i]) {
+            mux->slots[i] = ctx;
+            if (i >= mux->slot_count)
+                mux->slot_count = i + 1;
+            r = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mux->lock);
+
+    return r;
+}
+
+void vicc_mux_detach(struct vicc_mux *mux, struct vicc_ctx *ctx)
+{
+    size_t i;
+
+    pthread_mutex_lock(&mux->lock);
+    for (i = 0; i < mux->slot_count; i++) {
+        if (mux->slots[i] == ctx) {
+            mux->slots[i] = NULL;
+            mux->ids[i][0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&mux->lock);
+}
+
+#else
+
+struct vicc_mux *vicc_mux_init(unsigned short port)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int vicc_mux_exit(struct vicc_mux *mux)
+{
+    return 0;
+}
+
+int vicc_mux_attach(struct vicc_mux *mux, struct vicc_ctx *ctx)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void vicc_mux_detach(struct vicc_mux *mux, struct vicc_ctx *ctx)
+{
+}
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Request queue of a card shared by several clients.
+ *
+ * The card runs one request at a time. When it becomes free, it goes to the
+ * waiting request of the client that had its last turn longest ago, so
+ * clients take turns and a client with many requests waiting doesn't starve
+ * the others. The requests of a client run in the order they were made.
+ *
+ * A client may hold the card: for a transaction, until it ends it, or for a
+ * sequence of APDUs that only makes sense in one piece (command chaining, a
+ * response to be fetched with GET RESPONSE), until the sequence is over or
+ * the client has been silent for VICC_QUEUE_HOLD_MS. Only the requests of
+ * the holder get the card meanwhile.
+ */
+#include "vpcd.h"
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_PTHREAD && !defined(_WIN32)
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* Clients whose last turn is remembered, a client not among them goes first */
+#define QUEUE_RECENT 16
+
+#define HOLD_NONE        0
+#define HOLD_TRANSACTION 1
+#define HOLD_SEQUENCE    2
+
+struct waiter {
+    unsigned long client;
+    int granted;
+    struct waiter *next;
+};
+
+struct turn {
+    unsigned long client;
+    /* value of turns at the last turn of the client */
+    unsigned long long last;
+};
+
+struct vicc_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* waiting requests, in the order they were made */
+    struct waiter *head;
+    /* a request has the card */
+    int busy;
+    int hold;
+    unsigned long holder;
+    /* transactions begun by the holder and not ended yet */
+    size_t nesting;
+    /* end of a HOLD_SEQUENCE, in now_ms */
+    long long hold_until;
+    /* incremented by vicc_queue_cancel */
+    unsigned long cancels;
+    unsigned long long turns;
+    struct turn recent[QUEUE_RECENT];
+    struct vicc_queue_stats stats;
+};
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long long last_turn(struct vicc_queue *q, unsigned long client)
+{
+    size_t i;
+
+    for (i = 0; i < QUEUE_RECENT; i++) {
+        if (q->recent[i].last && q->recent[i].client == client)
+            return q->recent[i].last;
+    }
+
+    return 0;
+}
+
+static void record_turn(struct vicc_queue *q, unsigned long client)
+{
+    size_t i, oldest = 0;
+
+    q->turns++;
+    for (i = 0; i < QUEUE_RECENT; i++) {
+        if (q->recent[i].last && q->recent[i].client == client) {
+            oldest = i;
+            break;
+        }
+        if (q->recent[i].last < q->recent[oldest].last)
+            oldest = i;
+    }
+    q->recent[oldest].client = client;
+    q->recent[oldest].last = q->turns;
+}
+
+/* Give the card to the next request, if it is free. Called with the lock */
+static void dispatch(struct vicc_queue *q)
+{
+    struct waiter *w, **p, **best = NULL;
+    unsigned long long last, best_last = 0;
+
+    if (q->busy)
+        return;
+
+    if (q->hold == HOLD_SEQUENCE && now_ms() >= q->hold_until)
+        /* the holder went quiet, the others have waited long enough */
+        q->hold = HOLD_NONE;
+
+    for (p = &q->head; *p; p = &(*p)->next) {
+        if (q->hold != HOLD_NONE && (*p)->client != q->holder)
+            continue;
+        last = last_turn(q, (*p)->client);
+        if (!best || last < best_last) {
+            best = p;
+            best_last = last;
+        }
+    }
+
+    if (best) {
+        w = *best;
+        *best = w->next;
+        w->granted = 1;
+        q->busy = 1;
+        record_turn(q, w->client);
+        pthread_cond_broadcast(&q->cond);
+    }
+}
+
+static void wait_until(struct vicc_queue *q, long long until)
+{
+    struct timeval tv;
+    struct timespec ts;
+    long long left = until - now_ms();
+
+    if (left <= 0)
+        return;
+
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + left / 1000;
+    ts.tv_nsec = tv.tv_usec * 1000 + (left % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+}
+
+/* Wait for the turn of a request. Called with the lock */
+static int enter(struct vicc_queue *q, unsigned long client)
+{
+    struct waiter w, **p;
+    unsigned long cancels = q->cancels;
+    long long start = now_ms(), waited;
+
+    w.client = client;
+    w.granted = 0;
+    w.next = NULL;
+    for (p = &q->head; *p; p = &(*p)->next)
+        ;
+    *p = &w;
+
+    q->stats.depth++;
+    if (q->stats.depth > q->stats.max_depth)
+        q->stats.max_depth = q->stats.depth;
+
+    dispatch(q);
+    while (!w.granted) {
+        if (q->cancels != cancels) {
+            for (p = &q->head; *p && *p != &w; p = &(*p)->next)
+                ;
+            if (*p)
+                *p = w.next;
+            q->stats.depth--;
+            errno = ECANCELED;
+            return -1;
+        }
+        if (q->hold == HOLD_SEQUENCE && !q->busy)
+            /* wake up when the hold expires */
+            wait_until(q, q->hold_until);
+        else
+            pthread_cond_wait(&q->cond, &q->lock);
+        dispatch(q);
+    }
+
+    waited = now_ms() - start;
+    q->stats.depth--;
+    q->stats.served++;
+    q->stats.wait_ms += waited;
+    if (waited > q->stats.max_wait_ms)
+        q->stats.max_wait_ms = waited;
+
+    return 0;
+}
+
+struct vicc_queue *vicc_queue_create(void)
+{
+    struct vicc_queue *q = calloc(1, sizeof *q);
+
+    if (!q)
+        return NULL;
+
+    if (pthread_mutex_init(&q->lock, NULL) != 0) {
+        free(q);
+        return NULL;
+    }
+    if (pthread_cond_init(&q->cond, NULL) != 0) {
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+        return NULL;
+    }
+
+    return q;
+}
+
+void vicc_queue_free(struct vicc_queue *q)
+{
+    if (!q)
+        return;
+
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+int vicc_queue_enter(struct vicc_queue *q, unsigned long client)
+{
+    int r;
+
+    pthread_mutex_lock(&q->lock);
+    r = enter(q, client);
+    pthread_mutex_unlock(&q->lock);
+
+    return r;
+}
+
+void vicc_queue_leave(struct vicc_queue *q, unsigned long client, int more)
+{
+    pthread_mutex_lock(&q->lock);
+
+    q->busy = 0;
+    if (q->hold != HOLD_TRANSACTION) {
+        if (more) {
+            q->hold = HOLD_SEQUENCE;
+            q->holder = client;
+            q->hold_until = now_ms() + VICC_QUEUE_HOLD_MS;
+        } else if (q->hold == HOLD_SEQUENCE && q->holder == client) {
+            q->hold = HOLD_NONE;
+        }
+    }
+    dispatch(q);
+    /* the waiters may have to wait for the end of a new hold */
+    pthread_cond_broadcast(&q->cond);
+
+    pthread_mutex_unlock(&q->lock);
+}
+
+int vicc_queue_begin(struct vicc_queue *q, unsigned long client)
+{
+    int r = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->hold == HOLD_TRANSACTION && q->holder == client) {
+        q->nesting++;
+    } else if ((r = enter(q, client)) == 0) {
+        q->hold = HOLD_TRANSACTION;
+        q->holder = client;
+        q->nesting = 1;
+        q->busy = 0;
+        q->stats.transactions++;
+        dispatch(q);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return r;
+}
+
+int vicc_queue_end(struct vicc_queue *q, unsigned long client)
+{
+    int r = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->hold != HOLD_TRANSACTION || q->holder != client) {
+        errno = EPERM;
+        r = -1;
+    } else if (--q->nesting == 0) {
+        q->hold = HOLD_NONE;
+        dispatch(q);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return r;
+}
+
+void vicc_queue_release(struct vicc_queue *q, unsigned long client)
+{
+    pthread_mutex_lock(&q->lock);
+
+    if (q->hold != HOLD_NONE && q->holder == client) {
+        q->hold = HOLD_NONE;
+        q->nesting = 0;
+        dispatch(q);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+}
+
+void vicc_queue_cancel(struct vicc_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->cancels++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void vicc_queue_stats(struct vicc_queue *q, struct vicc_queue_stats *stats)
+{
+    pthread_mutex_lock(&q->lock);
+    *stats = q->stats;
+    pthread_mutex_unlock(&q->lock);
+}
+
+#else
+
+/* A single thread can't have competing requests, nothing to schedule */
+
+struct vicc_queue {
+    struct vicc_queue_stats stats;
+};
+
+struct vicc_queue *vicc_queue_create(void)
+{
+    return calloc(1, sizeof(struct vicc_queue));
+}
+
+void vicc_queue_free(struct vicc_queue *q)
+{
+    free(q);
+}
+
+int vicc_queue_enter(struct vicc_queue *q, unsigned long client)
+{
+    q->stats.served++;
+    return 0;
+}
+
+void vicc_queue_leave(struct vicc_queue *q, unsigned long client, int more)
+{
+}
+
+int vicc_queue_begin(struct vicc_queue *q, unsigned long client)
+{
+    q->stats.transactions++;
+    return 0;
+}
+
+int vicc_queue_end(struct vicc_queue *q, unsigned long client)
+{
+    return 0;
+}
+
+void vicc_queue_release(struct vicc_queue *q, unsigned long client)
+{
+}
+
+void vicc_queue_cancel(struct vicc_queue *q)
+{
+}
+
+void vicc_queue_stats(struct vicc_queue *q, struct vicc_queue_stats *stats)
+{
+    *stats = q->stats;
+}
+
+#endif
+
+int vicc_sequence_continues(size_t apdu_len, const unsigned char *apdu,
+        size_t rapdu_len, const unsigned char *rapdu)
+{
+    /* a chained command (CLA b5) expects the rest of the chain */
+    if (apdu_len >= 4 && apdu[0] != 0xFF && (apdu[0] & 0x10))
+        return 1;
+
+    /* 61 XX: the rest of the response is fetched with GET RESPONSE */
+    if (rapdu_len >= 2 && rapdu[rapdu_len - 2] == 0x61)
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "trace.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define TRACE_HEADER_LEN    (sizeof VICC_TRACE_MAGIC - 1 + 1)
+#define RECORD_HEADER_LEN   7
+
+int vicc_trace_create(struct vicc_trace *trace, const char *path)
+{
+    unsigned char header[TRACE_HEADER_LEN];
+
+    trace->last = -1;
+    trace->file = fopen(path, "wb");
+    if (!trace->file)
+        return -1;
+    memcpy(header, VICC_TRACE_MAGIC, sizeof VICC_TRACE_MAGIC - 1);
+    header[sizeof header - 1] = VICC_TRACE_VERSION;
+    if (fwrite(header, sizeof header, 1, trace->file) != 1) {
+        fclose(trace->file);
+        trace->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int vicc_trace_write(struct vicc_trace *trace, int kind, long long us,
+        const unsigned char *data, size_t len)
+{
+    unsigned char header[RECORD_HEADER_LEN];
+    long long delta = trace->last < 0 ? 0 : us - trace->last;
+
+    if (!trace->file || len > 0xFFFF)
+        return -1;
+    if (delta < 0)
+        delta = 0;
+    if (delta > UINT32_MAX)
+        delta = UINT32_MAX;
+    trace->last = us;
+
+    header[0] = (unsigned char) kind;
+    header[1] = (unsigned char) (delta >> 24);
+    header[2] = (unsigned char) (delta >> 16);
+    header[3] = (unsigned char) (delta >> 8);
+    header[4] = (unsigned char) delta;
+    header[5] = (unsigned char) (len >> 8);
+    header[6] = (unsigned char) len;
+    if (fwrite(header, sizeof header, 1, trace->file) != 1
+            || (len && fwrite(data, len, 1, trace->file) != 1))
+        return -1;
+    return 0;
+}
+
+int vicc_trace_open(struct vicc_trace *trace, const char *path)
+{
+    unsigned char header[TRACE_HEADER_LEN];
+
+    trace->last = 0;
+    trace->file = fopen(path, "rb");
+    if (!trace->file)
+        return -1;
+    if (fread(header, sizeof header, 1, trace->file) != 1
+            || memcmp(header, VICC_TRACE_MAGIC, sizeof VICC_TRACE_MAGIC - 1) != 0
+            || header[sizeof header - 1] != VICC_TRACE_VERSION) {
+        fclose(trace->file);
+        trace->file = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int vicc_trace_read(struct vicc_trace *trace, struct vicc_trace_record *record)
+{
+    unsigned char header[RECORD_HEADER_LEN];
+    size_t n = fread(header, 1, sizeof header, trace->file);
+
+    if (n == 0)
+        return 0;
+    if (n != sizeof header)
+        return -1;
+    record->kind = header[0];
+    trace->last += (long long) ((uint32_t) header[1] << 24 | (uint32_t) header[2] << 16
+            | (uint32_t) header[3] << 8 | header[4]);
+    record->us = trace->last;
+    record->len = (size_t) (header[5] << 8 | header[6]);
+    if (record->len && fread(record->data, record->len, 1, trace->file) != 1)
+        return -1;
+    return 1;
+}
+
+int vicc_trace_close(struct vicc_trace *trace)
+{
+    int r = 0;
+
+    if (trace->file) {
+        r = fclose(trace->file) == 0 ? 0 : -1;
+        trace->file = NULL;
+    }
+    return r;
+}
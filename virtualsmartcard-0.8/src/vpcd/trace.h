@@ -0,0 +1,102 @@
+/*
+ * This file is part of virtualsmartcard.
+ *
+ * virtualsmartcard is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * virtualsmartcard is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Traces of the frames between vpcd and a card, as captured by vpcd-relay -t
+ * and replayed by vpcd-replay. A trace is a header and then one record per
+ * frame, all numbers in network byte order:
+ *
+ *    Header: "VTRC" | Version (1)
+ *    Record: Kind (1) | Time (4) | Length (2) | Data
+ *
+ * The time is in microseconds since the record before, on a monotonic clock
+ * (a longer gap is cut to 2^32 - 1). A command record holds the frame from
+ * vpcd, an APDU or a batch of them (see vicc_transmit_batch), and the next
+ * response record the answer of the card to it.
+ */
+#ifndef _VPCD_TRACE_H_
+#define _VPCD_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VICC_TRACE_MAGIC    "VTRC"
+#define VICC_TRACE_VERSION  1
+
+/** Kinds of records */
+#define VICC_TRACE_COMMAND  'C'     /**< A frame from vpcd */
+#define VICC_TRACE_RESPONSE 'R'     /**< Answer of the card */
+#define VICC_TRACE_CACHED   'K'     /**< Answer of the relay from its cache */
+#define VICC_TRACE_RESET    'X'     /**< Reset of the card, no data */
+
+struct vicc_trace {
+    FILE *file;
+    long long last;     /**< Time of the last record, in microseconds */
+};
+
+struct vicc_trace_record {
+    int kind;
+    long long us;       /**< Time, microseconds since the first record */
+    size_t len;
+    unsigned char data[0xFFFF];
+};
+
+/**
+ * @brief Start a new trace in \a path.
+ *
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int vicc_trace_create(struct vicc_trace *trace, const char *path);
+
+/**
+ * @brief Append a record made at \a us microseconds (any monotonic clock).
+ *
+ * @return 0 on success, -1 on error
+ */
+int vicc_trace_write(struct vicc_trace *trace, int kind, long long us,
+        const unsigned char *data, size_t len);
+
+/**
+ * @brief Open the trace in \a path for reading.
+ *
+ * @return 0 on success, -1 on error (errno is \c EINVAL if it is no trace)
+ */
+int vicc_trace_open(struct vicc_trace *trace, const char *path);
+
+/**
+ * @brief Read the next record.
+ *
+ * @return 1 if a record has been read, 0 at the end of the trace, -1 if it
+ *         is cut short
+ */
+int vicc_trace_read(struct vicc_trace *trace, struct vicc_trace_record *record);
+
+/**
+ * @brief Flush and close the trace.
+ *
+ * @return 0 on success, -1 if what was written could not be flushed
+ */
+int vicc_trace_close(struct vicc_trace *trace);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
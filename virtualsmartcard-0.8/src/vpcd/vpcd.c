@@ -37,12 +37,16 @@
 typedef WORD uint16_t;
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
-#define INVALID_SOCKET -1
 #endif
 
 #include <errno.h>
@@ -52,41 +56,76 @@ typedef WORD uint16_t;
 #include <sys/types.h>
 
 static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t size, const unsigned char *buffer);
-static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer);
+static ssize_t recvFromVICC(struct vicc_ctx *ctx, const unsigned char **buffer);
 
-static ssize_t sendall(SOCKET sock, const void *buffer, size_t size);
-static ssize_t recvall(SOCKET sock, void *buffer, size_t size);
+static ssize_t sendframe(SOCKET sock, const void *buffer, size_t size);
+static int waitforresponse(struct vicc_ctx *ctx, long long deadline);
+static void nodelay(SOCKET sock);
 
 static SOCKET opensock(unsigned short port);
 static SOCKET connectsock(const char *hostname, unsigned short port);
 
-ssize_t sendall(SOCKET sock, const void *buffer, size_t size)
+/* Send the size of the message on 2 bytes and the message with a single
+ * call, so that a small APDU goes out in a single segment */
+static ssize_t sendframe(SOCKET sock, const void *buffer, size_t size)
 {
-    size_t sent;
-    ssize_t r;
-
-    /* FIXME we should actually check the length instead of simply casting from
-     * size_t to ssize_t (or int), which have both the same width! */
-	for (sent = 0; sent < size; sent += r) {
-        r = send(sock, (void *) (((unsigned char *) buffer)+sent),
+    uint16_t length = htons((uint16_t) size);
 #ifdef _WIN32
-                (int)
-#endif
-                (size-sent), MSG_NOSIGNAL);
+    WSABUF bufs[2];
+    DWORD sent;
+
+    bufs[0].buf = (char *) &length;
+    bufs[0].len = sizeof length;
+    bufs[1].buf = (char *) buffer;
+    bufs[1].len = (ULONG) size;
+    /* a blocking WSASend only returns once everything has been sent */
+    if (WSASend(sock, bufs, 2, &sent, 0, NULL, NULL) != 0)
+        return -1;
+    return (ssize_t) sent;
+#else
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = sizeof length + size;
+    size_t sent = 0;
+    ssize_t r;
 
-		if (r < 0)
-			return r;
-	}
+    iov[0].iov_base = &length;
+    iov[0].iov_len = sizeof length;
+    iov[1].iov_base = (void *) buffer;
+    iov[1].iov_len = size;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (sent < total) {
+        r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return r;
+        }
+        sent += r;
+        /* skip what has been sent */
+        while (msg.msg_iovlen && (size_t) r >= msg.msg_iov->iov_len) {
+            r -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (unsigned char *) msg.msg_iov->iov_base + r;
+            msg.msg_iov->iov_len -= r;
+        }
+    }
 
     return (ssize_t) sent;
+#endif
 }
 
-ssize_t recvall(SOCKET sock, void *buffer, size_t size) {
-    return recv(sock, buffer,
-#ifdef _WIN32
-            (int)
-#endif
-            size, MSG_WAITALL|MSG_NOSIGNAL);
+static void nodelay(SOCKET sock)
+{
+    int yes = 1;
+    /* don't let Nagle's algorithm hold back the APDUs, failing is harmless */
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &yes, sizeof yes);
 }
 
 static SOCKET opensock(unsigned short port)
@@ -107,6 +146,9 @@ static SOCKET opensock(unsigned short port)
         goto err;
 #endif
 
+    /* inherited by the accepted sockets on most systems */
+    nodelay(sock);
+
     memset(&server_sockaddr, 0, sizeof server_sockaddr);
     server_sockaddr.sin_family      = PF_INET;
     server_sockaddr.sin_port        = htons(port);
@@ -158,8 +200,10 @@ static SOCKET connectsock(const char *hostname, unsigned short port)
 #ifdef _WIN32
                     (int)
 #endif
-                    cur->ai_addrlen) != -1)
+                    cur->ai_addrlen) != -1) {
+            nodelay(sock);
 			break;
+        }
 
 		close(sock);
 	}
@@ -192,9 +236,13 @@ SOCKET waitforclient(SOCKET server, long secs, long usecs)
     if (select((int) server+1, &rfds, NULL, NULL, &tv) == -1)
         return INVALID_SOCKET;
 
-    if (FD_ISSET(server, &rfds))
-        return accept(server, (struct sockaddr *) &client_sockaddr,
+    if (FD_ISSET(server, &rfds)) {
+        SOCKET client = accept(server, (struct sockaddr *) &client_sockaddr,
                 &client_socklen);
+        if (client != INVALID_SOCKET)
+            nodelay(client);
+        return client;
+    }
 
     return INVALID_SOCKET;
 }
@@ -202,53 +250,270 @@ SOCKET waitforclient(SOCKET server, long secs, long usecs)
 static ssize_t sendToVICC(struct vicc_ctx *ctx, size_t length, const unsigned char* buffer)
 {
     ssize_t r;
-    uint16_t size;
 
     if (!ctx || length > 0xFFFF) {
         errno = EINVAL;
         return -1;
     }
 
-    /* send size of message on 2 bytes */
-    size = htons((uint16_t) length);
-    r = sendall(ctx->client_sock, (void *) &size, sizeof size);
-    if (r == sizeof size)
-        /* send message */
-        r = sendall(ctx->client_sock, buffer, length);
-
-    if (r < 0)
+    r = sendframe(ctx->client_sock, buffer, length);
+    if (r < 0) {
         vicc_eject(ctx);
+        return r;
+    }
 
-    return r;
+    /* as before, report the number of bytes of the message */
+    return (ssize_t) length;
+}
+
+static long long now_ms(void)
+{
+#ifdef _WIN32
+    return (long long) GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Milliseconds between two checks for vicc_cancel on Windows */
+#define CANCEL_POLL_MS 100
+
+/* Wait until the card has sent something. Returns 0 when it has, -1 with
+ * errno set to ETIMEDOUT once the deadline (of now_ms, 0 for none) has
+ * passed or to ECANCELED once vicc_cancel has been called. */
+static int waitforresponse(struct vicc_ctx *ctx, long long deadline)
+{
+    fd_set rfds;
+    struct timeval tv, *ptv;
+    long long left;
+    int maxfd;
+
+    while (1) {
+        if (ctx->cancelled) {
+            errno = ECANCELED;
+            return -1;
+        }
+
+        FD_ZERO(&rfds);
+#if _WIN32
+#pragma warning(disable:4127)
+        FD_SET(ctx->client_sock, &rfds);
+#pragma warning(default:4127)
+        maxfd = 0;
+        left = CANCEL_POLL_MS;
+        if (deadline && deadline - now_ms() < left)
+            left = deadline - now_ms();
+#else
+        FD_SET(ctx->client_sock, &rfds);
+        maxfd = ctx->client_sock;
+        if (ctx->cancel[0] >= 0) {
+            FD_SET(ctx->cancel[0], &rfds);
+            if (ctx->cancel[0] > maxfd)
+                maxfd = ctx->cancel[0];
+        }
+        left = deadline ? deadline - now_ms() : -1;
+#endif
+        if (deadline && deadline <= now_ms()) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        ptv = NULL;
+        if (left >= 0) {
+            tv.tv_sec = (long) (left / 1000);
+            tv.tv_usec = (long) (left % 1000) * 1000;
+            ptv = &tv;
+        }
+
+        if (select(maxfd+1, &rfds, NULL, NULL, ptv) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (FD_ISSET(ctx->client_sock, &rfds))
+            return 0;
+    }
 }
 
-static ssize_t recvFromVICC(struct vicc_ctx *ctx, unsigned char **buffer)
+/* Forget the cancellations of earlier transmits */
+static void clear_cancel(struct vicc_ctx *ctx)
+{
+#ifndef _WIN32
+    char drain[16];
+    while (ctx->cancel[0] >= 0 && read(ctx->cancel[0], drain, sizeof drain) > 0)
+        ;
+#endif
+    ctx->cancelled = 0;
+}
+
+/* Drop the previous message from ctx->buf, the next one starts at 0 */
+static void drop_message(struct vicc_ctx *ctx)
+{
+    if (ctx->buf_start == ctx->buf_end) {
+        ctx->buf_start = ctx->buf_end = 0;
+    } else if (ctx->buf_start) {
+        memmove(ctx->buf, ctx->buf + ctx->buf_start, ctx->buf_end - ctx->buf_start);
+        ctx->buf_end -= ctx->buf_start;
+        ctx->buf_start = 0;
+    }
+}
+
+/* Size of the message at the start of ctx->buf, -1 if it isn't all there */
+static size_t message_size(struct vicc_ctx *ctx)
+{
+    size_t size;
+
+    if (ctx->buf_end < 2)
+        return (size_t) -1;
+    /* size of message on 2 bytes */
+    size = (size_t) (ctx->buf[0] << 8 | ctx->buf[1]);
+    if (ctx->buf_end < 2 + size)
+        return (size_t) -1;
+    return size;
+}
+
+/* Receive the next message into ctx->buf, which is filled with as much as
+ * the socket has available, so that a frame usually takes a single call.
+ * The late responses of earlier transmits are dropped on the way. */
+static ssize_t recvFromVICC(struct vicc_ctx *ctx, const unsigned char **buffer)
 {
     ssize_t r;
-    uint16_t size;
-    unsigned char *p = NULL;
+    size_t size;
+    long long deadline = 0;
 
-    if (!buffer || !ctx) {
+    if (!buffer || !ctx || !ctx->buf) {
         errno = EINVAL;
         return -1;
     }
 
-    /* receive size of message on 2 bytes */
-    r = recvall(ctx->client_sock, &size, sizeof size);
-    if (r < sizeof size)
-        return r;
+    if (ctx->timeout_ms > 0)
+        deadline = now_ms() + ctx->timeout_ms;
 
-    size = ntohs(size);
+    while (1) {
+        drop_message(ctx);
 
-    p = realloc(*buffer, size);
-    if (p == NULL) {
-        errno = ENOMEM;
+        size = message_size(ctx);
+        if (size != (size_t) -1) {
+            ctx->buf_start = 2 + size;
+            if (ctx->late) {
+                /* the transmit this was for gave up already */
+                ctx->late--;
+                continue;
+            }
+            *buffer = ctx->buf + 2;
+            return (ssize_t) size;
+        }
+
+        if (waitforresponse(ctx, deadline) != 0)
+            return -1;
+
+        r = recv(ctx->client_sock, (void *) (ctx->buf + ctx->buf_end),
+#ifdef _WIN32
+                (int)
+#endif
+                (VICC_BUF_SIZE - ctx->buf_end), MSG_NOSIGNAL);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return r;
+        }
+        ctx->buf_end += r;
+    }
+}
+
+/* Forget the cached ATR, the card may answer with a new one */
+static void forget_atr(struct vicc_ctx *ctx)
+{
+    if (ctx && ctx->atr_lock && lock(ctx->atr_lock)) {
+        free(ctx->atr);
+        ctx->atr = NULL;
+        ctx->atr_len = 0;
+        unlock(ctx->atr_lock);
+    }
+}
+
+/* Whether the card has sent something, without blocking */
+static int client_readable(struct vicc_ctx *ctx)
+{
+    fd_set rfds;
+    struct timeval tv = { 0, 0 };
+
+    FD_ZERO(&rfds);
+#if _WIN32
+#pragma warning(disable:4127)
+    FD_SET(ctx->client_sock, &rfds);
+#pragma warning(default:4127)
+#else
+    FD_SET(ctx->client_sock, &rfds);
+#endif
+
+    if (select((int) ctx->client_sock+1, &rfds, NULL, NULL, &tv) == -1)
         return -1;
+
+    return FD_ISSET(ctx->client_sock, &rfds) ? 1 : 0;
+}
+
+/* Drop the late responses that have arrived, without blocking, so that
+ * they don't keep the socket readable for those waiting on vicc_eventsock.
+ * Returns 0 if the connection has been closed or fails */
+static int drop_late(struct vicc_ctx *ctx)
+{
+    ssize_t r;
+    size_t size;
+
+    while (ctx->late) {
+        drop_message(ctx);
+        size = message_size(ctx);
+        if (size != (size_t) -1) {
+            ctx->buf_start = 2 + size;
+            ctx->late--;
+            continue;
+        }
+
+        switch (client_readable(ctx)) {
+            case 0:
+                /* the rest is still on its way */
+                return 1;
+            case 1:
+                break;
+            default:
+                return 0;
+        }
+        r = recv(ctx->client_sock, (void *) (ctx->buf + ctx->buf_end),
+#ifdef _WIN32
+                (int)
+#endif
+                (VICC_BUF_SIZE - ctx->buf_end), MSG_NOSIGNAL);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return 0;
+        }
+        ctx->buf_end += r;
     }
-    *buffer = p;
+    drop_message(ctx);
+
+    return 1;
+}
+
+/* Check without blocking that the connection to the card hasn't been closed.
+ * The card never sends anything unasked, so anything readable but the late
+ * responses is either the end of the connection or means that it is out of
+ * sync. Called with io_lock */
+static int client_alive(struct vicc_ctx *ctx)
+{
+    if (!drop_late(ctx))
+        return 0;
+
+    /* what has arrived of a late response is still to be read */
+    if (ctx->late)
+        return 1;
+
+    if (ctx->buf_start != ctx->buf_end)
+        return 0;
 
-    /* receive message */
-    return recvall(ctx->client_sock, *buffer, size);
+    return client_readable(ctx) == 0;
 }
 
 int vicc_eject(struct vicc_ctx *ctx)
@@ -260,6 +525,13 @@ int vicc_eject(struct vicc_ctx *ctx)
         }
         ctx->client_sock = INVALID_SOCKET;
     }
+    if (ctx) {
+        /* whatever is left belongs to the old connection */
+        ctx->buf_start = ctx->buf_end = 0;
+        ctx->late = 0;
+        ctx->no_batch = 0;
+        forget_atr(ctx);
+    }
     return r;
 }
 
@@ -274,9 +546,24 @@ struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
 
     ctx->hostname = NULL;
     ctx->io_lock = NULL;
+    ctx->atr_lock = NULL;
+    ctx->buf = NULL;
+    ctx->atr = NULL;
+    ctx->atr_len = 0;
+    ctx->buf_start = 0;
+    ctx->buf_end = 0;
     ctx->server_sock = INVALID_SOCKET;
     ctx->client_sock = INVALID_SOCKET;
     ctx->port = port;
+    ctx->mux = NULL;
+    ctx->wake[0] = -1;
+    ctx->wake[1] = -1;
+    ctx->timeout_ms = VICC_TIMEOUT_MS;
+    ctx->late = 0;
+    ctx->cancelled = 0;
+    ctx->cancel[0] = -1;
+    ctx->cancel[1] = -1;
+    ctx->no_batch = 0;
 
 #ifdef _WIN32
     WSADATA wsaData;
@@ -287,8 +574,29 @@ struct vicc_ctx * vicc_init(const char *hostname, unsigned short port)
     if (!ctx->io_lock) {
         goto err;
     }
+    ctx->atr_lock = create_lock();
+    if (!ctx->atr_lock) {
+        goto err;
+    }
 
-    if (hostname) {
+    ctx->buf = malloc(VICC_BUF_SIZE);
+    if (!ctx->buf) {
+        goto err;
+    }
+
+#ifndef _WIN32
+    /* vicc_cancel must never block, the reader drains it before waiting */
+    if (pipe(ctx->cancel) != 0) {
+        ctx->cancel[0] = ctx->cancel[1] = -1;
+        goto err;
+    }
+    fcntl(ctx->cancel[0], F_SETFL, fcntl(ctx->cancel[0], F_GETFL) | O_NONBLOCK);
+    fcntl(ctx->cancel[1], F_SETFL, fcntl(ctx->cancel[1], F_GETFL) | O_NONBLOCK);
+#endif
+
+    if (!hostname && !port) {
+        /* the card comes from a shared port, see vicc_init_muxed */
+    } else if (hostname) {
         ctx->hostname = strdup(hostname);
         if (!ctx->hostname) {
             goto err;
@@ -310,12 +618,61 @@ err:
     return r;
 }
 
+struct vicc_ctx * vicc_init_muxed(struct vicc_mux *mux)
+{
+    struct vicc_ctx *ctx;
+
+    if (!mux)
+        return NULL;
+
+#ifdef _WIN32
+    errno = ENOSYS;
+    return NULL;
+#else
+    ctx = vicc_init(NULL, 0);
+    if (!ctx)
+        return NULL;
+
+    if (pipe(ctx->wake) != 0) {
+        ctx->wake[0] = ctx->wake[1] = -1;
+        vicc_exit(ctx);
+        return NULL;
+    }
+    if (vicc_mux_attach(mux, ctx) != 0) {
+        vicc_exit(ctx);
+        return NULL;
+    }
+    ctx->mux = mux;
+
+    return ctx;
+#endif
+}
+
 int vicc_exit(struct vicc_ctx *ctx)
 {
-    int r = vicc_eject(ctx);
+    int r;
+    if (ctx && ctx->mux) {
+        /* the listener must not hand out any card from now on */
+        vicc_mux_detach(ctx->mux, ctx);
+        ctx->mux = NULL;
+    }
+    r = vicc_eject(ctx);
     if (ctx) {
+#ifndef _WIN32
+        if (ctx->wake[0] >= 0) {
+            close(ctx->wake[0]);
+            close(ctx->wake[1]);
+        }
+        if (ctx->cancel[0] >= 0) {
+            close(ctx->cancel[0]);
+            close(ctx->cancel[1]);
+        }
+#endif
         free_lock(ctx->io_lock);
+        if (ctx->atr_lock)
+            free_lock(ctx->atr_lock);
         free(ctx->hostname);
+        free(ctx->buf);
         if (ctx->server_sock > 0) {
             ctx->server_sock = close(ctx->server_sock);
             if (ctx->server_sock == INVALID_SOCKET) {
@@ -331,20 +688,266 @@ int vicc_exit(struct vicc_ctx *ctx)
     return r;
 }
 
+/* After a receive failed: if it was a timeout or a cancellation, the card
+ * is still there and the response is owed, so it's dropped once it arrives
+ * instead of ejecting the card */
+static int gave_up(struct vicc_ctx *ctx)
+{
+    if (errno != ETIMEDOUT && errno != ECANCELED)
+        return 0;
+    ctx->late++;
+    return 1;
+}
+
+/* Length of the entry of a batch at offset, -1 if it's cut short */
+static ssize_t batch_entry(const unsigned char *batch, size_t batch_len, size_t offset)
+{
+    size_t size;
+
+    if (offset + 2 > batch_len)
+        return -1;
+    size = (size_t) (batch[offset] << 8 | batch[offset+1]);
+    if (offset + 2 + size > batch_len)
+        return -1;
+    return (ssize_t) size;
+}
+
+/* Whether the commands after a response may go on: 90 00 or 61 XX */
+static int batch_goes_on(const unsigned char *rapdu, size_t len)
+{
+    if (len < 2)
+        return 0;
+    return (rapdu[len-2] == 0x90 && rapdu[len-1] == 0x00) || rapdu[len-2] == 0x61;
+}
+
+/* Append an entry of length len to the batch of responses */
+static int batch_append(unsigned char **rbatch, size_t *rbatch_len,
+        const unsigned char *rapdu, size_t len)
+{
+    unsigned char *p = realloc(*rbatch, *rbatch_len + 2 + len);
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *rbatch = p;
+    p += *rbatch_len;
+    p[0] = (unsigned char) (len >> 8);
+    p[1] = (unsigned char) (len & 0xFF);
+    memcpy(p + 2, rapdu, len);
+    *rbatch_len += 2 + len;
+    return 0;
+}
+
+ssize_t vicc_transmit_batch(struct vicc_ctx *ctx,
+        size_t batch_len, const unsigned char *batch,
+        unsigned char **rbatch)
+{
+    unsigned char *frame = NULL;
+    const unsigned char *response;
+    size_t offset, end, roffset, rbatch_len = 0;
+    ssize_t r = 0, size, rsize;
+    int goes_on = 1;
+
+    if (!ctx || !batch || !rbatch || batch_len + 1 > 0xFFFF) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (offset = 0; offset < batch_len; offset += 2 + size) {
+        size = batch_entry(batch, batch_len, offset);
+        if (size < 4) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (!batch_len)
+        return 0;
+
+    frame = malloc(1 + batch_len);
+    if (!frame) {
+        errno = ENOMEM;
+        return -1;
+    }
+    frame[0] = VPCD_CTRL_BATCH;
+
+    if (!lock(ctx->io_lock)) {
+        free(frame);
+        return -1;
+    }
+    clear_cancel(ctx);
+
+    offset = 0;
+    while (goes_on && offset < batch_len) {
+        if (ctx->no_batch) {
+            /* one by one */
+            size = batch_entry(batch, batch_len, offset);
+            r = sendToVICC(ctx, size, batch + offset + 2);
+            if (r > 0)
+                r = recvFromVICC(ctx, &response);
+            if (r <= 0)
+                break;
+            offset += 2 + size;
+            if (batch_append(rbatch, &rbatch_len, response, r) != 0) {
+                r = -1;
+                break;
+            }
+            goes_on = batch_goes_on(response, r);
+            continue;
+        }
+
+        /* as many as fit into a frame the card takes, at least one */
+        end = offset + 2 + batch_entry(batch, batch_len, offset);
+        while (end < batch_len
+                && 1 + end + 2 + batch_entry(batch, batch_len, end) - offset <= VICC_BATCH_MAX)
+            end += 2 + batch_entry(batch, batch_len, end);
+        memcpy(frame + 1, batch + offset, end - offset);
+        r = sendToVICC(ctx, 1 + end - offset, frame);
+        if (r > 0)
+            r = recvFromVICC(ctx, &response);
+        if (r <= 0)
+            break;
+
+        if (response[0] != VPCD_CTRL_BATCH) {
+            /* the batch has been taken for a single APDU and has failed */
+            ctx->no_batch = 1;
+            continue;
+        }
+
+        /* each response answers the next command */
+        roffset = 1;
+        goes_on = 0;
+        while (roffset < (size_t) r) {
+            rsize = batch_entry(response, r, roffset);
+            if (rsize < 0 || offset >= end) {
+                errno = EPROTO;
+                r = -1;
+                break;
+            }
+            if (batch_append(rbatch, &rbatch_len, response + roffset + 2, rsize) != 0) {
+                r = -1;
+                break;
+            }
+            goes_on = batch_goes_on(response + roffset + 2, rsize);
+            roffset += 2 + rsize;
+            offset += 2 + batch_entry(batch, batch_len, offset);
+        }
+        if (r < 0)
+            break;
+    }
+
+    if (r < 0 && gave_up(ctx)) {
+        int e = errno;
+        unlock(ctx->io_lock);
+        free(frame);
+        errno = e;
+        return -1;
+    }
+    unlock(ctx->io_lock);
+    free(frame);
+
+    if (r <= 0) {
+        vicc_eject(ctx);
+        return -1;
+    }
+
+    return (ssize_t) rbatch_len;
+}
+
+void vicc_set_timeout(struct vicc_ctx *ctx, long msecs)
+{
+    if (ctx)
+        ctx->timeout_ms = msecs > 0 ? msecs : 0;
+}
+
+void vicc_cancel(struct vicc_ctx *ctx)
+{
+    if (!ctx)
+        return;
+    ctx->cancelled = 1;
+#ifndef _WIN32
+    if (ctx->cancel[1] >= 0 && write(ctx->cancel[1], "", 1) < 0) {
+        /* the pipe is full, a wake-up is pending anyway */
+    }
+#endif
+}
+
 ssize_t vicc_transmit(struct vicc_ctx *ctx,
         size_t apdu_len, const unsigned char *apdu,
         unsigned char **rapdu)
 {
     ssize_t r = -1;
+    const unsigned char *response;
+    unsigned char *p;
 
     if (ctx && lock(ctx->io_lock)) {
+        clear_cancel(ctx);
         if (apdu_len && apdu)
             r = sendToVICC(ctx, apdu_len, apdu);
         else
             r = 1;
 
-        if (r > 0 && rapdu)
-            r = recvFromVICC(ctx, rapdu);
+        if (r > 0 && rapdu) {
+            r = recvFromVICC(ctx, &response);
+            if (r < 0 && gave_up(ctx)) {
+                int e = errno;
+                unlock(ctx->io_lock);
+                errno = e;
+                return -1;
+            }
+            if (r > 0) {
+                p = realloc(*rapdu, r);
+                if (p == NULL) {
+                    errno = ENOMEM;
+                    r = -1;
+                } else {
+                    *rapdu = p;
+                    memcpy(*rapdu, response, r);
+                }
+            }
+        }
+
+        unlock(ctx->io_lock);
+    }
+
+    if (r <= 0)
+        vicc_eject(ctx);
+
+    return r;
+}
+
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        size_t rapdu_max, unsigned char *rapdu)
+{
+    ssize_t r = -1;
+    const unsigned char *response;
+
+    if (!rapdu) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx && lock(ctx->io_lock)) {
+        clear_cancel(ctx);
+        r = sendToVICC(ctx, apdu_len, apdu);
+
+        if (r > 0) {
+            r = recvFromVICC(ctx, &response);
+            if (r < 0 && gave_up(ctx)) {
+                int e = errno;
+                unlock(ctx->io_lock);
+                errno = e;
+                return -1;
+            }
+            if (r > 0) {
+                if ((size_t) r > rapdu_max) {
+                    /* the message has been consumed, the connection is fine */
+                    unlock(ctx->io_lock);
+                    errno = ENOBUFS;
+                    return -1;
+                }
+                memcpy(rapdu, response, r);
+            }
+        }
 
         unlock(ctx->io_lock);
     }
@@ -361,6 +964,27 @@ int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
     if (!ctx)
         return 0;
 
+#ifndef _WIN32
+    if (ctx->mux) {
+        /* the listener hands the card over, wait for it to do so */
+        char drain[16];
+        fd_set rfds;
+        struct timeval tv;
+
+        if (ctx->client_sock == INVALID_SOCKET) {
+            FD_ZERO(&rfds);
+            FD_SET(ctx->wake[0], &rfds);
+            tv.tv_sec = secs;
+            tv.tv_usec = usecs;
+            if (select(ctx->wake[0]+1, &rfds, NULL, NULL, &tv) > 0
+                    && read(ctx->wake[0], drain, sizeof drain) < 0) {
+                /* nothing to drain */
+            }
+        }
+        return ctx->client_sock != INVALID_SOCKET;
+    }
+#endif
+
     if (ctx->client_sock == INVALID_SOCKET) {
         if (ctx->server_sock) {
             /* server mode, try to accept a client */
@@ -383,9 +1007,27 @@ int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs)
 
 int vicc_present(struct vicc_ctx *ctx) {
     unsigned char *atr = NULL;
+    int known = 0;
+
+    if (!vicc_connect(ctx, 0, 0))
+        return 0;
+
+    if (!trylock(ctx->io_lock))
+        /* a transmit is in flight, it ejects the card if the connection fails */
+        return ctx->client_sock != INVALID_SOCKET;
+
+    /* a card whose ATR is known stays present as long as its connection */
+    if (ctx->atr) {
+        known = 1;
+        if (!client_alive(ctx))
+            vicc_eject(ctx);
+    }
+    unlock(ctx->io_lock);
+    if (known)
+        return ctx->client_sock != INVALID_SOCKET;
 
     /* get the atr to check if the card is still alive */
-    if (!vicc_connect(ctx, 0, 0) || vicc_getatr(ctx, &atr) <= 0)
+    if (vicc_getatr(ctx, &atr) <= 0)
         return 0;
 
     free(atr);
@@ -393,9 +1035,65 @@ int vicc_present(struct vicc_ctx *ctx) {
     return 1;
 }
 
+SOCKET vicc_eventsock(struct vicc_ctx *ctx) {
+    if (!ctx)
+        return INVALID_SOCKET;
+
+    if (ctx->client_sock != INVALID_SOCKET)
+        return ctx->client_sock;
+
+    if (ctx->mux)
+        return ctx->wake[0];
+
+    if (ctx->hostname)
+        return INVALID_SOCKET;
+
+    return ctx->server_sock;
+}
+
 ssize_t vicc_getatr(struct vicc_ctx *ctx, unsigned char **atr) {
     unsigned char i = VPCD_CTRL_ATR;
-    return vicc_transmit(ctx, VPCD_CTRL_LEN, &i, atr);
+    unsigned char *p;
+    ssize_t r = -1;
+
+    if (!ctx || !atr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* the cached ATR doesn't wait for a transmit in flight */
+    if (lock(ctx->atr_lock)) {
+        if (ctx->atr) {
+            p = realloc(*atr, ctx->atr_len);
+            if (p) {
+                *atr = p;
+                memcpy(*atr, ctx->atr, ctx->atr_len);
+                r = (ssize_t) ctx->atr_len;
+            } else {
+                errno = ENOMEM;
+            }
+            unlock(ctx->atr_lock);
+            return r;
+        }
+        unlock(ctx->atr_lock);
+    }
+
+    r = vicc_transmit(ctx, VPCD_CTRL_LEN, &i, atr);
+
+    if (r > 0 && lock(ctx->io_lock)) {
+        forget_atr(ctx);
+        if (lock(ctx->atr_lock)) {
+            ctx->atr = malloc(r);
+            if (ctx->atr) {
+                memcpy(ctx->atr, *atr, r);
+                ctx->atr_len = (size_t) r;
+            }
+            unlock(ctx->atr_lock);
+        }
+        unlock(ctx->io_lock);
+    }
+
+    return r;
 }
 
 int vicc_poweron(struct vicc_ctx *ctx) {
@@ -404,6 +1102,7 @@ int vicc_poweron(struct vicc_ctx *ctx) {
 
     if (ctx && lock(ctx->io_lock)) {
         r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
+        forget_atr(ctx);
         unlock(ctx->io_lock);
     }
 
@@ -428,6 +1127,7 @@ int vicc_reset(struct vicc_ctx *ctx) {
 
     if (ctx && lock(ctx->io_lock)) {
         r = sendToVICC(ctx, VPCD_CTRL_LEN, &i);
+        forget_atr(ctx);
         unlock(ctx->io_lock);
     }
 
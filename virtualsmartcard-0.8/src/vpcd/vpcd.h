@@ -32,6 +32,7 @@ typedef int ssize_t;
 #endif
 #else
 #define SOCKET int
+#define INVALID_SOCKET -1
 #include <unistd.h>
 #endif
 
@@ -41,6 +42,30 @@ typedef int ssize_t;
 #define VPCD_CTRL_ON    1
 #define VPCD_CTRL_RESET 2
 #define VPCD_CTRL_ATR	4
+/* First byte of a batch of APDUs, see vicc_transmit_batch. As CLA FF is
+ * invalid (ISO 7816-4), a batch can't be mistaken for an APDU */
+#define VPCD_CTRL_BATCH	0xFF
+
+/** Longest batch frame sent at once: the longest command the ESP32 takes,
+ * header, extended Lc, 1221 bytes of data and extended Le */
+#define VICC_BATCH_MAX      (7 + 1221 + 2)
+
+/** Size of the read buffer, large enough for a frame of maximum length */
+#define VICC_BUF_SIZE (2 + 0xFFFF)
+
+/** Default milliseconds a transmit waits for the response. Covers the
+ * confirmation button of the ESP32 (15 s) and a key generation on it */
+#define VICC_TIMEOUT_MS     60000
+
+/** First frame of a virtual ICC on a multiplexed port: VICC_HELLO | id */
+#define VICC_HELLO          "VICC"
+#define VICC_HELLO_LEN      4
+/** Maximum length of the identifier in the hello */
+#define VICC_ID_MAX         64
+/** Milliseconds to wait for a hello before taking the virtual ICC as is */
+#define VICC_HELLO_TIMEOUT  2000
+
+struct vicc_mux;
 
 struct vicc_ctx {
         SOCKET server_sock;
@@ -48,6 +73,30 @@ struct vicc_ctx {
         char *hostname;
         unsigned short port;
         void *io_lock;
+        /** Bytes received from the client, frames are parsed from here */
+        unsigned char *buf;
+        size_t buf_start;
+        size_t buf_end;
+        /** ATR of the card on client_sock, NULL until it has been received */
+        unsigned char *atr;
+        size_t atr_len;
+        /** Guards atr and atr_len, which are written with io_lock held as
+         * well, so that the ATR can be read while a transmit holds io_lock */
+        void *atr_lock;
+        /** Listener handing the cards to this slot, NULL if it has its own port */
+        struct vicc_mux *mux;
+        /** Written by the listener whenever it hands a card to this slot */
+        int wake[2];
+        /** Milliseconds a transmit waits for the response, 0 for no limit */
+        long timeout_ms;
+        /** Responses the card still owes to transmits that gave up waiting */
+        size_t late;
+        /** Set by \a vicc_cancel, which also writes to the pipe to wake up
+         * the waiting transmit (Windows has no pipe and checks the flag) */
+        volatile int cancelled;
+        int cancel[2];
+        /** Set once the card has answered a batch like an APDU */
+        int no_batch;
 };
 
 #ifdef __cplusplus
@@ -72,18 +121,77 @@ extern "C" {
  */
 struct vicc_ctx * vicc_init(const char *hostname, unsigned short port);
 
+/**
+ * @brief Open a port shared by several slots
+ *
+ * A virtual ICC connecting to the port may start with a hello frame
+ * (\a VICC_HELLO followed by up to \a VICC_ID_MAX bytes identifying it), which
+ * gives it the slot it had before. A virtual ICC without a hello gets the
+ * next free slot after \a VICC_HELLO_TIMEOUT.
+ *
+ * @param[in] port Port to open
+ *
+ * @return On success, the call returns the listener.
+ *         On error, NULL is returned, and errno is set appropriately (\c
+ *         ENOSYS if the listener is not available on this platform).
+ */
+struct vicc_mux * vicc_mux_init(unsigned short port);
+int vicc_mux_exit(struct vicc_mux *mux);
+
+/**
+ * @brief Initialize a slot that gets its cards from a shared port
+ *
+ * The slot must be closed with \a vicc_exit before the listener.
+ *
+ * @return On success, the call returns the initialized context
+ *         On error, NULL is returned.
+ */
+struct vicc_ctx * vicc_init_muxed(struct vicc_mux *mux);
+
+/* used by vicc_init_muxed and vicc_exit */
+int vicc_mux_attach(struct vicc_mux *mux, struct vicc_ctx *ctx);
+void vicc_mux_detach(struct vicc_mux *mux, struct vicc_ctx *ctx);
+
 int vicc_exit(struct vicc_ctx *ctx);
 int vicc_eject(struct vicc_ctx *ctx);
 
 int vicc_connect(struct vicc_ctx *ctx, long secs, long usecs);
-int vicc_present(struct vicc_ctx *ctx);
+/**
+ * @brief Get the socket that becomes readable when the state of the card may
+ * have changed: a card connecting (server mode) or the connected card going
+ * away. Check the state with \a vicc_present once it is readable.
+ *
+ * On a shared port, this is a pipe that the listener writes to when it hands
+ * a card to the slot.
+ *
+ * @return A socket to wait on, or INVALID_SOCKET in client mode without a
+ *         connection, where the only way to notice the card is to retry
+ */
+SOCKET vicc_eventsock(struct vicc_ctx *ctx);
+
 int vicc_poweron(struct vicc_ctx *ctx);
 int vicc_poweroff(struct vicc_ctx *ctx);
 int vicc_reset(struct vicc_ctx *ctx);
 
+/**
+ * @brief Check whether a virtual smart card is connected.
+ *
+ * Once the ATR has been received, the card is considered present until its
+ * connection is closed or fails, which is checked locally without a round
+ * trip to the card. The late responses that have arrived are dropped on the
+ * way. While a transmit is in flight, the card is present as long as it is
+ * connected: the check doesn't wait for the transmit, which ejects the card
+ * itself if the connection fails.
+ *
+ * @return 1 if the card is present, 0 otherwise
+ */
+int vicc_present(struct vicc_ctx *ctx);
+
 /**
  * @brief Receive ATR from the virtual smart card.
  *
+ * The ATR is cached until the card is ejected, powered up or reset.
+ *
  * @param[in,out] atr ATR received. Memory will be reused (via \a realloc) and
  *                    should be freed by the caller if no longer needed.
  *
@@ -101,13 +209,171 @@ ssize_t vicc_getatr(struct vicc_ctx *ctx, unsigned char** atr);
  *                         realloc) and should be freed by the caller if no
  *                         longer needed.
  *
+ * The response is awaited for at most the timeout of the context (see \a
+ * vicc_set_timeout). A transmit that times out or is cancelled leaves the
+ * card connected, its late response is dropped when it arrives, so the
+ * caller may simply retry.
+ *
  * @return On success, the call returns the number of bytes received.
- *         On error, -1 is returned, and errno is set appropriately.
+ *         On error, -1 is returned, and errno is set appropriately (\c
+ *         ETIMEDOUT if the response didn't arrive in time, \c ECANCELED if
+ *         \a vicc_cancel has been called).
  */
 ssize_t vicc_transmit(struct vicc_ctx *ctx,
         size_t apdu_len, const unsigned char *apdu,
         unsigned char **rapdu);
 
+/**
+ * @brief Send an APDU to the virtual smart card, receiving the response into
+ * a buffer of the caller.
+ *
+ * @param[in]  apdu_len  Number of bytes to send
+ * @param[in]  apdu      Data to be sent
+ * @param[in]  rapdu_max Size of \a rapdu
+ * @param[out] rapdu     Data received
+ *
+ * @return On success, the call returns the number of bytes received.
+ *         On error, -1 is returned, and errno is set appropriately (\c
+ *         ENOBUFS if the response doesn't fit into \a rapdu, \c ETIMEDOUT
+ *         and \c ECANCELED as for \a vicc_transmit).
+ */
+ssize_t vicc_transmit_into(struct vicc_ctx *ctx,
+        size_t apdu_len, const unsigned char *apdu,
+        size_t rapdu_max, unsigned char *rapdu);
+
+/**
+ * @brief Send several APDUs to the virtual smart card in one round trip.
+ *
+ * The card runs the APDUs in order and stops after the first one that
+ * doesn't end with 90 00 or 61 XX. A card that runs fewer of them (only a
+ * few fit into its buffers) gets the rest in another batch, a card that
+ * doesn't know batches at all gets them one by one. A batch frame is at
+ * most \a VICC_BATCH_MAX bytes long, the APDUs that don't fit into it go
+ * in the next one, and an APDU that is longer goes in a frame of its own.
+ *
+ * @param[in]     batch_len Number of bytes of \a batch
+ * @param[in]     batch     The APDUs, each prefixed with its length on 2
+ *                          bytes (network byte order)
+ * @param[in,out] rbatch    The responses, in the same form. Memory will be
+ *                          reused (via \a realloc) and should be freed by
+ *                          the caller if no longer needed.
+ *
+ * @return On success, the call returns the number of bytes of \a rbatch.
+ *         On error, -1 is returned, and errno is set appropriately (as for
+ *         \a vicc_transmit, \c EINVAL if \a batch is malformed).
+ */
+ssize_t vicc_transmit_batch(struct vicc_ctx *ctx,
+        size_t batch_len, const unsigned char *batch,
+        unsigned char **rbatch);
+
+/**
+ * @brief Set how long a transmit waits for the response.
+ *
+ * @param[in] msecs Milliseconds, 0 to wait for as long as the connection
+ *                  lasts. Defaults to \a VICC_TIMEOUT_MS.
+ */
+void vicc_set_timeout(struct vicc_ctx *ctx, long msecs);
+
+/**
+ * @brief Make the transmit currently waiting for a response give up.
+ *
+ * May be called from any thread. A cancellation only concerns the transmit
+ * in progress, the next transmit starts afresh.
+ */
+void vicc_cancel(struct vicc_ctx *ctx);
+
+/** Milliseconds a client may hold the card between the APDUs of a sequence
+ * (see \a vicc_queue_leave) before the others get their turn again */
+#define VICC_QUEUE_HOLD_MS  5000
+
+/** Request queue of a card shared by several clients, see \a
+ * vicc_queue_create */
+struct vicc_queue;
+
+struct vicc_queue_stats {
+        /** Requests waiting for their turn */
+        size_t depth;
+        /** Most requests that have been waiting at once */
+        size_t max_depth;
+        /** Requests that got their turn */
+        unsigned long long served;
+        /** Milliseconds they have waited for it, in total and at most */
+        unsigned long long wait_ms;
+        unsigned long long max_wait_ms;
+        /** Transactions begun */
+        unsigned long long transactions;
+};
+
+/**
+ * @brief Create the request queue of a card
+ *
+ * A client wraps each request to the card in \a vicc_queue_enter and \a
+ * vicc_queue_leave. The card goes to one request at a time, the clients take
+ * turns (the one whose last turn is the oldest goes first) and the requests
+ * of each client run in order. Without threads, the queue only counts.
+ *
+ * @return On success, the call returns the queue.
+ *         On error, NULL is returned.
+ */
+struct vicc_queue *vicc_queue_create(void);
+void vicc_queue_free(struct vicc_queue *q);
+
+/**
+ * @brief Wait for the turn of a request of \a client
+ *
+ * @return 0 once the request has the card.
+ *         On error, -1 is returned, and errno is set appropriately (\c
+ *         ECANCELED if \a vicc_queue_cancel has been called meanwhile).
+ */
+int vicc_queue_enter(struct vicc_queue *q, unsigned long client);
+
+/**
+ * @brief End a request of \a client
+ *
+ * @param[in] more Set if the request is part of a sequence that isn't over
+ *                 (see \a vicc_sequence_continues). The card is then held for
+ *                 \a client for at most \a VICC_QUEUE_HOLD_MS.
+ */
+void vicc_queue_leave(struct vicc_queue *q, unsigned long client, int more);
+
+/**
+ * @brief Hold the card for \a client until \a vicc_queue_end
+ *
+ * Waits for the turn of \a client like a request. Transactions of the same
+ * client nest.
+ *
+ * @return 0 once the card is held.
+ *         On error, -1 is returned, and errno is set appropriately (\c
+ *         ECANCELED as for \a vicc_queue_enter).
+ */
+int vicc_queue_begin(struct vicc_queue *q, unsigned long client);
+
+/**
+ * @brief End a transaction of \a client
+ *
+ * @return 0 on success.
+ *         On error, -1 is returned, and errno is set to \c EPERM if \a client
+ *         doesn't hold the card.
+ */
+int vicc_queue_end(struct vicc_queue *q, unsigned long client);
+
+/** @brief Drop any hold of \a client, e.g. when it goes away */
+void vicc_queue_release(struct vicc_queue *q, unsigned long client);
+
+/** @brief Make the requests waiting for their turn give up */
+void vicc_queue_cancel(struct vicc_queue *q);
+
+void vicc_queue_stats(struct vicc_queue *q, struct vicc_queue_stats *stats);
+
+/**
+ * @brief Check whether an exchange with the card is part of a sequence that
+ * isn't over: a chained command, or a response continued with GET RESPONSE.
+ *
+ * @return 1 if the card should stay with the client, 0 otherwise
+ */
+int vicc_sequence_continues(size_t apdu_len, const unsigned char *apdu,
+        size_t rapdu_len, const unsigned char *rapdu);
+
 #ifdef  __cplusplus
 }
 #endif
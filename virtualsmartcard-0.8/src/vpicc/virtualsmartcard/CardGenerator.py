@@ -667,7 +667,8 @@ class CardGenerator(object):
 
     def generateCard(self):
         """Generate a new card"""
-        if self.type == 'iso7816':
+        if self.type == 'iso7816' or self.type == 'esp32host':
+            # esp32host only needs the file system for the ATR
             self.__generate_iso_card()
         elif self.type == 'ePass':
             self.__generate_ePass()
@@ -20,6 +20,8 @@
 import atexit
 import errno
 import logging
+import os
+import select
 import socket
 import struct
 import sys
@@ -380,10 +382,67 @@ VPCD_CTRL_OFF = 0
 VPCD_CTRL_ON = 1
 VPCD_CTRL_RESET = 2
 VPCD_CTRL_ATR = 4
+VPCD_CTRL_BATCH = 0xFF  # First byte of a batch of APDUs, CLA FF is invalid
 
 
 # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
+ESP_KEEPALIVE = 10  # Seconds of inactivity after which a keep-alive is sent
+ESP_PORT = 5511     # The port the ESP32 connects to
+ESP_BEACON_PORT = 5512      # The UDP port the beacons are broadcast to
+ESP_BEACON_PERIOD = 1       # Seconds between two beacons
+ESP_BEACON_MAGIC = "WSCB"
+ESP_CHANNEL_MAGIC = "WSC1"  # The hello of a firmware built without PLAINTEXT
+ESP_HELLO_WAIT = 1          # Seconds to wait for that hello at the start of a session
+
+
+def beaconESP(localIP, port):
+    """
+    Announce the relay to the ESP32: a beacon (ESP_BEACON_MAGIC | port) is
+    broadcast from localIP every ESP_BEACON_PERIOD seconds, so that the
+    ESP32 connects as soon as the relay listens and learns its address.
+    """
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    sock.bind((localIP, 0))
+    beacon = ESP_BEACON_MAGIC + struct.pack('!H', port)
+    while True:
+        try:
+            sock.sendto(beacon, ('<broadcast>', ESP_BEACON_PORT))
+        except SocketError as e:    # No route to the network yet, keep trying
+            logging.debug("ESP32 beacon not sent: %s", str(e))
+        time.sleep(ESP_BEACON_PERIOD)
+
+
+def recvallESP(sock, size):
+    """ Receive exactly size bytes from the ESP32 """
+    msg = ""
+    while len(msg) < size:
+        chunk = sock.recv(size - len(msg))
+        if not chunk:
+            raise SocketError(errno.ECONNRESET, "ESP32 closed the session")
+        msg += chunk
+    return msg
+
+
+def sendFrameESP(sock, msg):
+    """ Send a length-framed message to the ESP32 """
+    sock.sendall(struct.pack('!H', len(msg)) + msg)
+
+
+def recvFrameESP(sock):
+    """ Receive a length-framed message from the ESP32 """
+    size = struct.unpack('!H', recvallESP(sock, _Csizeof_short))[0]
+    return recvallESP(sock, size)
+
+
 class handleConnection(SocketServer.BaseRequestHandler):
+    """
+    One session with the ESP32. The connection is kept open for as long as
+    the ESP32 stays reachable, and every APDU travels as a frame prefixed
+    with its length on 2 bytes. When there is nothing to do, an empty frame
+    is exchanged every ESP_KEEPALIVE seconds, so that the ESP32 does not
+    drop the session (and the PIN state) and we notice when it is gone.
+    """
     def handle(self):
         global command      # The command APDU
         global response     # The response APDU
@@ -393,20 +452,49 @@ class handleConnection(SocketServer.BaseRequestHandler):
         global processing   # Flag for the run function that the processing has finished
         global err          # Flag for the run function that an error happened
 
-        with condCommand:
-            while (newCommand == 0):
-                condCommand.wait()
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        logging.info("ESP32 session started from %s", self.client_address[0])
 
-        with condResponse:
+        # Without PLAINTEXT the firmware opens the session with the hello of
+        # its encrypted channel, which only vpcd-relay speaks
+        if select.select([self.request], [], [], ESP_HELLO_WAIT)[0]:
             try:
-                self.request.sendall(command)   # Send the command APDU to the ESP32
-                response = self.request.recv(257).strip()   # Get the response APDU
-            except SocketError:     # ESP32 probably disconnected
-                err = 1             # Set the error flag
-
-            processing = 0          # Processing finished, got the response
-            newCommand = 0          # Reset the newCommand flag
-            condResponse.notify()
+                hello = recvFrameESP(self.request)
+            except SocketError:
+                logging.info("ESP32 session ended")
+                return
+            if hello.startswith(ESP_CHANNEL_MAGIC):
+                logging.error("The firmware was built without PLAINTEXT and "
+                              "needs vpcd-relay")
+                os._exit(1)
+
+        while True:
+            with condCommand:
+                if (newCommand == 0):
+                    condCommand.wait(ESP_KEEPALIVE)
+                if (newCommand == 0):   # Nothing to send, check the ESP32 is still there
+                    try:
+                        sendFrameESP(self.request, "")
+                        recvFrameESP(self.request)
+                    except SocketError:
+                        logging.info("ESP32 session ended")
+                        return
+                    continue
+
+            with condResponse:
+                try:
+                    sendFrameESP(self.request, command)     # Send the command APDU to the ESP32
+                    response = recvFrameESP(self.request)   # Get the response APDU
+                except SocketError:     # ESP32 probably disconnected
+                    err = 1             # Set the error flag
+
+                processing = 0          # Processing finished, got the response
+                newCommand = 0          # Reset the newCommand flag
+                condResponse.notify()
+
+            if (err == 1):
+                logging.info("ESP32 session ended")
+                return
 # ADDED CODE SECTION ENDS HERE
 
 
@@ -423,8 +511,8 @@ class VirtualICC(object):
     def __init__(self, datasetfile, card_type, host, port, mode, localIP,   # MODIFIED ARGUMENTS
                  readernum=None, ef_cardsecurity=None, ef_cardaccess=None,
                  ca_key=None, cvca=None, disable_checks=False, esign_key=None,
-                 esign_ca_cert=None, esign_cert=None,
-                 logginglevel=logging.INFO):
+                 esign_ca_cert=None, esign_cert=None, esp32_lib=None,
+                 esp32_state=None, logginglevel=logging.INFO):
         from os.path import exists
 
         logging.basicConfig(level=logginglevel,
@@ -444,7 +532,8 @@ class VirtualICC(object):
 
         # Generate an OS object of the correct card_type
         if card_type == "iso7816" or card_type == "ePass":
-            self.os = Iso7816OS(MF, SAM)
+            # The ESP32 accepts extended Lc/Le, so announce it in the ATR
+            self.os = Iso7816OS(MF, SAM, extended_length=(mode == "esp"))  # MODIFIED ARGUMENTS
         elif card_type == "nPA":
             from virtualsmartcard.cards.nPA import NPAOS
             self.os = NPAOS(MF, SAM, ef_cardsecurity=ef_cardsecurity,
@@ -461,6 +550,9 @@ class VirtualICC(object):
         elif card_type == "handler_test":
             from virtualsmartcard.cards.HandlerTest import HandlerTestOS
             self.os = HandlerTestOS()
+        elif card_type == "esp32host":
+            from virtualsmartcard.cards.ESP32Host import ESP32HostOS
+            self.os = ESP32HostOS(MF, SAM, esp32_lib, esp32_state)
         else:
             logging.warning("Unknown cardtype %s. Will use standard card_type \
                             (ISO 7816)", card_type)
@@ -511,10 +603,13 @@ class VirtualICC(object):
         # ADDED CODE SECTION IN ORDER TO INTEGRATE ESP32 TO GNUPG STARTS HERE
         if (mode == "esp"):
             SocketServer.TCPServer.allow_reuse_address = True
-            server = SocketServer.TCPServer((localIP, 5511), handleConnection)
+            server = SocketServer.TCPServer((localIP, ESP_PORT), handleConnection)
             srvThrd = threading.Thread(target=server.serve_forever)
             srvThrd.daemon = True
             srvThrd.start()
+            beaconThrd = threading.Thread(target=beaconESP, args=(localIP, ESP_PORT))
+            beaconThrd.daemon = True    # Only started once the server listens
+            beaconThrd.start()
         # ADDED CODE SECTION ENDS HERE
 
         atexit.register(self.stop)
@@ -574,6 +669,26 @@ class VirtualICC(object):
 
         return size, msg
 
+    def __executeBatch(self, batch):
+        """
+        Run a batch of APDUs, each prefixed with its length on 2 bytes, in
+        order. Stops after the first response that doesn't end with 90 00 or
+        61 XX. Returns the responses in the same form, after VPCD_CTRL_BATCH.
+        """
+        answer = chr(VPCD_CTRL_BATCH)
+        while len(batch) >= _Csizeof_short:
+            size = struct.unpack('!H', batch[:_Csizeof_short])[0]
+            apdu = batch[_Csizeof_short:_Csizeof_short + size]
+            if len(apdu) != size:
+                logging.warning("Batch cut short")
+                break
+            batch = batch[_Csizeof_short + size:]
+            rapdu = self.os.execute(apdu)
+            answer += struct.pack('!H', len(rapdu)) + rapdu
+            if len(rapdu) < 2 or not (rapdu[-2:] == '\x90\x00' or rapdu[-2] == '\x61'):
+                break
+        return answer
+
     def run(self, mode):    # MODIFIED ARGUMENTS
         """
         Main loop of the vpicc. Receives command APDUs via a socket from the
@@ -591,6 +706,9 @@ class VirtualICC(object):
         global err          # Flag for the run function that an error happened
         condCommand = threading.Condition()
         condResponse = threading.Condition()
+        newCommand = 0      # The ESP32 session may start before the first APDU
+        processing = 0
+        err = 0
         # ADDED CODE SECTION ENDS HERE
 
         while True:
@@ -664,7 +782,10 @@ class VirtualICC(object):
                             sys.exit()      # Terminate execution
                 else:
                 # ADDED CODE SECTION ENDS HERE
-                    answer = self.os.execute(msg)
+                    if msg[0] == chr(VPCD_CTRL_BATCH):
+                        answer = self.__executeBatch(msg[1:])
+                    else:
+                        answer = self.os.execute(msg)
                     logging.info("Response APDU (%d Bytes):\n%s\n", len(answer),
                                  hexdump(answer))
                     self.__sendToVPICC(answer)
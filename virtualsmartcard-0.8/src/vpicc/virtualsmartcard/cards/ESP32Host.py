@@ -0,0 +1,84 @@
+#
+# This file is part of virtualsmartcard.
+#
+# virtualsmartcard is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option) any
+# later version.
+#
+# virtualsmartcard is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# virtualsmartcard.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import ctypes
+import logging
+import sys
+from virtualsmartcard.VirtualSmartcard import Iso7816OS
+
+# Largest response of the firmware: RESPONSE_MAX_LENGTH, the status word and
+# OUT_TAIL (libAPDU.h)
+ESP32_RESPONSE_MAX = 1221 + 2 + 16
+
+# esp_log_level_t of the firmware for the levels of logging
+ESP32_LOG_LEVELS = [(logging.DEBUG, 4), (logging.INFO, 3),
+                    (logging.WARNING, 2), (logging.ERROR, 1)]
+
+
+class ESP32HostOS(Iso7816OS):
+    """
+    This class runs the card firmware of the ESP32 (gpg/main) on the host,
+    built as a shared library by gpg/host. The command APDUs go straight to
+    process() of the firmware instead of over WiFi, so GnuPG and scdaemon can
+    be tested and the firmware profiled at the speed of the host. The state of
+    the card is kept in a directory, as the ESP32 keeps it in its flash.
+    """
+    def __init__(self, mf, sam, lib, state):
+        # The firmware accepts extended Lc/Le, as on the ESP32
+        Iso7816OS.__init__(self, mf, sam, extended_length=True)
+
+        try:
+            self.lib = ctypes.CDLL(lib)
+        except OSError as e:
+            logging.error("Failed to load the card firmware %s: %s", lib,
+                          str(e))
+            sys.exit()
+
+        self.lib.cardOpen.argtypes = [ctypes.c_char_p]
+        self.lib.cardOpen.restype = ctypes.c_uint8
+        self.lib.cardProcess.argtypes = [ctypes.c_char_p, ctypes.c_uint16,
+                                         ctypes.c_char_p, ctypes.c_uint16]
+        self.lib.cardProcess.restype = ctypes.c_uint16
+        self.lib.esp_log_level_set.argtypes = [ctypes.c_char_p, ctypes.c_int]
+
+        level = logging.getLogger().getEffectiveLevel()
+        for (logginglevel, esplevel) in ESP32_LOG_LEVELS:
+            if level <= logginglevel:
+                self.lib.esp_log_level_set("*", esplevel)
+                break
+
+        if self.lib.cardOpen(state) != 0:
+            logging.error("Failed to start the card kept in %s", state)
+            sys.exit()
+        logging.info("Running the card firmware %s, kept in %s", lib, state)
+
+        self.response = ctypes.create_string_buffer(ESP32_RESPONSE_MAX)
+
+    def invalidate(self):
+        # Custom INS to reset, as the ESP32 gets on a reset of the reader
+        self.execute('\x00\x55\x00\x00\x00')
+
+    def powerUp(self):
+        self.invalidate()
+
+    def reset(self):
+        self.invalidate()
+
+    def execute(self, msg):
+        length = self.lib.cardProcess(msg, len(msg), self.response,
+                                      len(self.response))
+        return self.response.raw[:length]
@@ -0,0 +1,346 @@
+#include "internal.h"
+#include "VirtualSCReader.h"
+#include "reader.h"
+#include "device.h"
+#include <winscard.h>
+#include "memory.h"
+#include <Sddl.h>
+#include "sectionLocker.h"
+
+// The reader takes the place of vpcd-relay (or `vicc --esp32`): the ESP32
+// connects to it directly. Every frame is prefixed with its length on 2
+// bytes (network byte order), an empty frame is a keep-alive that the ESP32
+// echoes back. While no ESP32 is connected, a beacon (ESP32_BEACON_MAGIC |
+// Port) is broadcast every second, so that the ESP32 finds the reader.
+
+#define ESP32_PORT 5511
+#define ESP32_BEACON_PORT 5512
+#define ESP32_BEACON_MAGIC "WSCB"
+#define ESP32_KEEPALIVE 10		// seconds of silence before a keep-alive, the ESP32 gives up after 30
+#define ESP32_TIMEOUT 60000		// ms to wait for a response: the proceed button, a key generation
+// the length of a frame is on 2 bytes, so of the commands and responses up to
+// READER_APDU_MAX and READER_RESP_MAX, only those over 65535 bytes can't be sent
+#define ESP32_FRAME_MAX 0xFFFF
+
+// the custom INS that resets the PINs of the ESP32, sent on a reset
+static const BYTE esp32Reset[]={0x00,0x55,0x00,0x00,0x00};
+
+// the ATR of `vicc --esp32`: ISO 7816 card with extended length
+static const BYTE esp32ATR[]={0x3b,0x95,0x13,0x81,0x01,0x80,0x73,0xff,0x01,0x40,0x4b};
+
+int Esp32Reader::portBase;
+
+Esp32Reader::Esp32Reader() {
+	rpcType=3;
+	state=SCARD_ABSENT;
+	cardPresent=false;
+	socket=INVALID_SOCKET;
+	AcceptSocket=INVALID_SOCKET;
+	beaconSocket=INVALID_SOCKET;
+	InitializeCriticalSection(&ioSection);
+}
+
+Esp32Reader::~Esp32Reader() {
+	DeleteCriticalSection(&ioSection);
+}
+
+void Esp32Reader::init(wchar_t *section) {
+	wchar_t address[100];
+
+	portBase=GetPrivateProfileInt(L"Driver",L"ESP32_PORT_BASE",ESP32_PORT,L"BixVReader.ini");
+
+	port=GetPrivateProfileInt(section,L"TCP_PORT",portBase+instance,L"BixVReader.ini");
+	beaconPort=GetPrivateProfileInt(section,L"BEACON_PORT",ESP32_BEACON_PORT,L"BixVReader.ini");
+	keepAlive=GetPrivateProfileInt(section,L"KEEPALIVE",ESP32_KEEPALIVE,L"BixVReader.ini");
+	// the ESP32 comes over the WiFi, so all of the interfaces by default
+	GetPrivateProfileString(section,L"LISTEN_ADDRESS",L"0.0.0.0",address,sizeof(address)/sizeof(address[0]),L"BixVReader.ini");
+	wcstombs(listenAddress,address,sizeof(listenAddress));
+	listenAddress[sizeof(listenAddress)-1]=0;
+}
+
+// exactly len bytes, false if the session is over
+bool Esp32Reader::recvAll(BYTE *buf,int len) {
+	int read=0;
+	while (read<len) {
+		int r=recv(AcceptSocket,(char*)buf+read,len-read,0);
+		if (r<=0)
+			return false;
+		read+=r;
+	}
+	return true;
+}
+
+bool Esp32Reader::sendFrame(const BYTE *data,int len) {
+	if (len>ESP32_FRAME_MAX)
+		return false;
+	BYTE *frame=new BYTE[2+len];
+	frame[0]=(BYTE)(len>>8);
+	frame[1]=(BYTE)(len&0xFF);
+	memcpy(frame+2,data,len);
+	// in a single segment, the ESP32 answers to every frame
+	bool sent=send(AcceptSocket,(char*)frame,len+2,0)==len+2;
+	delete[] frame;
+	return sent;
+}
+
+// the response to a frame into buf, *len is its room and then its length.
+// A response that doesn't fit is read and dropped, frameTooLong is set
+bool Esp32Reader::recvFrame(BYTE *buf,int *len) {
+	BYTE size[2];
+	frameTooLong=false;
+	if (!recvAll(size,sizeof(size)))
+		return false;
+	int frameLen=size[0]<<8|size[1];
+	if (frameLen>*len) {
+		BYTE drop[256];
+		frameTooLong=true;
+		while (frameLen>0) {
+			int chunk=frameLen>(int)sizeof(drop) ? (int)sizeof(drop) : frameLen;
+			if (!recvAll(drop,chunk))
+				return false;
+			frameLen-=chunk;
+		}
+		return false;
+	}
+	if (!recvAll(buf,frameLen))
+		return false;
+	*len=frameLen;
+	return true;
+}
+
+// called with ioSection
+void Esp32Reader::closeSession() {
+	if (AcceptSocket!=INVALID_SOCKET) {
+		OutputDebugString(L"[BixVReader]ESP32 session ended");
+		closesocket(AcceptSocket);
+		AcceptSocket=INVALID_SOCKET;
+	}
+	powered=0;
+	signalRemoval();
+}
+
+bool Esp32Reader::CheckATR() {
+	return cardPresent;
+}
+
+bool Esp32Reader::QueryTransmit(BYTE *APDU,int APDUlen,BYTE *Resp,int *Resplen) {
+	SectionLocker lock(ioSection);
+	if (AcceptSocket==INVALID_SOCKET || !APDU || !APDUlen || !Resp || !Resplen)
+		return false;
+	if (APDUlen>ESP32_FRAME_MAX)
+		return false;	// can't be framed, the session goes on
+	int len=ESP32_FRAME_MAX;	// Resp has room for READER_RESP_MAX
+	if (!sendFrame(APDU,APDUlen) || !recvFrame(Resp,&len) || len<2) {
+		if (!frameTooLong)
+			closeSession();
+		return false;
+	}
+	(*Resplen)=len;
+	lastIo=GetTickCount();
+	return true;
+}
+
+bool Esp32Reader::QueryATR(BYTE *ATR,DWORD *ATRsize,bool reset) {
+	SectionLocker lock(ioSection);
+	if (AcceptSocket==INVALID_SOCKET || !ATR || !ATRsize)
+		return false;
+	if (reset) {
+		// as vpcd-relay does: the response only tells that the PINs are reset
+		BYTE resp[2];
+		int len=sizeof(resp);
+		if (!sendFrame(esp32Reset,sizeof(esp32Reset)) || !recvFrame(resp,&len)) {
+			if (!frameTooLong) {
+				closeSession();
+				return false;
+			}
+		}
+		lastIo=GetTickCount();
+	}
+	memcpy(ATR,esp32ATR,sizeof(esp32ATR));
+	(*ATRsize)=sizeof(esp32ATR);
+	return true;
+}
+
+// with ioSection, the ESP32 echoes the empty frame
+void Esp32Reader::sendKeepAlive() {
+	BYTE empty[1];
+	int len=0;
+	if (!sendFrame(empty,0) || !recvFrame(empty,&len) || len!=0) {
+		closeSession();
+		return;
+	}
+	lastIo=GetTickCount();
+}
+
+void Esp32Reader::sendBeacon() {
+	BYTE beacon[sizeof(ESP32_BEACON_MAGIC)-1+2];
+	sockaddr_in to;
+	memcpy(beacon,ESP32_BEACON_MAGIC,sizeof(ESP32_BEACON_MAGIC)-1);
+	beacon[sizeof(beacon)-2]=(BYTE)(port>>8);
+	beacon[sizeof(beacon)-1]=(BYTE)(port&0xFF);
+	to.sin_family=AF_INET;
+	to.sin_addr.s_addr=htonl(INADDR_BROADCAST);
+	to.sin_port=htons((u_short)beaconPort);
+	sendto(beaconSocket,(char*)beacon,sizeof(beacon),0,(SOCKADDR*)&to,sizeof(to));
+}
+
+bool Esp32Reader::openServer() {
+	sockaddr_in Service;
+	BOOL yes=TRUE;
+
+	socket=WSASocket(AF_INET,SOCK_STREAM,IPPROTO_TCP,NULL,0,0);
+	if (socket==INVALID_SOCKET)
+		return false;
+	setsockopt(socket,SOL_SOCKET,SO_REUSEADDR,(char*)&yes,sizeof(yes));
+	Service.sin_family=AF_INET;
+	Service.sin_addr.s_addr=inet_addr(listenAddress);
+	Service.sin_port=htons((u_short)port);
+	if (bind(socket,(SOCKADDR*)&Service,sizeof(Service))!=0 || listen(socket,1)!=0) {
+		closesocket(socket);
+		socket=INVALID_SOCKET;
+		return false;
+	}
+
+	beaconSocket=WSASocket(AF_INET,SOCK_DGRAM,IPPROTO_UDP,NULL,0,0);
+	if (beaconSocket!=INVALID_SOCKET)
+		setsockopt(beaconSocket,SOL_SOCKET,SO_BROADCAST,(char*)&yes,sizeof(yes));
+	return true;
+}
+
+void Esp32Reader::acceptSession() {
+	SOCKET s=accept(socket,NULL,NULL);
+	if (s==INVALID_SOCKET)
+		return;
+
+	BOOL yes=TRUE;
+	DWORD timeout=ESP32_TIMEOUT;
+	// no Nagle delay on the small APDU frames
+	setsockopt(s,IPPROTO_TCP,TCP_NODELAY,(char*)&yes,sizeof(yes));
+	setsockopt(s,SOL_SOCKET,SO_KEEPALIVE,(char*)&yes,sizeof(yes));
+	setsockopt(s,SOL_SOCKET,SO_RCVTIMEO,(char*)&timeout,sizeof(timeout));
+
+	{
+		SectionLocker lock(ioSection);
+		// a new connection means that the ESP32 has started over
+		if (AcceptSocket!=INVALID_SOCKET)
+			closeSession();
+		AcceptSocket=s;
+		lastIo=GetTickCount();
+	}
+
+	wchar_t log[300];
+	swprintf(log,L"[BixVReader]ESP32 connected:%i",s);
+	OutputDebugString(log);
+	signalInsertion();
+}
+
+DWORD Esp32Reader::startServer() {
+	breakSocket=false;
+
+	while (!breakSocket) {
+		if (socket==INVALID_SOCKET && !openServer()) {
+			wchar_t log[100];
+			swprintf(log,L"[BixVReader]ESP32 port %i: wsa err:%x",port,WSAGetLastError());
+			OutputDebugString(log);
+			Sleep(1000);
+			continue;
+		}
+
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(socket,&readfds);
+		timeval tv={ 1, 0 };
+		int ret=select(0,&readfds,NULL,NULL,&tv);
+		if (breakSocket)
+			break;
+		if (ret<0) {
+			closesocket(socket);
+			socket=INVALID_SOCKET;
+			continue;
+		}
+		if (ret>0)
+			acceptSession();
+
+		if (AcceptSocket==INVALID_SOCKET) {
+			if (beaconSocket!=INVALID_SOCKET)
+				sendBeacon();
+		}
+		else if (GetTickCount()-lastIo>=(DWORD)keepAlive*1000) {
+			SectionLocker lock(ioSection);
+			if (AcceptSocket!=INVALID_SOCKET && GetTickCount()-lastIo>=(DWORD)keepAlive*1000)
+				sendKeepAlive();
+		}
+	}
+	return 0;
+}
+
+void Esp32Reader::shutdown() {
+	breakSocket=true;
+	WaitForSingleObject(serverThread,10000);
+	serverThread=NULL;
+	{
+		SectionLocker lock(ioSection);
+		if (AcceptSocket!=INVALID_SOCKET) {
+			closesocket(AcceptSocket);
+			AcceptSocket=INVALID_SOCKET;
+		}
+	}
+	if (socket!=INVALID_SOCKET) {
+		closesocket(socket);
+		socket=INVALID_SOCKET;
+	}
+	if (beaconSocket!=INVALID_SOCKET) {
+		closesocket(beaconSocket);
+		beaconSocket=INVALID_SOCKET;
+	}
+	state=SCARD_ABSENT;
+	cardPresent=false;
+	if (waitRemoveIpr!=NULL) {
+		SectionLocker lock(device->m_RequestLock);
+		if (waitRemoveIpr->UnmarkCancelable()==S_OK)
+			waitRemoveIpr->Complete(HRESULT_FROM_WIN32(ERROR_CANCELLED));
+		waitRemoveIpr=NULL;
+	}
+	if (waitInsertIpr!=NULL) {
+		SectionLocker lock(device->m_RequestLock);
+		if (waitInsertIpr->UnmarkCancelable()==S_OK)
+			waitInsertIpr->Complete(HRESULT_FROM_WIN32(ERROR_CANCELLED));
+		waitInsertIpr=NULL;
+	}
+}
+
+void Esp32Reader::signalRemoval(void) {
+	if (cardPresent) {
+		cardPresent = false;
+		state=SCARD_ABSENT;
+		if (waitRemoveIpr!=NULL) {
+			SectionLocker lock(device->m_RequestLock);
+			if (waitRemoveIpr->UnmarkCancelable()==S_OK) {
+				waitRemoveIpr->CompleteWithInformation(STATUS_SUCCESS, 0);
+			}
+			waitRemoveIpr=NULL;
+		}
+		if (waitInsertIpr!=NULL) {
+			SectionLocker lock(device->m_RequestLock);
+			if (waitInsertIpr->UnmarkCancelable()==S_OK) {
+				waitInsertIpr->CompleteWithInformation(HRESULT_FROM_WIN32(ERROR_CANCELLED), 0);
+			}
+			waitInsertIpr=NULL;
+		}
+	}
+}
+
+void Esp32Reader::signalInsertion(void) {
+	if (!cardPresent) {
+		cardPresent = true;
+		if (waitInsertIpr!=NULL) {
+			if (initProtocols()) {
+				SectionLocker lock(device->m_RequestLock);
+				if (waitInsertIpr->UnmarkCancelable()==S_OK)
+					waitInsertIpr->CompleteWithInformation(STATUS_SUCCESS, 0);
+				waitInsertIpr=NULL;
+				state=SCARD_SWALLOWED;
+			}
+		}
+	}
+}
@@ -7,6 +7,27 @@
 #include <Sddl.h>
 #include "SectionLocker.h"
 
+static VOID CALLBACK TransmitWork(PTP_CALLBACK_INSTANCE instance,PVOID context,PTP_WORK work) {
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(work);
+	((Reader*)context)->runTransmit();
+}
+
+Reader::Reader() {
+	transmitStopping=false;
+	InitializeCriticalSection(&transmitQueueSection);
+	InitializeCriticalSection(&transmitSection);
+	transmitWork=CreateThreadpoolWork(TransmitWork,this,NULL);
+}
+
+Reader::~Reader() {
+	stopTransmits();
+	if (transmitWork!=NULL)
+		CloseThreadpoolWork(transmitWork);
+	DeleteCriticalSection(&transmitSection);
+	DeleteCriticalSection(&transmitQueueSection);
+}
+
 void Reader::init(wchar_t *section) {
 	section;
 	state=SCARD_ABSENT;
@@ -199,25 +220,82 @@ void Reader::IoSmartCardTransmit(IWDFIoRequest* pRequest,SIZE_T inBufSize,SIZE_T
 	UNREFERENCED_PARAMETER(inBufSize);
 	UNREFERENCED_PARAMETER(outBufSize);
 	OutputDebugString(L"[BixVReader][TRSM]IOCTL_SMARTCARD_TRANSMIT");
-	BYTE APDU[1000];
-	int APDUSize;
-	getBuffer(pRequest,APDU,&APDUSize);
-	if (((SCARD_IO_REQUEST*)APDU)->dwProtocol!=protocol) {
+	TransmitJob *job=new TransmitJob;
+	job->request=pRequest;
+	if (!getBuffer(pRequest,job->APDU,&job->APDUSize,sizeof(job->APDU))
+			|| job->APDUSize<(int)sizeof(SCARD_IO_REQUEST)) {
+		delete job;
+		SectionLocker lock(device->m_RequestLock);
+        pRequest->CompleteWithInformation(STATUS_INVALID_PARAMETER, 0);
+		return;
+	}
+	if (((SCARD_IO_REQUEST*)job->APDU)->dwProtocol!=protocol) {
+		delete job;
 		SectionLocker lock(device->m_RequestLock);
         pRequest->CompleteWithInformation(STATUS_INVALID_DEVICE_STATE, 0);
 		return;
 	}
-	BYTE Resp[1000];
-	int RespSize;
-	if (!QueryTransmit(APDU+sizeof(SCARD_IO_REQUEST),APDUSize-sizeof(SCARD_IO_REQUEST),Resp+sizeof(SCARD_IO_REQUEST),&RespSize))
+	bool queued=false;
 	{
+		SectionLocker lock(transmitQueueSection);
+		if (transmitWork!=NULL && !transmitStopping) {
+			transmitQueue.push_back(job);
+			queued=true;
+		}
+	}
+	if (queued)
+		// the request is completed by runTransmit
+		SubmitThreadpoolWork(transmitWork);
+	else {
+		delete job;
 		SectionLocker lock(device->m_RequestLock);
-		pRequest->CompleteWithInformation(STATUS_NO_MEDIA, 0);					
+		pRequest->CompleteWithInformation(STATUS_NO_MEDIA, 0);
+	}
+}
+
+// one callback per queued transmit, transmitSection keeps them in order
+void Reader::runTransmit() {
+	SectionLocker lock(transmitSection);
+	TransmitJob *job=NULL;
+	bool stopping;
+	EnterCriticalSection(&transmitQueueSection);
+	if (!transmitQueue.empty()) {
+		job=transmitQueue.front();
+		transmitQueue.pop_front();
+	}
+	stopping=transmitStopping;
+	LeaveCriticalSection(&transmitQueueSection);
+	if (job==NULL)
+		return;
+
+	// on the heap, an extended length response is kept off the stack of the pool thread
+	BYTE *Resp=new BYTE[sizeof(SCARD_IO_REQUEST)+READER_RESP_MAX];
+	int RespSize;
+	if (stopping || !QueryTransmit(job->APDU+sizeof(SCARD_IO_REQUEST),job->APDUSize-sizeof(SCARD_IO_REQUEST),Resp+sizeof(SCARD_IO_REQUEST),&RespSize))
+	{
+		{
+			SectionLocker lock(device->m_RequestLock);
+			job->request->CompleteWithInformation(STATUS_NO_MEDIA, 0);
+		}
+		delete[] Resp;
+		delete job;
 		return;
 	}
 	((SCARD_IO_REQUEST*)Resp)->cbPciLength=sizeof(SCARD_IO_REQUEST);
 	((SCARD_IO_REQUEST*)Resp)->dwProtocol=protocol;
-	setBuffer(device,pRequest,Resp,RespSize+sizeof(SCARD_IO_REQUEST));
+	setBuffer(device,job->request,Resp,RespSize+sizeof(SCARD_IO_REQUEST));
+	delete[] Resp;
+	delete job;
+}
+
+// the transmits still queued fail, waits for the one on the card
+void Reader::stopTransmits() {
+	{
+		SectionLocker lock(transmitQueueSection);
+		transmitStopping=true;
+	}
+	if (transmitWork!=NULL)
+		WaitForThreadpoolWorkCallbacks(transmitWork,FALSE);
 }
 
 void Reader::IoSmartCardGetAttribute(IWDFIoRequest* pRequest,SIZE_T inBufSize,SIZE_T outBufSize) {
@@ -1,11 +1,28 @@
 #pragma once
 
 #include <Winsock2.h>
+#include <winscard.h>
+#include <deque>
 
 class CMyDevice;
 
+// the longest extended length command and response (ISO 7816-4), the
+// buffers of a transmit have room for them after the SCARD_IO_REQUEST
+#define READER_APDU_MAX (4+3+65535+2)
+#define READER_RESP_MAX (65536+2)
+
+// an IOCTL_SMARTCARD_TRANSMIT waiting for its turn on the card
+struct TransmitJob {
+	CComPtr<IWDFIoRequest> request;
+	BYTE APDU[sizeof(SCARD_IO_REQUEST)+READER_APDU_MAX];	// on the heap with the job
+	int APDUSize;
+};
+
 class Reader {
 public:
+	Reader();
+	virtual ~Reader();
+
 	CMyDevice *device;
 	CComPtr<IWDFIoRequest> waitRemoveIpr;
 	CComPtr<IWDFIoRequest> waitInsertIpr;
@@ -34,6 +51,8 @@ public:
 	void IoSmartCardTransmit(IWDFIoRequest* pRequest,SIZE_T inBufSize,SIZE_T outBufSize);
 
 	bool initProtocols();
+	void runTransmit();
+	void stopTransmits();
 	virtual bool QueryTransmit(BYTE *APDU,int APDUlen,BYTE *Resp,int *Resplen);
 	virtual bool QueryATR(BYTE *ATR,DWORD *ATRsize,bool reset=false);
 	virtual bool CheckATR();
@@ -41,6 +60,13 @@ public:
 	virtual void shutdown();
 	virtual void init(wchar_t *section);
 
+	// the transmits run on the thread pool, one at a time and in order, so
+	// that a slow card operation doesn't hold up the other IOCTLs
+	PTP_WORK transmitWork;
+	std::deque<TransmitJob*> transmitQueue;
+	bool transmitStopping;
+	CRITICAL_SECTION transmitQueueSection;
+	CRITICAL_SECTION transmitSection;
 };
 
 class PipeReader : public Reader {
@@ -105,3 +131,41 @@ public:
 
 	CRITICAL_SECTION ioSection;
 };
+
+class Esp32Reader : public Reader {
+public:
+	static int portBase;
+	int port;
+	int beaconPort;
+	int keepAlive;
+	char listenAddress[100];
+	SOCKET socket;
+	SOCKET AcceptSocket;
+	SOCKET beaconSocket;
+	bool breakSocket;
+	bool cardPresent;
+	bool frameTooLong;
+	DWORD lastIo;
+
+	Esp32Reader();
+	~Esp32Reader();
+	bool QueryTransmit(BYTE *APDU,int APDUlen,BYTE *Resp,int *Resplen);
+	bool QueryATR(BYTE *ATR,DWORD *ATRsize,bool reset=false);
+	bool CheckATR();
+	DWORD startServer();
+	void shutdown();
+	void init(wchar_t *section);
+	void signalRemoval(void);
+	void signalInsertion(void);
+
+	bool recvAll(BYTE *buf,int len);
+	bool sendFrame(const BYTE *data,int len);
+	bool recvFrame(BYTE *buf,int *len);
+	void closeSession();
+	void sendKeepAlive();
+	void sendBeacon();
+	bool openServer();
+	void acceptSession();
+
+	CRITICAL_SECTION ioSection;
+};
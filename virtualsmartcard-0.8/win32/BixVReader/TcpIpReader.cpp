@@ -25,7 +25,8 @@ void TcpIpReader::init(wchar_t *section) {
 }
 
 bool TcpIpReader::CheckATR() {
-	//SectionLocker lock(dataSection);
+	// the transmits run beside the other IOCTLs, one exchange at a time
+	SectionLocker lock(dataSection);
 	if (AcceptSocket==NULL)
 		return false;
 	int read=0;
@@ -46,23 +47,19 @@ bool TcpIpReader::CheckATR() {
 	return true;
 }
 bool TcpIpReader::QueryTransmit(BYTE *APDU,int APDUlen,BYTE *Resp,int *Resplen) {
-	//SectionLocker lock(dataSection);
+	SectionLocker lock(dataSection);
 	if (AcceptSocket==NULL)
 		return false;
 	DWORD command=2;
 	DWORD read=0;
-	if ((read=send(AcceptSocket,(char*)&command,sizeof(DWORD),NULL))<=0) {
-		::shutdown(AcceptSocket,SD_BOTH);
-		AcceptSocket=NULL;
-		return false;
-	}
 	DWORD dwAPDUlen=(DWORD)APDUlen;
-	if ((read=send(AcceptSocket,(char*)&dwAPDUlen,sizeof(DWORD),NULL))<=0) {
-		::shutdown(AcceptSocket,SD_BOTH);
-		AcceptSocket=NULL;
-		return false;
-	}
-	if ((read=send(AcceptSocket,(char*)APDU,APDUlen,NULL))<=0) {
+	// command, length and APDU in a single send, not three segments
+	WSABUF buffers[3]={
+		{ sizeof(DWORD),(char*)&command },
+		{ sizeof(DWORD),(char*)&dwAPDUlen },
+		{ (ULONG)APDUlen,(char*)APDU }
+	};
+	if (WSASend(AcceptSocket,buffers,3,&read,0,NULL,NULL)!=0 || read!=2*sizeof(DWORD)+dwAPDUlen) {
 		::shutdown(AcceptSocket,SD_BOTH);
 		AcceptSocket=NULL;
 		return false;
@@ -83,7 +80,7 @@ bool TcpIpReader::QueryTransmit(BYTE *APDU,int APDUlen,BYTE *Resp,int *Resplen)
 }
 
 bool TcpIpReader::QueryATR(BYTE *ATR,DWORD *ATRsize,bool reset) {
-	//SectionLocker lock(dataSection);
+	SectionLocker lock(dataSection);
 	if (AcceptSocket==NULL)
 		return false;
 	int read=0;
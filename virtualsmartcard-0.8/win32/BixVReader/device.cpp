@@ -244,6 +244,8 @@ HRESULT CMyDevice::OnD0Entry(IN IWDFDevice*  pWdfDevice,IN WDF_POWER_DEVICE_STAT
             readers[i]=new TcpIpReader();
         else if (rpcType==2)
             readers[i]=new VpcdReader();
+        else if (rpcType==3)
+            readers[i]=new Esp32Reader();
 
         readers[i]->instance=i;
         readers[i]->device=this;
@@ -272,6 +274,7 @@ HRESULT CMyDevice::OnD0Exit(IN IWDFDevice*  pWdfDevice,IN WDF_POWER_DEVICE_STATE
 void CMyDevice::shutDown() {
     SectionLogger a(__FUNCTION__);
     for (int i=0;i<numInstances;i++) {
+        readers[i]->stopTransmits();
         readers[i]->shutdown();
         delete readers[i];
     }
@@ -1,7 +1,8 @@
 #include "memory.h"
 #include "SectionLocker.h"
 
-bool getBuffer(IWDFIoRequest* pRequest,BYTE *buffer,int *bufferLen) {
+// false if the input doesn't fit bufferMax bytes
+bool getBuffer(IWDFIoRequest* pRequest,BYTE *buffer,int *bufferLen,int bufferMax) {
 
 	IWDFMemory *inmem=NULL;
 	pRequest->GetInputMemory(&inmem);
@@ -12,6 +13,10 @@ bool getBuffer(IWDFIoRequest* pRequest,BYTE *buffer,int *bufferLen) {
 	else {
 		SIZE_T size;
 		void *data=inmem->GetDataBuffer(&size);
+		if (size>(SIZE_T)bufferMax) {
+			inmem->Release();
+			return false;
+		}
 		memcpy(buffer,data,size);
 		(*bufferLen)=(int)size;
 		inmem->Release();
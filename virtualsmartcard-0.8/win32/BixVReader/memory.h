@@ -3,7 +3,7 @@
 #include "device.h"
 
 
-bool getBuffer(IWDFIoRequest* pRequest,BYTE *buffer,int *bufferLen);
+bool getBuffer(IWDFIoRequest* pRequest,BYTE *buffer,int *bufferLen,int bufferMax);
 void setString(CMyDevice *device,IWDFIoRequest* pRequest,char *result,int outSize);
 void setBuffer(CMyDevice *device,IWDFIoRequest* pRequest,BYTE *result,int inSize);
 void setInt(CMyDevice *device,IWDFIoRequest* pRequest,DWORD result);